@@ -0,0 +1,505 @@
+/* microbench.c: Parser and Handler Microbenchmarks (and HPACK checks) */
+
+#define _GNU_SOURCE
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <string.h>
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAVE_RDTSC 1
+#endif
+
+/* Constants */
+
+#define BENCH_ITERATIONS    10000       /* Default iterations per benchmark */
+#define BENCH_LISTING_SIZE  100         /* Entries in listing fixture */
+
+/* Allocation Counting
+ *
+ * Interpose the allocator so every malloc, calloc, and realloc made by the
+ * code under test (including those inside libc, e.g. strdup or fopen) is
+ * counted. */
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void  __libc_free(void *ptr);
+
+static unsigned long Allocations = 0;
+
+void *malloc(size_t size) {
+    Allocations++;
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size) {
+    Allocations++;
+    return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+    Allocations++;
+    return __libc_realloc(ptr, size);
+}
+
+void free(void *ptr) {
+    __libc_free(ptr);
+}
+
+/* Request Corpus */
+
+typedef struct {
+    const char  *name;
+    const char  *text;
+} Sample;
+
+static const Sample Corpus[] = {
+    {"minimal", "GET / HTTP/1.0\r\n\r\n"},
+    {"curl",    "GET /html/index.html HTTP/1.1\r\n"
+                "Host: localhost:9898\r\n"
+                "User-Agent: curl/8.5.0\r\n"
+                "Accept: */*\r\n"
+                "\r\n"},
+    {"browser", "GET /scripts/env.sh?q=spidey&page=2 HTTP/1.1\r\n"
+                "Host: localhost:9898\r\n"
+                "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:128.0) Gecko/20100101 Firefox/128.0\r\n"
+                "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8\r\n"
+                "Accept-Language: en-US,en;q=0.5\r\n"
+                "Accept-Encoding: gzip, deflate, br, zstd\r\n"
+                "Referer: http://localhost:9898/scripts\r\n"
+                "Connection: keep-alive\r\n"
+                "Upgrade-Insecure-Requests: 1\r\n"
+                "Sec-Fetch-Dest: document\r\n"
+                "Sec-Fetch-Mode: navigate\r\n"
+                "Sec-Fetch-Site: same-origin\r\n"
+                "Priority: u=0, i\r\n"
+                "\r\n"},
+};
+
+/* HPACK Examples (RFC 7541, Appendix C)
+ *
+ * Each example is three header blocks decoded in order with one table; the
+ * response examples use a 256 byte table, so later blocks evict entries. */
+
+typedef struct {
+    const char  *block;
+    size_t       length;
+    const char  *fields;                /*< Decoded fields ("name: value\n" each) */
+    size_t       size;                  /*< Dynamic table size afterwards */
+} HpackBlock;
+
+typedef struct {
+    const char  *name;
+    size_t       table_size;            /*< SETTINGS_HEADER_TABLE_SIZE */
+    HpackBlock   blocks[3];
+} HpackExample;
+
+#define BLOCK(s)    s, sizeof(s) - 1
+
+static const HpackExample Examples[] = {
+    {"requests", 4096, {  /* C.3: Requests without Huffman Coding */
+        {BLOCK("\x82\x86\x84\x41\x0f\x77\x77\x77\x2e\x65\x78\x61\x6d\x70\x6c\x65"
+               "\x2e\x63\x6f\x6d"),
+         ":method: GET\n:scheme: http\n:path: /\n:authority: www.example.com\n", 57},
+        {BLOCK("\x82\x86\x84\xbe\x58\x08\x6e\x6f\x2d\x63\x61\x63\x68\x65"),
+         ":method: GET\n:scheme: http\n:path: /\n:authority: www.example.com\ncache-control: no-cache\n", 110},
+        {BLOCK("\x82\x87\x85\xbf\x40\x0a\x63\x75\x73\x74\x6f\x6d\x2d\x6b\x65\x79"
+               "\x0c\x63\x75\x73\x74\x6f\x6d\x2d\x76\x61\x6c\x75\x65"),
+         ":method: GET\n:scheme: https\n:path: /index.html\n:authority: www.example.com\ncustom-key: custom-value\n", 164},
+    }},
+    {"requests_huffman", 4096, {  /* C.4: Requests with Huffman Coding */
+        {BLOCK("\x82\x86\x84\x41\x8c\xf1\xe3\xc2\xe5\xf2\x3a\x6b\xa0\xab\x90\xf4"
+               "\xff"),
+         ":method: GET\n:scheme: http\n:path: /\n:authority: www.example.com\n", 57},
+        {BLOCK("\x82\x86\x84\xbe\x58\x86\xa8\xeb\x10\x64\x9c\xbf"),
+         ":method: GET\n:scheme: http\n:path: /\n:authority: www.example.com\ncache-control: no-cache\n", 110},
+        {BLOCK("\x82\x87\x85\xbf\x40\x88\x25\xa8\x49\xe9\x5b\xa9\x7d\x7f\x89\x25"
+               "\xa8\x49\xe9\x5b\xb8\xe8\xb4\xbf"),
+         ":method: GET\n:scheme: https\n:path: /index.html\n:authority: www.example.com\ncustom-key: custom-value\n", 164},
+    }},
+    {"responses", 256, {  /* C.5: Responses without Huffman Coding */
+        {BLOCK("\x48\x03\x33\x30\x32\x58\x07\x70\x72\x69\x76\x61\x74\x65\x61\x1d"
+               "\x4d\x6f\x6e\x2c\x20\x32\x31\x20\x4f\x63\x74\x20\x32\x30\x31\x33"
+               "\x20\x32\x30\x3a\x31\x33\x3a\x32\x31\x20\x47\x4d\x54\x6e\x17\x68"
+               "\x74\x74\x70\x73\x3a\x2f\x2f\x77\x77\x77\x2e\x65\x78\x61\x6d\x70"
+               "\x6c\x65\x2e\x63\x6f\x6d"),
+         ":status: 302\ncache-control: private\ndate: Mon, 21 Oct 2013 20:13:21 GMT\nlocation: https://www.example.com\n", 222},
+        {BLOCK("\x48\x03\x33\x30\x37\xc1\xc0\xbf"),
+         ":status: 307\ncache-control: private\ndate: Mon, 21 Oct 2013 20:13:21 GMT\nlocation: https://www.example.com\n", 222},
+        {BLOCK("\x88\xc1\x61\x1d\x4d\x6f\x6e\x2c\x20\x32\x31\x20\x4f\x63\x74\x20"
+               "\x32\x30\x31\x33\x20\x32\x30\x3a\x31\x33\x3a\x32\x32\x20\x47\x4d"
+               "\x54\xc0\x5a\x04\x67\x7a\x69\x70\x77\x38\x66\x6f\x6f\x3d\x41\x53"
+               "\x44\x4a\x4b\x48\x51\x4b\x42\x5a\x58\x4f\x51\x57\x45\x4f\x50\x49"
+               "\x55\x41\x58\x51\x57\x45\x4f\x49\x55\x3b\x20\x6d\x61\x78\x2d\x61"
+               "\x67\x65\x3d\x33\x36\x30\x30\x3b\x20\x76\x65\x72\x73\x69\x6f\x6e"
+               "\x3d\x31"),
+         ":status: 200\ncache-control: private\ndate: Mon, 21 Oct 2013 20:13:22 GMT\nlocation: https://www.example.com\n"
+         "content-encoding: gzip\nset-cookie: foo=ASDJKHQKBZXOQWEOPIUAXQWEOIU; max-age=3600; version=1\n", 215},
+    }},
+    {"responses_huffman", 256, {  /* C.6: Responses with Huffman Coding */
+        {BLOCK("\x48\x82\x64\x02\x58\x85\xae\xc3\x77\x1a\x4b\x61\x96\xd0\x7a\xbe"
+               "\x94\x10\x54\xd4\x44\xa8\x20\x05\x95\x04\x0b\x81\x66\xe0\x82\xa6"
+               "\x2d\x1b\xff\x6e\x91\x9d\x29\xad\x17\x18\x63\xc7\x8f\x0b\x97\xc8"
+               "\xe9\xae\x82\xae\x43\xd3"),
+         ":status: 302\ncache-control: private\ndate: Mon, 21 Oct 2013 20:13:21 GMT\nlocation: https://www.example.com\n", 222},
+        {BLOCK("\x48\x83\x64\x0e\xff\xc1\xc0\xbf"),
+         ":status: 307\ncache-control: private\ndate: Mon, 21 Oct 2013 20:13:21 GMT\nlocation: https://www.example.com\n", 222},
+        {BLOCK("\x88\xc1\x61\x96\xd0\x7a\xbe\x94\x10\x54\xd4\x44\xa8\x20\x05\x95"
+               "\x04\x0b\x81\x66\xe0\x84\xa6\x2d\x1b\xff\xc0\x5a\x83\x9b\xd9\xab"
+               "\x77\xad\x94\xe7\x82\x1d\xd7\xf2\xe6\xc7\xb3\x35\xdf\xdf\xcd\x5b"
+               "\x39\x60\xd5\xaf\x27\x08\x7f\x36\x72\xc1\xab\x27\x0f\xb5\x29\x1f"
+               "\x95\x87\x31\x60\x65\xc0\x03\xed\x4e\xe5\xb1\x06\x3d\x50\x07"),
+         ":status: 200\ncache-control: private\ndate: Mon, 21 Oct 2013 20:13:22 GMT\nlocation: https://www.example.com\n"
+         "content-encoding: gzip\nset-cookie: foo=ASDJKHQKBZXOQWEOPIUAXQWEOIU; max-age=3600; version=1\n", 215},
+    }},
+};
+
+/* Benchmark */
+
+typedef struct Benchmark Benchmark;
+struct Benchmark {
+    const char  *name;
+    void       (*run)(Benchmark *b);    /*< Perform one operation */
+    const void  *arg;                   /*< Benchmark-specific input */
+};
+
+static size_t  Iterations = BENCH_ITERATIONS;
+static char   *Filter     = NULL;
+static char    Workspace[] = "/tmp/spidey-microbench.XXXXXX";
+static char   *ListingPath = NULL;
+static FILE   *Sink        = NULL;      /* Output of rendering benchmarks */
+static bool    Verbose     = false;
+
+/* Functions */
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint64_t now_cycles(void) {
+#ifdef HAVE_RDTSC
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+static void usage(const char *progname, int status) {
+    fprintf(stderr, "Usage: %s [options] [FILTER]\n", progname);
+    fprintf(stderr, "Options:\n");
+    fprintf(stderr, "    -h            Display help message\n");
+    fprintf(stderr, "    -m path       Path to mimetypes file\n");
+    fprintf(stderr, "    -n N          Iterations per benchmark (%d)\n", BENCH_ITERATIONS);
+    fprintf(stderr, "    -v            Keep debug output from the code under test\n");
+    fprintf(stderr, "\nOnly benchmarks whose name contains FILTER are run.\n");
+    exit(status);
+}
+
+/**
+ * Create fixture root with files to resolve and a directory to list.
+ **/
+static int make_fixtures(void) {
+    char path[PATH_MAX];
+
+    if (!mkdtemp(Workspace)) {
+        return -1;
+    }
+
+    snprintf(path, sizeof(path), "%s/html", Workspace);
+    mkdir(path, 0755);
+    snprintf(path, sizeof(path), "%s/html/index.html", Workspace);
+    fclose(fopen(path, "w"));
+
+    snprintf(path, sizeof(path), "%s/listing", Workspace);
+    mkdir(path, 0755);
+    for (int i = 0; i < BENCH_LISTING_SIZE; i++) {
+        snprintf(path, sizeof(path), "%s/listing/entry-%03d.txt", Workspace, i);
+        fclose(fopen(path, "w"));
+    }
+
+    RootPath    = Workspace;
+    ListingPath = strdup(path);
+    *strrchr(ListingPath, '/') = '\0';
+
+    /* Pack the same root (archive benchmarks are skipped if bin/pack is not built) */
+    char command[PATH_MAX * 2];
+    snprintf(command, sizeof(command), "./bin/pack %s %s.pack > /dev/null 2>&1", Workspace, Workspace);
+    snprintf(path, sizeof(path), "%s.pack", Workspace);
+    if (system(command) != 0 || archive_open(path) < 0) {
+        log("Unable to pack %s (skipping archive benchmarks)", Workspace);
+    }
+    return 0;
+}
+
+static void remove_fixtures(void) {
+    char command[PATH_MAX];
+    snprintf(command, sizeof(command), "rm -fr %s %s.pack", Workspace, Workspace);
+    if (system(command) != 0) {
+        log("Unable to remove %s", Workspace);
+    }
+}
+
+/* HPACK Checks */
+
+typedef struct {
+    char    text[BUFSIZ];
+    size_t  length;
+} Fields;
+
+static int collect_field(void *arg, const char *name, size_t name_length, const char *value, size_t value_length) {
+    Fields *f = arg;
+    int n = snprintf(f->text + f->length, sizeof(f->text) - f->length, "%.*s: %.*s\n",
+                     (int)name_length, name, (int)value_length, value);
+    if (n < 0 || (size_t)n >= sizeof(f->text) - f->length) {
+        return -1;
+    }
+    f->length += n;
+    return 0;
+}
+
+/**
+ * Decode example's header blocks and compare fields and table size with the
+ * RFC's.
+ **/
+static void decode_example(const HpackExample *e) {
+    HpackTable t;
+    hpack_init(&t, e->table_size);
+
+    for (size_t i = 0; i < sizeof(e->blocks)/sizeof(e->blocks[0]); i++) {
+        const HpackBlock *b = &e->blocks[i];
+        Fields fields = {.length = 0};
+
+        if (hpack_decode(&t, (const uint8_t *)b->block, b->length, collect_field, &fields) < 0) {
+            fatal("hpack_decode failed on %s block %zu", e->name, i + 1);
+        }
+        if (!streq(fields.text, b->fields)) {
+            fatal("hpack_decode %s block %zu fields:\n%s", e->name, i + 1, fields.text);
+        }
+        if (t.size != b->size) {
+            fatal("hpack_decode %s block %zu table size %zu != %zu", e->name, i + 1, t.size, b->size);
+        }
+    }
+    hpack_free(&t);
+}
+
+/* Benchmarks */
+
+static void bench_parse_request(Benchmark *b) {
+    const Sample *sample = b->arg;
+    static FILE *stream = NULL;
+    static const Sample *current = NULL;
+
+    /* Reuse one in-memory stream per sample so only parsing is measured */
+    if (current != sample) {
+        if (stream) {
+            fclose(stream);
+        }
+        stream  = fmemopen((void *)sample->text, strlen(sample->text), "r");
+        current = sample;
+    }
+    rewind(stream);
+
+    Request *r = calloc(1, sizeof(Request));
+    r->fd      = -1;
+    r->stream  = stream;
+    if (parse_request(r) < 0) {
+        fatal("parse_request failed on %s sample", sample->name);
+    }
+    r->stream  = NULL;
+    free_request(r);
+}
+
+static void bench_determine_mimetype(Benchmark *b) {
+    free(determine_mimetype(vhost_lookup(NULL), b->arg));
+}
+
+static void bench_determine_request_path(Benchmark *b) {
+    free(determine_request_path(vhost_lookup(NULL), b->arg));
+}
+
+static void bench_archive_serve(Benchmark *b) {
+    static Request r;
+
+    /* One request and response are reused so only the lookup and response are measured */
+    if (!r.response) {
+        r.response = response_new(-1, NULL);
+    }
+    response_reset(r.response);
+    r.uri = (char *)b->arg;
+    archive_serve(&r);
+}
+
+static void bench_hpack_decode(Benchmark *b) {
+    decode_example(b->arg);
+}
+
+static void bench_http_status_string(Benchmark *b) {
+    static volatile const char *result;
+    for (Status s = HTTP_STATUS_OK; s <= HTTP_STATUS_INTERNAL_SERVER_ERROR; s++) {
+        result = http_status_string(s);
+    }
+    (void)result;
+}
+
+static void bench_response_error(Benchmark *b) {
+    const Blob *response = response_error(HTTP_STATUS_NOT_FOUND);
+
+    rewind(Sink);
+    fwrite(response->data, 1, response->length, Sink);
+}
+
+static void bench_response_headers(Benchmark *b) {
+    const Blob *headers = response_headers(b->arg);
+
+    rewind(Sink);
+    fwrite(headers->data, 1, headers->length, Sink);
+}
+
+static void bench_render_listing(Benchmark *b) {
+    static struct dirent **entries = NULL;
+    static int n = 0;
+
+    /* Scan once; only rendering is measured */
+    if (!entries) {
+        n = scandir(ListingPath, &entries, 0, alphasort);
+        if (n < 0) {
+            fatal("Unable to scan %s: %s", ListingPath, strerror(errno));
+        }
+    }
+
+    rewind(Sink);
+    render_listing(Sink, b->arg, entries, n);
+}
+
+static void bench_scan_listing(Benchmark *b) {
+    struct dirent **entries;
+    int n = scandir(ListingPath, &entries, 0, alphasort);
+
+    rewind(Sink);
+    render_listing(Sink, b->arg, entries, n);
+    for (int i = 0; i < n; i++) {
+        free(entries[i]);
+    }
+    free(entries);
+}
+
+static Benchmark Benchmarks[] = {
+    {"parse_request/minimal",               bench_parse_request,            &Corpus[0]},
+    {"parse_request/curl",                  bench_parse_request,            &Corpus[1]},
+    {"parse_request/browser",               bench_parse_request,            &Corpus[2]},
+    {"determine_mimetype/html",             bench_determine_mimetype,       "/html/index.html"},
+    {"determine_mimetype/png",              bench_determine_mimetype,       "/images/a.png"},
+    {"determine_mimetype/unknown",          bench_determine_mimetype,       "/data/file.unknownext"},
+    {"determine_mimetype/none",             bench_determine_mimetype,       "/data/README"},
+    {"determine_request_path/file",         bench_determine_request_path,   "/html/index.html"},
+    {"determine_request_path/dir",          bench_determine_request_path,   "/listing"},
+    {"determine_request_path/missing",      bench_determine_request_path,   "/missing/file.txt"},
+    {"determine_request_path/escape",       bench_determine_request_path,   "/../../etc/passwd"},
+    {"archive_serve/file",                  bench_archive_serve,            "/html/index.html"},
+    {"archive_serve/dir",                   bench_archive_serve,            "/listing"},
+    {"archive_serve/missing",               bench_archive_serve,            "/missing/file.txt"},
+    {"hpack_decode/requests",               bench_hpack_decode,             &Examples[0]},
+    {"hpack_decode/requests_huffman",       bench_hpack_decode,             &Examples[1]},
+    {"hpack_decode/responses",              bench_hpack_decode,             &Examples[2]},
+    {"hpack_decode/responses_huffman",      bench_hpack_decode,             &Examples[3]},
+    {"http_status_string/all",              bench_http_status_string,       NULL},
+    {"response_error/404",                  bench_response_error,           NULL},
+    {"response_headers/html",               bench_response_headers,         "text/html"},
+    {"response_headers/png",                bench_response_headers,         "image/png"},
+    {"render_listing/100",                  bench_render_listing,           "/listing"},
+    {"scan_render_listing/100",             bench_scan_listing,             "/listing"},
+};
+
+/**
+ * Run benchmark and report per-operation time, cycles, and allocations.
+ **/
+static void run(Benchmark *b) {
+    size_t warmup = Iterations / 10 + 1;
+
+    for (size_t i = 0; i < warmup; i++) {
+        b->run(b);
+    }
+
+    unsigned long allocations = Allocations;
+    uint64_t cycles = now_cycles();
+    uint64_t start  = now_ns();
+    for (size_t i = 0; i < Iterations; i++) {
+        b->run(b);
+    }
+    uint64_t elapsed = now_ns() - start;
+    cycles      = now_cycles() - cycles;
+    allocations = Allocations - allocations;
+
+    printf("%-36s %10zu %12.1f %12.0f %10.2f\n", b->name, Iterations,
+        (double)elapsed / Iterations,
+        (double)cycles / Iterations,
+        (double)allocations / Iterations);
+}
+
+/* Main Execution */
+
+int main(int argc, char *argv[]) {
+    int c;
+
+    while ((c = getopt(argc, argv, "hm:n:v")) != -1) {
+        switch (c) {
+            case 'h': usage(argv[0], EXIT_SUCCESS); break;
+            case 'm': MimeTypesPath = optarg; break;
+            case 'n': Iterations = strtoul(optarg, NULL, 10); break;
+            case 'v': Verbose = true; break;
+            default:  usage(argv[0], EXIT_FAILURE); break;
+        }
+    }
+    if (optind < argc) {
+        Filter = argv[optind];
+    }
+    if (Iterations == 0) {
+        usage(argv[0], EXIT_FAILURE);
+    }
+
+    if (make_fixtures() < 0) {
+        fatal("Unable to create fixtures: %s", strerror(errno));
+    }
+
+    if (vhost_init(NULL) < 0 || response_init() < 0) {
+        fatal("Unable to create default virtual host");
+    }
+
+    Sink = fopen("/dev/null", "w");
+    if (!Sink) {
+        fatal("Unable to open /dev/null: %s", strerror(errno));
+    }
+
+    /* Decoders are checked against the RFC 7541 examples before they are timed */
+    for (size_t i = 0; i < sizeof(Examples)/sizeof(Examples[0]); i++) {
+        decode_example(&Examples[i]);
+    }
+
+    /* Debug logging is still executed (and measured), just not shown */
+    if (!Verbose && !freopen("/dev/null", "w", stderr)) {
+        fatal("Unable to silence stderr: %s", strerror(errno));
+    }
+
+    printf("%-36s %10s %12s %12s %10s\n", "BENCHMARK", "ITERATIONS", "NS/OP", "CYCLES/OP", "ALLOCS/OP");
+    for (size_t i = 0; i < sizeof(Benchmarks)/sizeof(Benchmarks[0]); i++) {
+        if ((!Filter || strstr(Benchmarks[i].name, Filter)) && (Benchmarks[i].run != bench_archive_serve || archive_enabled())) {
+            run(&Benchmarks[i]);
+        }
+    }
+
+    fclose(Sink);
+    remove_fixtures();
+    free(ListingPath);
+    return EXIT_SUCCESS;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -37,7 +37,7 @@ check_md5sum() {
 
 check_header() {
     status=$(head -n 1 $WORKSPACE/header | tr -d '\r\n')
-    content=$(awk '/Content/ { print $2 }' $WORKSPACE/header | tr -d '\r\n')
+    content=$(awk 'tolower($1) == "content-type:" { print $2 }' $WORKSPACE/header | tr -d '\r\n')
     if [ "$status" != "$1" ]; then
 	echo "FAILURE: $status != $1" > $WORKSPACE/test
 	return 1;
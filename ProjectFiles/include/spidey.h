@@ -3,10 +3,15 @@
 #pragma once
 
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 
+#include <dirent.h>
 #include <netdb.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <time.h>
 #include <unistd.h>
 
 /* Constants */
@@ -19,6 +24,8 @@
 typedef enum {
     SINGLE,                             /**< Single connection */
     FORKING,                            /**< Process per connection */
+    URING,                              /**< io_uring event loop */
+    HYBRID,                             /**< Event loop front end, pre-forked handlers */
     UNKNOWN
 } ServerMode;
 
@@ -28,6 +35,12 @@ extern char *Port;                      /**< Port number */
 extern char *MimeTypesPath;             /**< Path to mime.types file */
 extern char *DefaultMimeType;           /**< Default file mimetype */
 extern char *RootPath;                  /**< Path to root directory */
+extern char *AccessLogPath;             /**< Path to access log ("-" for stderr) */
+extern char *ArchivePath;               /**< Path to archive serving the default host (NULL for none) */
+extern int   WorkerId;                  /**< Index of this worker */
+extern int   DrainTimeout;              /**< Seconds to drain requests when stopping */
+extern long  TransferRate;              /**< Per-connection body bandwidth cap (bytes/second, 0 for none) */
+extern int   HybridHandlers;            /**< Handler processes in hybrid mode (0 for two per CPU) */
 
 /* Logging Macros */
 
@@ -40,60 +53,484 @@ extern char *RootPath;                  /**< Path to root directory */
 #define fatal(M, ...)   fprintf(stderr, "[%5d] FATAL %10s:%-4d " M "\n", getpid(), __FILE__, __LINE__, ##__VA_ARGS__); exit(EXIT_FAILURE)
 #define log(M, ...)     fprintf(stderr, "[%5d] LOG   %10s:%-4d " M "\n", getpid(), __FILE__, __LINE__, ##__VA_ARGS__)
 
+/* Virtual Hosts */
+
+typedef struct {
+    char    *name;                      /*< Host name (NULL for default host) */
+    char    *root;                      /*< Real path of document root */
+    size_t   root_length;               /*< Length of root */
+    char    *default_mimetype;          /*< Mimetype for unknown extensions */
+    char    *mimetypes_path;            /*< Path to mime.types file */
+    unsigned id;                        /*< Index (cache partition) of host */
+} VirtualHost;
+
+int         vhost_init(const char *path);
+const VirtualHost *vhost_lookup(const char *header);
+size_t      vhost_count(void);
+const VirtualHost *vhost_get(size_t id);
+
 /* HTTP Request */
 
 typedef struct header Header;
+typedef struct TlsSession TlsSession;
 struct header {
     char    *name;                      /*< Name of header entry */
     char    *data;                      /*< Data of header entry */
     Header  *next;                      /*< Next header entry */
 };
 
+/**
+ * Points in a request's life recorded by tracing
+ */
+typedef enum {
+    TRACE_ACCEPT,                       /**< Client accepted */
+    TRACE_FIRST_READ,                   /**< First request bytes read */
+    TRACE_PARSED,                       /**< Request line and headers parsed */
+    TRACE_RESOLVED,                     /**< Path resolved and handler chosen */
+    TRACE_FIRST_WRITE,                  /**< First response bytes written */
+    TRACE_DONE,                         /**< Response complete */
+    TRACE_POINTS
+} TracePoint;
+
+typedef struct {
+    bool     enabled;                   /*< Whether this request is traced */
+    uint64_t points[TRACE_POINTS];      /*< Monotonic nanoseconds (0 if not reached) */
+    unsigned reads;                     /*< Client read syscalls (or receive operations) */
+    unsigned writes;                    /*< Client write syscalls (or send operations) */
+    char     label[192];                /*< Status, client, and request line for the slow log */
+} Trace;
+
+/* HTTP Response */
+
+#define RESPONSE_SLICES 16              /* Memory slices before they are sent or merged */
+
+typedef struct {
+    const char *data;
+    size_t      length;
+} Blob;
+
+/**
+ * Response body sources (sent after the memory slices)
+ */
+typedef enum {
+    BODY_NONE,                          /**< Whole response is in memory */
+    BODY_FILE,                          /**< Range of a file */
+    BODY_PIPE,                          /**< Output of a child process */
+} BodySource;
+
+typedef struct {
+    const char *data;                   /*< Borrowed bytes (NULL if in the response buffer) */
+    size_t      offset;                 /*< Offset in response buffer (if not borrowed) */
+    size_t      length;                 /*< Bytes of slice */
+} Slice;
+
+typedef struct {
+    int         fd;                     /*< Socket to send to (-1 if the backend sends) */
+    Trace      *trace;                  /*< Trace counting sends (may be NULL) */
+
+    Slice       slices[RESPONSE_SLICES];/*< Headers and memory bodies, in order */
+    size_t      nslices;
+    size_t      skip;                   /*< Bytes of slices already sent */
+    char       *buffer;                 /*< Bytes copied or formatted into the response */
+    size_t      buffer_length;
+    size_t      buffer_capacity;
+
+    BodySource  body;                   /*< Body source (after the slices) */
+    int         body_fd;                /*< File or pipe being sent (owned) */
+    FILE       *body_pipe;              /*< Child process stream (for pclose) */
+    off_t       body_offset;            /*< Next byte of file to send */
+    off_t       body_length;            /*< Bytes of file left to send */
+
+    size_t      length;                 /*< Bytes added so far (bodies included) */
+    size_t      sent;                   /*< Bytes sent so far */
+    bool        failed;                 /*< Sending failed; the rest is dropped */
+} Response;
+
+Response *  response_new(int fd, Trace *trace);
+void        response_reset(Response *res);
+void        response_free(Response *res);
+int         response_write(Response *res, const void *data, size_t length);
+int         response_printf(Response *res, const char *format, ...) __attribute__((format(printf, 2, 3)));
+int         response_blob(Response *res, const Blob *blob);
+int         response_file(Response *res, int fd, off_t offset, off_t length);
+int         response_pipe(Response *res, FILE *pipe);
+int         response_flush(Response *res);
+int         response_collect(Response *res);
+size_t      response_iovecs(const Response *res, struct iovec *iov, size_t max);
+void        response_advance(Response *res, size_t sent);
+size_t      response_pending(const Response *res);
+int         response_take_body(Response *res, off_t *offset, off_t *length);
+size_t      response_bytes(const Response *res);
+
 typedef struct {
     int     fd;                         /*< Client socket file descripter */
-    FILE    *stream;                    /*< Client socket file stream */
+    FILE    *stream;                    /*< Client request stream (reading only, see request_stream) */
+    void    *source;                    /*< Cookie the stream reads from */
+    ssize_t (*source_read)(void *cookie, char *buffer, size_t size);
+    int     (*source_close)(void *cookie);
+    size_t   position;                  /*< Bytes read from source into the stream */
+    size_t   received;                  /*< Bytes of request taken off the client socket (see request_buffered) */
     char    *method;                    /*< HTTP method */
     char    *uri;                       /*< HTTP uniform resource identifier */
     char    *path;                      /*< Real path corrsponding to URI and RootPath */
     char    *query;                     /*< HTTP query string */
+    const VirtualHost *vhost;           /*< Virtual host matching Host header */
 
-    char     host[NI_MAXHOST];          /*< Host name of client */
-    char     port[NI_MAXSERV];          /*< Port number of client */
+    struct sockaddr_storage addr;       /*< Address of client (see request_host) */
+    socklen_t addrlen;                  /*< Length of client address */
+    struct timespec start;              /*< Monotonic time client was accepted */
+    size_t   nwritten;                  /*< Bytes written to client socket outside the response */
 
     Header  *headers;                   /*< List of name, data Header pairs */
+
+    bool     upgradable;                /*< Connection may switch to HTTP/2 */
+    Response *response;                 /*< Response being built (sent by the backend) */
+    bool     detached;                  /*< Handed to a CGI executor (which answers it) */
+    bool     executor;                  /*< This process is the CGI executor answering it */
+    TlsSession *tls;                    /*< TLS session (NULL for plaintext, see tls_accept) */
+
+    Trace    trace;                     /*< Phase timestamps (if tracing) */
 } Request;
 
 Request *   accept_request(int sfd);
 void	    free_request(Request *request);
+FILE *      request_stream(Request *request, void *cookie,
+                           ssize_t (*read)(void *cookie, char *buffer, size_t size), int (*close)(void *cookie));
+size_t      request_buffered(Request *request);
+int         request_hold(Request *request);
 int	    parse_request(Request *request);
+const char *request_header(Request *request, const char *name);
+const char *request_host(const Request *request);
+const char *request_port(const Request *request);
 
 /* HTTP Request Handlers */
 
 typedef enum {
     HTTP_STATUS_OK = 0,			/* 200 OK */
+    HTTP_STATUS_NOT_MODIFIED,		/* 304 Not Modified */
     HTTP_STATUS_BAD_REQUEST,		/* 400 Bad Request */
     HTTP_STATUS_NOT_FOUND,		/* 404 Not Found */
     HTTP_STATUS_INTERNAL_SERVER_ERROR,	/* 500 Internal Server Error */
+    HTTP_STATUS_BAD_GATEWAY,		/* 502 Bad Gateway */
+    HTTP_STATUS_SERVICE_UNAVAILABLE,	/* 503 Service Unavailable */
+    HTTP_STATUS_GATEWAY_TIMEOUT,	/* 504 Gateway Timeout */
 } Status;
 
 Status      handle_request(Request *request);
+void        render_listing(FILE *stream, const char *uri, struct dirent **entries, int n);
+
+/* Metrics */
+
+#define STATS_URI       "/__stats"
+#define STATS_MIMETYPE  "text/plain; version=0.0.4"
+
+/**
+ * Request handler types
+ */
+typedef enum {
+    HANDLER_BROWSE,                     /**< Directory listing */
+    HANDLER_FILE,                       /**< Static file */
+    HANDLER_CGI,                        /**< CGI script */
+    HANDLER_ERROR,                      /**< Error page */
+    HANDLER_STATS,                      /**< Metrics endpoint */
+    HANDLER_PROXY,                      /**< Reverse proxy */
+    HANDLER_ARCHIVE,                    /**< Packed archive */
+    HANDLER_TYPES
+} HandlerType;
+
+/**
+ * Request phases timed by handle_request
+ */
+typedef enum {
+    PHASE_ACCEPT,                       /**< Accepted until handling started */
+    PHASE_PARSE,                        /**< Parsing request line and headers */
+    PHASE_RESOLVE,                      /**< Resolving and checking path */
+    PHASE_RESPOND,                      /**< Running handler and flushing response */
+    PHASES
+} Phase;
+
+int         stats_init(void);
+void        stats_request(HandlerType type, Status status, size_t bytes);
+void        stats_phase(Phase phase, const struct timespec *start, const struct timespec *end);
+void        stats_connection(int delta);
+void        stats_cache(bool hit);
+void        stats_cold_read(void);
+void        stats_coalesced(void);
+int         stats_write(FILE *stream);
+
+/* Histogram */
+
+#define HISTOGRAM_SUB_BITS      7
+#define HISTOGRAM_SUB_BUCKETS   (1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_BUCKETS       ((64 - HISTOGRAM_SUB_BITS + 2) * HISTOGRAM_SUB_BUCKETS / 2)
+
+typedef struct {
+    uint64_t    total;                  /*< Number of recorded values */
+    uint64_t    sum;                    /*< Sum of recorded values */
+    uint64_t    max;                    /*< Largest recorded value */
+    uint64_t    counts[HISTOGRAM_BUCKETS]; /*< Log-linear bucket counts */
+} Histogram;
+
+void        histogram_record(Histogram *h, uint64_t value);
+void        histogram_record_n(Histogram *h, uint64_t value, uint64_t count);
+void        histogram_merge(Histogram *dst, const Histogram *src);
+uint64_t    histogram_percentile(const Histogram *h, double percentile);
 
 /* HTTP Server */
 
 int         single_server(int sfd);
 int         forking_server(int sfd);
+int         uring_server(int sfd);
+int         hybrid_server(int sfd);
+
+/* Graceful Restart */
+
+int         restart_listen(const char *port);
+void        restart_init(char *argv[]);
+void        restart_ready(void);
+bool        restart_wait(int sfd);
+bool        restart_stopping(int sfd);
+bool        restart_expired(void);
+
+/* Access Log */
+
+/**
+ * Access log line formats
+ */
+typedef enum {
+    ACCESS_LOG_COMMON,                  /**< Common Log Format */
+    ACCESS_LOG_COMBINED,                /**< Combined Log Format */
+    ACCESS_LOG_JSON,                    /**< One JSON object per line */
+} AccessLogFormat;
+
+int         accesslog_open(const char *path, AccessLogFormat format);
+void        accesslog_record(Request *request, Status status, const struct timespec *start, long long bytes);
+void        accesslog_close(void);
+unsigned long accesslog_dropped(void);
+
+/* Filesystem Watcher */
+
+int         watch_init(void);
+bool        watch_enabled(void);
+uint64_t    watch_generation(const VirtualHost *host);
+uint64_t    watch_mimetypes_generation(void);
+unsigned long watch_invalidations(void);
+
+/* Caches */
+
+#define CACHE_FILE_MAX  (64*1024)       /* Largest file cached as a whole response */
+
+/**
+ * Cache entry kinds
+ */
+typedef enum {
+    CACHE_PATH,                         /**< URI to real path and handler */
+    CACHE_FILE,                         /**< Real path to complete file response */
+    CACHE_LISTING,                      /**< URI to complete directory listing */
+    CACHE_CGI,                          /**< URI, query, and varying headers to CGI output */
+} CacheKind;
+
+HandlerType cache_resolve(const VirtualHost *host, const char *uri, char **path);
+bool        cache_lookup(CacheKind kind, const VirtualHost *host, const char *key, const char **data, size_t *length);
+void        cache_store(CacheKind kind, const VirtualHost *host, const char *key, uint64_t generation, char *data, size_t length);
+const char *cache_mimetype(const VirtualHost *host, const char *ext);
+
+/* CGI Microcache */
+
+int         microcache_add(const char *spec);
+int         microcache_init(void);
+bool        microcache_enabled(void);
+bool        microcache_lookup(Request *request);
+bool        microcache_serve(Request *request, Status *status);
+
+/* CGI Executor */
+
+int         cgi_limits(const char *spec);
+int         cgi_init(void);
+bool        cgi_detach(Request *request);
+bool        executor_detach(Request *request);
+void        executor_reap(void);
+Status      cgi_run(Request *request, FILE *output, int *exited);
+
+/* Precomputed Responses */
+
+int         response_init(void);
+const Blob *response_error(Status status);
+const Blob *response_headers(const char *mimetype);
+
+/* Transfer Scheduler */
+
+#define TRANSFER_QUANTUM    (64*1024)   /* Largest slice of a body sent per turn */
+
+typedef struct {
+    off_t       remaining;              /*< Body bytes not yet handed out */
+    unsigned    passes;                 /*< Turns lost since the last one taken */
+} Transfer;
+
+void        transfer_start(Transfer *t, off_t length);
+size_t      transfer_quantum(const Transfer *t);
+ssize_t     transfer_pick(Transfer *const *transfers, size_t n);
+void        transfer_sent(Transfer *t, size_t sent);
+void        transfer_pace(struct timespec *eligible, size_t sent, const struct timespec *now);
+bool        transfer_throttled(const struct timespec *eligible, const struct timespec *now);
+int         transfer_wait(const struct timespec *eligible, const struct timespec *now);
+
+/* File I/O */
+
+typedef struct FileJob FileJob;
+struct FileJob {
+    int         fd;                     /*< File to read */
+    void       *buffer;                 /*< Buffer to read into */
+    size_t      length;                 /*< Bytes to read */
+    off_t       offset;                 /*< Offset of first byte */
+    size_t      result;                 /*< Bytes read */
+    int         error;                  /*< errno of failed read (0 on success) */
+    void       *data;                   /*< Caller's context */
+    FileJob    *next;
+};
+
+void        fileio_advise(int fd, off_t offset, off_t length);
+void        fileio_release(int fd, off_t offset, off_t length);
+ssize_t     fileio_read_cached(int fd, void *buffer, size_t length, off_t offset);
+int         fileio_init(int threads);
+void        fileio_submit(FileJob *job);
+FileJob    *fileio_completed(void);
+
+/* Shared Cache */
+
+int         shmcache_init(size_t bytes, bool everything);
+bool        shmcache_enabled(CacheKind kind);
+bool        shmcache_fits(const char *key, size_t length);
+bool        shmcache_lookup(CacheKind kind, unsigned host, const char *key, uint64_t hash, uint64_t generation,
+                            char **buffer, size_t *capacity, size_t *length);
+void        shmcache_store(CacheKind kind, unsigned host, const char *key, uint64_t hash, uint64_t generation,
+                           const char *data, size_t length);
+unsigned long shmcache_bytes(void);
+
+/* Asset Archive
+ *
+ * A document root packed by bin/pack: the header, then URIs, response heads,
+ * and bodies, then the perfect hash seeds and entries.  Offsets are from the
+ * start of the archive; integers are in host byte order. */
+
+#define ARCHIVE_MAGIC       "SPIDEYPK"
+#define ARCHIVE_VERSION     1
+#define ARCHIVE_ETAG_MAX    24          /* Quoted ETag and its NUL */
+
+typedef struct {
+    char        magic[8];               /*< ARCHIVE_MAGIC */
+    uint32_t    version;                /*< ARCHIVE_VERSION */
+    uint32_t    count;                  /*< Entries */
+    uint32_t    buckets;                /*< Perfect hash buckets (one seed each) */
+    uint32_t    reserved;
+    uint64_t    seeds;                  /*< Offset of bucket seeds (uint32_t) */
+    uint64_t    entries;                /*< Offset of entries (in hash slot order) */
+    uint64_t    size;                   /*< Size of archive */
+} ArchiveHeader;
+
+typedef struct {
+    uint64_t    offset;                 /*< Offset of bytes */
+    uint64_t    length;                 /*< Number of bytes */
+} ArchiveRange;
+
+typedef struct {
+    ArchiveRange uri;                   /*< URI (NUL-terminated) */
+    ArchiveRange head;                  /*< 200 OK headers of identity body */
+    ArchiveRange body;                  /*< Identity body */
+    ArchiveRange gzip_head;             /*< 200 OK headers of gzip body (empty if none) */
+    ArchiveRange gzip_body;             /*< Gzip body (empty if none) */
+    ArchiveRange not_modified;          /*< Complete 304 response for identity body */
+    ArchiveRange gzip_not_modified;     /*< Complete 304 response for gzip body */
+    char        etag[ARCHIVE_ETAG_MAX]; /*< Quoted ETag of identity body */
+    char        gzip_etag[ARCHIVE_ETAG_MAX]; /*< Quoted ETag of gzip body */
+} ArchiveEntry;
+
+uint64_t    archive_hash(const char *key, size_t length, uint32_t seed);
+int         archive_open(const char *path);
+bool        archive_enabled(void);
+Status      archive_serve(Request *request);
+
+/* HTTP/2 */
+
+bool        http2_detect(Request *request);
+Status      http2_serve(Request *request);
+
+/* HPACK */
+
+typedef struct {
+    char    *name;
+    char    *value;
+    size_t   name_length;
+    size_t   value_length;
+} HpackEntry;
+
+typedef struct {
+    HpackEntry *entries;                /*< Dynamic table (ring, newest at newest) */
+    size_t      capacity;               /*< Slots in entries */
+    size_t      newest;                 /*< Slot of most recently added entry */
+    size_t      count;                  /*< Entries in table */
+    size_t      size;                   /*< Table size as defined by RFC 7541 */
+    size_t      max_size;               /*< Current largest size */
+    size_t      limit;                  /*< Largest size allowed by settings */
+    bool        update;                 /*< Size update must be sent (encoder) */
+} HpackTable;
+
+typedef int (*HpackEmit)(void *arg, const char *name, size_t name_length, const char *value, size_t value_length);
+
+void        hpack_init(HpackTable *t, size_t max_size);
+void        hpack_free(HpackTable *t);
+void        hpack_resize(HpackTable *t, size_t max_size);
+int         hpack_decode(HpackTable *t, const uint8_t *block, size_t length, HpackEmit emit, void *arg);
+ssize_t     hpack_encode(HpackTable *t, uint8_t *out, size_t size, const char *name, const char *value);
+
+/* Reverse Proxy */
+
+/**
+ * Upstream balancing policies
+ */
+typedef enum {
+    PROXY_ROUND_ROBIN,                  /**< Rotate through healthy upstreams */
+    PROXY_LEAST_CONNECTIONS,            /**< Healthy upstream with fewest requests in flight */
+} ProxyBalance;
+
+typedef struct ProxyRoute ProxyRoute;
+
+int         proxy_add(const char *spec);
+int         proxy_init(ProxyBalance balance);
+ProxyRoute *proxy_match(const char *uri);
+Status      handle_proxy_request(Request *request, ProxyRoute *route);
+
+/* Tracing */
+
+int         trace_open(const char *path, double threshold_ms, bool enabled);
+void        trace_start(Trace *t, const struct timespec *accepted);
+void        trace_point(Trace *t, TracePoint point);
+void        trace_label(Trace *t, Request *request, Status status, size_t bytes);
+void        trace_finish(Trace *t);
 
 /* Socket */
 
 int	    socket_listen(const char *port);
 
+/* TLS */
+
+#define TLS_HANDSHAKE_TIMEOUT   10          /* Seconds a client may take to finish the handshake */
+#define TLS_SESSION_CACHE       4096        /* Sessions remembered for resumption (per process) */
+#define TLS_SESSION_LIFETIME    7200        /* Seconds a session (or ticket) can be resumed for */
+#define TLS_RELAY_CHUNK         (16*1024)   /* Bytes relayed per record (one TLS record) */
+
+int         tls_init(const char *certificate, const char *key);
+bool        tls_enabled(void);
+int         tls_accept(Request *r);
+void        tls_close(Request *r);
+
 /* Utilities */
 
 #define chomp(s)    (s)[strlen(s) - 1] = '\0'
 #define streq(a, b) (strcmp((a), (b)) == 0)
 
-char *	    determine_mimetype(const char *path);
-char *	    determine_request_path(const char *uri);
+char *	    determine_mimetype(const VirtualHost *host, const char *path);
+char *	    determine_request_path(const VirtualHost *host, const char *uri);
 const char *http_status_string(Status status);
 char *	    skip_nonwhitespace(char *s);
 char *	    skip_whitespace(char *s);
@@ -0,0 +1,431 @@
+/* accesslog.c: Asynchronous Access Log */
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <time.h>
+
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+/* Constants */
+
+#define ACCESSLOG_RINGS     16          /* Rings (one per worker slot) */
+#define ACCESSLOG_SLOTS     1024        /* Records per ring (power of two) */
+#define ACCESSLOG_BATCH     (32*1024)   /* Formatted bytes per ring per flush */
+#define ACCESSLOG_LINE_MAX  4096        /* Longest formatted record (every field escaped) */
+#define ACCESSLOG_IDLE_NS   (10*1000000)/* Flusher sleep when rings are empty */
+#define ACCESSLOG_STALL_NS  (1000*1000000LL) /* Wait for a claimed slot to be published before skipping it */
+#define CACHELINE           64
+
+/* Access Record */
+
+typedef struct {
+    struct timespec time;               /*< Wall clock time request completed */
+    long            duration;           /*< Microseconds spent handling request */
+    long long       bytes;              /*< Response bytes (-1 if unknown) */
+    int             status;             /*< Numeric HTTP status */
+    char            host[48];
+    char            method[12];
+    char            uri[192];
+    char            referer[96];
+    char            agent[112];
+} AccessRecord;
+
+typedef struct {
+    _Atomic unsigned long sequence;     /*< Slot sequence number */
+    _Atomic pid_t         owner;        /*< Process filling a claimed slot (0 until known) */
+    AccessRecord          record;       /*< Record payload */
+} AccessSlot;
+
+/* Access Ring */
+
+typedef struct {
+    _Atomic unsigned long head __attribute__((aligned(CACHELINE)));    /*< Next slot to publish */
+    _Atomic unsigned long tail __attribute__((aligned(CACHELINE)));    /*< Next slot to flush */
+    unsigned long         stalled;      /*< Claimed slot the flusher is waiting on (flusher only) */
+    long long             stalled_since;/*< Monotonic nanoseconds it was first seen (0 if none) */
+    _Atomic unsigned long dropped __attribute__((aligned(CACHELINE))); /*< Records dropped (ring full or slot abandoned) */
+    AccessSlot            slots[ACCESSLOG_SLOTS];
+} AccessRing;
+
+/* Access Log State */
+
+static AccessRing     *Rings = NULL;    /* Shared with forked workers */
+static AccessLogFormat Format = ACCESS_LOG_COMMON;
+static int             LogFd = -1;
+static pthread_t       Flusher;
+static atomic_bool     Running = false;
+
+/* Producer Functions */
+
+/**
+ * Copy header value into fixed-size field, stopping at line terminators.
+ **/
+static void copy_field(char *dst, size_t size, const char *src) {
+    size_t n = 0;
+    if (src) {
+        while (n < size - 1 && src[n] && src[n] != '\r' && src[n] != '\n') {
+            dst[n] = src[n];
+            n++;
+        }
+    }
+    dst[n] = 0;
+}
+
+/**
+ * Record completed request in the access log.
+ *
+ * @param   r           HTTP Request structure.
+ * @param   status      Status of the HTTP request.
+ * @param   start       Monotonic time request handling started.
+ * @param   bytes       Response bytes (-1 if unknown).
+ *
+ * Copies the request into a slot on this worker's ring without blocking or
+ * writing; if the ring is full the record is dropped and counted.
+ **/
+void accesslog_record(Request *r, Status status, const struct timespec *start, long long bytes) {
+    if (!Rings) {
+        return;
+    }
+
+    AccessRing *ring = &Rings[WorkerId % ACCESSLOG_RINGS];
+    unsigned long position = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    AccessSlot *slot;
+
+    /* Claim a slot; a forked worker may share its ring with a sibling */
+    while (true) {
+        slot = &ring->slots[position & (ACCESSLOG_SLOTS - 1)];
+        unsigned long sequence = atomic_load_explicit(&slot->sequence, memory_order_acquire);
+        long difference = (long)(sequence - position);
+        if (difference == 0) {
+            if (atomic_compare_exchange_weak_explicit(&ring->head, &position, position + 1, memory_order_relaxed, memory_order_relaxed)) {
+                break;
+            }
+        } else if (difference < 0) {
+            atomic_fetch_add_explicit(&ring->dropped, 1, memory_order_relaxed);
+            return;
+        } else {
+            position = atomic_load_explicit(&ring->head, memory_order_relaxed);
+        }
+    }
+
+    atomic_store_explicit(&slot->owner, getpid(), memory_order_relaxed);
+
+    AccessRecord *record = &slot->record;
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &record->time);
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    const char *status_string = http_status_string(status);
+    record->status   = status_string ? atoi(status_string) : 0;
+    record->bytes    = bytes;
+    record->duration = (now.tv_sec - start->tv_sec) * 1000000L + (now.tv_nsec - start->tv_nsec) / 1000;
+    copy_field(record->host,    sizeof(record->host),    request_host(r));
+    copy_field(record->method,  sizeof(record->method),  r->method ? r->method : "-");
+    copy_field(record->uri,     sizeof(record->uri),     r->uri ? r->uri : "-");
+    copy_field(record->referer, sizeof(record->referer), request_header(r, "Referer"));
+    copy_field(record->agent,   sizeof(record->agent),   request_header(r, "User-Agent"));
+
+    atomic_store_explicit(&slot->sequence, position + 1, memory_order_release);
+}
+
+/* Flusher Functions */
+
+/**
+ * Append string for use between double quotes.
+ *
+ * Quotes and backslashes are escaped with a backslash, and control characters
+ * as \u00XX in JSON or \xXX (as Apache does) otherwise; other bytes, such as
+ * UTF-8 sequences, are copied as they are.
+ **/
+static int format_quoted(char *buffer, size_t size, const char *s, bool json) {
+    size_t n = 0;
+    for (; *s; s++) {
+        unsigned char c = *s;
+        if (c < 0x20 || c == 0x7f) {
+            if (n + 7 > size) {
+                break;
+            }
+            n += sprintf(buffer + n, json ? "\\u%04x" : "\\x%02x", c);
+            continue;
+        }
+        if (n + 3 > size) {
+            break;
+        }
+        if (c == '"' || c == '\\') {
+            buffer[n++] = '\\';
+        }
+        buffer[n++] = c;
+    }
+    buffer[n] = 0;
+    return n;
+}
+
+/**
+ * Format record as a single log line.
+ *
+ * @return  Number of bytes written to buffer.
+ **/
+static int format_record(char *buffer, size_t size, const AccessRecord *record) {
+    char timestamp[64];
+    char bytes[32];
+    char method[6*sizeof(record->method)];
+    char uri[6*sizeof(record->uri)];
+    char referer[6*sizeof(record->referer)];
+    char agent[6*sizeof(record->agent)];
+    bool json = Format == ACCESS_LOG_JSON;
+    struct tm tm;
+
+    if (record->bytes < 0) {
+        strcpy(bytes, "-");
+    } else {
+        snprintf(bytes, sizeof(bytes), "%lld", record->bytes);
+    }
+
+    format_quoted(method, sizeof(method), record->method, json);
+    format_quoted(uri, sizeof(uri), record->uri, json);
+    format_quoted(referer, sizeof(referer), record->referer[0] || json ? record->referer : "-", json);
+    format_quoted(agent, sizeof(agent), record->agent[0] || json ? record->agent : "-", json);
+    localtime_r(&record->time.tv_sec, &tm);
+
+    switch (Format) {
+        case ACCESS_LOG_JSON:
+            strftime(timestamp, sizeof(timestamp), "%Y-%m-%dT%H:%M:%S%z", &tm);
+            return snprintf(buffer, size,
+                "{\"time\":\"%s\",\"remote\":\"%s\",\"method\":\"%s\",\"uri\":\"%s\",\"status\":%d,\"bytes\":%s,\"duration_us\":%ld,\"referer\":\"%s\",\"agent\":\"%s\"}\n",
+                timestamp, record->host, method, uri, record->status, record->bytes < 0 ? "null" : bytes, record->duration, referer, agent);
+        case ACCESS_LOG_COMBINED:
+            strftime(timestamp, sizeof(timestamp), "%d/%b/%Y:%H:%M:%S %z", &tm);
+            return snprintf(buffer, size, "%s - - [%s] \"%s %s HTTP/1.0\" %d %s \"%s\" \"%s\"\n",
+                record->host, timestamp, method, uri, record->status, bytes, referer, agent);
+        default:
+            strftime(timestamp, sizeof(timestamp), "%d/%b/%Y:%H:%M:%S %z", &tm);
+            return snprintf(buffer, size, "%s - - [%s] \"%s %s HTTP/1.0\" %d %s\n",
+                record->host, timestamp, method, uri, record->status, bytes);
+    }
+}
+
+/**
+ * Return whether claimed slot was abandoned, skipping it if so.
+ *
+ * A worker that dies between claiming a slot and publishing it would
+ * otherwise hold up its ring for good.  Slots left unpublished for
+ * ACCESSLOG_STALL_NS are counted as dropped and made free again once the
+ * process that claimed them is gone; a live one (however slow) may still be
+ * writing the record, so it is waited on, since freeing the slot would let
+ * the next producer write over it.
+ **/
+static bool slot_abandoned(AccessRing *ring, AccessSlot *slot, unsigned long position) {
+    unsigned long head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    if ((long)(head - position) <= 0) {
+        return false;
+    }
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    long long nanoseconds = now.tv_sec * 1000000000LL + now.tv_nsec;
+    if (ring->stalled != position || !ring->stalled_since) {
+        ring->stalled       = position;
+        ring->stalled_since = nanoseconds;
+        return false;
+    }
+    if (nanoseconds - ring->stalled_since < ACCESSLOG_STALL_NS) {
+        return false;
+    }
+
+    pid_t owner = atomic_load_explicit(&slot->owner, memory_order_relaxed);
+    if (owner == 0 || kill(owner, 0) == 0 || errno != ESRCH) {
+        ring->stalled_since = nanoseconds;
+        return false;
+    }
+
+    atomic_store_explicit(&slot->owner, 0, memory_order_relaxed);
+    atomic_store_explicit(&slot->sequence, position + ACCESSLOG_SLOTS, memory_order_release);
+    atomic_fetch_add_explicit(&ring->dropped, 1, memory_order_relaxed);
+    ring->stalled_since = 0;
+    return true;
+}
+
+/**
+ * Drain published records from ring into buffer.
+ *
+ * @return  Number of bytes formatted into buffer.
+ **/
+static size_t drain_ring(AccessRing *ring, char *buffer, size_t size) {
+    size_t length = 0;
+    unsigned long position = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+
+    while (size - length > ACCESSLOG_LINE_MAX) {
+        AccessSlot *slot = &ring->slots[position & (ACCESSLOG_SLOTS - 1)];
+        if (atomic_load_explicit(&slot->sequence, memory_order_acquire) != position + 1) {
+            if (!slot_abandoned(ring, slot, position)) {
+                break;
+            }
+            position++;
+            continue;
+        }
+
+        int n = format_record(buffer + length, size - length, &slot->record);
+        if (n > 0) {
+            length += (size_t)n < size - length ? (size_t)n : size - length - 1;
+        }
+
+        atomic_store_explicit(&slot->owner, 0, memory_order_relaxed);
+        atomic_store_explicit(&slot->sequence, position + ACCESSLOG_SLOTS, memory_order_release);
+        position++;
+    }
+
+    atomic_store_explicit(&ring->tail, position, memory_order_relaxed);
+    return length;
+}
+
+/**
+ * Write formatted batch, retrying partial writes.
+ **/
+static void write_batch(struct iovec *iov, int iovcnt) {
+    while (iovcnt > 0) {
+        ssize_t n = writev(LogFd, iov, iovcnt);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return;
+        }
+
+        while (iovcnt > 0 && (size_t)n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+}
+
+/**
+ * Drain every ring once and write the result with a single writev.
+ *
+ * @return  Number of bytes written.
+ **/
+static size_t flush_rings(char *buffers) {
+    struct iovec iov[ACCESSLOG_RINGS];
+    int iovcnt = 0;
+    size_t total = 0;
+
+    for (int i = 0; i < ACCESSLOG_RINGS; i++) {
+        char *buffer = buffers + (size_t)i * ACCESSLOG_BATCH;
+        size_t length = drain_ring(&Rings[i], buffer, ACCESSLOG_BATCH);
+        if (length) {
+            iov[iovcnt].iov_base = buffer;
+            iov[iovcnt].iov_len  = length;
+            iovcnt++;
+            total += length;
+        }
+    }
+
+    write_batch(iov, iovcnt);
+    return total;
+}
+
+static void *flusher_thread(void *arg) {
+    char *buffers = arg;
+    unsigned long reported = 0;
+
+    while (atomic_load(&Running)) {
+        if (flush_rings(buffers) == 0) {
+            struct timespec idle = {0, ACCESSLOG_IDLE_NS};
+            nanosleep(&idle, NULL);
+        }
+
+        unsigned long dropped = accesslog_dropped();
+        if (dropped != reported) {
+            log("Access log dropped %lu records", dropped - reported);
+            reported = dropped;
+        }
+    }
+
+    while (flush_rings(buffers) > 0);
+    free(buffers);
+    return NULL;
+}
+
+/* Public Functions */
+
+/**
+ * Open access log and start background flusher.
+ *
+ * @param   path        Path to access log ("-" for stderr).
+ * @param   format      Log line format.
+ * @return  -1 on error and 0 on success.
+ *
+ * The rings live in anonymous shared memory so that forked workers can
+ * publish records which are then flushed by the parent's flusher thread.
+ * This must be called before any workers are forked.
+ **/
+int accesslog_open(const char *path, AccessLogFormat format) {
+    if (streq(path, "-")) {
+        LogFd = STDERR_FILENO;
+    } else if ((LogFd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644)) < 0) {
+        log("Unable to open access log %s: %s", path, strerror(errno));
+        return -1;
+    }
+
+    Rings = mmap(NULL, ACCESSLOG_RINGS * sizeof(AccessRing), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (Rings == MAP_FAILED) {
+        Rings = NULL;
+        return -1;
+    }
+
+    for (int i = 0; i < ACCESSLOG_RINGS; i++) {
+        for (unsigned long s = 0; s < ACCESSLOG_SLOTS; s++) {
+            atomic_init(&Rings[i].slots[s].sequence, s);
+        }
+    }
+
+    char *buffers = malloc((size_t)ACCESSLOG_RINGS * ACCESSLOG_BATCH);
+    if (!buffers) {
+        return -1;
+    }
+
+    Format = format;
+    atomic_store(&Running, true);
+    if ((errno = pthread_create(&Flusher, NULL, flusher_thread, buffers)) != 0) {
+        atomic_store(&Running, false);
+        free(buffers);
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Stop flusher after writing any remaining records.
+ **/
+void accesslog_close(void) {
+    if (!atomic_exchange(&Running, false)) {
+        return;
+    }
+    pthread_join(Flusher, NULL);
+}
+
+/**
+ * Return total number of records dropped (rings full or slots abandoned).
+ **/
+unsigned long accesslog_dropped(void) {
+    unsigned long dropped = 0;
+    for (int i = 0; Rings && i < ACCESSLOG_RINGS; i++) {
+        dropped += atomic_load_explicit(&Rings[i].dropped, memory_order_relaxed);
+    }
+    return dropped;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
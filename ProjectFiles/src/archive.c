@@ -0,0 +1,292 @@
+/* archive.c: Packed Asset Archive */
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <string.h>
+#include <strings.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/* Constants */
+
+#define ARCHIVE_INLINE_MAX  CACHE_FILE_MAX  /* Largest body sent straight from the mapping */
+
+/* Archive State */
+
+static const char         *Archive = NULL;  /* Mapped archive (NULL if none) */
+static size_t              ArchiveSize = 0;
+static int                 ArchiveFd = -1;  /* Kept open for sending large bodies */
+static const ArchiveHeader *Layout;   /* Header of mapped archive */
+static const uint32_t     *Seeds;
+static const ArchiveEntry *Entries;
+
+/**
+ * Hash key for the archive index (FNV-1a from a seeded basis, then mixed so
+ * every bit of the result depends on every byte).
+ *
+ * @param   key         Bytes to hash.
+ * @param   length      Number of bytes.
+ * @param   seed        Seed (0 picks the bucket; bucket seeds pick the slot).
+ * @return  Hash of key.
+ **/
+uint64_t archive_hash(const char *key, size_t length, uint32_t seed) {
+    uint64_t hash = 14695981039346656037ULL ^ ((uint64_t)seed * 0x9e3779b97f4a7c15ULL);
+    for (size_t i = 0; i < length; i++) {
+        hash ^= (unsigned char)key[i];
+        hash *= 1099511628211ULL;
+    }
+
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 33;
+    hash *= 0xc4ceb9fe1a85ec53ULL;
+    hash ^= hash >> 33;
+    return hash;
+}
+
+/**
+ * Return whether range lies within the archive.
+ **/
+static bool range_valid(const ArchiveRange *range) {
+    return range->offset <= ArchiveSize && range->length <= ArchiveSize - range->offset;
+}
+
+/**
+ * Check every offset in the archive once, so serving never has to.
+ **/
+static bool archive_valid(void) {
+    if (ArchiveSize < sizeof(ArchiveHeader) || memcmp(Layout->magic, ARCHIVE_MAGIC, sizeof(Layout->magic)) != 0 ||
+        Layout->version != ARCHIVE_VERSION || Layout->size != ArchiveSize || Layout->count == 0 || Layout->buckets == 0) {
+        return false;
+    }
+
+    ArchiveRange seeds   = {Layout->seeds, (uint64_t)Layout->buckets * sizeof(uint32_t)};
+    ArchiveRange entries = {Layout->entries, (uint64_t)Layout->count * sizeof(ArchiveEntry)};
+    if (!range_valid(&seeds) || !range_valid(&entries) || Layout->seeds % sizeof(uint32_t) || Layout->entries % sizeof(uint64_t)) {
+        return false;
+    }
+
+    for (uint32_t i = 0; i < Layout->count; i++) {
+        const ArchiveEntry *e = (const ArchiveEntry *)(Archive + Layout->entries) + i;
+        if (!range_valid(&e->uri) || e->uri.length == 0 || Archive[e->uri.offset + e->uri.length - 1] != '\0' ||
+            !range_valid(&e->head) || !range_valid(&e->body) || !range_valid(&e->gzip_head) || !range_valid(&e->gzip_body) ||
+            !range_valid(&e->not_modified) || !range_valid(&e->gzip_not_modified) ||
+            !memchr(e->etag, '\0', ARCHIVE_ETAG_MAX) || !memchr(e->gzip_etag, '\0', ARCHIVE_ETAG_MAX)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * Map packed archive to serve the default host from.
+ *
+ * @param   path        Path to archive built by bin/pack.
+ * @return  -1 on error and 0 on success.
+ *
+ * The mapping is shared (and never changes), so forked workers and the page
+ * cache hold one copy.  Replacing the file (by rename) does not affect a
+ * running server; the new archive is served after a restart.
+ **/
+int archive_open(const char *path) {
+    struct stat s;
+
+    ArchiveFd = open(path, O_RDONLY | O_CLOEXEC);
+    if (ArchiveFd < 0 || fstat(ArchiveFd, &s) < 0) {
+        log("Unable to open archive %s: %s", path, strerror(errno));
+        return -1;
+    }
+
+    ArchiveSize = s.st_size;
+    void *mapping = ArchiveSize ? mmap(NULL, ArchiveSize, PROT_READ, MAP_SHARED, ArchiveFd, 0) : MAP_FAILED;
+    if (mapping == MAP_FAILED) {
+        log("Unable to map archive %s: %s", path, strerror(errno));
+        return -1;
+    }
+
+    Archive = mapping;
+    Layout   = mapping;
+    if (!archive_valid()) {
+        log("Archive %s is not a valid version %d archive", path, ARCHIVE_VERSION);
+        munmap(mapping, ArchiveSize);
+        Archive = NULL;
+        return -1;
+    }
+
+    Seeds   = (const uint32_t *)(Archive + Layout->seeds);
+    Entries = (const ArchiveEntry *)(Archive + Layout->entries);
+
+    /* The index is read by every request, so fault it in now */
+    size_t index = Layout->seeds & ~(size_t)(sysconf(_SC_PAGESIZE) - 1);
+    madvise((char *)Archive + index, Layout->entries + (size_t)Layout->count * sizeof(ArchiveEntry) - index, MADV_WILLNEED);
+
+    debug("Archive %s: %u entries, %zu bytes", path, Layout->count, ArchiveSize);
+    return 0;
+}
+
+/**
+ * Return whether the default host is served from an archive.
+ **/
+bool archive_enabled(void) {
+    return Archive != NULL;
+}
+
+/**
+ * Normalize URI the way bin/pack stores it: no empty, ".", or trailing
+ * segments, and ".." removes the segment before it.
+ *
+ * @return  Length of normalized URI, or -1 if it does not fit or climbs above
+ * the root.
+ **/
+static ssize_t archive_normalize(const char *uri, char *buffer, size_t size) {
+    size_t length = 0;
+
+    while (*uri) {
+        while (*uri == '/') {
+            uri++;
+        }
+        size_t segment = strcspn(uri, "/");
+        if (segment == 0 || (segment == 1 && uri[0] == '.')) {
+            uri += segment;
+            continue;
+        }
+        if (segment == 2 && uri[0] == '.' && uri[1] == '.') {
+            if (length == 0) {
+                return -1;
+            }
+            while (buffer[--length] != '/');
+            uri += segment;
+            continue;
+        }
+        if (length + segment + 2 > size) {
+            return -1;
+        }
+        buffer[length++] = '/';
+        memcpy(buffer + length, uri, segment);
+        length += segment;
+        uri += segment;
+    }
+
+    if (length == 0) {
+        buffer[length++] = '/';
+    }
+    buffer[length] = '\0';
+    return length;
+}
+
+/**
+ * Find entry of URI with a single probe of the perfect hash.
+ **/
+static const ArchiveEntry *archive_lookup(const char *uri) {
+    char    key[PATH_MAX];
+    ssize_t length = archive_normalize(uri, key, sizeof(key));
+    if (length < 0) {
+        return NULL;
+    }
+
+    uint32_t seed = Seeds[archive_hash(key, length, 0) % Layout->buckets];
+    const ArchiveEntry *e = &Entries[archive_hash(key, length, seed) % Layout->count];
+
+    /* URIs that are not in the archive land on some other entry */
+    if (e->uri.length != (uint64_t)length + 1 || memcmp(Archive + e->uri.offset, key, length) != 0) {
+        return NULL;
+    }
+    return e;
+}
+
+/**
+ * Return whether header lists token (case-insensitive) without q=0.
+ **/
+static bool header_accepts(const char *header, const char *token) {
+    size_t length = strlen(token);
+
+    for (const char *p = header; p && *p; p = strchr(p, ',')) {
+        p += strspn(p, ", \t");
+        if (strncasecmp(p, token, length) == 0 && strchr(",; \t", p[length])) {
+            const char *q = strstr(p + length, "q=");
+            const char *end = strchr(p, ',');
+            return !(q && (!end || q < end) && strtod(q + 2, NULL) == 0);
+        }
+    }
+    return false;
+}
+
+/**
+ * Return whether If-None-Match header lists etag (or is "*").
+ **/
+static bool header_matches(const char *header, const char *etag) {
+    if (!header) {
+        return false;
+    }
+    if (streq(skip_whitespace((char *)header), "*")) {
+        return true;
+    }
+
+    /* Weak comparison: W/"x" matches "x" */
+    size_t length = strlen(etag);
+    for (const char *p = strstr(header, etag); p; p = strstr(p + 1, etag)) {
+        if (strchr(", \t/", p[length]) && (p == header || strchr(", \t/", p[-1]))) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Add range of the archive to the response.
+ *
+ * Small ranges are borrowed from the mapping; large ones go out as a file
+ * body, so they are sent with sendfile (or take turns in the backend) like any
+ * other file.
+ **/
+static int archive_send(Response *res, const ArchiveRange *range) {
+    if (range->length > ARCHIVE_INLINE_MAX) {
+        int fd = fcntl(ArchiveFd, F_DUPFD_CLOEXEC, 0);
+        if (fd >= 0) {
+            return response_file(res, fd, range->offset, range->length);
+        }
+    }
+
+    Blob blob = {Archive + range->offset, range->length};
+    return response_blob(res, &blob);
+}
+
+/**
+ * Serve request from the archive.
+ *
+ * @param   r           HTTP Request structure.
+ * @return  Status of the response (HTTP_STATUS_NOT_FOUND, with nothing
+ * written, if the URI is not in the archive).
+ *
+ * Everything was resolved when the archive was packed: each request is one
+ * hash probe, and the response is prebuilt headers and a body borrowed from
+ * the mapping, with no filesystem calls.  Clients that accept gzip get the
+ * compressed body (when packing found it worthwhile), and clients that hold
+ * the current ETag get 304 Not Modified.
+ **/
+Status archive_serve(Request *r) {
+    const ArchiveEntry *e = archive_lookup(r->uri);
+    if (!e) {
+        return HTTP_STATUS_NOT_FOUND;
+    }
+
+    bool        gzip = e->gzip_body.length > 0 && header_accepts(request_header(r, "Accept-Encoding"), "gzip");
+    const char *match = request_header(r, "If-None-Match");
+
+    if (header_matches(match, gzip ? e->gzip_etag : e->etag)) {
+        archive_send(r->response, gzip ? &e->gzip_not_modified : &e->not_modified);
+        return HTTP_STATUS_NOT_MODIFIED;
+    }
+
+    if (archive_send(r->response, gzip ? &e->gzip_head : &e->head) < 0 ||
+        archive_send(r->response, gzip ? &e->gzip_body : &e->body) < 0) {
+        return HTTP_STATUS_INTERNAL_SERVER_ERROR;
+    }
+    return HTTP_STATUS_OK;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,390 @@
+/* cache.c: Path, Response, and Mimetype Caches */
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <string.h>
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* Constants */
+
+#define CACHE_SLOTS         4096        /* Entries (direct mapped; collisions replace) */
+#define CACHE_BYTES         (64*1024*1024) /* Largest total size of cached responses */
+#define CACHE_MIMETYPES     8           /* Distinct mime.types files */
+
+/* Cache entry */
+
+typedef struct {
+    uint64_t    hash;                   /*< Hash of kind, host, and key (0 if empty) */
+    CacheKind   kind;
+    unsigned    host;                   /*< Id of virtual host */
+    uint64_t    generation;             /*< Host generation the entry was built at */
+    char       *key;                    /*< URI (paths and listings) or real path (files) */
+    char       *data;                   /*< Real path or complete response (NULL if none) */
+    size_t      length;                 /*< Bytes of response */
+    HandlerType type;                   /*< Handler for path (CACHE_PATH) */
+} CacheEntry;
+
+/* Mimetype table (extension to mimetype) */
+
+typedef struct {
+    char       *path;                   /*< Path of mime.types file */
+    uint64_t    generation;             /*< Mimetypes generation table was built at */
+    char      **extensions;             /*< Open addressing table of extensions */
+    char      **mimetypes;              /*< Mimetype of each extension */
+    size_t      mask;                   /*< Table size minus one */
+} MimeTable;
+
+/* Cache State
+ *
+ * Caches are per process, except that paths and responses go to the shared
+ * cache when one was created (forking mode), so workers fill it for each
+ * other.  In the other modes it holds only CGI output, which forked CGI
+ * executors fill.  Mimetype tables stay per process. */
+
+static CacheEntry  Entries[CACHE_SLOTS];
+static size_t      Bytes = 0;           /* Total length of cached responses */
+static MimeTable   MimeTables[CACHE_MIMETYPES];
+static char       *Copy = NULL;         /* Last response copied from the shared cache */
+static size_t      CopySize = 0;
+
+/**
+ * Hash key (FNV-1a) mixed with kind and host.
+ **/
+static uint64_t cache_hash(CacheKind kind, unsigned host, const char *key) {
+    uint64_t hash = 14695981039346656037ULL ^ ((uint64_t)kind << 32 | host);
+    for (const unsigned char *p = (const unsigned char *)key; *p; p++) {
+        hash ^= *p;
+        hash *= 1099511628211ULL;
+    }
+    return hash ? hash : 1;
+}
+
+static void entry_clear(CacheEntry *e) {
+    if (e->kind != CACHE_PATH) {
+        Bytes -= e->length;
+    }
+    free(e->key);
+    free(e->data);
+    memset(e, 0, sizeof(CacheEntry));
+}
+
+/**
+ * Find current entry for key.
+ *
+ * @return  Entry, or NULL if there is none (stale entries are dropped).
+ **/
+static CacheEntry *cache_find(CacheKind kind, const VirtualHost *host, const char *key, uint64_t hash) {
+    CacheEntry *e = &Entries[hash % CACHE_SLOTS];
+
+    if (e->hash != hash || e->kind != kind || e->host != host->id || !streq(e->key, key)) {
+        return NULL;
+    }
+
+    if (e->generation != watch_generation(host)) {
+        entry_clear(e);
+        return NULL;
+    }
+    return e;
+}
+
+/**
+ * Store entry, replacing whatever occupied its slot.
+ **/
+static CacheEntry *cache_put(CacheKind kind, const VirtualHost *host, const char *key, uint64_t hash, uint64_t generation) {
+    CacheEntry *e = &Entries[hash % CACHE_SLOTS];
+
+    if (e->hash) {
+        entry_clear(e);
+    }
+
+    if (!(e->key = strdup(key))) {
+        return NULL;
+    }
+    e->hash       = hash;
+    e->kind       = kind;
+    e->host       = host->id;
+    e->generation = generation;
+    return e;
+}
+
+/**
+ * Resolve URI to a real path and handler, using the path cache.
+ *
+ * @param   host        Virtual host serving the request.
+ * @param   uri         Resource path of URI.
+ * @param   path        Set to an allocated copy of the real path (NULL if
+ * the URI does not resolve to anything beneath the host's root).
+ * @return  Handler for the path (HANDLER_ERROR if it has none).
+ *
+ * Hits cost no system calls; misses (including URIs that resolve to nothing)
+ * are cached until anything beneath the root changes.
+ **/
+HandlerType cache_resolve(const VirtualHost *host, const char *uri, char **path) {
+    bool        enabled = watch_enabled();
+    bool        shared = enabled && shmcache_enabled(CACHE_PATH);
+    uint64_t    hash = cache_hash(CACHE_PATH, host->id, uri);
+    CacheEntry *e = enabled && !shared ? cache_find(CACHE_PATH, host, uri, hash) : NULL;
+    size_t      length = 0;
+
+    /* Shared entries hold the handler in the first byte, then the path (if any) */
+    if (shared && shmcache_lookup(CACHE_PATH, host->id, uri, hash, watch_generation(host), &Copy, &CopySize, &length) && length > 0) {
+        stats_cache(true);
+        *path = length > 1 ? strndup(Copy + 1, length - 1) : NULL;
+        return (HandlerType)Copy[0];
+    }
+
+    stats_cache(e != NULL);
+    if (e) {
+        *path = e->data ? strdup(e->data) : NULL;
+        return e->type;
+    }
+
+    /* Generation is read first, so a change during resolution makes the entry stale */
+    uint64_t    generation = watch_generation(host);
+    HandlerType type = HANDLER_ERROR;
+    struct stat s;
+
+    *path = determine_request_path(host, uri);
+    if (*path && stat(*path, &s) < 0) {
+        debug("Could not stat path: %s", *path);
+        free(*path);
+        *path = NULL;
+    }
+
+    if (*path) {
+        if (S_ISDIR(s.st_mode)) {
+            type = HANDLER_BROWSE;
+        } else if (access(*path, X_OK) == 0) {
+            type = HANDLER_CGI;
+        } else if (access(*path, R_OK) == 0) {
+            type = HANDLER_FILE;
+        }
+    }
+
+    if (shared) {
+        char entry[PATH_MAX + 1];
+        length = *path ? strlen(*path) : 0;
+        if (length < PATH_MAX) {
+            entry[0] = type;
+            if (*path) {
+                memcpy(entry + 1, *path, length);
+            }
+            shmcache_store(CACHE_PATH, host->id, uri, hash, generation, entry, length + 1);
+        }
+    } else if (enabled && (e = cache_put(CACHE_PATH, host, uri, hash, generation))) {
+        e->data = *path ? strdup(*path) : NULL;
+        e->type = type;
+    }
+    return type;
+}
+
+/**
+ * Look up cached response.
+ *
+ * @param   kind        CACHE_FILE, CACHE_LISTING, or CACHE_CGI.
+ * @param   host        Virtual host serving the request.
+ * @param   key         Real path (files) or URI (listings).
+ * @param   data        Set to the complete response (owned by the cache and
+ * only valid until the next cache call).
+ * @param   length      Set to the length of the response.
+ * @return  Whether a current response was found.
+ **/
+bool cache_lookup(CacheKind kind, const VirtualHost *host, const char *key, const char **data, size_t *length) {
+    if (!watch_enabled()) {
+        return false;
+    }
+
+    uint64_t hash = cache_hash(kind, host->id, key);
+    if (shmcache_enabled(kind)) {
+        bool hit = shmcache_lookup(kind, host->id, key, hash, watch_generation(host), &Copy, &CopySize, length);
+        stats_cache(hit);
+        *data = Copy;
+        return hit;
+    }
+
+    CacheEntry *e = cache_find(kind, host, key, hash);
+    stats_cache(e != NULL);
+    if (!e) {
+        return false;
+    }
+
+    *data   = e->data;
+    *length = e->length;
+    return true;
+}
+
+/**
+ * Store complete response.
+ *
+ * @param   kind        CACHE_FILE, CACHE_LISTING, or CACHE_CGI.
+ * @param   host        Virtual host serving the request.
+ * @param   key         Real path (files) or URI (listings).
+ * @param   generation  Host generation read before the response was built.
+ * @param   data        Allocated response (the cache takes ownership).
+ * @param   length      Length of response.
+ *
+ * Responses that would push the cache over its byte budget are dropped.  The
+ * shared cache (if any) evicts what has not been read lately instead.
+ **/
+void cache_store(CacheKind kind, const VirtualHost *host, const char *key, uint64_t generation, char *data, size_t length) {
+    uint64_t    hash = cache_hash(kind, host->id, key);
+    CacheEntry *e = &Entries[hash % CACHE_SLOTS];
+    size_t      replaced = (e->hash && e->kind != CACHE_PATH) ? e->length : 0;
+
+    if (watch_enabled() && shmcache_enabled(kind)) {
+        shmcache_store(kind, host->id, key, hash, generation, data, length);
+        free(data);
+        return;
+    }
+
+    if (!watch_enabled() || Bytes - replaced + length > CACHE_BYTES ||
+        !(e = cache_put(kind, host, key, hash, generation))) {
+        free(data);
+        return;
+    }
+
+    e->data   = data;
+    e->length = length;
+    Bytes    += length;
+}
+
+/**
+ * Parse mime.types file into table.
+ *
+ * @return  -1 on error and 0 on success.
+ **/
+static int mimetable_load(MimeTable *t, const char *path) {
+    FILE *fs = fopen(path, "r");
+    if (!fs) {
+        debug("Could not open mimetypes %s: %s", path, strerror(errno));
+        return -1;
+    }
+
+    size_t size = 1024;
+    t->extensions = calloc(size, sizeof(char *));
+    t->mimetypes  = calloc(size, sizeof(char *));
+    t->mask       = size - 1;
+
+    char   buffer[BUFSIZ];
+    size_t count = 0;
+    while (t->extensions && t->mimetypes && fgets(buffer, BUFSIZ, fs)) {
+        char *mimetype = strtok(buffer, WHITESPACE);
+        if (!mimetype || mimetype[0] == '#') {
+            continue;
+        }
+
+        for (char *ext = strtok(NULL, WHITESPACE); ext; ext = strtok(NULL, WHITESPACE)) {
+            /* Grow at half full, rehashing what is there */
+            if (2 * (count + 1) > size) {
+                MimeTable grown = {.mask = 2 * size - 1};
+                grown.extensions = calloc(2 * size, sizeof(char *));
+                grown.mimetypes  = calloc(2 * size, sizeof(char *));
+                if (!grown.extensions || !grown.mimetypes) {
+                    free(grown.extensions);
+                    free(grown.mimetypes);
+                    break;
+                }
+                for (size_t i = 0; i < size; i++) {
+                    if (t->extensions[i]) {
+                        size_t slot = cache_hash(0, 0, t->extensions[i]) & grown.mask;
+                        while (grown.extensions[slot]) {
+                            slot = (slot + 1) & grown.mask;
+                        }
+                        grown.extensions[slot] = t->extensions[i];
+                        grown.mimetypes[slot]  = t->mimetypes[i];
+                    }
+                }
+                free(t->extensions);
+                free(t->mimetypes);
+                t->extensions = grown.extensions;
+                t->mimetypes  = grown.mimetypes;
+                t->mask       = grown.mask;
+                size *= 2;
+            }
+
+            /* First mimetype listing an extension wins, as in a linear scan */
+            size_t slot = cache_hash(0, 0, ext) & t->mask;
+            while (t->extensions[slot] && !streq(t->extensions[slot], ext)) {
+                slot = (slot + 1) & t->mask;
+            }
+            if (!t->extensions[slot]) {
+                t->extensions[slot] = strdup(ext);
+                t->mimetypes[slot]  = strdup(mimetype);
+                count++;
+            }
+        }
+    }
+
+    fclose(fs);
+    return (t->extensions && t->mimetypes) ? 0 : -1;
+}
+
+static void mimetable_free(MimeTable *t) {
+    for (size_t i = 0; t->extensions && i <= t->mask; i++) {
+        free(t->extensions[i]);
+        free(t->mimetypes[i]);
+    }
+    free(t->extensions);
+    free(t->mimetypes);
+    t->extensions = NULL;
+    t->mimetypes  = NULL;
+}
+
+/**
+ * Look up mimetype of extension in host's mime.types.
+ *
+ * @param   host        Virtual host serving the file.
+ * @param   ext         File extension (without the dot).
+ * @return  Mimetype (owned by the cache), the host's default mimetype if the
+ * extension is unknown, or NULL if the table is unavailable.
+ *
+ * Each mime.types file is parsed once into a hash table, and again only
+ * after it changes.
+ **/
+const char *cache_mimetype(const VirtualHost *host, const char *ext) {
+    if (!watch_enabled()) {
+        return NULL;
+    }
+
+    uint64_t   generation = watch_mimetypes_generation();
+    MimeTable *t = NULL;
+    for (int i = 0; i < CACHE_MIMETYPES && !t; i++) {
+        if (!MimeTables[i].path || streq(MimeTables[i].path, host->mimetypes_path)) {
+            t = &MimeTables[i];
+        }
+    }
+    if (!t) {
+        return NULL;
+    }
+
+    if (!t->path || t->generation != generation) {
+        mimetable_free(t);
+        if (!t->path && !(t->path = strdup(host->mimetypes_path))) {
+            return NULL;
+        }
+        t->generation = generation;
+        if (mimetable_load(t, t->path) < 0) {
+            mimetable_free(t);
+            t->mask = 0;
+        }
+    }
+
+    if (!t->extensions) {
+        return host->default_mimetype;
+    }
+
+    size_t slot = cache_hash(0, 0, ext) & t->mask;
+    while (t->extensions[slot]) {
+        if (streq(t->extensions[slot], ext)) {
+            return t->mimetypes[slot];
+        }
+        slot = (slot + 1) & t->mask;
+    }
+    return host->default_mimetype;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,507 @@
+/* cgi.c: CGI Executor */
+
+#define _GNU_SOURCE
+
+#include "spidey.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <string.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+/* Constants */
+
+#define CGI_RUNNING         8           /* Scripts run at once (default) */
+#define CGI_QUEUED          32          /* Requests waiting for a run (default) */
+#define CGI_TIMEOUT         30          /* Seconds to answer once a request reaches the tier (default) */
+#define CGI_RECHECK_MS      1000        /* Longest wait between checks for dead seat holders */
+#define CGI_OUTPUT_MAX      (16*1024*1024) /* Most output collected from a script */
+#define EXECUTORS_MAX       256         /* Executors running at once (more are answered in place) */
+
+/* Seats in the tier (shared with forked workers and executors) */
+
+typedef struct {
+    pid_t       pid;                    /*< Process holding the seat (0 if free) */
+    bool        running;                /*< Running a script (else queued) */
+    uint64_t    ticket;                 /*< Arrival order of queued seats */
+} Seat;
+
+typedef struct {
+    pthread_mutex_t lock;               /*< Guards seats (robust, process shared) */
+    pthread_cond_t  freed;              /*< Broadcast when a script finishes */
+    uint64_t        tickets;            /*< Next arrival ticket */
+    Seat            seats[];            /*< Running plus Queued seats */
+} Tier;
+
+/* Executor State */
+
+static Tier *TheTier = NULL;
+static int   Running = CGI_RUNNING;
+static int   Queued  = CGI_QUEUED;
+static int   Timeout = CGI_TIMEOUT;
+static pid_t Executors[EXECUTORS_MAX];  /* Executors not yet reaped */
+static int   NExecutors = 0;
+
+/**
+ * Set limits of the CGI tier.
+ *
+ * @param   spec        Limits of the form RUNNING[:QUEUED[:SECONDS]].
+ * @return  -1 on error and 0 on success.
+ **/
+int cgi_limits(const char *spec) {
+    long  values[3] = {Running, Queued, Timeout};
+    const char *p = spec;
+    char *end = NULL;
+
+    for (int i = 0; i < 3; i++) {
+        values[i] = strtol(p, &end, 10);
+        if (end == p || values[i] < (i == 1 ? 0 : 1) || values[i] > 65536 || (*end && *end != ':')) {
+            log("CGI limits %s must be RUNNING[:QUEUED[:SECONDS]]", spec);
+            return -1;
+        }
+        if (!*end) {
+            break;
+        }
+        p = end + 1;
+    }
+    if (*end) {
+        log("CGI limits %s must be RUNNING[:QUEUED[:SECONDS]]", spec);
+        return -1;
+    }
+
+    Running = values[0];
+    Queued  = values[1];
+    Timeout = values[2];
+    return 0;
+}
+
+/**
+ * Create table of seats in the CGI tier.
+ *
+ * @return  -1 on error and 0 on success.
+ *
+ * This must be called before workers are forked, so the limits hold across
+ * all of them.
+ **/
+int cgi_init(void) {
+    size_t size = sizeof(Tier) + (size_t)(Running + Queued) * sizeof(Seat);
+    Tier  *tier = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (tier == MAP_FAILED) {
+        log("Unable to map CGI tier: %s", strerror(errno));
+        return -1;
+    }
+
+    pthread_mutexattr_t attributes;
+    pthread_mutexattr_init(&attributes);
+    pthread_mutexattr_setpshared(&attributes, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attributes, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(&tier->lock, &attributes);
+    pthread_mutexattr_destroy(&attributes);
+
+    pthread_condattr_t condition;
+    pthread_condattr_init(&condition);
+    pthread_condattr_setpshared(&condition, PTHREAD_PROCESS_SHARED);
+    pthread_condattr_setclock(&condition, CLOCK_MONOTONIC);
+    pthread_cond_init(&tier->freed, &condition);
+    pthread_condattr_destroy(&condition);
+
+    TheTier = tier;
+    return 0;
+}
+
+/**
+ * Return milliseconds left until deadline (0 if it has passed).
+ **/
+static int cgi_remaining(const struct timespec *deadline) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return transfer_wait(deadline, &now);
+}
+
+/* Seats
+ *
+ * A request takes a running seat if one is free, or else a queued seat, and
+ * queued seats move up in arrival order as scripts finish.  Holders that die
+ * without giving up their seat are found by checking their pids. */
+
+/**
+ * Lock tier, recovering it if a process died holding the lock.
+ **/
+static void tier_lock(void) {
+    if (pthread_mutex_lock(&TheTier->lock) == EOWNERDEAD) {
+        pthread_mutex_consistent(&TheTier->lock);
+    }
+}
+
+/**
+ * Free seats of dead holders and count the rest (tier must be locked).
+ **/
+static void tier_count(int *running, int *queued) {
+    *running = *queued = 0;
+    for (int i = 0; i < Running + Queued; i++) {
+        Seat *s = &TheTier->seats[i];
+        if (s->pid && kill(s->pid, 0) < 0 && errno == ESRCH) {
+            s->pid = 0;
+            pthread_cond_broadcast(&TheTier->freed);
+        }
+        if (s->pid && s->running) {
+            (*running)++;
+        } else if (s->pid) {
+            (*queued)++;
+        }
+    }
+}
+
+/**
+ * Return whether every seat is taken (a new request would be turned away).
+ **/
+static bool tier_full(void) {
+    int running, queued;
+
+    tier_lock();
+    tier_count(&running, &queued);
+    pthread_mutex_unlock(&TheTier->lock);
+    return running >= Running && queued >= Queued;
+}
+
+/**
+ * Take a running seat, waiting in the queue until deadline if need be.
+ *
+ * @param   deadline    Monotonic time to give up waiting.
+ * @return  Seat to give up with tier_leave (NULL if the queue is full or
+ * the deadline passed).
+ **/
+static Seat *tier_enter(const struct timespec *deadline) {
+    Seat *seat = NULL;
+
+    tier_lock();
+    while (true) {
+        int running, queued;
+        tier_count(&running, &queued);
+
+        /* Queued seats run in arrival order, newcomers after all of them */
+        int ahead = queued;
+        if (seat) {
+            ahead = 0;
+            for (int i = 0; i < Running + Queued; i++) {
+                Seat *s = &TheTier->seats[i];
+                ahead += s->pid && !s->running && s->ticket < seat->ticket;
+            }
+        }
+
+        bool run = running + ahead < Running;
+        for (int i = 0; !seat && (run || queued < Queued) && i < Running + Queued; i++) {
+            if (!TheTier->seats[i].pid) {
+                seat         = &TheTier->seats[i];
+                seat->pid    = getpid();
+                seat->ticket = TheTier->tickets++;
+            }
+        }
+        if (!seat) {
+            pthread_mutex_unlock(&TheTier->lock);
+            return NULL;
+        }
+
+        seat->running = run;
+        if (run) {
+            pthread_mutex_unlock(&TheTier->lock);
+            return seat;
+        }
+
+        /* Wake up now and then to notice holders that died */
+        int wait = cgi_remaining(deadline);
+        if (wait == 0) {
+            seat->pid = 0;
+            pthread_cond_broadcast(&TheTier->freed);
+            pthread_mutex_unlock(&TheTier->lock);
+            return NULL;
+        }
+
+        struct timespec until;
+        clock_gettime(CLOCK_MONOTONIC, &until);
+        wait = wait < CGI_RECHECK_MS ? wait : CGI_RECHECK_MS;
+        until.tv_sec  += wait / 1000;
+        until.tv_nsec += (wait % 1000) * 1000000L;
+        if (until.tv_nsec >= 1000000000L) {
+            until.tv_sec++;
+            until.tv_nsec -= 1000000000L;
+        }
+        if (pthread_cond_timedwait(&TheTier->freed, &TheTier->lock, &until) == EOWNERDEAD) {
+            pthread_mutex_consistent(&TheTier->lock);
+        }
+    }
+}
+
+/**
+ * Give up seat taken by tier_enter and wake the queue.
+ **/
+static void tier_leave(Seat *seat) {
+    tier_lock();
+    seat->pid = 0;
+    pthread_cond_broadcast(&TheTier->freed);
+    pthread_mutex_unlock(&TheTier->lock);
+}
+
+/* Scripts */
+
+/**
+ * Start script in its own process group.
+ *
+ * @param   path        Path of script (run by the shell, as popen would).
+ * @param   fd          Set to the read end of the script's output.
+ * @return  Pid of script (-1 on error).
+ **/
+static pid_t cgi_spawn(const char *path, int *fd) {
+    int fds[2];
+    if (pipe2(fds, O_CLOEXEC) < 0) {
+        return -1;
+    }
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        /* Killing the group also kills anything the script starts */
+        setpgid(0, 0);
+        signal(SIGPIPE, SIG_DFL);
+        dup2(fds[1], STDOUT_FILENO);
+        execl("/bin/sh", "sh", "-c", path, (char *)NULL);
+        _exit(127);
+    }
+
+    close(fds[1]);
+    if (pid < 0) {
+        close(fds[0]);
+        return -1;
+    }
+    setpgid(pid, pid);
+    *fd = fds[0];
+    return pid;
+}
+
+/**
+ * Wait for script to exit, killing it (and its group) at the deadline.
+ *
+ * @return  Wait status of script.
+ **/
+static int cgi_reap(pid_t pid, const struct timespec *deadline) {
+    int status = 0;
+    int pidfd = syscall(SYS_pidfd_open, pid, 0);
+
+    /* Without pidfds (before Linux 5.3) a lingering script is waited for */
+    if (pidfd >= 0) {
+        struct pollfd pfd = {.fd = pidfd, .events = POLLIN};
+        int wait;
+        while ((wait = cgi_remaining(deadline)) > 0 && poll(&pfd, 1, wait) < 0 && errno == EINTR);
+        if (!(pfd.revents & POLLIN)) {
+            kill(-pid, SIGKILL);
+            kill(pid, SIGKILL);
+        }
+        close(pidfd);
+    }
+
+    while (waitpid(pid, &status, 0) < 0 && errno == EINTR);
+    return status;
+}
+
+/**
+ * Run CGI script in the tier.
+ *
+ * @param   r           HTTP Request structure (CGI environment exported).
+ * @param   output      Stream the script's output is written to.
+ * @param   exited      Set to wait status of the script (may be NULL).
+ * @return  HTTP_STATUS_OK if the script ran to the end,
+ * HTTP_STATUS_SERVICE_UNAVAILABLE if the queue was full or the request
+ * waited in it too long, HTTP_STATUS_GATEWAY_TIMEOUT if the script overran
+ * (it was killed), HTTP_STATUS_BAD_GATEWAY if its output passed
+ * CGI_OUTPUT_MAX (it was killed), or HTTP_STATUS_INTERNAL_SERVER_ERROR if it
+ * could not be started.
+ *
+ * A request has Timeout seconds from reaching the tier, queueing included,
+ * to be answered.  Output is collected whole before anything is sent, so an
+ * overrun can still be answered with a 504.
+ **/
+Status cgi_run(Request *r, FILE *output, int *exited) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += Timeout;
+
+    Seat *seat = TheTier ? tier_enter(&deadline) : NULL;
+    if (TheTier && !seat) {
+        debug("CGI tier is saturated");
+        return HTTP_STATUS_SERVICE_UNAVAILABLE;
+    }
+
+    int   fd;
+    pid_t pid = cgi_spawn(r->path, &fd);
+    if (pid < 0) {
+        if (seat) {
+            tier_leave(seat);
+        }
+        return HTTP_STATUS_INTERNAL_SERVER_ERROR;
+    }
+
+    Status status = HTTP_STATUS_OK;
+    struct pollfd pfd = {.fd = fd, .events = POLLIN};
+    char   buffer[BUFSIZ];
+    size_t collected = 0;
+    while (true) {
+        int wait = cgi_remaining(&deadline);
+        int ready = wait > 0 ? poll(&pfd, 1, wait) : 0;
+        if (ready < 0 && errno == EINTR) {
+            continue;
+        }
+        if (ready == 0) {
+            log("CGI script %s overran %d seconds; killing it", r->path, Timeout);
+            kill(-pid, SIGKILL);
+            kill(pid, SIGKILL);
+            status = HTTP_STATUS_GATEWAY_TIMEOUT;
+            break;
+        }
+
+        ssize_t nread = ready > 0 ? read(fd, buffer, sizeof(buffer)) : -1;
+        if (nread < 0 && errno == EINTR) {
+            continue;
+        }
+        if (nread <= 0) {
+            break;
+        }
+        if ((collected += nread) > CGI_OUTPUT_MAX) {
+            log("CGI script %s wrote more than %d bytes; killing it", r->path, CGI_OUTPUT_MAX);
+            kill(-pid, SIGKILL);
+            kill(pid, SIGKILL);
+            status = HTTP_STATUS_BAD_GATEWAY;
+            break;
+        }
+        fwrite(buffer, 1, nread, output);
+    }
+    close(fd);
+
+    int waited = cgi_reap(pid, &deadline);
+    if (exited) {
+        *exited = waited;
+    }
+    if (seat) {
+        tier_leave(seat);
+    }
+    return status;
+}
+
+/* Executors
+ *
+ * The single and uring servers answer requests one after another in one
+ * process, so a slow script (or proxy upstream) would hold up every request
+ * behind it.  They fork an executor per CGI or proxied request instead, which
+ * answers it (and exits) while the server loop moves on.  Forked workers and
+ * HTTP/2 streams run scripts themselves: workers are processes of their own
+ * already, and streams share their connection with others. */
+
+/**
+ * Close sockets the executor inherited other than the client's.
+ *
+ * The listening socket and other clients' sockets stay open as long as any
+ * process holds them, so clients would not see their responses end.
+ **/
+static void executor_close_sockets(int client) {
+    DIR *dir = opendir("/proc/self/fd");
+    if (!dir) {
+        return;
+    }
+
+    struct dirent *entry;
+    while ((entry = readdir(dir))) {
+        int fd = atoi(entry->d_name);
+        struct stat s;
+        if (fd > STDERR_FILENO && fd != client && fd != dirfd(dir) && fstat(fd, &s) == 0 && S_ISSOCK(s.st_mode)) {
+            close(fd);
+        }
+    }
+    closedir(dir);
+}
+
+/**
+ * Collect executors that have exited.
+ *
+ * Only executors are waited for, so other children (such as the new server
+ * a restart spawns) are left to their own waits.  The single and uring
+ * servers call this once per loop iteration.
+ **/
+void executor_reap(void) {
+    for (int i = 0; i < NExecutors; ) {
+        if (waitpid(Executors[i], NULL, WNOHANG) != 0) {
+            Executors[i] = Executors[--NExecutors];
+        } else {
+            i++;
+        }
+    }
+}
+
+/**
+ * Hand request to a forked executor.
+ *
+ * @param   r           HTTP Request structure.
+ * @return  Whether an executor took the request (the caller must leave it
+ * alone: the executor sends, logs, and traces the response).
+ *
+ * Returns false in the executor (which goes on to answer the request and
+ * then exits, see handle_request), and when the request is to be answered
+ * in place: in forked workers, for HTTP/2 streams, while EXECUTORS_MAX
+ * executors run, or when fork fails.
+ **/
+bool executor_detach(Request *r) {
+    if (WorkerId != 0 || r->fd < 0) {
+        return false;
+    }
+
+    executor_reap();
+    if (NExecutors == EXECUTORS_MAX || request_hold(r) < 0) {
+        return false;
+    }
+
+    pid_t pid = fork();
+    if (pid < 0) {
+        log("Unable to fork CGI executor: %s", strerror(errno));
+        return false;
+    }
+
+    if (pid == 0) {
+        WorkerId    = getpid();
+        r->executor = true;
+        executor_close_sockets(r->fd);
+
+        /* Backends that send responses themselves (uring) stay with the server */
+        if (r->response->fd < 0) {
+            r->response = response_new(r->fd, &r->trace);
+            if (!r->response) {
+                _exit(EXIT_FAILURE);
+            }
+        }
+        return false;
+    }
+
+    Executors[NExecutors++] = pid;
+    r->detached      = true;
+    r->trace.enabled = false;
+    return true;
+}
+
+/**
+ * Hand CGI request to a forked executor (see executor_detach).
+ *
+ * @param   r           HTTP Request structure.
+ * @return  Whether an executor took the request.
+ *
+ * Requests stay in place when the tier is full (the answer is a quick 503).
+ **/
+bool cgi_detach(Request *r) {
+    return !(TheTier && tier_full()) && executor_detach(r);
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
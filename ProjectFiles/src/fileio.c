@@ -0,0 +1,206 @@
+/* fileio.c: File I/O */
+
+#define _GNU_SOURCE
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <string.h>
+
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+/* Constants */
+
+#define FILEIO_WINDOW       (1024*1024) /* Bytes read ahead when a body starts */
+#define FILEIO_HUGE         (128LL*1024*1024) /* Bodies dropped from the page cache once sent */
+
+/* Pool State */
+
+static pthread_mutex_t Lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  Queued = PTHREAD_COND_INITIALIZER;
+static FileJob        *Pending = NULL;  /* Jobs waiting for a thread (oldest first) */
+static FileJob        *PendingTail = NULL;
+static FileJob        *Completed = NULL;/* Jobs done and not yet collected */
+static int             Wake = -1;       /* Eventfd signalled when jobs complete */
+
+/* Page Cache Hints */
+
+/**
+ * Tell the kernel a body is about to be read sequentially.
+ *
+ * @param   fd          File descriptor.
+ * @param   offset      Offset of first byte.
+ * @param   length      Number of bytes.
+ *
+ * This doubles the readahead window and starts reading the first
+ * FILEIO_WINDOW bytes in the background, so the first sends do not wait on
+ * the disk.
+ **/
+void fileio_advise(int fd, off_t offset, off_t length) {
+    posix_fadvise(fd, offset, length, POSIX_FADV_SEQUENTIAL);
+    posix_fadvise(fd, offset, length < FILEIO_WINDOW ? length : FILEIO_WINDOW, POSIX_FADV_WILLNEED);
+}
+
+/**
+ * Drop a huge body from the page cache once it has been sent.
+ *
+ * @param   fd          File descriptor.
+ * @param   offset      Offset of first byte.
+ * @param   length      Number of bytes.
+ *
+ * One download of a file larger than FILEIO_HUGE would otherwise push the
+ * small, hot files out of memory; smaller bodies are left alone.
+ **/
+void fileio_release(int fd, off_t offset, off_t length) {
+    if (length >= FILEIO_HUGE) {
+        posix_fadvise(fd, offset, length, POSIX_FADV_DONTNEED);
+    }
+}
+
+/**
+ * Read from file only if the bytes are in the page cache.
+ *
+ * @param   fd          File descriptor.
+ * @param   buffer      Buffer to read into.
+ * @param   length      Bytes to read.
+ * @param   offset      Offset of first byte.
+ * @return  Bytes read, or -1 with errno EAGAIN if reading would wait on the
+ * disk (or with another errno on error).
+ *
+ * Kernels without RWF_NOWAIT for buffered files read normally.
+ **/
+ssize_t fileio_read_cached(int fd, void *buffer, size_t length, off_t offset) {
+    struct iovec iov = {.iov_base = buffer, .iov_len = length};
+    ssize_t n;
+
+    do {
+        n = preadv2(fd, &iov, 1, offset, RWF_NOWAIT);
+    } while (n < 0 && errno == EINTR);
+
+    if (n < 0 && (errno == EOPNOTSUPP || errno == ENOSYS || errno == EINVAL)) {
+        n = pread(fd, buffer, length, offset);
+    }
+    if (n > 0 && (size_t)n < length) {
+        /* Partly resident: the rest would wait on the disk */
+        errno = EAGAIN;
+        return -1;
+    }
+    return n;
+}
+
+/* Blocking I/O Pool
+ *
+ * Event loops must not wait on the disk, so reads of files that are not in
+ * the page cache go to a few threads that may block.  Each completion bumps
+ * an eventfd the loop watches; the loop then collects finished jobs. */
+
+/**
+ * Run jobs until the process exits.
+ **/
+static void *fileio_thread(void *arg) {
+    while (true) {
+        pthread_mutex_lock(&Lock);
+        while (!Pending) {
+            pthread_cond_wait(&Queued, &Lock);
+        }
+        FileJob *job = Pending;
+        if (!(Pending = job->next)) {
+            PendingTail = NULL;
+        }
+        pthread_mutex_unlock(&Lock);
+
+        size_t total = 0;
+        job->error = 0;
+        while (total < job->length) {
+            ssize_t n = pread(job->fd, (char *)job->buffer + total, job->length - total, job->offset + total);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n <= 0) {
+                job->error = n < 0 ? errno : EIO;
+                break;
+            }
+            total += n;
+        }
+        job->result = total;
+
+        pthread_mutex_lock(&Lock);
+        job->next = Completed;
+        Completed = job;
+        pthread_mutex_unlock(&Lock);
+
+        uint64_t one = 1;
+        if (write(Wake, &one, sizeof(one)) < 0) {
+            debug("Unable to signal completion: %s", strerror(errno));
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Start blocking I/O threads.
+ *
+ * @param   threads     Number of threads.
+ * @return  Eventfd that becomes readable as jobs complete (-1 on error).
+ **/
+int fileio_init(int threads) {
+    if (Wake >= 0) {
+        return Wake;
+    }
+
+    if ((Wake = eventfd(0, EFD_CLOEXEC)) < 0) {
+        return -1;
+    }
+
+    for (int i = 0; i < threads; i++) {
+        pthread_t thread;
+        if ((errno = pthread_create(&thread, NULL, fileio_thread, NULL)) != 0) {
+            log("Unable to start I/O thread: %s", strerror(errno));
+            if (i == 0) {
+                close(Wake);
+                Wake = -1;
+                return -1;
+            }
+            break;
+        }
+        pthread_detach(thread);
+    }
+    return Wake;
+}
+
+/**
+ * Queue job for a blocking I/O thread.
+ *
+ * The job must stay valid until it is returned by fileio_completed.
+ **/
+void fileio_submit(FileJob *job) {
+    pthread_mutex_lock(&Lock);
+    job->next = NULL;
+    if (PendingTail) {
+        PendingTail->next = job;
+    } else {
+        Pending = job;
+    }
+    PendingTail = job;
+    pthread_cond_signal(&Queued);
+    pthread_mutex_unlock(&Lock);
+}
+
+/**
+ * Take every job completed so far.
+ *
+ * @return  List of completed jobs linked by next (NULL if none).
+ **/
+FileJob *fileio_completed(void) {
+    pthread_mutex_lock(&Lock);
+    FileJob *jobs = Completed;
+    Completed = NULL;
+    pthread_mutex_unlock(&Lock);
+    return jobs;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -6,8 +6,61 @@
 #include <signal.h>
 #include <string.h>
 
+#include <sys/wait.h>
 #include <unistd.h>
 
+/* Worker State */
+
+static pid_t  *Children = NULL;         /* Workers still handling requests */
+static size_t  NChildren = 0;
+static size_t  ChildrenCapacity = 0;
+
+/**
+ * Remember worker so it can be waited for (or killed) when draining.
+ **/
+static void children_add(pid_t pid) {
+    if (NChildren == ChildrenCapacity) {
+        size_t capacity = ChildrenCapacity ? 2 * ChildrenCapacity : 64;
+        pid_t *children = realloc(Children, capacity * sizeof(pid_t));
+        if (!children) {
+            return;
+        }
+        Children = children;
+        ChildrenCapacity = capacity;
+    }
+    Children[NChildren++] = pid;
+}
+
+/**
+ * Forget reaped worker (anything else, e.g. a restarted server, is ignored).
+ **/
+static void children_remove(pid_t pid) {
+    for (size_t i = 0; i < NChildren; i++) {
+        if (Children[i] == pid) {
+            Children[i] = Children[--NChildren];
+            return;
+        }
+    }
+}
+
+/**
+ * Reap workers that have exited.
+ *
+ * @param   block       Whether to wait for at least one worker.
+ **/
+static void children_reap(bool block) {
+    pid_t pid;
+    while ((pid = waitpid(-1, NULL, block ? 0 : WNOHANG)) > 0) {
+        children_remove(pid);
+        block = false;
+    }
+
+    /* Nothing left to wait for (interrupted waits just return) */
+    if (pid < 0 && errno == ECHILD) {
+        NChildren = 0;
+    }
+}
+
 /**
  * Fork incoming HTTP requests to handle the concurrently.
  *
@@ -16,10 +69,21 @@
  *
  * The parent should accept a request and then fork off and let the child
  * handle the request.
+ *
+ * Once told to stop, the parent waits for its workers until the drain
+ * deadline and then kills any that remain.
  **/
 int forking_server(int sfd) {
     /* Accept and handle HTTP request */
     while (true) {
+        children_reap(false);
+        if (!restart_wait(sfd)) {
+            if (restart_stopping(sfd)) {
+                break;
+            }
+            continue;
+        }
+
     	/* Accept request */
         Request * r = accept_request(sfd);
         if(!r)
@@ -33,20 +97,46 @@ int forking_server(int sfd) {
         if(pid == 0)
         {
             debug("Handling Child");
-            handle_request(r);
+            WorkerId = getpid();
+            close(sfd);
+            stats_connection(1);
+            if(!tls_enabled() || tls_accept(r) == 0)
+            {
+                handle_request(r);
+            }
             free_request(r);
+            stats_connection(-1);
             exit(EXIT_SUCCESS);
 
         }
 	     /* Fork off child process to handle request */
         else
         {
+            if(pid > 0)
+            {
+                children_add(pid);
+            }
             free_request(r);
         }
     }
 
-    /* Close server socket */
+    /* Close server socket and drain workers */
     close(sfd);
+    while (NChildren > 0 && !restart_expired()) {
+        children_reap(true);
+    }
+
+    if (NChildren > 0) {
+        log("Drain deadline passed; killing %zu workers", NChildren);
+        for (size_t i = 0; i < NChildren; i++) {
+            kill(Children[i], SIGKILL);
+        }
+        while (NChildren > 0) {
+            children_reap(true);
+        }
+    }
+
+    free(Children);
     return EXIT_SUCCESS;
 }
 
@@ -0,0 +1,19 @@
+/* globals.c: Global Variables
+ *
+ * Settings the library reads, with their defaults; programs assign them
+ * (spidey from its options) before calling into the library. */
+
+#include "spidey.h"
+
+char *Port            = "9898";
+char *MimeTypesPath   = "/etc/mime.types";
+char *DefaultMimeType = "text/plain";
+char *RootPath        = "www";
+char *AccessLogPath   = "-";
+char *ArchivePath     = NULL;
+int   WorkerId        = 0;
+int   DrainTimeout    = 30;             /* Seconds */
+long  TransferRate    = 0;              /* Bytes per second */
+int   HybridHandlers  = 0;              /* Two per CPU */
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -7,6 +7,7 @@
 #include <string.h>
 
 #include <dirent.h>
+#include <fcntl.h>
 #include <sys/stat.h>
 #include <unistd.h>
 
@@ -14,8 +15,34 @@
 Status handle_browse_request(Request *request);
 Status handle_file_request(Request *request);
 Status handle_cgi_request(Request *request);
+Status handle_stats_request(Request *request);
 Status handle_error(Request *request, Status status);
 
+/**
+ * Print headers of a 200 OK response with the given Content-Type (for
+ * responses rendered into memory to be cached).
+ **/
+static void print_headers(FILE *stream, const char *mimetype) {
+    const Blob *headers = response_headers(mimetype);
+    if (headers) {
+        fwrite(headers->data, 1, headers->length, stream);
+    } else {
+        fprintf(stream, "HTTP/1.0 200 OK\r\nContent-Type: %s\r\n\r\n", mimetype);
+    }
+}
+
+/**
+ * Write headers of a 200 OK response with the given Content-Type.
+ **/
+static void write_headers(Response *res, const char *mimetype) {
+    const Blob *headers = response_headers(mimetype);
+    if (headers) {
+        response_blob(res, headers);
+    } else {
+        response_printf(res, "HTTP/1.0 200 OK\r\nContent-Type: %s\r\n\r\n", mimetype);
+    }
+}
+
 /**
  * Handle HTTP Request.
  *
@@ -29,52 +56,138 @@ Status handle_error(Request *request, Status status);
  **/
 Status  handle_request(Request *r) {
     Status result;
+    HandlerType type = HANDLER_ERROR;
+    struct timespec start, parsed, resolved, finished;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    stats_phase(PHASE_ACCEPT, &r->start, &start);
 
     /* Parse request */
     if(parse_request(r) == -1)
     {
         debug("Parse request failed: %s", strerror(errno));
         result = handle_error(r, HTTP_STATUS_BAD_REQUEST);
-        return result;
+        goto done;
     }
+    clock_gettime(CLOCK_MONOTONIC, &parsed);
+    stats_phase(PHASE_PARSE, &start, &parsed);
+    trace_point(&r->trace, TRACE_PARSED);
 
-    /* Determine request path */
-    r->path = determine_request_path(r->uri);
+    /* Hand the connection to HTTP/2; each stream is handled (and logged) on its own */
+    if(r->upgradable && http2_detect(r))
+    {
+        return http2_serve(r);
+    }
 
-    // Open stat on request path
-    struct stat s;
-    if(stat(r->path, &s) < 0)
+    /* Serve metrics without touching the filesystem */
+    if(streq(r->uri, STATS_URI))
     {
-        result = handle_error(r, HTTP_STATUS_NOT_FOUND);
-        debug("Could not stat path: %s", r->path);
-        return result;
+        type = HANDLER_STATS;
+        result = handle_stats_request(r);
+        goto done;
+    }
+
+    /* Forward proxied prefixes without touching the filesystem */
+    ProxyRoute *route = proxy_match(r->uri);
+    if(route)
+    {
+        type = HANDLER_PROXY;
+        trace_point(&r->trace, TRACE_RESOLVED);
+        result = handle_proxy_request(r, route);
+        if(r->detached)
+        {
+            return result;
+        }
+        goto done;
     }
 
+    /* Determine virtual host and request path */
+    r->vhost = vhost_lookup(request_header(r, "Host"));
 
+    /* Serve the default host from its packed archive without touching the
+     * filesystem; URIs it does not hold (such as CGI scripts) fall through */
+    if(archive_enabled() && r->vhost->id == 0)
+    {
+        result = archive_serve(r);
+        if(result != HTTP_STATUS_NOT_FOUND)
+        {
+            type = HANDLER_ARCHIVE;
+            trace_point(&r->trace, TRACE_RESOLVED);
+            goto done;
+        }
+    }
+
+    /* Determine appropriate handler (cached until the host's files change) */
+    type = cache_resolve(r->vhost, r->uri, &r->path);
+    if(!r->path)
+    {
+        result = handle_error(r, HTTP_STATUS_NOT_FOUND);
+        goto done;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &resolved);
+    stats_phase(PHASE_RESOLVE, &parsed, &resolved);
+    trace_point(&r->trace, TRACE_RESOLVED);
 
     // call appropriate handler
-    if(S_ISDIR(s.st_mode))
+    switch(type)
     {
-        result = handle_browse_request(r);
-        debug("Handling Browser");
+        case HANDLER_BROWSE:
+            debug("Handling Browser");
+            result = handle_browse_request(r);
+            break;
+        case HANDLER_CGI:
+            debug("Handling CGI");
+            result = handle_cgi_request(r);
+            break;
+        case HANDLER_FILE:
+            debug("Handling File");
+            result = handle_file_request(r);
+            break;
+        default:
+            result = handle_error(r, HTTP_STATUS_BAD_REQUEST);
+            break;
     }
-    else if(access(r->path, X_OK) == 0)
+
+    /* An executor sends, logs, and traces the response instead */
+    if(r->detached)
     {
-        result = handle_cgi_request(r);
-        debug("Handling CGI");
+        return result;
     }
-    else if(access(r->path, R_OK) == 0)
+    response_flush(r->response);
+    clock_gettime(CLOCK_MONOTONIC, &finished);
+    stats_phase(PHASE_RESPOND, &resolved, &finished);
+
+done:
+    /* Send response, unless the backend sends it itself (then pipe bodies are
+     * read into memory, since only file bodies can be handed over) */
+    bool sends = r->response && r->response->fd >= 0;
+    if(sends)
     {
-        result = handle_file_request(r);
-        debug("Handling File");
+        response_flush(r->response);
     }
-    else
+    else if(r->response)
     {
-        result = handle_error(r, HTTP_STATUS_BAD_REQUEST);
+        response_collect(r->response);
+    }
+
+    /* Queue access log record; the flusher thread does the formatting and I/O */
+    size_t bytes = r->nwritten + response_bytes(r->response);
+    debug("HTTP REQUEST STATUS: %s", http_status_string(result));
+    stats_request(type, result, bytes);
+    accesslog_record(r, result, &start, bytes);
+
+    /* Backends that send responses themselves finish the trace themselves */
+    trace_label(&r->trace, r, result, bytes);
+    if(sends)
+    {
+        trace_finish(&r->trace);
     }
 
-    /* Dispatch to appropriate request handler type based on file type */
-    log("HTTP REQUEST STATUS: %s", http_status_string(result));
+    /* Executors answer one request and exit */
+    if(r->executor)
+    {
+        free_request(r);
+        exit(EXIT_SUCCESS);
+    }
 
     return result;
 }
@@ -93,50 +206,91 @@ Status  handle_request(Request *r) {
 Status  handle_browse_request(Request *r) {
     struct dirent **entries;
     int n;
+    const char *cached;
+    size_t length;
+
+    /* Replay cached listing */
+    if(cache_lookup(CACHE_LISTING, r->vhost, r->uri, &cached, &length))
+    {
+        response_write(r->response, cached, length);
+        return HTTP_STATUS_OK;
+    }
 
     /* Open a directory for reading or scanning */
+    uint64_t generation = watch_generation(r->vhost);
     n = scandir(r->path, &entries, 0, alphasort);
     if(n < 0)
     {
         debug("scandir failed: %s", strerror(errno));
-        free(entries);
         return handle_error(r, HTTP_STATUS_NOT_FOUND);
     }
 
+    /* Render into memory */
+    char *buffer = NULL;
+    FILE *capture = open_memstream(&buffer, &length);
+    if(capture)
+    {
+        /* Write HTTP Header with OK Status and text/html Content-Type */
+        print_headers(capture, "text/html");
 
-    /* Write HTTP Header with OK Status and text/html Content-Type */
-    fprintf(r->stream, "HTTP/1.0 200 OK\r\n");
-    fprintf(r->stream, "Content-Type: text/html\r\n");
-    fprintf(r->stream, "\r\n");
+        /* Emit HTML list of entries */
+        render_listing(capture, r->uri, entries, n);
+    }
 
-    /* For each entry in directory, emit HTML list item */
-    fprintf(r->stream, "<ul>\r\n");
+    /* Free entries */
     for(int i = 0; i < n; i++)
     {
-        if(strcmp(entries[i]->d_name, ".") == 0)
-        {
-            free(entries[i]);
-            continue;
-        }
-
-        if(strcmp(r->uri,"/") == 0){
-          //debug("href: %s%s", r->uri,entries[i]->d_name);
-          fprintf(r->stream, "<li><a href=\"%s%s\">%s</a></li>\n", r->uri,entries[i]->d_name,entries[i]->d_name);
-        }
-        else{
-          //debug("href: %s/%s", r->uri,entries[i]->d_name);
-          fprintf(r->stream, "<li><a href=\"%s/%s\">%s</a></li>\n", r->uri,entries[i]->d_name,entries[i]->d_name);
-        }
-
-
         free(entries[i]);
     }
-    fprintf(r->stream, "</ul>\r\n");
     free(entries);
+
+    if(!capture)
+    {
+        return handle_error(r, HTTP_STATUS_INTERNAL_SERVER_ERROR);
+    }
+
+    /* Send and cache listing */
+    fclose(capture);
+    response_write(r->response, buffer, length);
+    if(watch_enabled())
+    {
+        cache_store(CACHE_LISTING, r->vhost, r->uri, generation, buffer, length);
+    }
+    else
+    {
+        free(buffer);
+    }
+
     /* Return OK */
     return HTTP_STATUS_OK;
 }
 
+/**
+ * Render directory listing.
+ *
+ * @param   stream      Stream to write to.
+ * @param   uri         URI of the directory (prefix for each link).
+ * @param   entries     Directory entries (as returned by scandir).
+ * @param   n           Number of entries.
+ *
+ * This emits an HTML list item linking to each entry except ".".  The entries
+ * are left for the caller to free.
+ **/
+void    render_listing(FILE *stream, const char *uri, struct dirent **entries, int n) {
+    const char *separator = streq(uri, "/") ? "" : "/";
+
+    fprintf(stream, "<ul>\r\n");
+    for(int i = 0; i < n; i++)
+    {
+        if(streq(entries[i]->d_name, "."))
+        {
+            continue;
+        }
+        fprintf(stream, "<li><a href=\"%s%s%s\">%s</a></li>\n", uri, separator, entries[i]->d_name, entries[i]->d_name);
+    }
+    fprintf(stream, "</ul>\r\n");
+}
+
 /**
  * Handle file request.
  *
@@ -149,45 +303,71 @@ Status  handle_browse_request(Request *r) {
  * HTTP_STATUS_NOT_FOUND.
  **/
 Status  handle_file_request(Request *r) {
-    FILE *fs;
-    char buffer[BUFSIZ];
+    int fd;
     char *mimetype = NULL;
-    size_t nread;
+    const char *cached;
+    size_t length;
+
+    /* Replay cached response */
+    if(cache_lookup(CACHE_FILE, r->vhost, r->path, &cached, &length))
+    {
+        response_write(r->response, cached, length);
+        return HTTP_STATUS_OK;
+    }
 
     /* Open file for reading */
-    fs = fopen(r->path, "r");
-    if(!fs)
+    uint64_t generation = watch_generation(r->vhost);
+    fd = open(r->path, O_RDONLY | O_CLOEXEC);
+    struct stat s;
+    if(fd < 0 || fstat(fd, &s) < 0)
     {
         debug("Failed to open file from path: %s", strerror(errno));
-        fclose(fs);
         goto fail;
     }
 
     /* Determine mimetype */
-    mimetype = determine_mimetype(r->path);
-
-    /* Write HTTP Headers with OK status and determined Content-Type */
-    fprintf(r->stream, "HTTP/1.0 200 OK\r\n");
-    fprintf(r->stream, "Content-Type: %s\r\n", mimetype);
-    fprintf(r->stream, "\r\n");
+    mimetype = determine_mimetype(r->vhost, r->path);
 
-    /* Read from file and write to socket in chunks */
-    nread = fread(buffer, 1, BUFSIZ, fs);
-    while(nread > 0)
+    /* Small files are read into memory once and cached as whole responses
+     * (unless reading them would wait on the disk) */
+    if(watch_enabled() && S_ISREG(s.st_mode) && s.st_size <= CACHE_FILE_MAX)
     {
-        fwrite(buffer, 1, nread, r->stream);
-        nread = fread(buffer, 1, BUFSIZ, fs);
+        char *body = malloc(s.st_size + 1);
+        char *response = NULL;
+        FILE *capture = NULL;
+        if(body && fileio_read_cached(fd, body, s.st_size, 0) == s.st_size && (capture = open_memstream(&response, &length)))
+        {
+            print_headers(capture, mimetype);
+            fwrite(body, 1, s.st_size, capture);
+            fclose(capture);
+            free(body);
+
+            response_write(r->response, response, length);
+            cache_store(CACHE_FILE, r->vhost, r->path, generation, response, length);
+            close(fd);
+            free(mimetype);
+            return HTTP_STATUS_OK;
+        }
+        free(body);
     }
 
-    /* Close file, deallocate mimetype, return OK */
-    fclose(fs);
+    /* Write HTTP Headers with OK status and determined Content-Type, then
+     * leave the file to the response (sent with sendfile or by the backend) */
+    write_headers(r->response, mimetype);
+    fileio_advise(fd, 0, s.st_size);
+    response_file(r->response, fd, 0, s.st_size);
+
+    /* Deallocate mimetype, return OK */
     free(mimetype);
     return HTTP_STATUS_OK;
 
 fail:
     /* Close file, free mimetype, return INTERNAL_SERVER_ERROR */
+    if(fd >= 0)
+    {
+        close(fd);
+    }
     free(mimetype);
-    fclose(fs);
     return HTTP_STATUS_INTERNAL_SERVER_ERROR;
 }
 
@@ -197,26 +377,24 @@ fail:
  * @param   r           HTTP Request structure.
  * @return  Status of the HTTP file request.
  *
- * This popens and streams the results of the specified executables to the
- * socket.
+ * This runs the specified executable in the CGI tier (see cgi_run) and
+ * sends its output.
  *
- * If the path cannot be popened, then handle error with
- * HTTP_STATUS_INTERNAL_SERVER_ERROR.
+ * If the tier is saturated or the script overruns, then handle error with
+ * HTTP_STATUS_SERVICE_UNAVAILABLE or HTTP_STATUS_GATEWAY_TIMEOUT; if the
+ * script cannot be started, with HTTP_STATUS_INTERNAL_SERVER_ERROR.
  **/
 Status  handle_cgi_request(Request *r) {
-    FILE *pfs;
-    char buffer[BUFSIZ];
-
     /* Export CGI environment variables from request:
      * http://en.wikipedia.org/wiki/Common_Gateway_Interface */
     setenv("REQUEST_METHOD", r->method, 1);
     setenv("REQUEST_URI",r->uri, 1);
     setenv("SCRIPT_FILENAME",r->path, 1);
     setenv("QUERY_STRING",r->query, 1);
-    setenv("REMOTE_ADDR",r->host, 1);
-    setenv("REMOTE_PORT",r->port, 1);
+    setenv("REMOTE_ADDR",request_host(r), 1);
+    setenv("REMOTE_PORT",request_port(r), 1);
 
-    setenv("DOCUMENT_ROOT", RootPath, 1);
+    setenv("DOCUMENT_ROOT", r->vhost->root, 1);
 
     /* Export CGI environment variables from request headers */
     Header  *h = r->headers;
@@ -228,14 +406,18 @@ Status  handle_cgi_request(Request *r) {
           if(!copyData){
             return handle_error(r,HTTP_STATUS_INTERNAL_SERVER_ERROR);
           }
-          char *portNum = strchr(copyData, ':');
-          *portNum = '\0';
-          portNum++;
+          char *portNum = strrchr(copyData, ':');
+          if(portNum && !strchr(portNum, ']')){
+            *portNum++ = '\0';
+          }
+          else{
+            portNum = Port;
+          }
           char *hostName = copyData;
           setenv("HTTP_HOST",hostName, 1);
           setenv("SERVER_PORT",portNum,1);
           debug("HTTP_HOST: %s", hostName);
-          debug("SERVER_PORT: %s", hostName);
+          debug("SERVER_PORT: %s", portNum);
           free(copyData);
 
         }
@@ -259,21 +441,68 @@ Status  handle_cgi_request(Request *r) {
     }
 
 
-    /* POpen CGI Script */
-    pfs = popen(r->path, "r");
-    if(!pfs){
+    /* Answer fresh output from the microcache without running anything */
+    if(microcache_lookup(r)){
+      return HTTP_STATUS_OK;
+    }
+
+    /* Let an executor run the script if the server loop would wait on it */
+    if(cgi_detach(r)){
+      return HTTP_STATUS_OK;
+    }
+
+    /* Answer from the microcache (or fill it) if the script's prefix is cached */
+    Status status;
+    if(microcache_serve(r, &status)){
+      return status;
+    }
+
+    /* Run CGI script in the CGI tier (bounded and timed) */
+    char  *output = NULL;
+    size_t length = 0;
+    FILE  *capture = open_memstream(&output, &length);
+    if(!capture){
       return handle_error(r,HTTP_STATUS_INTERNAL_SERVER_ERROR);
     }
-    /* Copy data from popen to socket */
-    size_t nread = fread(buffer, 1, BUFSIZ, pfs);
-    while(nread > 0){
-      fwrite(buffer, 1, nread, r->stream);
-      nread = fread(buffer, 1, BUFSIZ, pfs);
+
+    status = cgi_run(r, capture, NULL);
+    fclose(capture);
+    if(status == HTTP_STATUS_OK){
+      response_write(r->response, output, length);
     }
+    free(output);
 
-    /* Close popen, return OK */
-    pclose(pfs);
+    return status == HTTP_STATUS_OK ? status : handle_error(r, status);
+}
 
+/**
+ * Handle stats request.
+ *
+ * @param   r           HTTP Request structure.
+ * @return  Status of the HTTP stats request.
+ *
+ * This writes the server's counters and latency histograms as plain text,
+ * or a 500 error if they could not be gathered.
+ **/
+Status  handle_stats_request(Request *r) {
+    char *buffer = NULL;
+    size_t length;
+    FILE *capture = open_memstream(&buffer, &length);
+    if(!capture)
+    {
+        return handle_error(r, HTTP_STATUS_INTERNAL_SERVER_ERROR);
+    }
+
+    int status = stats_write(capture);
+    if(fclose(capture) != 0 || status < 0)
+    {
+        free(buffer);
+        return handle_error(r, HTTP_STATUS_INTERNAL_SERVER_ERROR);
+    }
+
+    write_headers(r->response, STATS_MIMETYPE);
+    response_write(r->response, buffer, length);
+    free(buffer);
     return HTTP_STATUS_OK;
 }
 
@@ -283,22 +512,16 @@ Status  handle_cgi_request(Request *r) {
  * @param   r           HTTP Request structure.
  * @return  Status of the HTTP error request.
  *
- * This writes an HTTP status error code and then generates an HTML message to
- * notify the user of the error.
+ * This writes the HTTP status error code and an HTML message to notify the
+ * user of the error, both rendered once at startup (see response_init).
  **/
 Status  handle_error(Request *r, Status status) {
-    const char *status_string = http_status_string(status);
+    const Blob *response = response_error(status);
 
-
-    /* Write HTTP Header */
-    fprintf(r->stream, "HTTP/1.0 %s\r\n", status_string);
-    fprintf(r->stream, "Content-Type: text/html\r\n");
-    fprintf(r->stream, "\r\n");
-
-    /* Write HTML Description of Error*/
-    fprintf(r->stream, "<html>\n<h1>%s</h1>\n", status_string);
-    fprintf(r->stream, "<h2>You played yourself</h2>\r\n</html>\r\n");
-    fprintf(r->stream, "<img src='https://i.kym-cdn.com/entries/icons/facebook/000/019/954/khaled.jpg' style='width:400px;height:400px;'>");
+    /* Write complete response (statuses that are not errors have none) */
+    if (response) {
+        response_blob(r->response, response);
+    }
 
     /* Return specified status */
     return status;
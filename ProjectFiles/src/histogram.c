@@ -0,0 +1,109 @@
+/* histogram.c: Log-linear Latency Histograms */
+
+#include "spidey.h"
+
+#include <stdatomic.h>
+#include <string.h>
+
+/**
+ * Determine bucket index for value.
+ *
+ * @param   value       Recorded value.
+ * @return  Bucket index.
+ *
+ * Values below HISTOGRAM_SUB_BUCKETS get one bucket each; above that each
+ * power of two is split into HISTOGRAM_SUB_BUCKETS/2 linear buckets, which
+ * bounds the relative error at 2/HISTOGRAM_SUB_BUCKETS (like HdrHistogram).
+ **/
+static size_t histogram_index(uint64_t value) {
+    if (value < HISTOGRAM_SUB_BUCKETS) {
+        return value;
+    }
+
+    int magnitude = 63 - __builtin_clzll(value);
+    int shift = magnitude - HISTOGRAM_SUB_BITS + 1;
+    size_t index = (size_t)(shift + 1) * (HISTOGRAM_SUB_BUCKETS / 2) + ((value >> shift) & (HISTOGRAM_SUB_BUCKETS / 2 - 1));
+    return index < HISTOGRAM_BUCKETS ? index : HISTOGRAM_BUCKETS - 1;
+}
+
+/**
+ * Determine highest value that falls into bucket.
+ **/
+static uint64_t histogram_value(size_t index) {
+    if (index < HISTOGRAM_SUB_BUCKETS) {
+        return index;
+    }
+
+    int shift = (int)(index / (HISTOGRAM_SUB_BUCKETS / 2)) - 1;
+    uint64_t sub = (index % (HISTOGRAM_SUB_BUCKETS / 2)) + HISTOGRAM_SUB_BUCKETS / 2;
+    return ((sub + 1) << shift) - 1;
+}
+
+/**
+ * Record value in histogram.
+ *
+ * @param   h           Histogram structure.
+ * @param   value       Value to record.
+ *
+ * Uses relaxed atomic adds so histograms in shared memory may be updated by
+ * more than one process.
+ **/
+void histogram_record(Histogram *h, uint64_t value) {
+    histogram_record_n(h, value, 1);
+}
+
+/**
+ * Record value in histogram count times.
+ **/
+void histogram_record_n(Histogram *h, uint64_t value, uint64_t count) {
+    atomic_fetch_add_explicit((_Atomic uint64_t *)&h->counts[histogram_index(value)], count, memory_order_relaxed);
+    atomic_fetch_add_explicit((_Atomic uint64_t *)&h->total, count, memory_order_relaxed);
+    atomic_fetch_add_explicit((_Atomic uint64_t *)&h->sum, value * count, memory_order_relaxed);
+
+    uint64_t max = atomic_load_explicit((_Atomic uint64_t *)&h->max, memory_order_relaxed);
+    while (value > max && !atomic_compare_exchange_weak_explicit((_Atomic uint64_t *)&h->max, &max, value, memory_order_relaxed, memory_order_relaxed));
+}
+
+/**
+ * Add counts from src histogram into dst histogram.
+ **/
+void histogram_merge(Histogram *dst, const Histogram *src) {
+    for (size_t i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        dst->counts[i] += src->counts[i];
+    }
+    dst->total += src->total;
+    dst->sum   += src->sum;
+    if (src->max > dst->max) {
+        dst->max = src->max;
+    }
+}
+
+/**
+ * Determine value at percentile.
+ *
+ * @param   h           Histogram structure.
+ * @param   percentile  Percentile between 0 and 100.
+ * @return  Upper bound of bucket containing the percentile (0 if empty).
+ **/
+uint64_t histogram_percentile(const Histogram *h, double percentile) {
+    if (h->total == 0) {
+        return 0;
+    }
+
+    uint64_t target = (uint64_t)(percentile / 100.0 * h->total + 0.5);
+    if (target < 1) {
+        target = 1;
+    }
+
+    uint64_t seen = 0;
+    for (size_t i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        seen += h->counts[i];
+        if (seen >= target) {
+            uint64_t value = histogram_value(i);
+            return value < h->max ? value : h->max;
+        }
+    }
+    return h->max;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,637 @@
+/* hpack.c: HPACK Header Compression (RFC 7541) */
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <string.h>
+#include <strings.h>
+
+/* Constants */
+
+#define HPACK_STATIC_ENTRIES    61
+#define HPACK_HUFFMAN_SYMBOLS   257     /* 256 octets plus EOS */
+#define HPACK_HUFFMAN_NODES     (2 * HPACK_HUFFMAN_SYMBOLS)
+#define HPACK_ENTRY_OVERHEAD    32      /* Per-entry size accounting */
+
+typedef struct {
+    const char *name;
+    const char *value;
+} HpackField;
+
+/* Tables (RFC 7541 Appendices A and B) */
+
+static const uint32_t HuffmanCodes[HPACK_HUFFMAN_SYMBOLS] = {
+    0x1ff8, 0x7fffd8, 0xfffffe2, 0xfffffe3, 0xfffffe4, 0xfffffe5, 0xfffffe6, 0xfffffe7,
+    0xfffffe8, 0xffffea, 0x3ffffffc, 0xfffffe9, 0xfffffea, 0x3ffffffd, 0xfffffeb, 0xfffffec,
+    0xfffffed, 0xfffffee, 0xfffffef, 0xffffff0, 0xffffff1, 0xffffff2, 0x3ffffffe, 0xffffff3,
+    0xffffff4, 0xffffff5, 0xffffff6, 0xffffff7, 0xffffff8, 0xffffff9, 0xffffffa, 0xffffffb,
+    0x14, 0x3f8, 0x3f9, 0xffa, 0x1ff9, 0x15, 0xf8, 0x7fa,
+    0x3fa, 0x3fb, 0xf9, 0x7fb, 0xfa, 0x16, 0x17, 0x18,
+    0x0, 0x1, 0x2, 0x19, 0x1a, 0x1b, 0x1c, 0x1d,
+    0x1e, 0x1f, 0x5c, 0xfb, 0x7ffc, 0x20, 0xffb, 0x3fc,
+    0x1ffa, 0x21, 0x5d, 0x5e, 0x5f, 0x60, 0x61, 0x62,
+    0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69, 0x6a,
+    0x6b, 0x6c, 0x6d, 0x6e, 0x6f, 0x70, 0x71, 0x72,
+    0xfc, 0x73, 0xfd, 0x1ffb, 0x7fff0, 0x1ffc, 0x3ffc, 0x22,
+    0x7ffd, 0x3, 0x23, 0x4, 0x24, 0x5, 0x25, 0x26,
+    0x27, 0x6, 0x74, 0x75, 0x28, 0x29, 0x2a, 0x7,
+    0x2b, 0x76, 0x2c, 0x8, 0x9, 0x2d, 0x77, 0x78,
+    0x79, 0x7a, 0x7b, 0x7ffe, 0x7fc, 0x3ffd, 0x1ffd, 0xffffffc,
+    0xfffe6, 0x3fffd2, 0xfffe7, 0xfffe8, 0x3fffd3, 0x3fffd4, 0x3fffd5, 0x7fffd9,
+    0x3fffd6, 0x7fffda, 0x7fffdb, 0x7fffdc, 0x7fffdd, 0x7fffde, 0xffffeb, 0x7fffdf,
+    0xffffec, 0xffffed, 0x3fffd7, 0x7fffe0, 0xffffee, 0x7fffe1, 0x7fffe2, 0x7fffe3,
+    0x7fffe4, 0x1fffdc, 0x3fffd8, 0x7fffe5, 0x3fffd9, 0x7fffe6, 0x7fffe7, 0xffffef,
+    0x3fffda, 0x1fffdd, 0xfffe9, 0x3fffdb, 0x3fffdc, 0x7fffe8, 0x7fffe9, 0x1fffde,
+    0x7fffea, 0x3fffdd, 0x3fffde, 0xfffff0, 0x1fffdf, 0x3fffdf, 0x7fffeb, 0x7fffec,
+    0x1fffe0, 0x1fffe1, 0x3fffe0, 0x1fffe2, 0x7fffed, 0x3fffe1, 0x7fffee, 0x7fffef,
+    0xfffea, 0x3fffe2, 0x3fffe3, 0x3fffe4, 0x7ffff0, 0x3fffe5, 0x3fffe6, 0x7ffff1,
+    0x3ffffe0, 0x3ffffe1, 0xfffeb, 0x7fff1, 0x3fffe7, 0x7ffff2, 0x3fffe8, 0x1ffffec,
+    0x3ffffe2, 0x3ffffe3, 0x3ffffe4, 0x7ffffde, 0x7ffffdf, 0x3ffffe5, 0xfffff1, 0x1ffffed,
+    0x7fff2, 0x1fffe3, 0x3ffffe6, 0x7ffffe0, 0x7ffffe1, 0x3ffffe7, 0x7ffffe2, 0xfffff2,
+    0x1fffe4, 0x1fffe5, 0x3ffffe8, 0x3ffffe9, 0xffffffd, 0x7ffffe3, 0x7ffffe4, 0x7ffffe5,
+    0xfffec, 0xfffff3, 0xfffed, 0x1fffe6, 0x3fffe9, 0x1fffe7, 0x1fffe8, 0x7ffff3,
+    0x3fffea, 0x3fffeb, 0x1ffffee, 0x1ffffef, 0xfffff4, 0xfffff5, 0x3ffffea, 0x7ffff4,
+    0x3ffffeb, 0x7ffffe6, 0x3ffffec, 0x3ffffed, 0x7ffffe7, 0x7ffffe8, 0x7ffffe9, 0x7ffffea,
+    0x7ffffeb, 0xffffffe, 0x7ffffec, 0x7ffffed, 0x7ffffee, 0x7ffffef, 0x7fffff0, 0x3ffffee,
+    0x3fffffff,
+};
+
+static const uint8_t HuffmanLengths[HPACK_HUFFMAN_SYMBOLS] = {
+    13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28,
+    28, 28, 28, 28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+     6, 10, 10, 12, 13,  6,  8, 11, 10, 10,  8, 11,  8,  6,  6,  6,
+     5,  5,  5,  6,  6,  6,  6,  6,  6,  6,  7,  8, 15,  6, 12, 10,
+    13,  6,  7,  7,  7,  7,  7,  7,  7,  7,  7,  7,  7,  7,  7,  7,
+     7,  7,  7,  7,  7,  7,  7,  7,  8,  7,  8, 13, 19, 13, 14,  6,
+    15,  5,  6,  5,  6,  5,  6,  6,  6,  5,  7,  7,  6,  6,  6,  5,
+     6,  7,  6,  5,  5,  6,  7,  7,  7,  7,  7, 15, 11, 14, 13, 28,
+    20, 22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23,
+    24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24,
+    22, 21, 20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23,
+    21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23,
+    26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25,
+    19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27,
+    20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23,
+    26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26,
+    30,
+};
+
+static const HpackField StaticTable[HPACK_STATIC_ENTRIES] = {
+    {":authority", ""},
+    {":method", "GET"},
+    {":method", "POST"},
+    {":path", "/"},
+    {":path", "/index.html"},
+    {":scheme", "http"},
+    {":scheme", "https"},
+    {":status", "200"},
+    {":status", "204"},
+    {":status", "206"},
+    {":status", "304"},
+    {":status", "400"},
+    {":status", "404"},
+    {":status", "500"},
+    {"accept-charset", ""},
+    {"accept-encoding", "gzip, deflate"},
+    {"accept-language", ""},
+    {"accept-ranges", ""},
+    {"accept", ""},
+    {"access-control-allow-origin", ""},
+    {"age", ""},
+    {"allow", ""},
+    {"authorization", ""},
+    {"cache-control", ""},
+    {"content-disposition", ""},
+    {"content-encoding", ""},
+    {"content-language", ""},
+    {"content-length", ""},
+    {"content-location", ""},
+    {"content-range", ""},
+    {"content-type", ""},
+    {"cookie", ""},
+    {"date", ""},
+    {"etag", ""},
+    {"expect", ""},
+    {"expires", ""},
+    {"from", ""},
+    {"host", ""},
+    {"if-match", ""},
+    {"if-modified-since", ""},
+    {"if-none-match", ""},
+    {"if-range", ""},
+    {"if-unmodified-since", ""},
+    {"last-modified", ""},
+    {"link", ""},
+    {"location", ""},
+    {"max-forwards", ""},
+    {"proxy-authenticate", ""},
+    {"proxy-authorization", ""},
+    {"range", ""},
+    {"referer", ""},
+    {"refresh", ""},
+    {"retry-after", ""},
+    {"server", ""},
+    {"set-cookie", ""},
+    {"strict-transport-security", ""},
+    {"transfer-encoding", ""},
+    {"user-agent", ""},
+    {"vary", ""},
+    {"via", ""},
+    {"www-authenticate", ""},
+};
+
+/* Huffman Decoding Tree
+ *
+ * Node 0 is the root; children >= 0 are node indexes and children < 0 are
+ * leaves holding -(symbol + 1). */
+
+static int16_t HuffmanTree[HPACK_HUFFMAN_NODES][2];
+static bool    HuffmanReady = false;
+
+static void huffman_build(void) {
+    int nodes = 1;
+
+    memset(HuffmanTree, 0, sizeof(HuffmanTree));
+    for (int symbol = 0; symbol < HPACK_HUFFMAN_SYMBOLS; symbol++) {
+        uint32_t code = HuffmanCodes[symbol];
+        int      node = 0;
+        for (int bit = HuffmanLengths[symbol] - 1; bit > 0; bit--) {
+            int b = (code >> bit) & 1;
+            if (!HuffmanTree[node][b]) {
+                HuffmanTree[node][b] = nodes++;
+            }
+            node = HuffmanTree[node][b];
+        }
+        HuffmanTree[node][code & 1] = -(symbol + 1);
+    }
+    HuffmanReady = true;
+}
+
+/**
+ * Decode Huffman-coded string.
+ *
+ * @return  Decoded length, or -1 if the input is malformed.
+ **/
+static ssize_t huffman_decode(const uint8_t *in, size_t length, char *out) {
+    size_t n = 0;
+    int    node = 0;
+    int    depth = 0;                   /* Bits consumed since last symbol */
+    bool   ones = true;                 /* Whether those bits were all ones */
+
+    if (!HuffmanReady) {
+        huffman_build();
+    }
+
+    for (size_t i = 0; i < length; i++) {
+        for (int bit = 7; bit >= 0; bit--) {
+            int b = (in[i] >> bit) & 1;
+            int next = HuffmanTree[node][b];
+            depth++;
+            ones = ones && b;
+            if (next < 0) {
+                if (-next - 1 == 256) {
+                    return -1;          /* EOS must not appear in strings */
+                }
+                out[n++] = (char)(-next - 1);
+                node = depth = 0;
+                ones = true;
+            } else if (next == 0) {
+                return -1;
+            } else {
+                node = next;
+            }
+        }
+    }
+
+    /* Padding must be a prefix of EOS shorter than eight bits */
+    return (depth < 8 && ones) ? (ssize_t)n : -1;
+}
+
+static size_t huffman_length(const char *s, size_t length) {
+    uint64_t bits = 0;
+    for (size_t i = 0; i < length; i++) {
+        bits += HuffmanLengths[(uint8_t)s[i]];
+    }
+    return (bits + 7) / 8;
+}
+
+static void huffman_encode(const char *s, size_t length, uint8_t *out) {
+    uint64_t bits = 0;
+    int      nbits = 0;
+
+    for (size_t i = 0; i < length; i++) {
+        uint8_t symbol = (uint8_t)s[i];
+        bits   = (bits << HuffmanLengths[symbol]) | HuffmanCodes[symbol];
+        nbits += HuffmanLengths[symbol];
+        while (nbits >= 8) {
+            nbits -= 8;
+            *out++ = (uint8_t)(bits >> nbits);
+        }
+    }
+    if (nbits > 0) {
+        *out = (uint8_t)((bits << (8 - nbits)) | (0xff >> nbits));
+    }
+}
+
+/* Primitive Encoding */
+
+static ssize_t integer_decode(const uint8_t *in, size_t length, int prefix, uint64_t *value) {
+    uint64_t mask = (1u << prefix) - 1;
+    size_t   n = 1;
+
+    if (length < 1) {
+        return -1;
+    }
+
+    *value = in[0] & mask;
+    if (*value < mask) {
+        return 1;
+    }
+
+    for (int shift = 0; n < length; shift += 7) {
+        if (shift > 56) {
+            return -1;
+        }
+        *value += (uint64_t)(in[n] & 0x7f) << shift;
+        if (!(in[n++] & 0x80)) {
+            return n;
+        }
+    }
+    return -1;
+}
+
+static ssize_t integer_encode(uint8_t *out, size_t size, int prefix, uint8_t flags, uint64_t value) {
+    uint64_t mask = (1u << prefix) - 1;
+    size_t   n = 0;
+
+    if (size < 1) {
+        return -1;
+    }
+    if (value < mask) {
+        out[n++] = flags | value;
+        return n;
+    }
+
+    out[n++] = flags | mask;
+    value -= mask;
+    while (value >= 0x80) {
+        if (n >= size) {
+            return -1;
+        }
+        out[n++] = (value & 0x7f) | 0x80;
+        value >>= 7;
+    }
+    if (n >= size) {
+        return -1;
+    }
+    out[n++] = value;
+    return n;
+}
+
+/**
+ * Decode string literal into newly allocated buffer.
+ **/
+static ssize_t string_decode(const uint8_t *in, size_t length, char **string, size_t *string_length) {
+    uint64_t size;
+    ssize_t  n = integer_decode(in, length, 7, &size);
+    if (n < 0 || size > length - n) {
+        return -1;
+    }
+
+    bool huffman = in[0] & 0x80;
+    char *s = malloc(huffman ? size * 8 / 5 + 1 : size + 1);
+    if (!s) {
+        return -1;
+    }
+
+    ssize_t decoded = size;
+    if (huffman) {
+        decoded = huffman_decode(in + n, size, s);
+    } else {
+        memcpy(s, in + n, size);
+    }
+    if (decoded < 0) {
+        free(s);
+        return -1;
+    }
+
+    s[decoded]     = '\0';
+    *string        = s;
+    *string_length = decoded;
+    return n + size;
+}
+
+static ssize_t string_encode(uint8_t *out, size_t size, const char *s, size_t length) {
+    size_t  encoded = huffman_length(s, length);
+    bool    huffman = encoded < length;
+    ssize_t n = integer_encode(out, size, 7, huffman ? 0x80 : 0, huffman ? encoded : length);
+
+    if (n < 0 || (size_t)n + (huffman ? encoded : length) > size) {
+        return -1;
+    }
+    if (huffman) {
+        huffman_encode(s, length, out + n);
+    } else {
+        memcpy(out + n, s, length);
+    }
+    return n + (huffman ? encoded : length);
+}
+
+/* Dynamic Table */
+
+static HpackEntry *table_get(HpackTable *t, size_t i) {
+    return &t->entries[(t->newest + t->capacity - i) % t->capacity];
+}
+
+static void table_evict(HpackTable *t, size_t size) {
+    while (t->count > 0 && t->size + size > t->max_size) {
+        HpackEntry *e = table_get(t, t->count - 1);
+        t->size -= e->name_length + e->value_length + HPACK_ENTRY_OVERHEAD;
+        free(e->name);
+        free(e->value);
+        t->count--;
+    }
+}
+
+static int table_add(HpackTable *t, const char *name, size_t name_length, const char *value, size_t value_length) {
+    size_t size = name_length + value_length + HPACK_ENTRY_OVERHEAD;
+
+    table_evict(t, size);
+    if (size > t->max_size) {
+        return 0;                       /* Too large: table is now empty */
+    }
+
+    if (t->count == t->capacity) {
+        size_t capacity = t->capacity ? t->capacity * 2 : 16;
+        HpackEntry *entries = calloc(capacity, sizeof(HpackEntry));
+        if (!entries) {
+            return -1;
+        }
+        for (size_t i = 0; i < t->count; i++) {
+            entries[t->count - 1 - i] = *table_get(t, i);
+        }
+        free(t->entries);
+        t->entries  = entries;
+        t->capacity = capacity;
+        t->newest   = t->count ? t->count - 1 : capacity - 1;
+    }
+
+    t->newest = (t->newest + 1) % t->capacity;
+    HpackEntry *e = &t->entries[t->newest];
+    e->name         = strndup(name, name_length);
+    e->value        = strndup(value, value_length);
+    e->name_length  = name_length;
+    e->value_length = value_length;
+    if (!e->name || !e->value) {
+        free(e->name);
+        free(e->value);
+        t->newest = (t->newest + t->capacity - 1) % t->capacity;
+        return -1;
+    }
+
+    t->count++;
+    t->size += size;
+    return 0;
+}
+
+/**
+ * Look up 1-based index in static then dynamic table.
+ **/
+static int table_lookup(HpackTable *t, uint64_t index, const char **name, size_t *name_length, const char **value, size_t *value_length) {
+    if (index == 0) {
+        return -1;
+    }
+    if (index <= HPACK_STATIC_ENTRIES) {
+        *name         = StaticTable[index - 1].name;
+        *value        = StaticTable[index - 1].value;
+        *name_length  = strlen(*name);
+        *value_length = strlen(*value);
+        return 0;
+    }
+    if (index - HPACK_STATIC_ENTRIES > t->count) {
+        return -1;
+    }
+
+    HpackEntry *e = table_get(t, index - HPACK_STATIC_ENTRIES - 1);
+    *name         = e->name;
+    *value        = e->value;
+    *name_length  = e->name_length;
+    *value_length = e->value_length;
+    return 0;
+}
+
+/**
+ * Find best index for field: exact match (sets *exact) or name-only match.
+ **/
+static uint64_t table_find(HpackTable *t, const char *name, size_t name_length, const char *value, size_t value_length, bool *exact) {
+    uint64_t name_index = 0;
+
+    *exact = false;
+    for (size_t i = 0; i < HPACK_STATIC_ENTRIES; i++) {
+        if (strlen(StaticTable[i].name) == name_length && memcmp(StaticTable[i].name, name, name_length) == 0) {
+            if (strlen(StaticTable[i].value) == value_length && memcmp(StaticTable[i].value, value, value_length) == 0) {
+                *exact = true;
+                return i + 1;
+            }
+            if (!name_index) {
+                name_index = i + 1;
+            }
+        }
+    }
+
+    for (size_t i = 0; i < t->count; i++) {
+        HpackEntry *e = table_get(t, i);
+        if (e->name_length == name_length && memcmp(e->name, name, name_length) == 0) {
+            if (e->value_length == value_length && memcmp(e->value, value, value_length) == 0) {
+                *exact = true;
+                return HPACK_STATIC_ENTRIES + 1 + i;
+            }
+            if (!name_index) {
+                name_index = HPACK_STATIC_ENTRIES + 1 + i;
+            }
+        }
+    }
+    return name_index;
+}
+
+/* Public Functions */
+
+/**
+ * Initialize empty table.
+ *
+ * @param   t           HPACK table (one per direction per connection).
+ * @param   max_size    Largest table size (SETTINGS_HEADER_TABLE_SIZE).
+ **/
+void hpack_init(HpackTable *t, size_t max_size) {
+    memset(t, 0, sizeof(HpackTable));
+    t->max_size = max_size;
+    t->limit    = max_size;
+}
+
+/**
+ * Release table entries.
+ **/
+void hpack_free(HpackTable *t) {
+    table_evict(t, SIZE_MAX / 2);
+    free(t->entries);
+    memset(t, 0, sizeof(HpackTable));
+}
+
+/**
+ * Change largest encoder table size after the peer's settings change.
+ *
+ * The new size is announced at the start of the next encoded header block.
+ **/
+void hpack_resize(HpackTable *t, size_t max_size) {
+    t->limit    = max_size;
+    t->max_size = max_size < t->max_size ? max_size : t->max_size;
+    table_evict(t, 0);
+    t->update   = true;
+}
+
+/**
+ * Decode header block.
+ *
+ * @param   t           Decoder table.
+ * @param   block       Complete header block (HEADERS plus CONTINUATION payloads).
+ * @param   length      Length of block.
+ * @param   emit        Called with each decoded field (names are not copied).
+ * @param   arg         Argument passed to emit.
+ * @return  -1 on error (COMPRESSION_ERROR) and 0 on success.
+ **/
+int hpack_decode(HpackTable *t, const uint8_t *block, size_t length, HpackEmit emit, void *arg) {
+    size_t offset = 0;
+
+    while (offset < length) {
+        const uint8_t *in = block + offset;
+        size_t   left = length - offset;
+        uint64_t index;
+        ssize_t  n;
+
+        if (in[0] & 0x80) {
+            /* Indexed field */
+            const char *name, *value;
+            size_t name_length, value_length;
+            if ((n = integer_decode(in, left, 7, &index)) < 0 ||
+                table_lookup(t, index, &name, &name_length, &value, &value_length) < 0 ||
+                emit(arg, name, name_length, value, value_length) < 0) {
+                return -1;
+            }
+            offset += n;
+            continue;
+        }
+
+        if ((in[0] & 0xe0) == 0x20) {
+            /* Dynamic table size update */
+            if ((n = integer_decode(in, left, 5, &index)) < 0 || index > t->limit) {
+                return -1;
+            }
+            t->max_size = index;
+            table_evict(t, 0);
+            offset += n;
+            continue;
+        }
+
+        /* Literal field: with incremental indexing (01), without (0000), never (0001) */
+        bool  indexing = (in[0] & 0xc0) == 0x40;
+        int   prefix   = indexing ? 6 : 4;
+        char *name = NULL, *value = NULL;
+        size_t name_length = 0, value_length = 0;
+        int   status = -1;
+
+        if ((n = integer_decode(in, left, prefix, &index)) < 0) {
+            return -1;
+        }
+        offset += n;
+
+        if (index) {
+            const char *indexed_name, *ignored;
+            size_t ignored_length;
+            if (table_lookup(t, index, &indexed_name, &name_length, &ignored, &ignored_length) < 0 ||
+                !(name = strndup(indexed_name, name_length))) {
+                return -1;
+            }
+        } else if ((n = string_decode(block + offset, length - offset, &name, &name_length)) < 0) {
+            return -1;
+        } else {
+            offset += n;
+        }
+
+        if ((n = string_decode(block + offset, length - offset, &value, &value_length)) >= 0) {
+            offset += n;
+            status = emit(arg, name, name_length, value, value_length);
+            if (status == 0 && indexing) {
+                status = table_add(t, name, name_length, value, value_length);
+            }
+        }
+
+        free(name);
+        free(value);
+        if (status < 0) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Encode header field.
+ *
+ * @param   t           Encoder table.
+ * @param   out         Output buffer.
+ * @param   size        Space left in output buffer.
+ * @param   name        Field name (lowercase).
+ * @param   value       Field value.
+ * @return  Bytes written, or -1 if there was not enough room.
+ *
+ * Fields matching a table entry are sent as an index; others are added to
+ * the dynamic table (except content-length, which rarely repeats) with
+ * Huffman coding used whenever it is shorter.
+ **/
+ssize_t hpack_encode(HpackTable *t, uint8_t *out, size_t size, const char *name, const char *value) {
+    size_t  name_length  = strlen(name);
+    size_t  value_length = strlen(value);
+    size_t  n = 0;
+    ssize_t w;
+    bool    exact;
+
+    if (t->update) {
+        if ((w = integer_encode(out, size, 5, 0x20, t->max_size)) < 0) {
+            return -1;
+        }
+        n += w;
+        t->update = false;
+    }
+
+    uint64_t index = table_find(t, name, name_length, value, value_length, &exact);
+    if (exact) {
+        w = integer_encode(out + n, size - n, 7, 0x80, index);
+        return w < 0 ? -1 : (ssize_t)(n + w);
+    }
+
+    bool indexing = !streq(name, "content-length");
+    if ((w = integer_encode(out + n, size - n, indexing ? 6 : 4, indexing ? 0x40 : 0x00, index)) < 0) {
+        return -1;
+    }
+    n += w;
+
+    if (!index) {
+        if ((w = string_encode(out + n, size - n, name, name_length)) < 0) {
+            return -1;
+        }
+        n += w;
+    }
+
+    if ((w = string_encode(out + n, size - n, value, value_length)) < 0) {
+        return -1;
+    }
+    n += w;
+
+    if (indexing && table_add(t, name, name_length, value, value_length) < 0) {
+        return -1;
+    }
+    return n;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,1151 @@
+/* http2.c: HTTP/2 Cleartext (h2c) Connections */
+
+#define _GNU_SOURCE
+
+#include "spidey.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <string.h>
+#include <strings.h>
+
+#include <sys/socket.h>
+#include <unistd.h>
+
+/* Constants */
+
+#define H2_PREFACE          "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+#define H2_FRAME_HEADER     9
+#define H2_FRAME_SIZE       16384       /* Default (and our) SETTINGS_MAX_FRAME_SIZE */
+#define H2_WINDOW           65535       /* Default initial window size */
+#define H2_WINDOW_MAX       0x7fffffff
+#define H2_STREAMS          100         /* Our SETTINGS_MAX_CONCURRENT_STREAMS */
+#define H2_TABLE_SIZE       4096        /* HPACK table size (both directions) */
+#define H2_BLOCK_MAX        (64*1024)   /* Largest request header block */
+#define H2_OUT_HIGH         (256*1024)  /* Stop producing DATA above this much unsent output */
+#define H2_IDLE_MS          10000       /* Close idle connections after this long */
+
+/* Frame types */
+
+enum {
+    H2_DATA          = 0x0,
+    H2_HEADERS       = 0x1,
+    H2_PRIORITY      = 0x2,
+    H2_RST_STREAM    = 0x3,
+    H2_SETTINGS      = 0x4,
+    H2_PUSH_PROMISE  = 0x5,
+    H2_PING          = 0x6,
+    H2_GOAWAY        = 0x7,
+    H2_WINDOW_UPDATE = 0x8,
+    H2_CONTINUATION  = 0x9,
+};
+
+/* Frame flags */
+
+enum {
+    H2_FLAG_END_STREAM  = 0x01,
+    H2_FLAG_ACK         = 0x01,
+    H2_FLAG_END_HEADERS = 0x04,
+    H2_FLAG_PADDED      = 0x08,
+    H2_FLAG_PRIORITY    = 0x20,
+};
+
+/* Error codes */
+
+enum {
+    H2_NO_ERROR          = 0x0,
+    H2_PROTOCOL_ERROR    = 0x1,
+    H2_INTERNAL_ERROR    = 0x2,
+    H2_FLOW_CONTROL_ERROR = 0x3,
+    H2_STREAM_CLOSED     = 0x5,
+    H2_FRAME_SIZE_ERROR  = 0x6,
+    H2_REFUSED_STREAM    = 0x7,
+    H2_COMPRESSION_ERROR = 0x9,
+};
+
+/* Settings */
+
+enum {
+    H2_SETTINGS_HEADER_TABLE_SIZE      = 0x1,
+    H2_SETTINGS_ENABLE_PUSH            = 0x2,
+    H2_SETTINGS_MAX_CONCURRENT_STREAMS = 0x3,
+    H2_SETTINGS_INITIAL_WINDOW_SIZE    = 0x4,
+    H2_SETTINGS_MAX_FRAME_SIZE         = 0x5,
+};
+
+/* Stream */
+
+typedef struct {
+    uint32_t    id;                     /*< Stream identifier (0 if slot free) */
+    bool        remote_closed;          /*< END_STREAM received */
+    bool        responding;             /*< Response headers sent; DATA pending */
+
+    char       *block;                  /*< Header block being assembled */
+    size_t      block_length;
+
+    char       *request;                /*< Request rewritten as HTTP/1 text */
+    size_t      request_length;
+    size_t      request_read;           /*< Bytes consumed by parse_request */
+
+    char       *response;               /*< Captured HTTP/1 response */
+    size_t      response_length;
+    size_t      response_capacity;
+    size_t      response_sent;          /*< Bytes of response sent (after head) */
+
+    int         body_fd;                /*< File body (-1 if none) */
+    off_t       body_offset;            /*< Offset of next byte to send */
+    off_t       body_end;               /*< Offset just past the body */
+
+    int64_t     window;                 /*< Send window */
+    uint32_t    consumed;               /*< Received DATA not yet acknowledged */
+    Transfer    transfer;               /*< Scheduling state of body */
+    Trace       trace;                  /*< Trace kept until the response is sent */
+} Stream;
+
+/* Connection */
+
+typedef struct {
+    Request    *r;                      /*< Request that started the connection */
+    int         fd;                     /*< Client socket */
+
+    uint8_t    *in;                     /*< Received bytes not yet processed */
+    size_t      in_length;
+    size_t      in_capacity;
+    const char *preface;                /*< Rest of client preface expected (NULL once seen) */
+
+    uint8_t    *out;                    /*< Frames not yet sent */
+    size_t      out_length;
+    size_t      out_capacity;
+    size_t      out_sent;
+
+    HpackTable  decoder;
+    HpackTable  encoder;
+
+    Stream      streams[H2_STREAMS];
+    Stream      discard;                /*< Header block decoded only to keep HPACK in sync */
+    int         nstreams;               /*< Streams in use */
+    struct timespec eligible;           /*< Earliest time of next DATA (bandwidth cap) */
+    uint32_t    last_stream;            /*< Highest client stream seen */
+    uint32_t    continuation;           /*< Stream expecting CONTINUATION (0 if none) */
+
+    int64_t     window;                 /*< Connection send window */
+    uint32_t    consumed;               /*< Received DATA not yet acknowledged */
+    uint32_t    peer_frame_size;        /*< Largest frame we may send */
+    uint32_t    peer_window;            /*< Initial stream send window */
+    bool        goaway;                 /*< Peer (or we) ended the connection */
+} Connection;
+
+/* Request rewriting state passed to hpack_decode */
+
+typedef struct {
+    char       *method;
+    char       *path;
+    char       *authority;
+    char       *headers;                /*< "Name: value\r\n" lines */
+    size_t      length;
+    size_t      capacity;
+    bool        host;                   /*< Whether a host field was seen */
+} Rewrite;
+
+/* Buffer Functions */
+
+static int buffer_reserve(uint8_t **buffer, size_t *capacity, size_t needed) {
+    if (needed <= *capacity) {
+        return 0;
+    }
+
+    size_t size = *capacity ? *capacity : BUFSIZ;
+    while (size < needed) {
+        size *= 2;
+    }
+
+    uint8_t *b = realloc(*buffer, size);
+    if (!b) {
+        return -1;
+    }
+    *buffer   = b;
+    *capacity = size;
+    return 0;
+}
+
+static inline void put32(uint8_t *p, uint32_t v) {
+    p[0] = v >> 24; p[1] = v >> 16; p[2] = v >> 8; p[3] = v;
+}
+
+static inline uint32_t get32(const uint8_t *p) {
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+/**
+ * Append frame header and reserve payload space in the output buffer.
+ *
+ * @return  Pointer to payload (length bytes), or NULL on error.
+ **/
+static uint8_t *frame_start(Connection *c, uint8_t type, uint8_t flags, uint32_t stream, size_t length) {
+    if (buffer_reserve(&c->out, &c->out_capacity, c->out_length + H2_FRAME_HEADER + length) < 0) {
+        return NULL;
+    }
+
+    uint8_t *h = c->out + c->out_length;
+    h[0] = length >> 16; h[1] = length >> 8; h[2] = length;
+    h[3] = type;
+    h[4] = flags;
+    put32(h + 5, stream & H2_WINDOW_MAX);
+    c->out_length += H2_FRAME_HEADER + length;
+    return h + H2_FRAME_HEADER;
+}
+
+static void send_rst_stream(Connection *c, uint32_t stream, uint32_t error) {
+    uint8_t *p = frame_start(c, H2_RST_STREAM, 0, stream, 4);
+    if (p) {
+        put32(p, error);
+    }
+}
+
+static void send_goaway(Connection *c, uint32_t error) {
+    uint8_t *p = frame_start(c, H2_GOAWAY, 0, 0, 8);
+    if (p) {
+        put32(p, c->last_stream);
+        put32(p + 4, error);
+    }
+    c->goaway = true;
+}
+
+static void send_window_update(Connection *c, uint32_t stream, uint32_t increment) {
+    uint8_t *p = frame_start(c, H2_WINDOW_UPDATE, 0, stream, 4);
+    if (p) {
+        put32(p, increment);
+    }
+}
+
+/**
+ * Write as much buffered output as the socket accepts.
+ *
+ * @return  -1 on error and 0 on success.
+ **/
+static int connection_flush(Connection *c) {
+    while (c->out_sent < c->out_length) {
+        ssize_t n = send(c->fd, c->out + c->out_sent, c->out_length - c->out_sent, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+        }
+        c->out_sent        += n;
+        c->r->nwritten     += n;
+    }
+
+    c->out_length = c->out_sent = 0;
+    return 0;
+}
+
+/* Stream Functions */
+
+static Stream *stream_find(Connection *c, uint32_t id) {
+    for (int i = 0; i < H2_STREAMS; i++) {
+        if (c->streams[i].id == id) {
+            return &c->streams[i];
+        }
+    }
+    return NULL;
+}
+
+static Stream *stream_open(Connection *c, uint32_t id) {
+    Stream *s = stream_find(c, 0);
+    if (!s) {
+        return NULL;
+    }
+
+    memset(s, 0, sizeof(Stream));
+    s->id      = id;
+    s->body_fd = -1;
+    s->window  = c->peer_window;
+    c->nstreams++;
+    return s;
+}
+
+static void stream_close(Connection *c, Stream *s) {
+    if (s->body_fd >= 0) {
+        fileio_release(s->body_fd, 0, s->body_end);
+        close(s->body_fd);
+    }
+    trace_finish(&s->trace);
+    free(s->block);
+    free(s->request);
+    free(s->response);
+    memset(s, 0, sizeof(Stream));
+    c->nstreams--;
+}
+
+/* Handler Stream Functions
+ *
+ * Handlers read the rewritten HTTP/1 request from a cookie stream backed by
+ * the Stream; their HTTP/1 response is built in a Response the Stream copies
+ * (taking over any file body). */
+
+static ssize_t stream_read(void *cookie, char *buf, size_t size) {
+    Stream *s = cookie;
+    size_t available = s->request_length - s->request_read;
+    size_t n = size < available ? size : available;
+
+    memcpy(buf, s->request + s->request_read, n);
+    s->request_read += n;
+    return n;
+}
+
+static int stream_close_cookie(void *cookie) {
+    return 0;
+}
+
+/* Request Rewriting */
+
+static int rewrite_append(Rewrite *w, const char *name, size_t name_length, const char *value, size_t value_length) {
+    if (w->length + name_length + value_length + 4 > H2_BLOCK_MAX ||
+        buffer_reserve((uint8_t **)&w->headers, &w->capacity, w->length + name_length + value_length + 5) < 0) {
+        return -1;
+    }
+
+    char *p = w->headers + w->length;
+    memcpy(p, name, name_length);
+    p += name_length;
+    *p++ = ':';
+    *p++ = ' ';
+    memcpy(p, value, value_length);
+    p += value_length;
+    *p++ = '\r';
+    *p++ = '\n';
+    *p   = '\0';
+    w->length = p - w->headers;
+    return 0;
+}
+
+static int rewrite_field(void *arg, const char *name, size_t name_length, const char *value, size_t value_length) {
+    Rewrite *w = arg;
+
+    /* Values must not smuggle extra lines into the rewritten request */
+    if (memchr(value, '\r', value_length) || memchr(value, '\n', value_length)) {
+        return -1;
+    }
+
+    if (name_length > 0 && name[0] == ':') {
+        char **field = NULL;
+        if (name_length == 7 && memcmp(name, ":method", 7) == 0) {
+            field = &w->method;
+        } else if (name_length == 5 && memcmp(name, ":path", 5) == 0) {
+            field = &w->path;
+        } else if (name_length == 10 && memcmp(name, ":authority", 10) == 0) {
+            field = &w->authority;
+        }
+        if (field && !*field) {
+            *field = strndup(value, value_length);
+            return *field ? 0 : -1;
+        }
+        return 0;
+    }
+
+    if (name_length == 4 && memcmp(name, "host", 4) == 0) {
+        w->host = true;
+    }
+    return rewrite_append(w, name, name_length, value, value_length);
+}
+
+/**
+ * Decode stream's header block and rewrite it as an HTTP/1 request.
+ *
+ * @return  -1 on compression error, 1 on malformed request, 0 on success.
+ **/
+static int stream_rewrite(Connection *c, Stream *s) {
+    Rewrite w = {0};
+    int status = 0;
+
+    if (hpack_decode(&c->decoder, (uint8_t *)s->block, s->block_length, rewrite_field, &w) < 0) {
+        status = -1;
+    } else if (!w.method || !w.path || strpbrk(w.method, " \t") || strpbrk(w.path, " \t")) {
+        status = 1;
+    } else {
+        if (w.authority && !w.host) {
+            rewrite_append(&w, "Host", 4, w.authority, strlen(w.authority));
+        }
+
+        s->request_length = strlen(w.method) + strlen(w.path) + w.length + 16;
+        s->request = malloc(s->request_length);
+        if (!s->request) {
+            status = 1;
+        } else {
+            s->request_length = snprintf(s->request, s->request_length, "%s %s HTTP/2.0\r\n%s\r\n",
+                w.method, w.path, w.headers ? w.headers : "");
+        }
+    }
+
+    free(w.method);
+    free(w.path);
+    free(w.authority);
+    free(w.headers);
+    free(s->block);
+    s->block = NULL;
+    s->block_length = 0;
+    return status;
+}
+
+/* Response Conversion */
+
+static bool connection_specific(const char *name) {
+    static const char *Names[] = {"connection", "keep-alive", "proxy-connection", "transfer-encoding", "upgrade"};
+    for (size_t i = 0; i < sizeof(Names)/sizeof(Names[0]); i++) {
+        if (streq(name, Names[i])) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Send HEADERS (and CONTINUATION) frames carrying header block.
+ **/
+static int send_headers(Connection *c, uint32_t stream, const uint8_t *block, size_t length, bool end_stream) {
+    size_t offset = 0;
+    bool   first = true;
+
+    do {
+        size_t  n = length - offset < c->peer_frame_size ? length - offset : c->peer_frame_size;
+        uint8_t flags = (offset + n == length ? H2_FLAG_END_HEADERS : 0) | (first && end_stream ? H2_FLAG_END_STREAM : 0);
+        uint8_t *p = frame_start(c, first ? H2_HEADERS : H2_CONTINUATION, flags, stream, n);
+        if (!p) {
+            return -1;
+        }
+        memcpy(p, block + offset, n);
+        offset += n;
+        first = false;
+    } while (offset < length);
+
+    return 0;
+}
+
+/**
+ * Convert captured HTTP/1 response head into HEADERS; the body follows as DATA.
+ **/
+static int stream_respond(Connection *c, Stream *s) {
+    uint8_t block[H2_BLOCK_MAX];
+    size_t  n = 0;
+    ssize_t w;
+    char    status[4] = "500";
+    char   *head = s->response ? s->response : "";
+    size_t  length = s->response_length;
+
+    /* Find end of head (CGI scripts may use bare LFs) */
+    char   *end = NULL;
+    for (size_t i = 0; i + 1 < length && !end; i++) {
+        if (head[i] == '\n' && head[i + 1] == '\n') {
+            end = head + i + 2;
+        } else if (head[i] == '\n' && i + 2 < length && head[i + 1] == '\r' && head[i + 2] == '\n') {
+            end = head + i + 3;
+        }
+    }
+    if (!end) {
+        end = head;
+        length = 0;
+        s->response_length = 0;
+        if (s->body_fd >= 0) {
+            close(s->body_fd);
+            s->body_fd = -1;
+        }
+    }
+
+    /* Status line */
+    char *line = head;
+    if (end > head && strncmp(line, "HTTP/", 5) == 0) {
+        char *code = strchr(line, ' ');
+        if (code && isdigit(code[1]) && isdigit(code[2]) && isdigit(code[3])) {
+            memcpy(status, code + 1, 3);
+        }
+        line = memchr(line, '\n', end - line) + 1;
+    } else if (end > head) {
+        memcpy(status, "200", 3);
+    }
+
+    if ((w = hpack_encode(&c->encoder, block, sizeof(block), ":status", status)) < 0) {
+        return -1;
+    }
+    n += w;
+
+    /* Header fields, lowercased */
+    while (line < end) {
+        char *next = memchr(line, '\n', end - line);
+        char *colon = memchr(line, ':', next - line);
+        if (colon) {
+            char name[256];
+            char value[BUFSIZ];
+            size_t name_length = colon - line;
+            char *v = colon + 1;
+            while (v < next && (*v == ' ' || *v == '\t')) {
+                v++;
+            }
+            size_t value_length = next - v;
+            while (value_length > 0 && (v[value_length - 1] == '\r' || v[value_length - 1] == ' ')) {
+                value_length--;
+            }
+
+            if (name_length > 0 && name_length < sizeof(name) && value_length < sizeof(value)) {
+                for (size_t i = 0; i < name_length; i++) {
+                    name[i] = tolower((unsigned char)line[i]);
+                }
+                name[name_length] = '\0';
+                memcpy(value, v, value_length);
+                value[value_length] = '\0';
+
+                if (!connection_specific(name) && !streq(name, "content-length")) {
+                    if ((w = hpack_encode(&c->encoder, block + n, sizeof(block) - n, name, value)) < 0) {
+                        return -1;
+                    }
+                    n += w;
+                }
+            }
+        }
+        line = next + 1;
+    }
+
+    /* Body is the rest of the capture plus any deferred file */
+    s->response_sent = end - head;
+    off_t body = (off_t)(length - s->response_sent) + (s->body_fd >= 0 ? s->body_end - s->body_offset : 0);
+    char  content_length[32];
+    snprintf(content_length, sizeof(content_length), "%lld", (long long)body);
+    if ((w = hpack_encode(&c->encoder, block + n, sizeof(block) - n, "content-length", content_length)) < 0) {
+        return -1;
+    }
+    n += w;
+
+    if (send_headers(c, s->id, block, n, body == 0) < 0) {
+        return -1;
+    }
+    trace_point(&s->trace, TRACE_FIRST_WRITE);
+    transfer_start(&s->transfer, body);
+    s->responding = true;
+    return body == 0 ? 1 : 0;
+}
+
+/**
+ * Run stream's request through the regular handlers and queue the response.
+ **/
+static void stream_dispatch(Connection *c, Stream *s) {
+    Request *r = calloc(1, sizeof(Request));
+    if (!r || !(r->response = response_new(-1, NULL))) {
+        free(r);
+        send_rst_stream(c, s->id, H2_INTERNAL_ERROR);
+        stream_close(c, s);
+        return;
+    }
+
+    r->fd = -1;
+    r->addr    = c->r->addr;
+    r->addrlen = c->r->addrlen;
+    clock_gettime(CLOCK_MONOTONIC, &r->start);
+    trace_start(&r->trace, &r->start);
+
+    r->stream   = request_stream(r, s, stream_read, stream_close_cookie);
+    r->received = s->request_length;
+    if (!r->stream) {
+        response_free(r->response);
+        free(r);
+        send_rst_stream(c, s->id, H2_INTERNAL_ERROR);
+        stream_close(c, s);
+        return;
+    }
+
+    handle_request(r);
+
+    /* Copy response head (and any body in memory) */
+    struct iovec iov[RESPONSE_SLICES];
+    size_t       n = response_iovecs(r->response, iov, RESPONSE_SLICES);
+    int          status = buffer_reserve((uint8_t **)&s->response, &s->response_capacity, response_pending(r->response));
+    for (size_t i = 0; i < n && status == 0; i++) {
+        memcpy(s->response + s->response_length, iov[i].iov_base, iov[i].iov_len);
+        s->response_length += iov[i].iov_len;
+    }
+
+    /* Take ownership of file body and trace */
+    off_t length = 0;
+    s->body_fd   = response_take_body(r->response, &s->body_offset, &length);
+    s->body_end  = s->body_offset + length;
+    s->trace     = r->trace;
+    free_request(r);
+
+    if (status == 0) {
+        status = stream_respond(c, s);
+    }
+    if (status < 0) {
+        send_rst_stream(c, s->id, H2_INTERNAL_ERROR);
+    }
+    if (status != 0) {
+        stream_close(c, s);
+    }
+}
+
+/**
+ * Queue DATA frames, taking turns among streams, within flow control limits.
+ *
+ * Each turn is one frame; turns favor the stream with the least left to send
+ * (see transfer_pick), so small responses are not stuck behind downloads.
+ **/
+static void connection_schedule(Connection *c) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    while (c->window > 0 && c->out_length - c->out_sent < H2_OUT_HIGH && !transfer_throttled(&c->eligible, &now)) {
+        Transfer *candidates[H2_STREAMS];
+        Stream   *streams[H2_STREAMS];
+        size_t    n = 0;
+        for (int i = 0; i < H2_STREAMS; i++) {
+            Stream *s = &c->streams[i];
+            if (s->id && s->responding && s->window > 0) {
+                candidates[n] = &s->transfer;
+                streams[n++]  = s;
+            }
+        }
+        if (n == 0) {
+            return;
+        }
+
+        Stream *s = streams[transfer_pick(candidates, n)];
+        size_t  captured = s->response_length - s->response_sent;
+        off_t   file = s->body_fd >= 0 ? s->body_end - s->body_offset : 0;
+        int64_t chunk = c->peer_frame_size;
+        chunk = chunk < c->window ? chunk : c->window;
+        chunk = chunk < s->window ? chunk : s->window;
+        chunk = chunk < (int64_t)captured + file ? chunk : (int64_t)captured + file;
+
+        bool last = chunk == (int64_t)captured + file;
+        uint8_t *p = frame_start(c, H2_DATA, last ? H2_FLAG_END_STREAM : 0, s->id, chunk);
+        if (!p) {
+            return;
+        }
+
+        size_t from_capture = (size_t)chunk < captured ? (size_t)chunk : captured;
+        memcpy(p, s->response + s->response_sent, from_capture);
+        s->response_sent += from_capture;
+        if (chunk > (int64_t)from_capture) {
+            ssize_t n = pread(s->body_fd, p + from_capture, chunk - from_capture, s->body_offset);
+            if (n != (ssize_t)(chunk - from_capture)) {
+                /* Drop the half-built frame and abandon the stream */
+                c->out_length -= H2_FRAME_HEADER + chunk;
+                send_rst_stream(c, s->id, H2_INTERNAL_ERROR);
+                stream_close(c, s);
+                continue;
+            }
+            s->body_offset += n;
+        }
+
+        s->window -= chunk;
+        c->window -= chunk;
+        transfer_sent(&s->transfer, chunk);
+        transfer_pace(&c->eligible, chunk, &now);
+        if (last) {
+            stream_close(c, s);
+        }
+    }
+}
+
+/**
+ * Whether any stream has DATA it is allowed to send.
+ **/
+static bool connection_sendable(Connection *c) {
+    for (int i = 0; i < H2_STREAMS && c->window > 0; i++) {
+        if (c->streams[i].id && c->streams[i].responding && c->streams[i].window > 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Frame Processing */
+
+static int apply_settings(Connection *c, const uint8_t *payload, size_t length) {
+    for (size_t i = 0; i + 6 <= length; i += 6) {
+        uint16_t id    = (payload[i] << 8) | payload[i + 1];
+        uint32_t value = get32(payload + i + 2);
+
+        switch (id) {
+            case H2_SETTINGS_HEADER_TABLE_SIZE:
+                hpack_resize(&c->encoder, value < H2_TABLE_SIZE ? value : H2_TABLE_SIZE);
+                break;
+            case H2_SETTINGS_INITIAL_WINDOW_SIZE:
+                if (value > H2_WINDOW_MAX) {
+                    return H2_FLOW_CONTROL_ERROR;
+                }
+                for (int s = 0; s < H2_STREAMS; s++) {
+                    c->streams[s].window += (int64_t)value - c->peer_window;
+                }
+                c->peer_window = value;
+                break;
+            case H2_SETTINGS_MAX_FRAME_SIZE:
+                if (value < H2_FRAME_SIZE || value > 0xffffff) {
+                    return H2_PROTOCOL_ERROR;
+                }
+                c->peer_frame_size = value;
+                break;
+        }
+    }
+    return H2_NO_ERROR;
+}
+
+/**
+ * Handle complete header block for stream.
+ **/
+static int headers_complete(Connection *c, Stream *s) {
+    if (s == &c->discard) {
+        Rewrite ignored = {0};
+        int status = hpack_decode(&c->decoder, (uint8_t *)s->block, s->block_length, rewrite_field, &ignored);
+        free(ignored.method);
+        free(ignored.path);
+        free(ignored.authority);
+        free(ignored.headers);
+        free(s->block);
+        memset(s, 0, sizeof(Stream));
+        return status < 0 ? H2_COMPRESSION_ERROR : H2_NO_ERROR;
+    }
+
+    int status = stream_rewrite(c, s);
+    if (status < 0) {
+        return H2_COMPRESSION_ERROR;
+    }
+    if (status > 0) {
+        send_rst_stream(c, s->id, H2_PROTOCOL_ERROR);
+        stream_close(c, s);
+        return H2_NO_ERROR;
+    }
+
+    /* Request bodies are not used by any handler, so respond right away */
+    stream_dispatch(c, s);
+    return H2_NO_ERROR;
+}
+
+/**
+ * Append header block fragment, completing the block on END_HEADERS.
+ **/
+static int headers_fragment(Connection *c, Stream *s, const uint8_t *data, size_t length, uint8_t flags) {
+    if (s->block_length + length > H2_BLOCK_MAX) {
+        return H2_PROTOCOL_ERROR;
+    }
+
+    char *block = realloc(s->block, s->block_length + length + 1);
+    if (!block) {
+        return H2_INTERNAL_ERROR;
+    }
+    memcpy(block + s->block_length, data, length);
+    s->block = block;
+    s->block_length += length;
+
+    if (flags & H2_FLAG_END_HEADERS) {
+        c->continuation = 0;
+        return headers_complete(c, s);
+    }
+    c->continuation = s->id;
+    return H2_NO_ERROR;
+}
+
+/**
+ * Strip padding (and priority) from HEADERS or DATA payload.
+ **/
+static int frame_unpad(const uint8_t **payload, size_t *length, uint8_t flags, size_t priority) {
+    size_t pad = 0;
+    if (flags & H2_FLAG_PADDED) {
+        if (*length < 1) {
+            return -1;
+        }
+        pad = (*payload)[0];
+        (*payload)++;
+        (*length)--;
+    }
+    if (*length < priority + pad) {
+        return -1;
+    }
+    *payload += priority;
+    *length  -= priority + pad;
+    return 0;
+}
+
+/**
+ * Process one frame.
+ *
+ * @return  HTTP/2 error code (H2_NO_ERROR on success); errors end the connection.
+ **/
+static int process_frame(Connection *c, uint8_t type, uint8_t flags, uint32_t id, const uint8_t *payload, size_t length) {
+    Stream *s = id ? stream_find(c, id) : NULL;
+
+    if (c->continuation && (type != H2_CONTINUATION || id != c->continuation)) {
+        return H2_PROTOCOL_ERROR;
+    }
+
+    switch (type) {
+        case H2_DATA:
+            if (!id || frame_unpad(&payload, &length, flags, 0) < 0) {
+                return H2_PROTOCOL_ERROR;
+            }
+
+            /* Bodies are discarded, but the window is still replenished */
+            c->consumed += length + (flags & H2_FLAG_PADDED ? 1 : 0);
+            if (c->consumed >= H2_WINDOW / 2) {
+                send_window_update(c, 0, c->consumed);
+                c->consumed = 0;
+            }
+            if (s && !s->remote_closed) {
+                s->consumed += length;
+                if (s->consumed >= H2_WINDOW / 2 && !(flags & H2_FLAG_END_STREAM)) {
+                    send_window_update(c, id, s->consumed);
+                    s->consumed = 0;
+                }
+                s->remote_closed = flags & H2_FLAG_END_STREAM;
+            }
+            break;
+
+        case H2_HEADERS:
+            if (!id || !(id & 1) || frame_unpad(&payload, &length, flags, flags & H2_FLAG_PRIORITY ? 5 : 0) < 0) {
+                return H2_PROTOCOL_ERROR;
+            }
+
+            if (s && s->request) {
+                /* Trailers (or a repeated request) are decoded and ignored */
+                c->discard.id = id;
+                return headers_fragment(c, &c->discard, payload, length, flags);
+            }
+            if (!s && (id <= c->last_stream || c->goaway)) {
+                /* Stream already answered, or the connection is going away */
+                if (id > c->last_stream) {
+                    send_rst_stream(c, id, H2_REFUSED_STREAM);
+                }
+                c->discard.id = id;
+                return headers_fragment(c, &c->discard, payload, length, flags);
+            }
+            if (!s) {
+                c->last_stream = id;
+                if (!(s = stream_open(c, id))) {
+                    send_rst_stream(c, id, H2_REFUSED_STREAM);
+                    c->discard.id = id;
+                    return headers_fragment(c, &c->discard, payload, length, flags);
+                }
+            }
+            s->remote_closed = flags & H2_FLAG_END_STREAM;
+            return headers_fragment(c, s, payload, length, flags);
+
+        case H2_CONTINUATION:
+            if (!s && c->discard.id == id) {
+                s = &c->discard;
+            }
+            if (!s) {
+                return H2_PROTOCOL_ERROR;
+            }
+            return headers_fragment(c, s, payload, length, flags);
+
+        case H2_PRIORITY:
+            break;
+
+        case H2_RST_STREAM:
+            if (!id || length != 4) {
+                return H2_PROTOCOL_ERROR;
+            }
+            if (s) {
+                stream_close(c, s);
+            }
+            break;
+
+        case H2_SETTINGS:
+            if (id || (length % 6) || ((flags & H2_FLAG_ACK) && length)) {
+                return H2_PROTOCOL_ERROR;
+            }
+            if (!(flags & H2_FLAG_ACK)) {
+                int status = apply_settings(c, payload, length);
+                if (status != H2_NO_ERROR) {
+                    return status;
+                }
+                frame_start(c, H2_SETTINGS, H2_FLAG_ACK, 0, 0);
+            }
+            break;
+
+        case H2_PUSH_PROMISE:
+            return H2_PROTOCOL_ERROR;
+
+        case H2_PING:
+            if (id || length != 8) {
+                return H2_PROTOCOL_ERROR;
+            }
+            if (!(flags & H2_FLAG_ACK)) {
+                uint8_t *p = frame_start(c, H2_PING, H2_FLAG_ACK, 0, 8);
+                if (p) {
+                    memcpy(p, payload, 8);
+                }
+            }
+            break;
+
+        case H2_GOAWAY:
+            c->goaway = true;
+            break;
+
+        case H2_WINDOW_UPDATE: {
+            if (length != 4) {
+                return H2_FRAME_SIZE_ERROR;
+            }
+            uint32_t increment = get32(payload) & H2_WINDOW_MAX;
+            if (!id) {
+                if (!increment || c->window + increment > H2_WINDOW_MAX) {
+                    return increment ? H2_FLOW_CONTROL_ERROR : H2_PROTOCOL_ERROR;
+                }
+                c->window += increment;
+            } else if (s) {
+                if (!increment || s->window + increment > H2_WINDOW_MAX) {
+                    send_rst_stream(c, id, increment ? H2_FLOW_CONTROL_ERROR : H2_PROTOCOL_ERROR);
+                    stream_close(c, s);
+                } else {
+                    s->window += increment;
+                }
+            }
+            break;
+        }
+
+        default:
+            break;                      /* Unknown frame types are ignored */
+    }
+
+    return H2_NO_ERROR;
+}
+
+/**
+ * Process every complete frame in the input buffer.
+ *
+ * @return  HTTP/2 error code (H2_NO_ERROR on success).
+ **/
+static int connection_process(Connection *c) {
+    size_t offset = 0;
+    int    status = H2_NO_ERROR;
+
+    /* The client preface comes first */
+    if (c->preface) {
+        size_t expected = strlen(c->preface);
+        size_t n = c->in_length < expected ? c->in_length : expected;
+        if (memcmp(c->in, c->preface, n) != 0) {
+            return H2_PROTOCOL_ERROR;
+        }
+        if (n < expected) {
+            return H2_NO_ERROR;
+        }
+        c->preface = NULL;
+        offset = n;
+    }
+
+    while (status == H2_NO_ERROR && c->in_length - offset >= H2_FRAME_HEADER) {
+        const uint8_t *h = c->in + offset;
+        size_t length = (h[0] << 16) | (h[1] << 8) | h[2];
+        if (length > H2_FRAME_SIZE) {
+            return H2_FRAME_SIZE_ERROR;
+        }
+        if (c->in_length - offset < H2_FRAME_HEADER + length) {
+            break;
+        }
+
+        status  = process_frame(c, h[3], h[4], get32(h + 5) & H2_WINDOW_MAX, h + H2_FRAME_HEADER, length);
+        offset += H2_FRAME_HEADER + length;
+    }
+
+    memmove(c->in, c->in + offset, c->in_length - offset);
+    c->in_length -= offset;
+    return status;
+}
+
+/**
+ * Decode base64url HTTP2-Settings header into a SETTINGS payload.
+ **/
+static size_t decode_settings_header(const char *value, uint8_t *out, size_t size) {
+    uint32_t bits = 0;
+    int      nbits = 0;
+    size_t   n = 0;
+
+    for (const char *p = value; *p && *p != '='; p++) {
+        int v;
+        if (*p >= 'A' && *p <= 'Z')      v = *p - 'A';
+        else if (*p >= 'a' && *p <= 'z') v = *p - 'a' + 26;
+        else if (*p >= '0' && *p <= '9') v = *p - '0' + 52;
+        else if (*p == '-' || *p == '+') v = 62;
+        else if (*p == '_' || *p == '/') v = 63;
+        else continue;
+
+        bits   = (bits << 6) | v;
+        nbits += 6;
+        if (nbits >= 8 && n < size) {
+            nbits -= 8;
+            out[n++] = bits >> nbits;
+        }
+    }
+    return n;
+}
+
+/* Public Functions */
+
+/**
+ * Determine whether request starts an HTTP/2 connection.
+ *
+ * @param   r           HTTP Request structure (parsed).
+ * @return  Whether the request is the prior knowledge preface ("PRI *") or
+ * an HTTP/1.1 request without a body asking to upgrade to h2c.
+ **/
+bool http2_detect(Request *r) {
+    if (streq(r->method, "PRI") && streq(r->uri, "*")) {
+        return true;
+    }
+
+    const char *upgrade  = request_header(r, "Upgrade");
+    const char *settings = request_header(r, "HTTP2-Settings");
+    const char *length   = request_header(r, "Content-Length");
+    return upgrade && settings && strcasestr(upgrade, "h2c") && (!length || atoll(length) == 0);
+}
+
+/**
+ * Serve HTTP/2 connection.
+ *
+ * @param   r           HTTP Request structure that started the connection.
+ * @return  Status of the connection (HTTP_STATUS_OK unless it failed to start).
+ *
+ * Each stream's request is rewritten as HTTP/1 text and run through
+ * handle_request with its output captured, so the browse, file, and CGI
+ * handlers are shared with HTTP/1.  File bodies are deferred and read
+ * straight into DATA frames.  Responses are interleaved one DATA frame per
+ * stream at a time, limited by the connection and stream send windows.
+ **/
+Status http2_serve(Request *r) {
+    Connection *c = calloc(1, sizeof(Connection));
+    if (!c) {
+        return HTTP_STATUS_INTERNAL_SERVER_ERROR;
+    }
+
+    c->r               = r;
+    c->fd              = r->fd;
+    c->window          = H2_WINDOW;
+    c->peer_window     = H2_WINDOW;
+    c->peer_frame_size = H2_FRAME_SIZE;
+    hpack_init(&c->decoder, H2_TABLE_SIZE);
+    hpack_init(&c->encoder, H2_TABLE_SIZE);
+
+    /* Take over whatever stdio has already buffered */
+    size_t buffered = request_buffered(r);
+    if (buffer_reserve(&c->in, &c->in_capacity, buffered + BUFSIZ) < 0) {
+        free(c);
+        return HTTP_STATUS_INTERNAL_SERVER_ERROR;
+    }
+    c->in_length = fread(c->in, 1, buffered, r->stream);
+
+    if (streq(r->method, "PRI")) {
+        /* parse_request consumed "PRI * HTTP/2.0\r\n\r\n" */
+        c->preface = H2_PREFACE + strlen("PRI * HTTP/2.0\r\n\r\n");
+    } else {
+        /* Upgrade: switch protocols, then answer the request as stream 1 */
+        static const char Switching[] = "HTTP/1.1 101 Switching Protocols\r\nConnection: Upgrade\r\nUpgrade: h2c\r\n\r\n";
+        uint8_t settings[256];
+        size_t  n = decode_settings_header(request_header(r, "HTTP2-Settings"), settings, sizeof(settings));
+        apply_settings(c, settings, n - n % 6);
+
+        response_flush(r->response);
+        if (send(c->fd, Switching, sizeof(Switching) - 1, MSG_NOSIGNAL) < 0) {
+            hpack_free(&c->decoder);
+            hpack_free(&c->encoder);
+            free(c->in);
+            free(c);
+            return HTTP_STATUS_OK;
+        }
+        c->preface = H2_PREFACE;
+
+        Stream *s = stream_open(c, 1);
+        Rewrite w = {0};
+        for (Header *h = r->headers; h; h = h->next) {
+            if (h->name && h->data && strcasecmp(h->name, "Upgrade") && strcasecmp(h->name, "HTTP2-Settings") && strcasecmp(h->name, "Connection")) {
+                rewrite_append(&w, h->name, strlen(h->name), h->data, strlen(h->data));
+            }
+        }
+        s->request_length = strlen(r->method) + strlen(r->uri) + strlen(r->query) + w.length + 16;
+        s->request = malloc(s->request_length);
+        if (s->request) {
+            s->request_length = snprintf(s->request, s->request_length, "%s %s%s%s HTTP/2.0\r\n%s\r\n",
+                r->method, r->uri, r->query[0] ? "?" : "", r->query, w.headers ? w.headers : "");
+        }
+        free(w.headers);
+        s->remote_closed = true;
+        c->last_stream   = 1;
+    }
+
+    /* Our settings: fewer concurrent streams than the unlimited default */
+    uint8_t *p = frame_start(c, H2_SETTINGS, 0, 0, 6);
+    if (p) {
+        p[0] = 0; p[1] = H2_SETTINGS_MAX_CONCURRENT_STREAMS;
+        put32(p + 2, H2_STREAMS);
+    }
+
+    /* Stream 1 of an upgrade is answered after our SETTINGS */
+    Stream *upgraded = stream_find(c, 1);
+    if (upgraded && upgraded->request) {
+        stream_dispatch(c, upgraded);
+    }
+
+    fcntl(c->fd, F_SETFL, fcntl(c->fd, F_GETFL) | O_NONBLOCK);
+
+    int error = H2_NO_ERROR;
+    while (true) {
+        if ((error = connection_process(c)) != H2_NO_ERROR) {
+            debug("HTTP/2 connection error %d", error);
+            send_goaway(c, error);
+        }
+        connection_schedule(c);
+        if (connection_flush(c) < 0) {
+            break;
+        }
+        if (c->goaway && (error != H2_NO_ERROR || c->nstreams == 0) && c->out_length == 0) {
+            break;
+        }
+
+        /* Streams held back by the bandwidth cap wake the loop when they may send */
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        int  wait = transfer_wait(&c->eligible, &now);
+        bool sendable = connection_sendable(c);
+        int  timeout = sendable && wait > 0 && wait < H2_IDLE_MS ? wait : H2_IDLE_MS;
+
+        struct pollfd pfd = {.fd = c->fd, .events = POLLIN | (c->out_length || (sendable && wait == 0) ? POLLOUT : 0)};
+        int ready = poll(&pfd, 1, timeout);
+        if ((ready < 0 && errno == EINTR) || (ready == 0 && timeout < H2_IDLE_MS)) {
+            continue;
+        }
+        if (ready <= 0) {
+            if (c->nstreams == 0 && !c->goaway) {
+                send_goaway(c, H2_NO_ERROR);
+                continue;
+            }
+            break;
+        }
+
+        if (pfd.revents & (POLLIN | POLLHUP | POLLERR)) {
+            if (buffer_reserve(&c->in, &c->in_capacity, c->in_length + H2_FRAME_SIZE + H2_FRAME_HEADER) < 0) {
+                break;
+            }
+            ssize_t n = recv(c->fd, c->in + c->in_length, c->in_capacity - c->in_length, 0);
+            if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR)) {
+                break;
+            }
+            if (n > 0) {
+                c->in_length += n;
+            }
+        }
+    }
+
+    for (int i = 0; i < H2_STREAMS; i++) {
+        if (c->streams[i].id) {
+            stream_close(c, &c->streams[i]);
+        }
+    }
+    free(c->discard.block);
+    hpack_free(&c->decoder);
+    hpack_free(&c->encoder);
+    free(c->in);
+    free(c->out);
+    free(c);
+    return HTTP_STATUS_OK;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,651 @@
+/* hybrid.c: Event Loop HTTP Server with Pre-forked Handlers */
+
+#define _GNU_SOURCE
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <string.h>
+
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+/* The front end (this process) owns every client socket until its request
+ * head has arrived: it accepts, reads, and times out slow clients with one
+ * epoll loop, so an idle connection costs a small struct rather than a
+ * process.  Complete heads go to pre-forked handler processes over a shared
+ * unix socket, with the client socket attached (SCM_RIGHTS), and the handler
+ * answers the request straight to the client (sendfile and splice included)
+ * exactly like a forked worker.  A handler that crashes takes only its own
+ * request with it; the front end starts a replacement. */
+
+/* Constants */
+
+#define HYBRID_HEAD_MAX     8192        /* Request head bytes read by the front end */
+#define HYBRID_HEAD_TIMEOUT 30          /* Seconds a client may take to send its request head */
+#define HYBRID_EVENTS       256         /* Events handled per epoll_wait */
+#define HYBRID_POLL_MS      1000        /* Longest wait between timeout and flag checks */
+#define HYBRID_RESERVED_FDS 64          /* Descriptors left for the front end's own use */
+
+/* Handoff (message sent with each client socket) */
+
+typedef struct {
+    struct sockaddr_storage addr;       /*< Address of client */
+    socklen_t       addrlen;            /*< Length of client address */
+    struct timespec accepted;           /*< Monotonic time client was accepted */
+} Handoff;
+
+/* Front End Connection */
+
+typedef struct Connection Connection;
+struct Connection {
+    int         fd;                     /*< Client socket */
+    Handoff     handoff;                /*< Client details for the handler */
+    char       *head;                   /*< Request head so far (NULL until a read falls short) */
+    size_t      length;                 /*< Bytes of head */
+    bool        ready;                  /*< Head complete, waiting for the channel */
+    Connection *prev;                   /*< Previous connection in its list */
+    Connection *next;                   /*< Next connection in its list */
+};
+
+typedef struct {
+    Connection *head;
+    Connection *tail;
+} ConnectionList;
+
+/* Handler Client (the request stream of a handed off request) */
+
+typedef struct {
+    Request *request;
+    char     head[HYBRID_HEAD_MAX];     /*< Request head read by the front end */
+    size_t   length;                    /*< Bytes of head */
+    size_t   offset;                    /*< Bytes of head read by the request stream */
+} Client;
+
+/* Front End State */
+
+static int            Epoll = -1;
+static int            Channel = -1;     /* Front end's end of the handoff socket */
+static int            HandlerEnd = -1;  /* Handlers' end of the handoff socket */
+static ConnectionList Reading;          /* Waiting for request heads (oldest first) */
+static ConnectionList Ready;            /* Waiting for room in the channel (oldest first) */
+static pid_t         *Handlers = NULL;  /* Handler processes (0 once exited) */
+static int            NHandlers = 0;
+static size_t         NConnections = 0; /* Connections held by the front end */
+static size_t         MaxConnections = 0;
+
+/* Epoll tags for the sockets that are not clients */
+static Connection     ListenTag;
+static Connection     ChannelTag;
+
+/* List Functions */
+
+static void list_append(ConnectionList *list, Connection *c) {
+    c->prev = list->tail;
+    c->next = NULL;
+    if (list->tail) {
+        list->tail->next = c;
+    } else {
+        list->head = c;
+    }
+    list->tail = c;
+}
+
+static void list_remove(ConnectionList *list, Connection *c) {
+    if (c->prev) {
+        c->prev->next = c->next;
+    } else {
+        list->head = c->next;
+    }
+    if (c->next) {
+        c->next->prev = c->prev;
+    } else {
+        list->tail = c->prev;
+    }
+    c->prev = c->next = NULL;
+}
+
+static void list_close(const ConnectionList *list) {
+    for (Connection *c = list->head; c; c = c->next) {
+        close(c->fd);
+    }
+}
+
+/* Handler Functions */
+
+static ssize_t client_read(void *cookie, char *buffer, size_t size) {
+    Client *c = cookie;
+    ssize_t nread;
+
+    /* The head the front end read comes first, then the rest of the request */
+    if (c->offset < c->length) {
+        nread = size < c->length - c->offset ? size : c->length - c->offset;
+        memcpy(buffer, c->head + c->offset, nread);
+        c->offset += nread;
+    } else {
+        do {
+            nread = read(c->request->fd, buffer, size);
+            c->request->trace.reads++;
+        } while (nread < 0 && errno == EINTR);
+        if (nread > 0) {
+            c->request->received += nread;
+        }
+    }
+
+    if (nread > 0) {
+        trace_point(&c->request->trace, TRACE_FIRST_READ);
+    }
+    return nread;
+}
+
+static int client_close(void *cookie) {
+    Client *c = cookie;
+    return close(c->request->fd);
+}
+
+/**
+ * Receive next client from the front end.
+ *
+ * @param   channel     Handlers' end of the handoff socket.
+ * @param   client      Client to store request head in.
+ * @param   handoff     Handoff to store client details in.
+ * @return  Client socket, or -1 once the front end is gone.
+ **/
+static int handler_receive(int channel, Client *client, Handoff *handoff) {
+    while (true) {
+        char cmsg[CMSG_SPACE(sizeof(int))];
+        struct iovec iov[] = {
+            {.iov_base = handoff,      .iov_len = sizeof(Handoff)},
+            {.iov_base = client->head, .iov_len = sizeof(client->head)},
+        };
+        struct msghdr msg = {.msg_iov = iov, .msg_iovlen = 2, .msg_control = cmsg, .msg_controllen = sizeof(cmsg)};
+
+        ssize_t n = recvmsg(channel, &msg, MSG_CMSG_CLOEXEC);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+
+        struct cmsghdr *c = CMSG_FIRSTHDR(&msg);
+        if (!c || c->cmsg_level != SOL_SOCKET || c->cmsg_type != SCM_RIGHTS) {
+            continue;
+        }
+        int fd;
+        memcpy(&fd, CMSG_DATA(c), sizeof(fd));
+        if (n < (ssize_t)sizeof(Handoff)) {
+            close(fd);
+            continue;
+        }
+
+        /* The front end reads without blocking; handlers answer like forked workers */
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+        client->length = n - sizeof(Handoff);
+        client->offset = 0;
+        return fd;
+    }
+}
+
+/**
+ * Handle clients sent by the front end until it goes away.
+ *
+ * @param   channel     Handlers' end of the handoff socket.
+ **/
+static void handler_run(int channel) {
+    static Client client;
+    Handoff handoff;
+    int     fd;
+
+    while ((fd = handler_receive(channel, &client, &handoff)) >= 0) {
+        Request *r = calloc(1, sizeof(Request));
+        if (!r) {
+            close(fd);
+            continue;
+        }
+
+        r->fd         = fd;
+        r->addr       = handoff.addr;
+        r->addrlen    = handoff.addrlen;
+        r->start      = handoff.accepted;
+        r->upgradable = true;
+        trace_start(&r->trace, &r->start);
+        client.request = r;
+
+        r->stream   = request_stream(r, &client, client_read, client_close);
+        r->received = client.length;
+        r->response = r->stream ? response_new(fd, &r->trace) : NULL;
+        if (!r->response) {
+            debug("Unable to open client stream: %s", strerror(errno));
+            if (!r->stream) {
+                close(fd);
+                r->fd = -1;
+            }
+            free_request(r);
+            continue;
+        }
+
+        debug("Accepted Request From %s:%s", request_host(r), request_port(r));
+        stats_connection(1);
+        handle_request(r);
+        free_request(r);
+        stats_connection(-1);
+    }
+}
+
+/**
+ * Fork handler process into slot.
+ *
+ * @param   sfd         Server socket file descriptor (-1 once closed).
+ * @param   index       Slot of handler.
+ * @return  -1 on error and 0 on success.
+ *
+ * The handler inherits the front end's sockets and closes them, so clients
+ * the front end closes (or hands off) are not kept open by it.
+ **/
+static int handler_spawn(int sfd, int index) {
+    pid_t pid = fork();
+    if (pid < 0) {
+        log("Unable to fork handler: %s", strerror(errno));
+        return -1;
+    }
+
+    if (pid == 0) {
+        WorkerId = index + 1;
+        if (sfd >= 0) {
+            close(sfd);
+        }
+        close(Epoll);
+        close(Channel);
+        list_close(&Reading);
+        list_close(&Ready);
+
+        handler_run(HandlerEnd);
+        exit(EXIT_SUCCESS);
+    }
+
+    Handlers[index] = pid;
+    return 0;
+}
+
+/**
+ * Reap handlers that have exited, replacing them unless draining.
+ **/
+static void handlers_reap(int sfd, bool draining) {
+    pid_t pid;
+    int   status;
+
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+        for (int i = 0; i < NHandlers; i++) {
+            if (Handlers[i] != pid) {
+                continue;
+            }
+            Handlers[i] = 0;
+            if (!draining) {
+                if (WIFSIGNALED(status)) {
+                    log("Handler %d killed by signal %d; starting another", pid, WTERMSIG(status));
+                } else {
+                    log("Handler %d exited with status %d; starting another", pid, WEXITSTATUS(status));
+                }
+                handler_spawn(sfd, i);
+            }
+        }
+    }
+}
+
+/**
+ * Return number of handlers still running.
+ **/
+static int handlers_running(void) {
+    int running = 0;
+    for (int i = 0; i < NHandlers; i++) {
+        running += Handlers[i] != 0;
+    }
+    return running;
+}
+
+/* Front End Functions */
+
+/**
+ * Close client (whether or not a handler has it now).
+ **/
+static void connection_close(Connection *c) {
+    /* A handed off socket stays open in the handler, and with it the epoll
+     * registration, which must not report events for a freed connection */
+    if (!c->ready) {
+        epoll_ctl(Epoll, EPOLL_CTL_DEL, c->fd, NULL);
+    }
+    list_remove(c->ready ? &Ready : &Reading, c);
+    close(c->fd);
+    free(c->head);
+    free(c);
+    NConnections--;
+    stats_connection(-1);
+}
+
+/**
+ * Send client to a handler.
+ *
+ * @return  -1 on error, 0 if the channel is full, and 1 on success.
+ **/
+static int connection_handoff(Connection *c, const char *head) {
+    char cmsg[CMSG_SPACE(sizeof(int))] = {0};
+    struct iovec iov[] = {
+        {.iov_base = &c->handoff,   .iov_len = sizeof(Handoff)},
+        {.iov_base = (char *)head,  .iov_len = c->length},
+    };
+    struct msghdr msg = {.msg_iov = iov, .msg_iovlen = 2, .msg_control = cmsg, .msg_controllen = sizeof(cmsg)};
+
+    struct cmsghdr *control = CMSG_FIRSTHDR(&msg);
+    control->cmsg_level = SOL_SOCKET;
+    control->cmsg_type  = SCM_RIGHTS;
+    control->cmsg_len   = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(control), &c->fd, sizeof(int));
+
+    ssize_t n;
+    while ((n = sendmsg(Channel, &msg, MSG_DONTWAIT | MSG_NOSIGNAL)) < 0 && errno == EINTR);
+    if (n < 0) {
+        return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+    }
+    return 1;
+}
+
+/**
+ * Hand client whose head is complete to a handler, or queue it until the
+ * channel has room.
+ *
+ * @param   head        Request head (the connection's own, or read straight
+ * into the caller's buffer).
+ **/
+static void connection_dispatch(Connection *c, const char *head) {
+    int status = connection_handoff(c, head);
+    if (status != 0) {
+        if (status < 0) {
+            log("Unable to hand off client: %s", strerror(errno));
+        }
+        connection_close(c);
+        return;
+    }
+
+    /* Handlers are all busy and the channel is full: wait in line */
+    if (!c->head) {
+        c->head = malloc(HYBRID_HEAD_MAX);
+        if (!c->head) {
+            connection_close(c);
+            return;
+        }
+        memcpy(c->head, head, c->length);
+    }
+    epoll_ctl(Epoll, EPOLL_CTL_DEL, c->fd, NULL);
+    list_remove(&Reading, c);
+    list_append(&Ready, c);
+    c->ready = true;
+
+    struct epoll_event event = {.events = EPOLLOUT, .data.ptr = &ChannelTag};
+    epoll_ctl(Epoll, EPOLL_CTL_MOD, Channel, &event);
+}
+
+/**
+ * Hand queued clients to handlers while the channel has room.
+ **/
+static void connections_flush(void) {
+    while (Ready.head) {
+        Connection *c = Ready.head;
+        int status = connection_handoff(c, c->head);
+        if (status == 0) {
+            return;
+        }
+        if (status < 0) {
+            log("Unable to hand off client: %s", strerror(errno));
+        }
+        connection_close(c);
+    }
+
+    struct epoll_event event = {.events = 0, .data.ptr = &ChannelTag};
+    epoll_ctl(Epoll, EPOLL_CTL_MOD, Channel, &event);
+}
+
+/**
+ * Read more of client's request head, dispatching it once complete.
+ **/
+static void connection_receive(Connection *c) {
+    char    buffer[HYBRID_HEAD_MAX + 1];
+    char   *head = c->head ? c->head : buffer;
+    ssize_t n;
+
+    while ((n = read(c->fd, head + c->length, HYBRID_HEAD_MAX - c->length)) < 0 && errno == EINTR);
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        return;
+    }
+    if (n <= 0) {
+        connection_close(c);
+        return;
+    }
+    c->length += n;
+
+    /* Heads too large for the buffer go on as is (the handler reads the rest) */
+    if (memmem(head, c->length, "\r\n\r\n", 4) || memmem(head, c->length, "\n\n", 2) || c->length == HYBRID_HEAD_MAX) {
+        connection_dispatch(c, head);
+        return;
+    }
+
+    /* Partial head: keep it until the rest arrives */
+    if (!c->head) {
+        c->head = malloc(HYBRID_HEAD_MAX);
+        if (!c->head) {
+            connection_close(c);
+            return;
+        }
+        memcpy(c->head, buffer, c->length);
+    }
+}
+
+/**
+ * Accept client from listening socket.
+ *
+ * @return  -1 on error and 0 on success.
+ **/
+static int connection_accept(int sfd) {
+    Connection *c = calloc(1, sizeof(Connection));
+    if (!c) {
+        return -1;
+    }
+
+    c->handoff.addrlen = sizeof(c->handoff.addr);
+    c->fd = accept4(sfd, (struct sockaddr *)&c->handoff.addr, &c->handoff.addrlen, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (c->fd < 0) {
+        free(c);
+        return -1;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &c->handoff.accepted);
+
+    struct epoll_event event = {.events = EPOLLIN | EPOLLRDHUP, .data.ptr = c};
+    if (epoll_ctl(Epoll, EPOLL_CTL_ADD, c->fd, &event) < 0) {
+        close(c->fd);
+        free(c);
+        return -1;
+    }
+
+    list_append(&Reading, c);
+    NConnections++;
+    stats_connection(1);
+    return 0;
+}
+
+/**
+ * Close clients that have taken too long to send their request heads.
+ **/
+static void connections_expire(const struct timespec *now) {
+    while (Reading.head && now->tv_sec - Reading.head->handoff.accepted.tv_sec >= HYBRID_HEAD_TIMEOUT) {
+        debug("Closing client that sent no request in %ds", HYBRID_HEAD_TIMEOUT);
+        connection_close(Reading.head);
+    }
+}
+
+/**
+ * Determine how many clients the front end can hold at once (raising the
+ * descriptor limit as far as allowed).
+ **/
+static size_t connections_max(void) {
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) < 0) {
+        return 1024 - HYBRID_RESERVED_FDS;
+    }
+    if (limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+        getrlimit(RLIMIT_NOFILE, &limit);
+    }
+    return limit.rlim_cur > 2 * HYBRID_RESERVED_FDS ? limit.rlim_cur - HYBRID_RESERVED_FDS : HYBRID_RESERVED_FDS;
+}
+
+/**
+ * Set up epoll, the handoff socket, and the handler processes.
+ *
+ * @return  -1 on error and 0 on success.
+ **/
+static int hybrid_init(int sfd) {
+    int pair[2];
+
+    /* Handler ends are blocking (they wait for clients); the front end's is not */
+    if ((Epoll = epoll_create1(EPOLL_CLOEXEC)) < 0 || socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, pair) < 0) {
+        return -1;
+    }
+    Channel    = pair[0];
+    HandlerEnd = pair[1];
+    fcntl(Channel, F_SETFL, fcntl(Channel, F_GETFL) | O_NONBLOCK);
+
+    struct epoll_event listen = {.events = EPOLLIN, .data.ptr = &ListenTag};
+    struct epoll_event channel = {.events = 0, .data.ptr = &ChannelTag};
+    if (epoll_ctl(Epoll, EPOLL_CTL_ADD, sfd, &listen) < 0 || epoll_ctl(Epoll, EPOLL_CTL_ADD, Channel, &channel) < 0) {
+        return -1;
+    }
+
+    NHandlers = HybridHandlers > 0 ? HybridHandlers : 2 * sysconf(_SC_NPROCESSORS_ONLN);
+    Handlers  = calloc(NHandlers, sizeof(pid_t));
+    if (!Handlers) {
+        return -1;
+    }
+    for (int i = 0; i < NHandlers; i++) {
+        if (handler_spawn(sfd, i) < 0) {
+            return -1;
+        }
+    }
+
+    MaxConnections = connections_max();
+    return 0;
+}
+
+/**
+ * Accept clients and read their requests in an epoll loop, and answer them
+ * in pre-forked handler processes.
+ *
+ * @param   sfd         Server socket file descriptor.
+ * @return  Exit status of server (EXIT_SUCCESS).
+ *
+ * While every handler is busy, complete requests queue in the handoff socket
+ * and then in the front end, which stops accepting until they drain; the
+ * listen backlog holds the rest.
+ *
+ * Once told to stop, the front end hands off the requests still arriving
+ * (until the drain deadline), closes the handoff socket, and waits for the
+ * handlers to answer what they were given.
+ **/
+int hybrid_server(int sfd) {
+    signal(SIGPIPE, SIG_IGN);
+    if (hybrid_init(sfd) < 0) {
+        log("Unable to start hybrid server: %s", strerror(errno));
+        return EXIT_FAILURE;
+    }
+    log("Started %d handler processes", NHandlers);
+
+    struct epoll_event events[HYBRID_EVENTS];
+    bool accepting = true;
+    bool draining  = false;
+    while (true) {
+        handlers_reap(draining ? -1 : sfd, draining);
+
+        if (!draining && restart_stopping(sfd)) {
+            draining = true;
+            epoll_ctl(Epoll, EPOLL_CTL_DEL, sfd, NULL);
+            close(sfd);
+        }
+        if (draining && ((!Reading.head && !Ready.head) || restart_expired())) {
+            break;
+        }
+
+        /* Stop accepting while clients wait in line (or descriptors run out) */
+        bool want = !Ready.head && NConnections < MaxConnections;
+        if (!draining && want != accepting) {
+            struct epoll_event event = {.events = want ? EPOLLIN : 0, .data.ptr = &ListenTag};
+            epoll_ctl(Epoll, EPOLL_CTL_MOD, sfd, &event);
+            accepting = want;
+        }
+
+        int n = epoll_wait(Epoll, events, HYBRID_EVENTS, HYBRID_POLL_MS);
+        if (n < 0 && errno != EINTR) {
+            fatal("epoll_wait failed: %s", strerror(errno));
+        }
+
+        for (int i = 0; i < n; i++) {
+            Connection *c = events[i].data.ptr;
+            if (c == &ListenTag) {
+                if (!draining && connection_accept(sfd) < 0) {
+                    debug("Unable to Accept Client: %s", strerror(errno));
+                }
+            } else if (c == &ChannelTag) {
+                connections_flush();
+            } else {
+                connection_receive(c);
+            }
+        }
+
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        connections_expire(&now);
+    }
+
+    /* Clients still waiting past the deadline are dropped */
+    while (Reading.head) {
+        connection_close(Reading.head);
+    }
+    while (Ready.head) {
+        connection_close(Ready.head);
+    }
+
+    /* Handlers exit once they have answered everything handed to them */
+    close(Channel);
+    close(HandlerEnd);
+    while (handlers_running() > 0 && !restart_expired()) {
+        pid_t pid = wait(NULL);
+        for (int i = 0; i < NHandlers; i++) {
+            if (pid > 0 && Handlers[i] == pid) {
+                Handlers[i] = 0;
+            }
+        }
+        if (pid < 0 && errno == ECHILD) {
+            break;
+        }
+    }
+
+    if (handlers_running() > 0) {
+        log("Drain deadline passed; killing %d handlers", handlers_running());
+        for (int i = 0; i < NHandlers; i++) {
+            if (Handlers[i]) {
+                kill(Handlers[i], SIGKILL);
+                waitpid(Handlers[i], NULL, 0);
+            }
+        }
+    }
+
+    close(Epoll);
+    free(Handlers);
+    return EXIT_SUCCESS;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
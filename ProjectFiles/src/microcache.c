@@ -0,0 +1,490 @@
+/* microcache.c: CGI Microcache */
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <string.h>
+#include <strings.h>
+
+#include <sys/mman.h>
+
+/* Internal Declarations */
+Status handle_error(Request *request, Status status);
+
+/* Constants */
+
+#define MICROCACHE_ROUTES   16          /* Cached prefixes */
+#define MICROCACHE_FLIGHTS  64          /* Scripts being run for waiters at once */
+#define MICROCACHE_WAIT     10          /* Seconds to wait for another worker's run */
+#define MICROCACHE_MAX      (1024*1024) /* Largest output cached */
+
+/* Cached prefix */
+
+typedef struct {
+    char       *prefix;                 /*< URI prefix */
+    size_t      prefix_length;
+    int         ttl;                    /*< Seconds output stays fresh (0: only as Cache-Control allows) */
+} MicroRoute;
+
+/* Scripts being run (shared with forked workers) */
+
+typedef struct {
+    uint64_t    hash;                   /*< Hash of key being run (0 if free) */
+    pid_t       pid;                    /*< Worker running it */
+} Flight;
+
+typedef struct {
+    pthread_mutex_t lock;               /*< Guards flights (robust, process shared) */
+    pthread_cond_t  landed;             /*< Broadcast when a run finishes */
+    Flight          flights[MICROCACHE_FLIGHTS];
+} FlightTable;
+
+/* Microcache State */
+
+static MicroRoute   Routes[MICROCACHE_ROUTES];
+static int          NRoutes = 0;
+static FlightTable *Flights = NULL;
+
+/* Varying request headers that scripts see (see handle_cgi_request) */
+static const char *VaryHeaders[] = {"Accept-Encoding", "Accept-Language", NULL};
+
+/**
+ * Add microcached prefix.
+ *
+ * @param   spec        Route of the form /PREFIX=SECONDS.
+ * @return  -1 on error and 0 on success.
+ **/
+int microcache_add(const char *spec) {
+    if (NRoutes >= MICROCACHE_ROUTES) {
+        log("Too many microcache routes (max %d)", MICROCACHE_ROUTES);
+        return -1;
+    }
+
+    const char *equals = strchr(spec, '=');
+    char *end = NULL;
+    long  ttl = equals ? strtol(equals + 1, &end, 10) : -1;
+    if (!equals || equals == spec || spec[0] != '/' || !end || *end || end == equals + 1 || ttl < 0) {
+        log("Microcache route %s must be /PREFIX=SECONDS", spec);
+        return -1;
+    }
+
+    MicroRoute *route = &Routes[NRoutes++];
+    route->prefix        = strndup(spec, equals - spec);
+    route->prefix_length = equals - spec;
+    route->ttl           = ttl;
+    return route->prefix ? 0 : -1;
+}
+
+/**
+ * Create table of scripts being run.
+ *
+ * @return  -1 on error and 0 on success.
+ *
+ * This must be called after all routes are added and before workers are
+ * forked, so concurrent misses in any worker wait for the same run.
+ **/
+int microcache_init(void) {
+    if (NRoutes == 0) {
+        return 0;
+    }
+
+    FlightTable *table = mmap(NULL, sizeof(FlightTable), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (table == MAP_FAILED) {
+        log("Unable to map microcache: %s", strerror(errno));
+        return -1;
+    }
+
+    pthread_mutexattr_t attributes;
+    pthread_mutexattr_init(&attributes);
+    pthread_mutexattr_setpshared(&attributes, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attributes, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(&table->lock, &attributes);
+    pthread_mutexattr_destroy(&attributes);
+
+    pthread_condattr_t condition;
+    pthread_condattr_init(&condition);
+    pthread_condattr_setpshared(&condition, PTHREAD_PROCESS_SHARED);
+    pthread_condattr_setclock(&condition, CLOCK_MONOTONIC);
+    pthread_cond_init(&table->landed, &condition);
+    pthread_condattr_destroy(&condition);
+
+    Flights = table;
+    return 0;
+}
+
+/**
+ * Return whether any prefix is microcached.
+ **/
+bool microcache_enabled(void) {
+    return NRoutes > 0;
+}
+
+/**
+ * Find route with the longest prefix matching URI.
+ **/
+static MicroRoute *microcache_match(const char *uri) {
+    MicroRoute *best = NULL;
+
+    for (int i = 0; i < NRoutes; i++) {
+        MicroRoute *route = &Routes[i];
+        if (strncmp(uri, route->prefix, route->prefix_length) == 0 &&
+            (!best || route->prefix_length > best->prefix_length)) {
+            best = route;
+        }
+    }
+    return best;
+}
+
+/**
+ * Return current monotonic time in nanoseconds.
+ **/
+static uint64_t microcache_now(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+/**
+ * Format cache key: URI, query, and the varying headers.
+ *
+ * @return  Allocated key (NULL on error).
+ **/
+static char *microcache_key(Request *r) {
+    char  *key = NULL;
+    size_t length;
+    FILE  *stream = open_memstream(&key, &length);
+    if (!stream) {
+        return NULL;
+    }
+
+    fprintf(stream, "%s?%s", r->uri, r->query ? r->query : "");
+    for (const char **name = VaryHeaders; *name; name++) {
+        const char *value = request_header(r, *name);
+        fprintf(stream, "\n%s", value ? value : "");
+    }
+    fclose(stream);
+    return key;
+}
+
+/**
+ * Hash key the way the cache does, for the flight table.
+ **/
+static uint64_t microcache_hash(const VirtualHost *host, const char *key) {
+    uint64_t hash = 14695981039346656037ULL ^ host->id;
+    for (const char *c = key; *c; c++) {
+        hash = (hash ^ (unsigned char)*c) * 1099511628211ULL;
+    }
+    return hash ? hash : 1;
+}
+
+/**
+ * Determine how long output stays fresh from its status line and
+ * Cache-Control header.
+ *
+ * @param   output      Complete CGI output.
+ * @param   length      Length of output.
+ * @param   ttl         Route's default (returned if there is no header).
+ * @return  Seconds output stays fresh (0 if it must not be cached).
+ *
+ * Only 200 responses are cached, so an error a script reports once is not
+ * replayed for the rest of the TTL.
+ **/
+static int microcache_ttl(const char *output, size_t length, int ttl) {
+    const char *end = output + length;
+    const char *status = memchr(output, '\n', length);
+    size_t      status_length = status ? (size_t)(status - output) : length;
+    const char *code = status_length > 5 && strncmp(output, "HTTP/", 5) == 0 ? memchr(output, ' ', status_length) : NULL;
+
+    if (!code || output + status_length - code < 4 || strncmp(code + 1, "200", 3) != 0 ||
+        (output + status_length - code > 4 && !strchr(" \r", code[4]))) {
+        return 0;
+    }
+
+    for (const char *line = output; line < end; ) {
+        const char *next = memchr(line, '\n', end - line);
+        next = next ? next + 1 : end;
+        if (next - line <= 2 && (*line == '\n' || *line == '\r')) {
+            break;
+        }
+
+        if ((size_t)(next - line) > 14 && strncasecmp(line, "Cache-Control:", 14) == 0) {
+            char directives[BUFSIZ];
+            size_t n = next - line - 14 < sizeof(directives) - 1 ? (size_t)(next - line - 14) : sizeof(directives) - 1;
+            memcpy(directives, line + 14, n);
+            directives[n] = '\0';
+
+            int max_age = -1, shared_max_age = -1;
+            char *save = NULL;
+            for (char *d = strtok_r(directives, ", \t\r\n", &save); d; d = strtok_r(NULL, ", \t\r\n", &save)) {
+                if (strcasecmp(d, "no-store") == 0 || strcasecmp(d, "no-cache") == 0 || strcasecmp(d, "private") == 0) {
+                    return 0;
+                } else if (strncasecmp(d, "max-age=", 8) == 0) {
+                    max_age = atoi(d + 8);
+                } else if (strncasecmp(d, "s-maxage=", 9) == 0) {
+                    shared_max_age = atoi(d + 9);
+                }
+            }
+            if (shared_max_age >= 0) {
+                return shared_max_age;
+            }
+            if (max_age >= 0) {
+                return max_age;
+            }
+        }
+        line = next;
+    }
+    return ttl;
+}
+
+/**
+ * Lock flight table, recovering it if a worker died holding the lock.
+ **/
+static void flights_lock(void) {
+    if (pthread_mutex_lock(&Flights->lock) == EOWNERDEAD) {
+        pthread_mutex_consistent(&Flights->lock);
+    }
+}
+
+/**
+ * Wait for another worker running the same key, or claim the run.
+ *
+ * @param   hash        Hash of key.
+ * @return  Whether this worker claimed the run (and must call flight_land).
+ *
+ * Returns false without claiming when another worker ran the key (its output
+ * may now be cached), when the wait times out, or when the table is full.
+ **/
+static bool flight_board(uint64_t hash) {
+    if (!Flights) {
+        return false;
+    }
+
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += MICROCACHE_WAIT;
+
+    flights_lock();
+    bool waited = false;
+    while (true) {
+        Flight *found = NULL, *empty = NULL;
+        for (int i = 0; i < MICROCACHE_FLIGHTS; i++) {
+            Flight *f = &Flights->flights[i];
+            if (f->hash == hash) {
+                found = f;
+            } else if (!f->hash && !empty) {
+                empty = f;
+            }
+        }
+
+        /* A worker that died mid-run never lands */
+        if (found && kill(found->pid, 0) < 0 && errno == ESRCH) {
+            found->hash = 0;
+            found = NULL;
+        }
+
+        if (!found) {
+            if (waited || !empty) {
+                pthread_mutex_unlock(&Flights->lock);
+                return false;
+            }
+            empty->hash = hash;
+            empty->pid  = getpid();
+            pthread_mutex_unlock(&Flights->lock);
+            return true;
+        }
+
+        if (!waited) {
+            stats_coalesced();
+            waited = true;
+        }
+        int status = pthread_cond_timedwait(&Flights->landed, &Flights->lock, &deadline);
+        if (status == EOWNERDEAD) {
+            pthread_mutex_consistent(&Flights->lock);
+        } else if (status == ETIMEDOUT) {
+            pthread_mutex_unlock(&Flights->lock);
+            return false;
+        }
+    }
+}
+
+/**
+ * Finish run claimed by flight_board and wake its waiters.
+ **/
+static void flight_land(uint64_t hash) {
+    flights_lock();
+    for (int i = 0; i < MICROCACHE_FLIGHTS; i++) {
+        if (Flights->flights[i].hash == hash && Flights->flights[i].pid == getpid()) {
+            Flights->flights[i].hash = 0;
+        }
+    }
+    pthread_cond_broadcast(&Flights->landed);
+    pthread_mutex_unlock(&Flights->lock);
+}
+
+/**
+ * Answer from the cache if output is fresh.
+ *
+ * Output too large to cache leaves an entry of just its expiry time, which
+ * sets oversized: requests for it should run the script rather than wait on
+ * a run whose output they could not replay.
+ **/
+static bool microcache_replay(Request *r, const char *key, bool *oversized) {
+    const char *cached;
+    size_t      length;
+
+    if (!cache_lookup(CACHE_CGI, r->vhost, key, &cached, &length) || length < sizeof(uint64_t)) {
+        return false;
+    }
+
+    uint64_t expires;
+    memcpy(&expires, cached, sizeof(expires));
+    if (expires <= microcache_now()) {
+        return false;
+    }
+    if (length == sizeof(expires)) {
+        *oversized = true;
+        return false;
+    }
+
+    response_write(r->response, cached + sizeof(expires), length - sizeof(expires));
+    return true;
+}
+
+/**
+ * Return whether an entry of length bytes under key can be cached.
+ *
+ * Entries too large for the shared cache's biggest chunk class would be
+ * dropped there, leaving every worker waiting on the run to miss and run
+ * the script itself.
+ **/
+static bool microcache_fits(const char *key, size_t length) {
+    if (length > MICROCACHE_MAX) {
+        return false;
+    }
+    return !shmcache_enabled(CACHE_CGI) || shmcache_fits(key, length);
+}
+
+/**
+ * Run script, send its output, and cache it while fresh.
+ **/
+static Status microcache_run(Request *r, const char *key, int ttl) {
+    uint64_t generation = watch_generation(r->vhost);
+
+    /* Output is kept behind its expiry time, as it is cached */
+    char  *entry = NULL;
+    size_t length;
+    FILE  *capture = open_memstream(&entry, &length);
+    if (!capture) {
+        return handle_error(r, HTTP_STATUS_INTERNAL_SERVER_ERROR);
+    }
+
+    int exited = -1;
+    fwrite(&(uint64_t){0}, sizeof(uint64_t), 1, capture);
+    Status status = cgi_run(r, capture, &exited);
+    fclose(capture);
+    if (status != HTTP_STATUS_OK) {
+        free(entry);
+        return handle_error(r, status);
+    }
+
+    const char *output = entry + sizeof(uint64_t);
+    size_t      output_length = length - sizeof(uint64_t);
+    response_write(r->response, output, output_length);
+
+    /* Failed scripts are not cached; output too large is only marked as such */
+    ttl = microcache_ttl(output, output_length, ttl);
+    if (ttl > 0 && exited == 0 && output_length > 0) {
+        uint64_t expires = microcache_now() + (uint64_t)ttl * 1000000000ULL;
+        if (!microcache_fits(key, length)) {
+            char *marker = realloc(entry, sizeof(expires));
+            entry  = marker ? marker : entry;
+            length = sizeof(expires);
+        }
+        memcpy(entry, &expires, sizeof(expires));
+        cache_store(CACHE_CGI, r->vhost, key, generation, entry, length);
+    } else {
+        free(entry);
+    }
+    return HTTP_STATUS_OK;
+}
+
+/**
+ * Return route of a request whose output may be cached (NULL if none).
+ **/
+static MicroRoute *microcache_route(Request *r) {
+    MicroRoute *route = NRoutes ? microcache_match(r->uri) : NULL;
+    if (!route || !watch_enabled() || !(streq(r->method, "GET") || streq(r->method, "HEAD")) ||
+        request_header(r, "Authorization") || request_header(r, "Cookie")) {
+        return NULL;
+    }
+    return route;
+}
+
+/**
+ * Answer CGI request from the microcache if its output is fresh.
+ *
+ * @param   r           HTTP Request structure.
+ * @return  Whether the request was answered.
+ *
+ * This never runs or waits for the script, so the server loop can try it
+ * before handing the request to a CGI executor.
+ **/
+bool microcache_lookup(Request *r) {
+    char *key = microcache_route(r) ? microcache_key(r) : NULL;
+    bool  oversized = false;
+    bool  hit = key && microcache_replay(r, key, &oversized);
+    free(key);
+    return hit;
+}
+
+/**
+ * Answer CGI request from the microcache, or run the script once for every
+ * worker that wants the same output.
+ *
+ * @param   r           HTTP Request structure (CGI environment exported).
+ * @param   status      Set to status of the request when it was answered.
+ * @return  Whether the request was answered (false if it is not cacheable).
+ *
+ * Only GET and HEAD requests without credentials under a microcached prefix
+ * are considered.  Output is keyed by URI, query, and VaryHeaders, and stays
+ * fresh for the route's TTL unless its Cache-Control header says otherwise.
+ * Concurrent misses for the same key (in any worker) wait for one run and
+ * replay its output.
+ **/
+bool microcache_serve(Request *r, Status *status) {
+    MicroRoute *route = microcache_route(r);
+    if (!route) {
+        return false;
+    }
+
+    char *key = microcache_key(r);
+    if (!key) {
+        return false;
+    }
+
+    *status = HTTP_STATUS_OK;
+    bool oversized = false;
+    if (microcache_replay(r, key, &oversized)) {
+        free(key);
+        return true;
+    }
+
+    /* Wait for a run of the same key elsewhere, then try the cache again */
+    uint64_t hash = microcache_hash(r->vhost, key);
+    bool     claimed = !oversized && flight_board(hash);
+    if (!claimed && !oversized && microcache_replay(r, key, &oversized)) {
+        free(key);
+        return true;
+    }
+
+    *status = microcache_run(r, key, route->ttl);
+    if (claimed) {
+        flight_land(hash);
+    }
+    free(key);
+    return true;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,470 @@
+/* pack.c: Pack Document Root into Archive */
+
+#define _GNU_SOURCE
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <string.h>
+
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+
+/* Constants */
+
+#define PACK_BUCKET_SIZE    4           /* Average entries per perfect hash bucket */
+#define PACK_DEPTH          64          /* Deepest directory packed */
+#define PACK_SEEDS          (1U << 24)  /* Seeds tried per bucket before giving up */
+#define PACK_GZIP_MIN       256         /* Smallest body worth compressing */
+#define PACK_GZIP_RATIO     0.9         /* Largest compressed/identity size kept */
+
+/* Packed entry (before it has a slot) */
+
+typedef struct {
+    char         *uri;
+    uint64_t      hash;                 /*< Hash of URI with seed 0 */
+    ArchiveEntry  entry;
+} PackEntry;
+
+/* Pack State */
+
+static FILE       *Output;
+static uint64_t    Offset = 0;          /* Bytes written to Output */
+static PackEntry  *Packed = NULL;
+static size_t      NPacked = 0;
+static size_t      Capacity = 0;
+static VirtualHost Host;                /* Mimetypes of packed files */
+static bool        Gzip = true;
+static char        Root[PATH_MAX];
+static struct stat Visiting[PACK_DEPTH]; /* Directories being packed (to stop at link loops) */
+static size_t      NVisiting = 0;
+static size_t     *Sizes;               /* Keys per bucket (see compare_buckets) */
+static uint32_t    Buckets;
+
+/* Utilities */
+
+static void usage(const char *progname, int status) {
+    fprintf(stderr, "Usage: %s [options] ROOT ARCHIVE\n", progname);
+    fprintf(stderr, "Options:\n");
+    fprintf(stderr, "    -h            Display help message\n");
+    fprintf(stderr, "    -m path       Path to mimetypes file\n");
+    fprintf(stderr, "    -M mimetype   Default mimetype\n");
+    fprintf(stderr, "    -Z            Do not store gzip bodies\n");
+    fprintf(stderr, "\nThe archive is written beside ARCHIVE and renamed over it once complete.\n");
+    exit(status);
+}
+
+/**
+ * Append bytes to the archive.
+ *
+ * @return  Range of the bytes in the archive.
+ **/
+static ArchiveRange append(const void *data, size_t length) {
+    ArchiveRange range = {Offset, length};
+    if (length > 0 && fwrite(data, 1, length, Output) != length) {
+        fatal("Unable to write archive: %s", strerror(errno));
+    }
+    Offset += length;
+    return range;
+}
+
+/**
+ * Pad the archive to a multiple of alignment.
+ **/
+static void align(size_t alignment) {
+    static const char zeros[16];
+    append(zeros, (alignment - Offset % alignment) % alignment);
+}
+
+/**
+ * Append formatted text to the archive.
+ **/
+static ArchiveRange append_printf(const char *format, ...) __attribute__((format(printf, 1, 2)));
+static ArchiveRange append_printf(const char *format, ...) {
+    char   *text = NULL;
+    va_list args;
+
+    va_start(args, format);
+    int length = vasprintf(&text, format, args);
+    va_end(args);
+    if (length < 0) {
+        fatal("Unable to format archive: %s", strerror(errno));
+    }
+
+    ArchiveRange range = append(text, length);
+    free(text);
+    return range;
+}
+
+/**
+ * Compress body into gzip format.
+ *
+ * @return  Allocated gzip body (NULL if compressing does not pay off).
+ **/
+static char *gzip_body(const char *body, size_t length, size_t *compressed) {
+    if (!Gzip || length < PACK_GZIP_MIN) {
+        return NULL;
+    }
+
+    z_stream z = {0};
+    if (deflateInit2(&z, Z_BEST_COMPRESSION, Z_DEFLATED, 15 + 16, 9, Z_DEFAULT_STRATEGY) != Z_OK) {
+        return NULL;
+    }
+
+    size_t bound = deflateBound(&z, length);
+    char  *out = malloc(bound);
+    z.next_in   = (Bytef *)body;
+    z.avail_in  = length;
+    z.next_out  = (Bytef *)out;
+    z.avail_out = bound;
+    int status  = out ? deflate(&z, Z_FINISH) : Z_MEM_ERROR;
+    *compressed = z.total_out;
+    deflateEnd(&z);
+
+    if (status != Z_STREAM_END || *compressed > length * PACK_GZIP_RATIO) {
+        free(out);
+        return NULL;
+    }
+    return out;
+}
+
+/**
+ * Add URI with body to the archive.
+ *
+ * The response heads are prebuilt: Content-Length, a strong ETag per
+ * encoding, and (when there is a gzip body) Vary: Accept-Encoding.
+ **/
+static void pack_body(const char *uri, const char *mimetype, const char *body, size_t length) {
+    if (NPacked == Capacity) {
+        Capacity = Capacity ? Capacity * 2 : 256;
+        if (!(Packed = realloc(Packed, Capacity * sizeof(PackEntry)))) {
+            fatal("Unable to allocate entries: %s", strerror(errno));
+        }
+    }
+
+    PackEntry    *p = &Packed[NPacked++];
+    ArchiveEntry *e = &p->entry;
+    size_t        compressed = 0;
+    char         *gzip = gzip_body(body, length, &compressed);
+    const char   *vary = gzip ? "Vary: Accept-Encoding\r\n" : "";
+    uint64_t      etag = archive_hash(body, length, 0);
+
+    memset(e, 0, sizeof(ArchiveEntry));
+    p->uri  = strdup(uri);
+    p->hash = archive_hash(uri, strlen(uri), 0);
+    snprintf(e->etag, sizeof(e->etag), "\"%016llx\"", (unsigned long long)etag);
+    snprintf(e->gzip_etag, sizeof(e->gzip_etag), "\"%016llx-gz\"", (unsigned long long)etag);
+
+    e->uri  = append(uri, strlen(uri) + 1);
+    e->head = append_printf("HTTP/1.0 200 OK\r\nContent-Type: %s\r\nContent-Length: %zu\r\nETag: %s\r\n%s\r\n",
+                            mimetype, length, e->etag, vary);
+    e->body = append(body, length);
+    e->not_modified = append_printf("HTTP/1.0 304 Not Modified\r\nETag: %s\r\n%s\r\n", e->etag, vary);
+
+    if (gzip) {
+        e->gzip_head = append_printf("HTTP/1.0 200 OK\r\nContent-Type: %s\r\nContent-Encoding: gzip\r\nContent-Length: %zu\r\nETag: %s\r\n%s\r\n",
+                                     mimetype, compressed, e->gzip_etag, vary);
+        e->gzip_body = append(gzip, compressed);
+        e->gzip_not_modified = append_printf("HTTP/1.0 304 Not Modified\r\nETag: %s\r\n%s\r\n", e->gzip_etag, vary);
+        free(gzip);
+    }
+}
+
+/**
+ * Add file to the archive.
+ **/
+static void pack_file(const char *uri, const char *path, const struct stat *s) {
+    int   fd = open(path, O_RDONLY | O_CLOEXEC);
+    char *body = malloc(s->st_size + 1);
+    if (fd < 0 || !body) {
+        fatal("Unable to read %s: %s", path, strerror(errno));
+    }
+
+    size_t length = 0;
+    while (length < (size_t)s->st_size) {
+        ssize_t n = read(fd, body + length, s->st_size - length);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            fatal("Unable to read %s: %s", path, n < 0 ? strerror(errno) : "file shrank");
+        }
+        length += n;
+    }
+    close(fd);
+
+    char *mimetype = determine_mimetype(&Host, path);
+    pack_body(uri, mimetype, body, length);
+    free(mimetype);
+    free(body);
+}
+
+/**
+ * Resolve directory entry the way the server resolves it.
+ *
+ * Symbolic links are followed as long as they stay beneath the root.
+ *
+ * @return  Whether the entry is packed (a directory or readable file) or left
+ * to the server's filesystem handlers (a CGI script).
+ **/
+static bool pack_resolve(const char *child, char *real, struct stat *s) {
+    if (!realpath(child, real) || stat(real, s) < 0 ||
+        strncmp(real, Root, strlen(Root)) != 0 || (real[strlen(Root)] != '/' && real[strlen(Root)] != '\0')) {
+        log("Skipping %s: not beneath root", child);
+        return false;
+    }
+    if (S_ISDIR(s->st_mode)) {
+        return true;
+    }
+    if (!S_ISREG(s->st_mode)) {
+        log("Skipping %s: not a regular file", child);
+        return false;
+    }
+    if (access(real, X_OK) == 0) {
+        log("Leaving %s: CGI scripts run from the filesystem", child);
+        return true;
+    }
+    if (access(real, R_OK) < 0) {
+        log("Skipping %s: not readable", child);
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Add directory (its listing, then everything beneath it) to the archive.
+ *
+ * Entries that the server could not serve are left out of the listing;
+ * executables (CGI scripts, which need the filesystem) are listed but not
+ * packed, since the server falls back to the filesystem for URIs the archive
+ * does not hold.
+ **/
+static void pack_directory(const char *uri, const char *path, const struct stat *s) {
+    for (size_t i = 0; i < NVisiting; i++) {
+        if (Visiting[i].st_dev == s->st_dev && Visiting[i].st_ino == s->st_ino) {
+            log("Skipping %s: links back to %s", path, uri);
+            return;
+        }
+    }
+    if (NVisiting == PACK_DEPTH) {
+        log("Skipping %s: nested too deeply", path);
+        return;
+    }
+    Visiting[NVisiting++] = *s;
+
+    struct dirent **entries;
+    int n = scandir(path, &entries, 0, alphasort);
+    if (n < 0) {
+        fatal("Unable to scan %s: %s", path, strerror(errno));
+    }
+
+    /* Keep only the entries that are served */
+    int kept = 0;
+    for (int i = 0; i < n; i++) {
+        const char *name = entries[i]->d_name;
+        char        child[PATH_MAX], real[PATH_MAX];
+        struct stat s;
+
+        if (streq(name, ".") || streq(name, "..") ||
+            (snprintf(child, sizeof(child), "%s/%s", path, name) < (int)sizeof(child) && pack_resolve(child, real, &s))) {
+            entries[kept++] = entries[i];
+        } else {
+            free(entries[i]);
+        }
+    }
+
+    /* Listing is rendered as handle_browse_request would */
+    char  *listing = NULL;
+    size_t length = 0;
+    FILE  *capture = open_memstream(&listing, &length);
+    if (!capture) {
+        fatal("Unable to render listing: %s", strerror(errno));
+    }
+    render_listing(capture, uri, entries, kept);
+    fclose(capture);
+    pack_body(uri, "text/html", listing, length);
+    free(listing);
+
+    for (int i = 0; i < kept; i++) {
+        const char *name = entries[i]->d_name;
+        char        child[PATH_MAX], real[PATH_MAX], child_uri[PATH_MAX];
+        struct stat s;
+
+        if (streq(name, ".") || streq(name, "..") ||
+            snprintf(child, sizeof(child), "%s/%s", path, name) >= (int)sizeof(child) ||
+            snprintf(child_uri, sizeof(child_uri), "%s%s%s", uri, streq(uri, "/") ? "" : "/", name) >= (int)sizeof(child_uri) ||
+            !realpath(child, real) || stat(real, &s) < 0) {
+            free(entries[i]);
+            continue;
+        }
+        free(entries[i]);
+
+        if (S_ISDIR(s.st_mode)) {
+            pack_directory(child_uri, real, &s);
+        } else if (access(real, X_OK) < 0) {
+            pack_file(child_uri, real, &s);
+        }
+    }
+    free(entries);
+    NVisiting--;
+}
+
+/**
+ * Order packed entries by the size of their bucket (largest first), then by
+ * bucket.
+ **/
+static int compare_buckets(const void *a, const void *b) {
+    size_t x = Packed[*(const size_t *)a].hash % Buckets;
+    size_t y = Packed[*(const size_t *)b].hash % Buckets;
+
+    if (Sizes[x] != Sizes[y]) {
+        return Sizes[x] > Sizes[y] ? -1 : 1;
+    }
+    return x < y ? -1 : x > y;
+}
+
+/**
+ * Build perfect hash and write seeds and entries.
+ *
+ * Keys are spread over buckets by their seed 0 hash; each bucket (largest
+ * first) then gets the first seed that sends all of its keys to free slots,
+ * so a lookup is one seed read and one entry probe.
+ **/
+static void pack_index(ArchiveHeader *header) {
+    uint32_t  count   = NPacked;
+    uint32_t  buckets = (count + PACK_BUCKET_SIZE - 1) / PACK_BUCKET_SIZE;
+    uint32_t *seeds   = calloc(buckets, sizeof(uint32_t));
+    size_t   *sizes   = calloc(buckets, sizeof(size_t));
+    size_t   *order   = calloc(count, sizeof(size_t));
+    size_t   *slots   = calloc(count, sizeof(size_t));
+    bool     *taken   = calloc(count, sizeof(bool));
+    ArchiveEntry *table = calloc(count, sizeof(ArchiveEntry));
+    if (!seeds || !sizes || !order || !slots || !taken || !table) {
+        fatal("Unable to allocate index: %s", strerror(errno));
+    }
+
+    /* Order keys by bucket size (largest first), then by bucket */
+    for (size_t i = 0; i < count; i++) {
+        sizes[Packed[i].hash % buckets]++;
+        order[i] = i;
+    }
+    Sizes   = sizes;
+    Buckets = buckets;
+    qsort(order, count, sizeof(size_t), compare_buckets);
+
+    for (size_t start = 0; start < count;) {
+        size_t bucket = Packed[order[start]].hash % buckets;
+        size_t end = start + sizes[bucket];
+
+        uint32_t seed;
+        for (seed = 1; seed < PACK_SEEDS; seed++) {
+            size_t i;
+            for (i = start; i < end; i++) {
+                PackEntry *p = &Packed[order[i]];
+                slots[i] = archive_hash(p->uri, strlen(p->uri), seed) % count;
+                bool clash = taken[slots[i]];
+                for (size_t j = start; j < i && !clash; j++) {
+                    clash = slots[j] == slots[i];
+                }
+                if (clash) {
+                    break;
+                }
+            }
+            if (i == end) {
+                break;
+            }
+        }
+        if (seed == PACK_SEEDS) {
+            fatal("Unable to build perfect hash");
+        }
+
+        seeds[bucket] = seed;
+        for (size_t i = start; i < end; i++) {
+            taken[slots[i]] = true;
+            table[slots[i]] = Packed[order[i]].entry;
+        }
+        start = end;
+    }
+
+    align(sizeof(uint64_t));
+    header->count   = count;
+    header->buckets = buckets;
+    header->seeds   = append(seeds, buckets * sizeof(uint32_t)).offset;
+    align(sizeof(uint64_t));
+    header->entries = append(table, count * sizeof(ArchiveEntry)).offset;
+
+    free(seeds);
+    free(sizes);
+    free(order);
+    free(slots);
+    free(taken);
+    free(table);
+}
+
+/**
+ * Pack document root into an archive for spidey -A.
+ **/
+int main(int argc, char *argv[]) {
+    int argind = 1;
+    while (argind < argc && strlen(argv[argind]) > 1 && argv[argind][0] == '-') {
+        char *arg = argv[argind++];
+        if (arg[1] != 'h' && arg[1] != 'Z' && argind >= argc) {
+            usage(argv[0], EXIT_FAILURE);
+        }
+        switch (arg[1]) {
+            case 'm': MimeTypesPath   = argv[argind++]; break;
+            case 'M': DefaultMimeType = argv[argind++]; break;
+            case 'Z': Gzip            = false; break;
+            case 'h': usage(argv[0], EXIT_SUCCESS); break;
+            default:  usage(argv[0], EXIT_FAILURE); break;
+        }
+    }
+    if (argc - argind != 2) {
+        usage(argv[0], EXIT_FAILURE);
+    }
+
+    if (!realpath(argv[argind], Root)) {
+        fatal("Unable to resolve root %s: %s", argv[argind], strerror(errno));
+    }
+    Host.default_mimetype = DefaultMimeType;
+    Host.mimetypes_path   = MimeTypesPath;
+
+    /* Written beside the archive, so the rename is atomic */
+    char *target = argv[argind + 1];
+    char  temporary[PATH_MAX];
+    snprintf(temporary, sizeof(temporary), "%s.%d", target, getpid());
+    if (!(Output = fopen(temporary, "w"))) {
+        fatal("Unable to create %s: %s", temporary, strerror(errno));
+    }
+
+    ArchiveHeader header = {.version = ARCHIVE_VERSION};
+    memcpy(header.magic, ARCHIVE_MAGIC, sizeof(header.magic));
+    append(&header, sizeof(header));
+
+    struct stat s;
+    if (stat(Root, &s) < 0 || !S_ISDIR(s.st_mode)) {
+        fatal("Root %s is not a directory", Root);
+    }
+    pack_directory("/", Root, &s);
+    pack_index(&header);
+
+    header.size = Offset;
+    if (fseek(Output, 0, SEEK_SET) < 0 || fwrite(&header, sizeof(header), 1, Output) != 1 ||
+        fflush(Output) != 0 || fsync(fileno(Output)) < 0 || fclose(Output) != 0) {
+        unlink(temporary);
+        fatal("Unable to write %s: %s", temporary, strerror(errno));
+    }
+    if (rename(temporary, target) < 0) {
+        unlink(temporary);
+        fatal("Unable to rename %s to %s: %s", temporary, target, strerror(errno));
+    }
+
+    printf("Packed %zu entries (%llu bytes) into %s\n", NPacked, (unsigned long long)Offset, target);
+    return EXIT_SUCCESS;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
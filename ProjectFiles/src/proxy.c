@@ -0,0 +1,693 @@
+/* proxy.c: Reverse Proxy Handler */
+
+#define _GNU_SOURCE
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <strings.h>
+
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+/* Internal Declarations */
+Status handle_error(Request *request, Status status);
+
+/* Constants */
+
+#define PROXY_ROUTES        16          /* Largest number of routes */
+#define PROXY_UPSTREAMS     64          /* Largest number of upstreams (all routes) */
+#define PROXY_POOL          16          /* Idle connections kept per upstream per worker */
+#define PROXY_HEADER_MAX    (16*1024)   /* Largest upstream response header */
+#define PROXY_PIPE_SIZE     (64*1024)   /* Bytes moved per splice */
+#define PROXY_TIMEOUT       30          /* Upstream I/O timeout (seconds) */
+#define PROXY_CONNECT_MS    1000        /* Connect and health check timeout */
+#define PROXY_HEALTH_MS     2000        /* Health check interval */
+
+/* Upstream */
+
+typedef struct {
+    _Atomic bool     healthy;           /*< Passed last health check */
+    _Atomic long     active;            /*< Requests in flight (all workers) */
+    _Atomic unsigned long failures;     /*< Connection failures */
+} UpstreamState;
+
+typedef struct {
+    char                    name[NI_MAXHOST + NI_MAXSERV]; /*< host:port as configured */
+    struct sockaddr_storage addr;       /*< Resolved address */
+    socklen_t               addrlen;    /*< Address length */
+    UpstreamState          *state;      /*< Shared with forked workers */
+    int                     idle[PROXY_POOL]; /*< Idle keep-alive connections (this worker) */
+    int                     nidle;      /*< Number of idle connections */
+} Upstream;
+
+/* Route */
+
+struct ProxyRoute {
+    char           *prefix;             /*< URI prefix forwarded by this route */
+    size_t          prefix_length;      /*< Length of prefix */
+    Upstream       *upstreams[PROXY_UPSTREAMS]; /*< Upstreams serving route */
+    int             nupstreams;         /*< Number of upstreams */
+    _Atomic unsigned long *next;        /*< Round-robin counter (shared) */
+};
+
+/* Proxy State */
+
+static ProxyRoute     Routes[PROXY_ROUTES];
+static int            NRoutes = 0;
+static Upstream       Upstreams[PROXY_UPSTREAMS];
+static int            NUpstreams = 0;
+static ProxyBalance   Balance = PROXY_ROUND_ROBIN;
+static int            Pipe[2] = {-1, -1}; /* Splice pipe (this worker) */
+static pid_t          PipeOwner = 0;
+
+/* Upstream Functions */
+
+/**
+ * Resolve and add upstream (or return existing one with the same name).
+ **/
+static Upstream *upstream_add(const char *name) {
+    for (int i = 0; i < NUpstreams; i++) {
+        if (streq(Upstreams[i].name, name)) {
+            return &Upstreams[i];
+        }
+    }
+
+    if (NUpstreams >= PROXY_UPSTREAMS) {
+        log("Too many upstreams (max %d)", PROXY_UPSTREAMS);
+        return NULL;
+    }
+
+    char host[NI_MAXHOST];
+    const char *port = strrchr(name, ':');
+    if (!port || port == name || (size_t)(port - name) >= sizeof(host)) {
+        log("Upstream %s must be HOST:PORT", name);
+        return NULL;
+    }
+    memcpy(host, name, port - name);
+    host[port - name] = '\0';
+    port++;
+
+    /* Allow [::1]:8080 */
+    char *h = host;
+    if (h[0] == '[' && h[strlen(h) - 1] == ']') {
+        h[strlen(h) - 1] = '\0';
+        h++;
+    }
+
+    struct addrinfo hints = {
+        .ai_family   = AF_UNSPEC,
+        .ai_socktype = SOCK_STREAM,
+    };
+    struct addrinfo *results;
+    int status;
+    if ((status = getaddrinfo(h, port, &hints, &results)) != 0) {
+        log("Unable to resolve upstream %s: %s", name, gai_strerror(status));
+        return NULL;
+    }
+
+    Upstream *u = &Upstreams[NUpstreams++];
+    snprintf(u->name, sizeof(u->name), "%s", name);
+    memcpy(&u->addr, results->ai_addr, results->ai_addrlen);
+    u->addrlen = results->ai_addrlen;
+    freeaddrinfo(results);
+    return u;
+}
+
+/**
+ * Connect to upstream, waiting at most PROXY_CONNECT_MS.
+ *
+ * @return  Connected blocking socket with I/O timeouts set, or -1 on error.
+ **/
+static int upstream_connect(Upstream *u) {
+    int fd = socket(u->addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return -1;
+    }
+
+    if (connect(fd, (struct sockaddr *)&u->addr, u->addrlen) < 0) {
+        struct pollfd p = {.fd = fd, .events = POLLOUT};
+        int error = 0;
+        socklen_t length = sizeof(error);
+        if (errno != EINPROGRESS || poll(&p, 1, PROXY_CONNECT_MS) != 1 ||
+            getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &length) < 0 || error) {
+            close(fd);
+            errno = error ? error : (errno == EINPROGRESS ? ETIMEDOUT : errno);
+            return -1;
+        }
+    }
+
+    struct timeval timeout = {.tv_sec = PROXY_TIMEOUT};
+    int one = 1;
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return fd;
+}
+
+/**
+ * Take connection to upstream from this worker's pool, or open a new one.
+ *
+ * @param   u           Upstream.
+ * @param   pooled      Set to whether the connection came from the pool.
+ * @return  Connected socket or -1 on error.
+ **/
+static int upstream_acquire(Upstream *u, bool *pooled) {
+    while (u->nidle > 0) {
+        int fd = u->idle[--u->nidle];
+        char byte;
+
+        /* Idle connections must have nothing to read; EOF or data means stale */
+        ssize_t n = recv(fd, &byte, 1, MSG_PEEK | MSG_DONTWAIT);
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            *pooled = true;
+            return fd;
+        }
+        close(fd);
+    }
+
+    *pooled = false;
+    int fd = upstream_connect(u);
+    if (fd < 0) {
+        atomic_fetch_add(&u->state->failures, 1);
+        atomic_store(&u->state->healthy, false);
+        log("Unable to connect to upstream %s: %s", u->name, strerror(errno));
+    }
+    return fd;
+}
+
+/**
+ * Return connection to this worker's pool (or close it if the pool is full).
+ **/
+static void upstream_release(Upstream *u, int fd, bool reusable) {
+    if (reusable && u->nidle < PROXY_POOL) {
+        u->idle[u->nidle++] = fd;
+    } else {
+        close(fd);
+    }
+}
+
+/**
+ * Choose healthy upstream for route.
+ **/
+static Upstream *route_choose(ProxyRoute *route) {
+    Upstream *best = NULL;
+
+    if (Balance == PROXY_LEAST_CONNECTIONS) {
+        long fewest = 0;
+        for (int i = 0; i < route->nupstreams; i++) {
+            Upstream *u = route->upstreams[i];
+            long active = atomic_load(&u->state->active);
+            if (atomic_load(&u->state->healthy) && (!best || active < fewest)) {
+                best   = u;
+                fewest = active;
+            }
+        }
+    } else {
+        unsigned long start = atomic_fetch_add(route->next, 1);
+        for (int i = 0; i < route->nupstreams && !best; i++) {
+            Upstream *u = route->upstreams[(start + i) % route->nupstreams];
+            if (atomic_load(&u->state->healthy)) {
+                best = u;
+            }
+        }
+    }
+
+    /* If everything looks down, try anyway rather than failing outright */
+    if (!best) {
+        best = route->upstreams[atomic_fetch_add(route->next, 1) % route->nupstreams];
+    }
+    return best;
+}
+
+/**
+ * Periodically mark upstreams healthy or unhealthy by connecting to them.
+ **/
+static void *health_thread(void *arg) {
+    while (true) {
+        for (int i = 0; i < NUpstreams; i++) {
+            Upstream *u = &Upstreams[i];
+            int fd = upstream_connect(u);
+            bool healthy = fd >= 0;
+            if (healthy != atomic_exchange(&u->state->healthy, healthy)) {
+                log("Upstream %s is %s", u->name, healthy ? "up" : "down");
+            }
+            if (fd >= 0) {
+                close(fd);
+            }
+        }
+        usleep(PROXY_HEALTH_MS * 1000);
+    }
+    return NULL;
+}
+
+/* I/O Functions */
+
+static int write_all(int fd, const char *buffer, size_t size) {
+    while (size > 0) {
+        ssize_t n = send(fd, buffer, size, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        buffer += n;
+        size   -= n;
+    }
+    return 0;
+}
+
+/**
+ * Move bytes between sockets through this worker's pipe without copying them
+ * into user space.
+ *
+ * @param   src         Source socket.
+ * @param   dst         Destination socket.
+ * @param   length      Bytes to move (-1 for until EOF on src).
+ * @return  Bytes moved, or -1 on error.
+ **/
+static long long splice_all(int src, int dst, long long length) {
+    long long moved = 0;
+
+    if (PipeOwner != getpid()) {
+        /* Forked workers must not share the parent's pipe */
+        if (Pipe[0] >= 0 && PipeOwner) {
+            close(Pipe[0]);
+            close(Pipe[1]);
+        }
+        if (pipe2(Pipe, O_CLOEXEC) < 0) {
+            return -1;
+        }
+        fcntl(Pipe[1], F_SETPIPE_SZ, PROXY_PIPE_SIZE);
+        PipeOwner = getpid();
+    }
+
+    while (length < 0 || moved < length) {
+        size_t want = PROXY_PIPE_SIZE;
+        if (length >= 0 && length - moved < (long long)want) {
+            want = length - moved;
+        }
+
+        ssize_t n = splice(src, NULL, Pipe[1], NULL, want, SPLICE_F_MOVE | SPLICE_F_MORE);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return (n == 0 && length < 0) ? moved : -1;
+        }
+
+        for (ssize_t left = n; left > 0; ) {
+            ssize_t m = splice(Pipe[0], NULL, dst, NULL, left, SPLICE_F_MOVE | SPLICE_F_MORE);
+            if (m < 0 && errno == EINTR) {
+                continue;
+            }
+            if (m <= 0) {
+                /* Drain pipe so the next transfer starts clean */
+                char discard[BUFSIZ];
+                while (left > 0 && (m = read(Pipe[0], discard, left < BUFSIZ ? left : BUFSIZ)) > 0) {
+                    left -= m;
+                }
+                return -1;
+            }
+            left -= m;
+        }
+        moved += n;
+    }
+    return moved;
+}
+
+/**
+ * Determine whether header line is hop-by-hop (not forwarded).
+ **/
+static bool hop_by_hop(const char *name, size_t length) {
+    static const char *Names[] = {"Connection", "Keep-Alive", "Proxy-Connection", "Transfer-Encoding", "Upgrade"};
+    for (size_t i = 0; i < sizeof(Names)/sizeof(Names[0]); i++) {
+        if (strlen(Names[i]) == length && strncasecmp(Names[i], name, length) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Send request line and headers to upstream.
+ **/
+static int send_request_head(Request *r, int fd) {
+    char   buffer[PROXY_HEADER_MAX];
+    size_t n = 0;
+    int    w;
+
+    w = snprintf(buffer, sizeof(buffer), "%s %s%s%s HTTP/1.0\r\n", r->method, r->uri, r->query[0] ? "?" : "", r->query);
+    if (w < 0 || (size_t)w >= sizeof(buffer)) {
+        return -1;
+    }
+    n = w;
+
+    for (Header *h = r->headers; h; h = h->next) {
+        if (!h->name || hop_by_hop(h->name, strlen(h->name)) || strcasecmp(h->name, "X-Forwarded-For") == 0) {
+            continue;
+        }
+        w = snprintf(buffer + n, sizeof(buffer) - n, "%s: %s\r\n", h->name, h->data);
+        if (w < 0 || (size_t)w >= sizeof(buffer) - n) {
+            return -1;
+        }
+        n += w;
+    }
+
+    const char *forwarded = request_header(r, "X-Forwarded-For");
+    w = snprintf(buffer + n, sizeof(buffer) - n, "X-Forwarded-For: %s%s%s\r\nConnection: keep-alive\r\n\r\n",
+        forwarded ? forwarded : "", forwarded ? ", " : "", request_host(r));
+    if (w < 0 || (size_t)w >= sizeof(buffer) - n) {
+        return -1;
+    }
+    n += w;
+
+    return write_all(fd, buffer, n);
+}
+
+/**
+ * Forward request body (Content-Length bytes) from client to upstream.
+ *
+ * Bytes stdio has already buffered are written first; the rest is spliced
+ * straight from the client socket.
+ **/
+static int send_request_body(Request *r, int fd) {
+    const char *header = request_header(r, "Content-Length");
+    long long length = header ? strtoll(header, NULL, 10) : 0;
+    if (length <= 0) {
+        return 0;
+    }
+
+    char buffer[BUFSIZ];
+    size_t buffered = request_buffered(r);
+    while (buffered > 0 && length > 0) {
+        size_t want = buffered < sizeof(buffer) ? buffered : sizeof(buffer);
+        want = (long long)want < length ? want : (size_t)length;
+        size_t n = fread(buffer, 1, want, r->stream);
+        if (n == 0 || write_all(fd, buffer, n) < 0) {
+            return -1;
+        }
+        buffered -= n;
+        length   -= n;
+    }
+
+    return (length == 0 || splice_all(r->fd, fd, length) == length) ? 0 : -1;
+}
+
+/**
+ * Read response head from upstream and forward it to the client.
+ *
+ * @param   r           HTTP Request structure.
+ * @param   fd          Upstream socket.
+ * @param   length      Set to body length (-1 if until EOF).
+ * @param   reusable    Set to whether upstream will keep the connection open.
+ * @return  Bytes read from upstream, or -1 on error.
+ **/
+static ssize_t forward_response_head(Request *r, int fd, long long *length, bool *reusable) {
+    char   buffer[PROXY_HEADER_MAX];
+    char   head[PROXY_HEADER_MAX + 32];
+    size_t nread = 0;
+    char  *end   = NULL;
+
+    /* Read until end of headers (may include the start of the body) */
+    while (!end) {
+        if (nread == sizeof(buffer) - 1) {
+            return -1;
+        }
+        ssize_t n = recv(fd, buffer + nread, sizeof(buffer) - 1 - nread, 0);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return nread > 0 ? -1 : n;
+        }
+        nread += n;
+        buffer[nread] = '\0';
+        end = strstr(buffer, "\r\n\r\n");
+    }
+    end += 4;
+
+    /* Rewrite hop-by-hop headers; the client connection always closes */
+    int    status = atoi(strchr(buffer, ' ') ? strchr(buffer, ' ') + 1 : "0");
+    bool   http11 = strncmp(buffer, "HTTP/1.1", 8) == 0;
+    bool   keepalive = http11, chunked = false;
+    size_t n = 0;
+
+    *length = -1;
+    for (char *line = buffer; line < end - 2; ) {
+        char *next = strstr(line, "\r\n") + 2;
+        char *colon = memchr(line, ':', next - line);
+
+        if (line != buffer && colon) {
+            size_t name_length = colon - line;
+            char  *value = colon + 1;
+            while (*value == ' ' || *value == '\t') {
+                value++;
+            }
+
+            if (name_length == 14 && strncasecmp(line, "Content-Length", 14) == 0) {
+                *length = strtoll(value, NULL, 10);
+            } else if (name_length == 10 && strncasecmp(line, "Connection", 10) == 0) {
+                keepalive = strncasecmp(value, "keep-alive", 10) == 0 || (http11 && strncasecmp(value, "close", 5) != 0);
+            } else if (name_length == 17 && strncasecmp(line, "Transfer-Encoding", 17) == 0) {
+                chunked = true;
+            }
+
+            /* Chunked bodies are passed through untouched, so keep that header */
+            if (hop_by_hop(line, name_length) && !(name_length == 17 && strncasecmp(line, "Transfer-Encoding", 17) == 0)) {
+                line = next;
+                continue;
+            }
+        }
+
+        memcpy(head + n, line, next - line);
+        n += next - line;
+        line = next;
+    }
+    n += snprintf(head + n, sizeof(head) - n, "Connection: close\r\n\r\n");
+
+    /* Responses without bodies */
+    if (streq(r->method, "HEAD") || (status >= 100 && status < 200) || status == 204 || status == 304) {
+        *length = 0;
+    }
+    if (chunked && *length != 0) {
+        *length = -1;
+    }
+    *reusable = keepalive && *length >= 0;
+
+    /* Send head and whatever part of the body arrived with it */
+    size_t body = nread - (end - buffer);
+    if ((long long)body > *length && *length >= 0) {
+        body = *length;
+        *reusable = false;
+    }
+    if (write_all(r->fd, head, n) < 0 || write_all(r->fd, end, body) < 0) {
+        return -1;
+    }
+    r->nwritten += n + body;
+    r->trace.writes += 2;
+    trace_point(&r->trace, TRACE_FIRST_WRITE);
+
+    if (*length >= 0) {
+        *length -= body;
+    }
+    return nread;
+}
+
+/* Public Functions */
+
+/**
+ * Add proxy route.
+ *
+ * @param   spec        Route of the form PREFIX=HOST:PORT[,HOST:PORT...].
+ * @return  -1 on error and 0 on success.
+ *
+ * Requests whose URI begins with PREFIX are forwarded to one of the upstreams.
+ **/
+int proxy_add(const char *spec) {
+    if (NRoutes >= PROXY_ROUTES) {
+        log("Too many proxy routes (max %d)", PROXY_ROUTES);
+        return -1;
+    }
+
+    const char *equals = strchr(spec, '=');
+    if (!equals || equals == spec || spec[0] != '/') {
+        log("Proxy route %s must be /PREFIX=HOST:PORT[,HOST:PORT...]", spec);
+        return -1;
+    }
+
+    ProxyRoute *route = &Routes[NRoutes];
+    route->prefix        = strndup(spec, equals - spec);
+    route->prefix_length = equals - spec;
+
+    char *upstreams = strdup(equals + 1);
+    char *save      = NULL;
+    for (char *name = strtok_r(upstreams, ",", &save); name; name = strtok_r(NULL, ",", &save)) {
+        Upstream *u = upstream_add(name);
+        if (!u || route->nupstreams >= PROXY_UPSTREAMS) {
+            free(upstreams);
+            return -1;
+        }
+        route->upstreams[route->nupstreams++] = u;
+    }
+    free(upstreams);
+
+    if (route->nupstreams == 0) {
+        log("Proxy route %s has no upstreams", route->prefix);
+        return -1;
+    }
+
+    NRoutes++;
+    return 0;
+}
+
+/**
+ * Start reverse proxy.
+ *
+ * @param   balance     How to choose among a route's upstreams.
+ * @return  -1 on error and 0 on success.
+ *
+ * Upstream health and in-flight counts live in shared memory so forked
+ * workers balance with the same view; connection pools are per worker.  This
+ * must be called after all routes are added and before workers are forked.
+ **/
+int proxy_init(ProxyBalance balance) {
+    if (NRoutes == 0) {
+        return 0;
+    }
+
+    size_t size = NUpstreams * sizeof(UpstreamState) + NRoutes * sizeof(_Atomic unsigned long);
+    char *shared = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (shared == MAP_FAILED) {
+        return -1;
+    }
+
+    for (int i = 0; i < NUpstreams; i++) {
+        Upstreams[i].state = (UpstreamState *)shared + i;
+        atomic_init(&Upstreams[i].state->healthy, true);
+    }
+    for (int i = 0; i < NRoutes; i++) {
+        Routes[i].next = (_Atomic unsigned long *)(shared + NUpstreams * sizeof(UpstreamState)) + i;
+    }
+    Balance = balance;
+
+    /* Upstreams may hang up on us mid-transfer */
+    signal(SIGPIPE, SIG_IGN);
+
+    pthread_t thread;
+    if ((errno = pthread_create(&thread, NULL, health_thread, NULL)) != 0) {
+        return -1;
+    }
+    pthread_detach(thread);
+    return 0;
+}
+
+/**
+ * Find route with the longest prefix matching URI.
+ **/
+ProxyRoute *proxy_match(const char *uri) {
+    ProxyRoute *best = NULL;
+    for (int i = 0; i < NRoutes; i++) {
+        ProxyRoute *route = &Routes[i];
+        if (strncmp(uri, route->prefix, route->prefix_length) == 0 &&
+            (!best || route->prefix_length > best->prefix_length)) {
+            best = route;
+        }
+    }
+    return best;
+}
+
+/**
+ * Handle proxy request.
+ *
+ * @param   r           HTTP Request structure.
+ * @param   route       Matching proxy route.
+ * @return  Status of the HTTP proxy request.
+ *
+ * The request head is rewritten and sent to an upstream chosen by the
+ * balancing policy; bodies are moved with splice(2) in both directions.  The
+ * response is written directly to the client socket.  If a pooled connection
+ * turns out to be dead before any response arrives, the request is retried
+ * once on a fresh connection (bodiless requests only).
+ *
+ * Servers that answer requests one after another hand the request to an
+ * executor (see executor_detach), so a slow upstream or client holds up only
+ * that request.
+ *
+ * If no upstream can be reached, then handle error with
+ * HTTP_STATUS_BAD_GATEWAY.
+ **/
+Status handle_proxy_request(Request *r, ProxyRoute *route) {
+    /* Requests without a client socket (HTTP/2 streams) cannot be spliced */
+    if (r->fd < 0) {
+        return handle_error(r, HTTP_STATUS_BAD_GATEWAY);
+    }
+
+    /* Let an executor wait on the upstream if the server loop would */
+    if (executor_detach(r)) {
+        return HTTP_STATUS_OK;
+    }
+
+    Upstream *u = route_choose(route);
+    bool      has_body = request_header(r, "Content-Length") != NULL;
+
+    /* Anything already written must precede the response */
+    response_flush(r->response);
+
+    for (int attempt = 0; attempt < 2; attempt++) {
+        bool pooled;
+        int  fd = upstream_acquire(u, &pooled);
+        if (fd < 0) {
+            /* The failed upstream is now marked down, so this picks another */
+            Upstream *next = route_choose(route);
+            if (attempt == 0 && next != u) {
+                u = next;
+                continue;
+            }
+            return handle_error(r, HTTP_STATUS_BAD_GATEWAY);
+        }
+
+        atomic_fetch_add(&u->state->active, 1);
+        long long length   = -1;
+        bool      reusable = false;
+        ssize_t   nread    = -1;
+        if (send_request_head(r, fd) == 0 && send_request_body(r, fd) == 0) {
+            nread = forward_response_head(r, fd, &length, &reusable);
+        }
+
+        if (nread <= 0) {
+            atomic_fetch_sub(&u->state->active, 1);
+            close(fd);
+            if (nread == 0 && pooled && !has_body) {
+                debug("Pooled connection to %s went stale; retrying", u->name);
+                continue;
+            }
+            log("Upstream %s failed: %s", u->name, nread == 0 ? "connection closed" : strerror(errno));
+            return r->nwritten ? HTTP_STATUS_BAD_GATEWAY : handle_error(r, HTTP_STATUS_BAD_GATEWAY);
+        }
+
+        /* Stream remaining body */
+        long long moved = length == 0 ? 0 : splice_all(fd, r->fd, length);
+        if (moved > 0) {
+            r->nwritten += moved;
+        }
+        atomic_fetch_sub(&u->state->active, 1);
+        upstream_release(u, fd, reusable && moved == length);
+        return (length < 0 || moved == length) ? HTTP_STATUS_OK : HTTP_STATUS_BAD_GATEWAY;
+    }
+
+    return handle_error(r, HTTP_STATUS_BAD_GATEWAY);
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
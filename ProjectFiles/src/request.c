@@ -1,15 +1,174 @@
 /* request.c: HTTP Request Functions */
 
+#define _GNU_SOURCE
+
 #include "spidey.h"
 
 #include <errno.h>
 #include <string.h>
+#include <strings.h>
 
 #include <unistd.h>
 
 int parse_request_method(Request *r);
 int parse_request_headers(Request *r);
 
+/* Client Stream Functions */
+
+static ssize_t request_read(void *cookie, char *buffer, size_t size) {
+    Request *r = cookie;
+    ssize_t nread;
+
+    do {
+        nread = read(r->fd, buffer, size);
+        r->trace.reads++;
+    } while (nread < 0 && errno == EINTR);
+
+    if (nread > 0) {
+        r->received += nread;
+        trace_point(&r->trace, TRACE_FIRST_READ);
+    }
+    return nread;
+}
+
+static int request_close(void *cookie) {
+    Request *r = cookie;
+    return close(r->fd);
+}
+
+/* Request Stream Functions */
+
+static ssize_t stream_read(void *cookie, char *buffer, size_t size) {
+    Request *r = cookie;
+    ssize_t nread = r->source_read(r->source, buffer, size);
+    if (nread > 0) {
+        r->position += nread;
+    }
+    return nread;
+}
+
+/* Only reports the position (see request_buffered) */
+static int stream_seek(void *cookie, off64_t *offset, int whence) {
+    Request *r = cookie;
+    if (whence != SEEK_CUR || *offset != 0) {
+        errno = ESPIPE;
+        return -1;
+    }
+    *offset = r->position;
+    return 0;
+}
+
+static int stream_close(void *cookie) {
+    Request *r = cookie;
+    return r->source_close(r->source);
+}
+
+static const cookie_io_functions_t RequestStreamFunctions = {
+    .read  = stream_read,
+    .seek  = stream_seek,
+    .close = stream_close,
+};
+
+/* Held bytes, read before the backend's source (see request_hold) */
+
+typedef struct {
+    void    *source;                    /*< Backend's source */
+    ssize_t (*source_read)(void *cookie, char *buffer, size_t size);
+    int     (*source_close)(void *cookie);
+    size_t   length;                    /*< Bytes held */
+    size_t   offset;                    /*< Bytes read so far */
+    char     data[];
+} Held;
+
+static ssize_t held_read(void *cookie, char *buffer, size_t size) {
+    Held *h = cookie;
+    if (h->offset == h->length) {
+        return h->source_read(h->source, buffer, size);
+    }
+
+    size_t n = size < h->length - h->offset ? size : h->length - h->offset;
+    memcpy(buffer, h->data + h->offset, n);
+    h->offset += n;
+    return n;
+}
+
+static int held_close(void *cookie) {
+    Held *h = cookie;
+    int status = h->source_close(h->source);
+    free(h);
+    return status;
+}
+
+/**
+ * Open stream for reading request from a backend's source.
+ *
+ * @param   r           HTTP Request structure.
+ * @param   cookie      Source passed to read and close.
+ * @param   read        Read function of source (as for fopencookie).
+ * @param   close       Close function of source (as for fopencookie).
+ * @return  Stream (NULL on error).
+ *
+ * The stream counts bytes read from the source; the backend counts bytes it
+ * takes off the client socket in r->received (see request_buffered).
+ **/
+FILE *request_stream(Request *r, void *cookie,
+                     ssize_t (*read)(void *cookie, char *buffer, size_t size), int (*close)(void *cookie)) {
+    r->source       = cookie;
+    r->source_read  = read;
+    r->source_close = close;
+    r->position     = 0;
+    return fopencookie(r, "r", RequestStreamFunctions);
+}
+
+/**
+ * Return bytes of request taken off the client socket but not yet consumed.
+ *
+ * @param   r           HTTP Request structure.
+ * @return  Bytes that reading the stream returns before it reads the socket.
+ *
+ * These are held by stdio or by the backend's source (such as a head read
+ * by an event loop), so they must be read from the stream rather than the
+ * socket.
+ **/
+size_t request_buffered(Request *r) {
+    off_t consumed = ftello(r->stream);
+    return consumed < 0 ? 0 : r->received - consumed;
+}
+
+/**
+ * Move bytes of request not yet consumed into memory the request owns.
+ *
+ * @param   r           HTTP Request structure.
+ * @return  -1 on error and 0 on success.
+ *
+ * Some backends' sources cannot be read by a forked child (uring's registered
+ * buffers are not inherited), so this is called before forking an executor.
+ * The stream then reads the held bytes before going back to the source.
+ **/
+int request_hold(Request *r) {
+    size_t length = request_buffered(r);
+    if (length == 0) {
+        return 0;
+    }
+
+    Held *h = malloc(sizeof(Held) + length);
+    if (!h) {
+        return -1;
+    }
+    h->length = fread(h->data, 1, length, r->stream);
+    h->offset = 0;
+    h->source       = r->source;
+    h->source_read  = r->source_read;
+    h->source_close = r->source_close;
+
+    /* The held bytes are taken off the socket as far as the stream can tell */
+    r->source       = h;
+    r->source_read  = held_read;
+    r->source_close = held_close;
+    r->received    += h->length;
+    return 0;
+}
+
 /**
  * Accept request from server socket.
  *
@@ -22,7 +181,7 @@ int parse_request_headers(Request *r);
  *  2. Initializes the headers list in the request struct.
  *  3. Accepts a client connection from the server socket.
  *  4. Looks up the client information and stores it in the request struct.
- *  5. Opens the client socket stream for the request struct.
+ *  5. Opens the client socket stream and response for the request struct.
  *  6. Returns the request struct.
  *
  * The returned request struct must be deallocated using free_request.
@@ -36,31 +195,32 @@ Request * accept_request(int sfd) {
     }
 
 
-    /* Accept a client */
-    struct sockaddr raddr;
-    socklen_t rlen = sizeof(struct sockaddr);
-    r->fd = accept(sfd, &raddr, &rlen);
+    /* Accept a client (its address is only formatted when needed) */
+    r->addrlen = sizeof(r->addr);
+    r->fd = accept(sfd, (struct sockaddr *)&r->addr, &r->addrlen);
     if(r->fd < 0){
       debug("Unable to Accept Client: %s", strerror(errno));
       goto fail;
     }
+    clock_gettime(CLOCK_MONOTONIC, &r->start);
+    trace_start(&r->trace, &r->start);
+    r->upgradable = true;
 
-    /* Lookup client information */
-    int client_info = getnameinfo(&raddr, rlen, r->host, sizeof(r->host), r->port, sizeof(r->port), NI_NUMERICHOST | NI_NUMERICSERV);
-    if(client_info < 0)
-    {
-      debug("Unable to Obtain Client Info: %s", gai_strerror(client_info));
+    /* Open socket stream for reading the request */
+    r->stream = request_stream(r, r, request_read, request_close);
+    if(!r->stream){
+      debug("fopencookie Failed: %s", strerror(errno));
       goto fail;
     }
 
-    /* Open socket stream */
-    r->stream = fdopen(r->fd, "w+");
-    if(!r->stream){
-      debug("fdopen Failed: %s", strerror(errno));
+    /* Responses are sent straight to the socket (counts bytes for stats and logging) */
+    r->response = response_new(r->fd, &r->trace);
+    if(!r->response){
+      debug("Unable to Allocate Response: %s", strerror(errno));
       goto fail;
     }
 
-    log("Accepted Request From %s:%s", r->host, r->port);
+    debug("Accepted Request From %s:%s", request_host(r), request_port(r));
     return r;
 
 fail:
@@ -97,6 +257,12 @@ void free_request(Request *r) {
       close(r->fd);
     }
 
+    /* Finish TLS session (after the socket closed, so its relay sees the end) */
+    tls_close(r);
+
+    /* Free response (closing any body that was never sent) */
+    response_free(r->response);
+
     /* Free allocated strings */
     free(r->method);
     free(r->query);
@@ -280,7 +446,7 @@ int parse_request_headers(Request *r) {
         *data++ = '\0';
 
         data = skip_whitespace(data);
-        chomp(data);
+        data[strcspn(data, "\r\n")] = '\0';
         name = buffer;
 
         // Fill next Header
@@ -309,4 +475,50 @@ fail:
     return -1;
 }
 
+/**
+ * Find request header by name.
+ *
+ * @param   r           Request structure.
+ * @param   name        Header name (matched case-insensitively).
+ * @return  Data of first matching header (or NULL if not present).
+ **/
+const char *request_header(Request *r, const char *name) {
+    for (Header *h = r->headers; h; h = h->next) {
+        if (h->name && strcasecmp(h->name, name) == 0) {
+            return h->data;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Return numeric host of client.
+ *
+ * @param   r           Request structure.
+ * @return  Host formatted from the client's address ("-" if it cannot be).
+ *
+ * Requests keep only the raw address; the string is formatted on each call
+ * and stays valid until the next one.
+ **/
+const char *request_host(const Request *r) {
+    static char host[NI_MAXHOST];
+
+    if (getnameinfo((const struct sockaddr *)&r->addr, r->addrlen, host, sizeof(host), NULL, 0, NI_NUMERICHOST) != 0) {
+        strcpy(host, "-");
+    }
+    return host;
+}
+
+/**
+ * Return port of client (formatted like request_host).
+ **/
+const char *request_port(const Request *r) {
+    static char port[NI_MAXSERV];
+
+    if (getnameinfo((const struct sockaddr *)&r->addr, r->addrlen, NULL, 0, port, sizeof(port), NI_NUMERICSERV) != 0) {
+        strcpy(port, "-");
+    }
+    return port;
+}
+
 /* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,696 @@
+/* response.c: HTTP Responses */
+
+#define _GNU_SOURCE
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <string.h>
+
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+
+/* Constants */
+
+#define RESPONSE_STATUSES   (HTTP_STATUS_GATEWAY_TIMEOUT + 1)
+#define RESPONSE_HEADERS    64          /* Distinct mimetypes with prebuilt headers */
+#define RESPONSE_KEEP       (64*1024)   /* Largest buffer kept by response_reset */
+#define RESPONSE_CHUNK      (64*1024)   /* Bytes moved per splice or copy */
+
+#define ERROR_BODY \
+    "<html>\n<h1>%s</h1>\n" \
+    "<h2>You played yourself</h2>\r\n</html>\r\n" \
+    "<img src='https://i.kym-cdn.com/entries/icons/facebook/000/019/954/khaled.jpg' style='width:400px;height:400px;'>"
+
+/* Prebuilt headers of a mimetype */
+
+typedef struct {
+    char   *mimetype;
+    Blob    headers;
+} Headers;
+
+/* Response State
+ *
+ * Blobs are built once and never change, so they can be written as is. */
+
+static Blob     Errors[RESPONSE_STATUSES];
+static Headers  Prebuilt[RESPONSE_HEADERS];
+static size_t   NPrebuilt = 0;
+
+/* Response Builder
+ *
+ * Handlers add memory slices (copied into the response buffer, or borrowed if
+ * they never change) and at most one body source, which comes last.  Blocking
+ * backends send everything with response_flush: slices in one sendmsg(2),
+ * files with sendfile(2), and pipes with splice(2).  Backends that send
+ * responses themselves take the slices as iovecs and the file body with
+ * response_take_body; pipes are read into memory first (response_collect). */
+
+/**
+ * Allocate response.
+ *
+ * @param   fd          Socket response_flush sends to (-1 if the backend
+ * sends the response itself).
+ * @param   trace       Trace counting sends (may be NULL).
+ * @return  Newly allocated response (NULL on error).
+ **/
+Response *response_new(int fd, Trace *trace) {
+    Response *res = calloc(1, sizeof(Response));
+    if (!res) {
+        return NULL;
+    }
+
+    res->fd      = fd;
+    res->trace   = trace;
+    res->body_fd = -1;
+    return res;
+}
+
+/**
+ * Release body source and slices, keeping the buffer for the next response.
+ **/
+void response_reset(Response *res) {
+    if (res->body == BODY_PIPE) {
+        pclose(res->body_pipe);
+    } else if (res->body == BODY_FILE) {
+        close(res->body_fd);
+    }
+    res->body      = BODY_NONE;
+    res->body_fd   = -1;
+    res->body_pipe = NULL;
+
+    if (res->buffer_capacity > RESPONSE_KEEP) {
+        free(res->buffer);
+        res->buffer          = NULL;
+        res->buffer_capacity = 0;
+    }
+    res->buffer_length = 0;
+    res->nslices       = 0;
+    res->skip          = 0;
+    res->length        = 0;
+    res->sent          = 0;
+    res->failed        = false;
+}
+
+/**
+ * Deallocate response (closing any body source that was not sent).
+ **/
+void response_free(Response *res) {
+    if (!res) {
+        return;
+    }
+    response_reset(res);
+    free(res->buffer);
+    free(res);
+}
+
+/**
+ * Return address of slice's bytes.
+ **/
+static inline const char *slice_data(const Response *res, const Slice *slice) {
+    return slice->data ? slice->data : res->buffer + slice->offset;
+}
+
+/**
+ * Copy every slice into one buffer slice so another can be added.
+ *
+ * @return  -1 on error and 0 on success.
+ **/
+static int response_merge(Response *res) {
+    size_t length = response_pending(res);
+    char  *buffer = malloc(length > RESPONSE_KEEP ? length : RESPONSE_KEEP);
+    if (!buffer) {
+        return -1;
+    }
+
+    struct iovec iov[RESPONSE_SLICES];
+    size_t n = response_iovecs(res, iov, RESPONSE_SLICES);
+    size_t offset = 0;
+    for (size_t i = 0; i < n; i++) {
+        memcpy(buffer + offset, iov[i].iov_base, iov[i].iov_len);
+        offset += iov[i].iov_len;
+    }
+
+    free(res->buffer);
+    res->buffer          = buffer;
+    res->buffer_length   = length;
+    res->buffer_capacity = length > RESPONSE_KEEP ? length : RESPONSE_KEEP;
+    res->slices[0]       = (Slice){NULL, 0, length};
+    res->nslices         = length ? 1 : 0;
+    res->skip            = 0;
+    return 0;
+}
+
+/**
+ * Make room for another slice, sending or merging the ones there are.
+ *
+ * @return  -1 on error and 0 on success.
+ **/
+static int response_slot(Response *res) {
+    if (res->body != BODY_NONE) {
+        /* Bodies come last; anything after one is a handler bug */
+        debug("Response data added after its body");
+        return -1;
+    }
+    if (res->nslices < RESPONSE_SLICES) {
+        return 0;
+    }
+    if (res->fd >= 0) {
+        return response_flush(res);
+    }
+    return response_merge(res);
+}
+
+/**
+ * Append bytes (copied into the response buffer).
+ *
+ * @param   res         Response.
+ * @param   data        Bytes to append.
+ * @param   length      Number of bytes.
+ * @return  -1 on error and 0 on success.
+ **/
+int response_write(Response *res, const void *data, size_t length) {
+    if (length == 0) {
+        return 0;
+    }
+
+    Slice *last = res->nslices ? &res->slices[res->nslices - 1] : NULL;
+    bool   extend = last && !last->data && last->offset + last->length == res->buffer_length;
+    if (!extend && response_slot(res) < 0) {
+        return -1;
+    }
+
+    if (res->buffer_length + length > res->buffer_capacity) {
+        size_t capacity = res->buffer_capacity ? res->buffer_capacity : BUFSIZ;
+        while (capacity < res->buffer_length + length) {
+            capacity *= 2;
+        }
+        char *buffer = realloc(res->buffer, capacity);
+        if (!buffer) {
+            return -1;
+        }
+        res->buffer          = buffer;
+        res->buffer_capacity = capacity;
+    }
+
+    /* response_slot may have sent or merged everything */
+    last   = res->nslices ? &res->slices[res->nslices - 1] : NULL;
+    extend = last && !last->data && last->offset + last->length == res->buffer_length;
+    if (extend) {
+        last->length += length;
+    } else {
+        res->slices[res->nslices++] = (Slice){NULL, res->buffer_length, length};
+    }
+
+    memcpy(res->buffer + res->buffer_length, data, length);
+    res->buffer_length += length;
+    res->length        += length;
+    return 0;
+}
+
+/**
+ * Append formatted text.
+ *
+ * @return  -1 on error and 0 on success.
+ **/
+int response_printf(Response *res, const char *format, ...) {
+    char    buffer[BUFSIZ];
+    va_list args;
+
+    va_start(args, format);
+    int length = vsnprintf(buffer, sizeof(buffer), format, args);
+    va_end(args);
+    if (length < 0) {
+        return -1;
+    }
+    if ((size_t)length < sizeof(buffer)) {
+        return response_write(res, buffer, length);
+    }
+
+    char *text = malloc(length + 1);
+    if (!text) {
+        return -1;
+    }
+    va_start(args, format);
+    vsnprintf(text, length + 1, format, args);
+    va_end(args);
+
+    int status = response_write(res, text, length);
+    free(text);
+    return status;
+}
+
+/**
+ * Append blob without copying it.
+ *
+ * @param   res         Response.
+ * @param   blob        Bytes that stay unchanged until the response is sent
+ * (e.g. precomputed responses).
+ * @return  -1 on error and 0 on success.
+ **/
+int response_blob(Response *res, const Blob *blob) {
+    if (blob->length == 0) {
+        return 0;
+    }
+    if (response_slot(res) < 0) {
+        return -1;
+    }
+
+    res->slices[res->nslices++] = (Slice){blob->data, 0, blob->length};
+    res->length += blob->length;
+    return 0;
+}
+
+/**
+ * Finish response with a range of a file.
+ *
+ * @param   res         Response.
+ * @param   fd          File descriptor (the response takes ownership).
+ * @param   offset      Offset of first byte.
+ * @param   length      Number of bytes.
+ * @return  -1 on error and 0 on success.
+ **/
+int response_file(Response *res, int fd, off_t offset, off_t length) {
+    if (res->body != BODY_NONE) {
+        close(fd);
+        return -1;
+    }
+
+    res->body        = BODY_FILE;
+    res->body_fd     = fd;
+    res->body_offset = offset;
+    res->body_length = length;
+    res->length     += length;
+    return 0;
+}
+
+/**
+ * Finish response with the output of a child process.
+ *
+ * @param   res         Response.
+ * @param   pipe        Stream opened by popen (the response takes ownership
+ * and closes it with pclose).
+ * @return  -1 on error and 0 on success.
+ **/
+int response_pipe(Response *res, FILE *pipe) {
+    if (res->body != BODY_NONE) {
+        pclose(pipe);
+        return -1;
+    }
+
+    res->body      = BODY_PIPE;
+    res->body_pipe = pipe;
+    res->body_fd   = fileno(pipe);
+    return 0;
+}
+
+/**
+ * Record bytes sent to the client.
+ **/
+static void response_count(Response *res, size_t sent) {
+    res->sent += sent;
+    if (res->trace) {
+        res->trace->writes++;
+        trace_point(res->trace, TRACE_FIRST_WRITE);
+    }
+}
+
+/**
+ * Copy from descriptor to socket through memory (when zero-copy fails).
+ *
+ * @param   res         Response.
+ * @param   fd          File or pipe.
+ * @param   offset      File offset to read from (NULL for pipes).
+ * @param   length      Bytes to copy (-1 for everything).
+ * @return  -1 on error and 0 on success.
+ **/
+static int response_copy(Response *res, int fd, off_t *offset, off_t length) {
+    char buffer[RESPONSE_CHUNK];
+
+    while (length != 0) {
+        size_t  want = (length < 0 || length > RESPONSE_CHUNK) ? RESPONSE_CHUNK : (size_t)length;
+        ssize_t nread = offset ? pread(fd, buffer, want, *offset) : read(fd, buffer, want);
+        if (nread < 0 && errno == EINTR) {
+            continue;
+        }
+        if (nread <= 0) {
+            return (nread == 0 && length < 0) ? 0 : -1;
+        }
+        if (offset) {
+            *offset += nread;
+        }
+        if (length > 0) {
+            length -= nread;
+        }
+
+        for (ssize_t written = 0; written < nread; ) {
+            ssize_t n = write(res->fd, buffer + written, nread - written);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n < 0) {
+                return -1;
+            }
+            written += n;
+            response_count(res, n);
+        }
+    }
+    return 0;
+}
+
+/**
+ * Send file body with sendfile(2).
+ *
+ * @return  -1 on error and 0 on success.
+ **/
+static int response_send_file(Response *res) {
+    off_t start  = res->body_offset;
+    off_t length = res->body_length;
+
+    while (res->body_length > 0) {
+        size_t  want = res->body_length > (1 << 30) ? (1 << 30) : (size_t)res->body_length;
+        ssize_t n = sendfile(res->fd, res->body_fd, &res->body_offset, want);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 && (errno == EINVAL || errno == ENOSYS)) {
+            return response_copy(res, res->body_fd, &res->body_offset, res->body_length);
+        }
+        if (n <= 0) {
+            /* The file shrank, or the client went away */
+            return -1;
+        }
+        res->body_length -= n;
+        response_count(res, n);
+    }
+
+    fileio_release(res->body_fd, start, length);
+    return 0;
+}
+
+/**
+ * Send pipe body with splice(2).
+ *
+ * @return  -1 on error and 0 on success.
+ **/
+static int response_send_pipe(Response *res) {
+    while (true) {
+        ssize_t n = splice(res->body_fd, NULL, res->fd, NULL, RESPONSE_CHUNK, SPLICE_F_MOVE | SPLICE_F_MORE);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 && errno == EINVAL) {
+            return response_copy(res, res->body_fd, NULL, -1);
+        }
+        if (n <= 0) {
+            return n == 0 ? 0 : -1;
+        }
+        res->length += n;
+        response_count(res, n);
+    }
+}
+
+/**
+ * Send everything added so far to the response's socket.
+ *
+ * @param   res         Response.
+ * @return  -1 on error and 0 on success.
+ *
+ * Slices go out in a single sendmsg(2) (marked MSG_MORE when a body follows,
+ * so headers and body share packets); the body is sent without copying it
+ * through user space.  Once a send fails, the rest of the response is
+ * dropped.  Responses sent by the backend are left alone.
+ **/
+int response_flush(Response *res) {
+    if (!res || res->fd < 0) {
+        return 0;
+    }
+    if (res->failed) {
+        return -1;
+    }
+
+    struct iovec iov[RESPONSE_SLICES];
+    while (response_pending(res) > 0) {
+        struct msghdr msg = {.msg_iov = iov, .msg_iovlen = response_iovecs(res, iov, RESPONSE_SLICES)};
+        ssize_t n = sendmsg(res->fd, &msg, MSG_NOSIGNAL | (res->body != BODY_NONE ? MSG_MORE : 0));
+        if (n < 0 && errno == ENOTSOCK) {
+            n = writev(res->fd, iov, msg.msg_iovlen);
+        }
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            goto fail;
+        }
+        response_count(res, n);
+        response_advance(res, n);
+    }
+
+    int status = 0;
+    if (res->body == BODY_FILE) {
+        status = response_send_file(res);
+        close(res->body_fd);
+    } else if (res->body == BODY_PIPE) {
+        status = response_send_pipe(res);
+        pclose(res->body_pipe);
+    }
+    res->body      = BODY_NONE;
+    res->body_fd   = -1;
+    res->body_pipe = NULL;
+    if (status < 0) {
+        goto fail;
+    }
+    return 0;
+
+fail:
+    debug("Unable to send response: %s", strerror(errno));
+    res->failed = true;
+    return -1;
+}
+
+/**
+ * Read pipe body into memory (for backends that send responses themselves).
+ *
+ * @return  -1 on error and 0 on success.
+ **/
+int response_collect(Response *res) {
+    if (res->body != BODY_PIPE) {
+        return 0;
+    }
+
+    char    buffer[RESPONSE_CHUNK];
+    ssize_t n;
+    int     fd = res->body_fd;
+    FILE   *pipe = res->body_pipe;
+
+    /* The pipe stops being the body, so its output can be appended */
+    res->body      = BODY_NONE;
+    res->body_fd   = -1;
+    res->body_pipe = NULL;
+    while ((n = read(fd, buffer, sizeof(buffer))) != 0) {
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 || response_write(res, buffer, n) < 0) {
+            break;
+        }
+    }
+
+    pclose(pipe);
+    return n == 0 ? 0 : -1;
+}
+
+/**
+ * Describe unsent slices as iovecs.
+ *
+ * @param   res         Response.
+ * @param   iov         Array to fill.
+ * @param   max         Entries in array.
+ * @return  Number of entries filled.
+ **/
+size_t response_iovecs(const Response *res, struct iovec *iov, size_t max) {
+    size_t n = 0;
+    size_t skip = res->skip;
+
+    for (size_t i = 0; i < res->nslices && n < max; i++) {
+        const Slice *slice = &res->slices[i];
+        if (skip >= slice->length) {
+            skip -= slice->length;
+            continue;
+        }
+        iov[n].iov_base = (char *)slice_data(res, slice) + skip;
+        iov[n].iov_len  = slice->length - skip;
+        skip = 0;
+        n++;
+    }
+    return n;
+}
+
+/**
+ * Mark bytes of the slices as sent; once all are, the slices are dropped.
+ **/
+void response_advance(Response *res, size_t sent) {
+    res->skip += sent;
+    if (response_pending(res) == 0) {
+        res->nslices       = 0;
+        res->skip          = 0;
+        res->buffer_length = 0;
+    }
+}
+
+/**
+ * Return bytes of the slices not yet sent.
+ **/
+size_t response_pending(const Response *res) {
+    size_t length = 0;
+    for (size_t i = 0; i < res->nslices; i++) {
+        length += res->slices[i].length;
+    }
+    return length - res->skip;
+}
+
+/**
+ * Take file body (for backends that send responses themselves).
+ *
+ * @param   res         Response.
+ * @param   offset      Set to the offset of the first byte.
+ * @param   length      Set to the number of bytes.
+ * @return  File descriptor now owned by the caller (-1 if there is none).
+ **/
+int response_take_body(Response *res, off_t *offset, off_t *length) {
+    if (res->body != BODY_FILE) {
+        return -1;
+    }
+
+    int fd = res->body_fd;
+    *offset = res->body_offset;
+    *length = res->body_length;
+    res->body    = BODY_NONE;
+    res->body_fd = -1;
+    return fd;
+}
+
+/**
+ * Return bytes sent, or (for backends that send responses themselves) bytes
+ * to send.
+ **/
+size_t response_bytes(const Response *res) {
+    if (!res) {
+        return 0;
+    }
+    return res->fd >= 0 ? res->sent : res->length;
+}
+
+/* Precomputed Responses */
+
+/**
+ * Format allocated blob.
+ *
+ * @return  -1 on error and 0 on success.
+ **/
+static int blob_format(Blob *b, const char *format, ...) {
+    va_list args;
+
+    va_start(args, format);
+    int length = vsnprintf(NULL, 0, format, args);
+    va_end(args);
+
+    char *data = length >= 0 ? malloc(length + 1) : NULL;
+    if (!data) {
+        return -1;
+    }
+
+    va_start(args, format);
+    vsnprintf(data, length + 1, format, args);
+    va_end(args);
+
+    b->data   = data;
+    b->length = length;
+    return 0;
+}
+
+/**
+ * Build headers of mimetype (if there is room for them).
+ **/
+static const Blob *headers_add(const char *mimetype) {
+    if (NPrebuilt == RESPONSE_HEADERS) {
+        return NULL;
+    }
+
+    Headers *h = &Prebuilt[NPrebuilt];
+    if (!(h->mimetype = strdup(mimetype))) {
+        return NULL;
+    }
+    if (blob_format(&h->headers, "HTTP/1.0 200 OK\r\nContent-Type: %s\r\n\r\n", mimetype) < 0) {
+        free(h->mimetype);
+        return NULL;
+    }
+
+    NPrebuilt++;
+    return &h->headers;
+}
+
+/**
+ * Build complete error responses (statuses from 400 up) and the headers of
+ * common mimetypes.
+ *
+ * @return  -1 on error and 0 on success.
+ *
+ * This must be called after vhost_init (each host's default mimetype is
+ * prebuilt).
+ **/
+int response_init(void) {
+    for (Status s = HTTP_STATUS_BAD_REQUEST; s < RESPONSE_STATUSES; s++) {
+        const char *status = http_status_string(s);
+        Blob        body;
+
+        if (blob_format(&body, ERROR_BODY, status) < 0 ||
+            blob_format(&Errors[s], "HTTP/1.0 %s\r\nContent-Type: text/html\r\nContent-Length: %zu\r\n\r\n%s",
+                        status, body.length, body.data) < 0) {
+            return -1;
+        }
+        free((char *)body.data);
+    }
+
+    if (!response_headers("text/html") || !response_headers(STATS_MIMETYPE)) {
+        return -1;
+    }
+    for (size_t i = 0; i < vhost_count(); i++) {
+        response_headers(vhost_get(i)->default_mimetype);
+    }
+    return 0;
+}
+
+/**
+ * Return complete error response for status (NULL if status is not an
+ * error, such as 200 or 304, which have no error body).
+ **/
+const Blob *response_error(Status status) {
+    if (status < HTTP_STATUS_BAD_REQUEST) {
+        return NULL;
+    }
+    return &Errors[status < RESPONSE_STATUSES ? status : HTTP_STATUS_INTERNAL_SERVER_ERROR];
+}
+
+/**
+ * Return headers of a 200 OK response with the given Content-Type.
+ *
+ * @param   mimetype    Content-Type of response.
+ * @return  Headers (including the blank line that ends them), or NULL if
+ * there is no room left for another mimetype.
+ *
+ * Mimetypes not prebuilt by response_init are added on first use; a site
+ * serves a few dozen at most, so a linear scan finds them.
+ **/
+const Blob *response_headers(const char *mimetype) {
+    for (size_t i = 0; i < NPrebuilt; i++) {
+        if (streq(Prebuilt[i].mimetype, mimetype)) {
+            return &Prebuilt[i].headers;
+        }
+    }
+    return headers_add(mimetype);
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,253 @@
+/* restart.c: Graceful Shutdown and Restart */
+
+#define _GNU_SOURCE
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <string.h>
+
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+/* Constants */
+
+#define RESTART_LISTEN_ENV  "SPIDEY_LISTEN_FD"  /* Inherited listening socket */
+#define RESTART_READY_ENV   "SPIDEY_READY_FD"   /* Pipe to report readiness on */
+#define RESTART_READY_MS    10000       /* How long to wait for a new server */
+#define RESTART_POLL_MS     1000        /* Longest wait between flag checks */
+
+/* Restart State */
+
+static volatile sig_atomic_t Stopping   = 0;    /* SIGTERM or SIGINT received */
+static volatile sig_atomic_t Restarting = 0;    /* SIGUSR2 received */
+static volatile sig_atomic_t Expired    = 0;    /* Drain deadline passed */
+static char **Arguments = NULL;         /* Command line to exec on restart */
+
+static void restart_signal(int signum) {
+    if (signum == SIGUSR2) {
+        Restarting = 1;
+    } else if (Stopping && signum == SIGINT) {
+        /* Interrupting twice does not wait for the deadline */
+        _exit(EXIT_FAILURE);
+    } else {
+        /* Stopping is certain, so the deadline starts now */
+        Stopping = 1;
+        if (DrainTimeout > 0) {
+            alarm(DrainTimeout);
+        }
+    }
+}
+
+static void restart_expire(int signum) {
+    /* Handlers stuck where interruption does not help (e.g. waiting on a CGI
+     * script) get one more second before the process just exits */
+    if (Expired) {
+        _exit(EXIT_FAILURE);
+    }
+    Expired = 1;
+    alarm(1);
+}
+
+/**
+ * Determine listening socket inherited from a previous server.
+ *
+ * @return  Inherited socket, or -1 if there is none.
+ **/
+static int restart_inherited(void) {
+    const char *value = getenv(RESTART_LISTEN_ENV);
+    if (!value) {
+        return -1;
+    }
+
+    int fd = atoi(value);
+    int listening = 0;
+    socklen_t length = sizeof(listening);
+    unsetenv(RESTART_LISTEN_ENV);
+    if (getsockopt(fd, SOL_SOCKET, SO_ACCEPTCONN, &listening, &length) < 0 || !listening) {
+        log("Ignoring inherited socket %s: not listening", value);
+        return -1;
+    }
+
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    return fd;
+}
+
+/**
+ * Spawn a new server that inherits the listening socket.
+ *
+ * @param   sfd         Server socket file descriptor.
+ * @return  -1 on error and 0 once the new server is ready.
+ **/
+static int restart_spawn(int sfd) {
+    int ready[2];
+    if (pipe2(ready, O_CLOEXEC) < 0) {
+        return -1;
+    }
+
+    pid_t pid = fork();
+    if (pid < 0) {
+        close(ready[0]);
+        close(ready[1]);
+        return -1;
+    }
+
+    if (pid == 0) {
+        char value[16];
+
+        /* Only the listening socket and readiness pipe survive exec */
+        fcntl(sfd, F_SETFD, 0);
+        fcntl(ready[1], F_SETFD, 0);
+        snprintf(value, sizeof(value), "%d", sfd);
+        setenv(RESTART_LISTEN_ENV, value, 1);
+        snprintf(value, sizeof(value), "%d", ready[1]);
+        setenv(RESTART_READY_ENV, value, 1);
+
+        signal(SIGUSR2, SIG_DFL);
+        signal(SIGTERM, SIG_DFL);
+        signal(SIGINT, SIG_DFL);
+        execvp(Arguments[0], Arguments);
+        log("Unable to exec %s: %s", Arguments[0], strerror(errno));
+        _exit(EXIT_FAILURE);
+    }
+
+    /* The new server writes one byte once it is ready to accept */
+    close(ready[1]);
+    struct pollfd pfd = {.fd = ready[0], .events = POLLIN};
+    char byte = 0;
+    int  status = -1;
+    while (poll(&pfd, 1, RESTART_READY_MS) < 0 && errno == EINTR);
+    if ((pfd.revents & POLLIN) && read(ready[0], &byte, 1) == 1) {
+        status = 0;
+    }
+    close(ready[0]);
+
+    if (status < 0) {
+        log("New server %d did not become ready", pid);
+        kill(pid, SIGKILL);
+        waitpid(pid, NULL, 0);
+    } else {
+        log("Handed listening socket to new server %d", pid);
+    }
+    return status;
+}
+
+/**
+ * Allocate listening socket, or take over the one of a previous server.
+ *
+ * @param   port        Port number to bind to and listen on.
+ * @return  Server socket file descriptor (-1 on error).
+ **/
+int restart_listen(const char *port) {
+    int sfd = restart_inherited();
+    if (sfd >= 0) {
+        log("Inherited listening socket %d (ignoring port %s)", sfd, port);
+        return sfd;
+    }
+    return socket_listen(port);
+}
+
+/**
+ * Install shutdown and restart signal handlers.
+ *
+ * @param   argv        Command line used to exec the new server on restart.
+ *
+ * SIGTERM and SIGINT stop accepting and drain in-flight requests.  SIGUSR2
+ * first spawns a new server that inherits the listening socket and only
+ * drains once that server is ready, so no connection is refused.  In either
+ * case the server exits after DrainTimeout seconds, interrupting whatever is
+ * still in flight (or at once on a second SIGINT).
+ *
+ * Handlers restart interrupted I/O so requests in flight are unaffected;
+ * servers notice the flags between clients (see restart_wait).
+ **/
+void restart_init(char *argv[]) {
+    struct sigaction action = {.sa_handler = restart_signal, .sa_flags = SA_RESTART};
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGTERM, &action, NULL);
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGUSR2, &action, NULL);
+
+    /* The deadline interrupts blocking I/O on purpose */
+    struct sigaction expire = {.sa_handler = restart_expire};
+    sigemptyset(&expire.sa_mask);
+    sigaction(SIGALRM, &expire, NULL);
+
+    Arguments = argv;
+}
+
+/**
+ * Report readiness to the server that spawned this one (if any).
+ **/
+void restart_ready(void) {
+    const char *value = getenv(RESTART_READY_ENV);
+    if (!value) {
+        return;
+    }
+
+    int fd = atoi(value);
+    unsetenv(RESTART_READY_ENV);
+    if (write(fd, "1", 1) != 1) {
+        log("Unable to report readiness: %s", strerror(errno));
+    }
+    close(fd);
+}
+
+/**
+ * Wait until a client is ready to be accepted or a signal arrives.
+ *
+ * @param   sfd         Server socket file descriptor.
+ * @return  Whether a client can be accepted.
+ *
+ * poll(2) is never restarted after a signal, so stopping is noticed at once;
+ * the timeout bounds the window between checking the flags and polling.
+ **/
+bool restart_wait(int sfd) {
+    struct pollfd pfd = {.fd = sfd, .events = POLLIN};
+    return !Stopping && !Restarting && poll(&pfd, 1, RESTART_POLL_MS) > 0;
+}
+
+/**
+ * Determine whether the server should stop accepting clients.
+ *
+ * @param   sfd         Server socket file descriptor.
+ * @return  Whether to stop accepting and drain.
+ *
+ * A pending restart spawns the new server first; if it fails to start, the
+ * restart is abandoned and this server keeps running.
+ **/
+bool restart_stopping(int sfd) {
+    if (Stopping) {
+        log("Stopping: draining requests (deadline %ds)", DrainTimeout);
+        return true;
+    }
+
+    if (Restarting) {
+        Restarting = 0;
+        if (restart_spawn(sfd) < 0) {
+            log("Restart failed; still serving");
+            return false;
+        }
+        Stopping = 1;
+        if (DrainTimeout > 0) {
+            alarm(DrainTimeout);
+        }
+        log("Restarting: draining requests (deadline %ds)", DrainTimeout);
+        return true;
+    }
+
+    return false;
+}
+
+/**
+ * Return whether the drain deadline has passed.
+ **/
+bool restart_expired(void) {
+    return Expired;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
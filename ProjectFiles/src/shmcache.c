@@ -0,0 +1,385 @@
+/* shmcache.c: Shared Response Cache */
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <string.h>
+
+#include <sys/mman.h>
+
+/* Constants */
+
+#define SHM_SLOTS           8192        /* Index entries (direct mapped; collisions replace) */
+#define SHM_PAGE            (128*1024)  /* Slab page; holds chunks of one class */
+#define SHM_MIN_CHUNK       512         /* Smallest chunk class */
+#define SHM_CLASSES         9           /* Chunk classes: 512 bytes to 128KB */
+#define SHM_READ_TRIES      4           /* Seqlock retries before reporting a miss */
+
+/* Index slot
+ *
+ * Readers never lock: they copy the slot and its chunk, then check that the
+ * sequence is even and unchanged.  Writers (holding the segment lock) make
+ * the sequence odd while they change the slot or anything its chunk holds. */
+
+typedef struct {
+    _Atomic uint32_t seq;               /*< Sequence (odd while being written) */
+    _Atomic bool     referenced;        /*< Read since the clock hand last passed */
+    uint8_t          kind;              /*< CacheKind */
+    uint32_t         host;              /*< Id of virtual host */
+    uint64_t         hash;              /*< Hash of kind, host, and key */
+    uint64_t         generation;        /*< Host generation the response was built at */
+    uint32_t         chunk;             /*< Offset of chunk in segment (0 if empty) */
+    uint32_t         key_length;        /*< Bytes of key at start of chunk data */
+    uint32_t         length;            /*< Bytes of response after key */
+} ShmSlot;
+
+/* Chunk header (followed by key, then response) */
+
+typedef struct {
+    int32_t          slot;              /*< Owning slot (-1 if free) */
+    uint32_t         next;              /*< Next free chunk of class (0 if none) */
+} ShmChunk;
+
+/* Segment header */
+
+typedef struct {
+    pthread_mutex_t  lock;              /*< Serializes writers (robust, process shared) */
+    uint32_t         free[SHM_CLASSES]; /*< Free chunk lists */
+    uint32_t         hand[SHM_CLASSES]; /*< Clock hand (chunk offset) of each class */
+    uint32_t         pages;             /*< Number of pages */
+    uint32_t         used;              /*< Pages given to a class */
+    _Atomic uint64_t bytes;             /*< Bytes of responses held */
+    ShmSlot          slots[SHM_SLOTS];
+    uint8_t          classes[];         /*< Class of each used page */
+} ShmSegment;
+
+/* Shared Cache State */
+
+static ShmSegment *Segment = NULL;
+static size_t      SegmentSize = 0;
+static size_t      PagesOffset = 0;     /* Offset of first page */
+static bool        Everything = false;  /* Whether every kind is shared (else CGI output only) */
+
+static inline size_t class_size(int class) {
+    return (size_t)SHM_MIN_CHUNK << class;
+}
+
+static inline ShmChunk *chunk_at(uint32_t offset) {
+    return (ShmChunk *)((char *)Segment + offset);
+}
+
+/**
+ * Return smallest class whose chunks hold size bytes (-1 if none).
+ **/
+static int class_for(size_t size) {
+    for (int class = 0; class < SHM_CLASSES; class++) {
+        if (size <= class_size(class)) {
+            return class;
+        }
+    }
+    return -1;
+}
+
+/**
+ * Begin or end changing a slot (or the chunk it owns).
+ **/
+static inline void slot_write_begin(ShmSlot *s) {
+    atomic_fetch_add_explicit(&s->seq, 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+}
+
+static inline void slot_write_end(ShmSlot *s) {
+    atomic_fetch_add_explicit(&s->seq, 1, memory_order_release);
+}
+
+/**
+ * Empty slot and return its chunk to the free list.
+ **/
+static void slot_clear(ShmSlot *s) {
+    if (!s->chunk) {
+        return;
+    }
+
+    slot_write_begin(s);
+    ShmChunk *c = chunk_at(s->chunk);
+    int class = class_for(sizeof(ShmChunk) + s->key_length + s->length);
+    atomic_fetch_sub_explicit(&Segment->bytes, s->length, memory_order_relaxed);
+    c->slot = -1;
+    c->next = Segment->free[class];
+    Segment->free[class] = s->chunk;
+    s->chunk = 0;
+    slot_write_end(s);
+}
+
+/**
+ * Give a fresh page to class, or take a chunk back from it.
+ *
+ * @return  Offset of a chunk that is not in any free list (0 if none).
+ *
+ * Pages are carved into chunks the first time a class needs one; once every
+ * page is in use, the class's clock hand evicts the first chunk whose entry
+ * has not been read since the hand last passed.
+ **/
+static uint32_t chunk_reclaim(int class) {
+    size_t size = class_size(class);
+
+    if (Segment->used < Segment->pages) {
+        uint32_t page = PagesOffset + Segment->used * SHM_PAGE;
+        Segment->classes[Segment->used++] = class;
+        for (size_t offset = SHM_PAGE - size; offset > 0; offset -= size) {
+            ShmChunk *c = chunk_at(page + offset);
+            c->slot = -1;
+            c->next = Segment->free[class];
+            Segment->free[class] = page + offset;
+        }
+        chunk_at(page)->slot = -1;
+        return page;
+    }
+
+    /* Two sweeps give every referenced chunk its second chance */
+    size_t chunks = 0;
+    for (uint32_t p = 0; p < Segment->used; p++) {
+        chunks += Segment->classes[p] == class ? SHM_PAGE / size : 0;
+    }
+
+    uint32_t hand = Segment->hand[class];
+    for (size_t step = 0; step < 2 * chunks; step++) {
+        /* Advance hand to next chunk of class */
+        do {
+            hand += size;
+            if (hand < PagesOffset || hand >= PagesOffset + Segment->used * SHM_PAGE) {
+                hand = PagesOffset;
+            }
+        } while (Segment->classes[(hand - PagesOffset) / SHM_PAGE] != class);
+
+        ShmChunk *c = chunk_at(hand);
+        if (c->slot < 0) {
+            continue;
+        }
+
+        ShmSlot *s = &Segment->slots[c->slot];
+        if (s->chunk != hand) {
+            /* Orphaned by a worker that died while writing */
+            Segment->hand[class] = hand;
+            c->slot = -1;
+            return hand;
+        }
+        if (atomic_exchange_explicit(&s->referenced, false, memory_order_relaxed)) {
+            continue;
+        }
+
+        Segment->hand[class] = hand;
+        slot_clear(s);
+        Segment->free[class] = c->next;     /* Just pushed by slot_clear */
+        return hand;
+    }
+    return 0;
+}
+
+/**
+ * Take segment lock, repairing the index if a worker died holding it.
+ **/
+static void segment_lock(void) {
+    if (pthread_mutex_lock(&Segment->lock) == EOWNERDEAD) {
+        /* A slot left mid-write is dropped (its chunk is lost, not reused) */
+        for (size_t i = 0; i < SHM_SLOTS; i++) {
+            ShmSlot *s = &Segment->slots[i];
+            if (atomic_load(&s->seq) & 1) {
+                s->chunk = 0;
+                atomic_fetch_add(&s->seq, 1);
+            }
+        }
+        pthread_mutex_consistent(&Segment->lock);
+    }
+}
+
+/**
+ * Create shared cache segment.
+ *
+ * @param   bytes       Size of the segment.
+ * @param   everything  Whether every kind of entry is shared (forked
+ * workers), rather than just CGI output (forked CGI executors).
+ * @return  -1 on error and 0 on success.
+ *
+ * This must be called before any workers are forked; every worker then
+ * reads and fills the same copy of each response.
+ **/
+int shmcache_init(size_t bytes, bool everything) {
+    size_t pages = bytes / SHM_PAGE;
+    size_t header = sizeof(ShmSegment) + pages;
+
+    PagesOffset = (header + SHM_PAGE - 1) / SHM_PAGE * SHM_PAGE;
+    SegmentSize = PagesOffset + pages * SHM_PAGE;
+    if (!pages || SegmentSize > UINT32_MAX) {
+        log("Shared cache size must be between 1 and 4095 MB");
+        return -1;
+    }
+
+    Segment = mmap(NULL, SegmentSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (Segment == MAP_FAILED) {
+        log("Unable to map shared cache: %s", strerror(errno));
+        Segment = NULL;
+        return -1;
+    }
+
+    pthread_mutexattr_t attributes;
+    pthread_mutexattr_init(&attributes);
+    pthread_mutexattr_setpshared(&attributes, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attributes, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(&Segment->lock, &attributes);
+    pthread_mutexattr_destroy(&attributes);
+
+    Segment->pages = pages;
+    Everything     = everything;
+    debug("Shared cache: %zu pages of %d bytes", pages, SHM_PAGE);
+    return 0;
+}
+
+/**
+ * Return whether entries of kind go to the shared cache.
+ **/
+bool shmcache_enabled(CacheKind kind) {
+    return Segment != NULL && (Everything || kind == CACHE_CGI);
+}
+
+/**
+ * Return whether a response of length bytes under key fits in a chunk (larger
+ * ones are never stored).
+ **/
+bool shmcache_fits(const char *key, size_t length) {
+    return class_for(sizeof(ShmChunk) + strlen(key) + length) >= 0;
+}
+
+/**
+ * Look up response in shared cache.
+ *
+ * @param   kind        Kind of response.
+ * @param   host        Id of virtual host.
+ * @param   key         Key of response.
+ * @param   hash        Hash of kind, host, and key.
+ * @param   generation  Current generation of host.
+ * @param   buffer      Private buffer the response is copied into (grown as
+ * needed).
+ * @param   capacity    Size of buffer.
+ * @param   length      Set to the length of the response.
+ * @return  Whether a current response was found.
+ *
+ * The response is copied out, since a writer may replace it as soon as the
+ * copy has been checked.
+ **/
+bool shmcache_lookup(CacheKind kind, unsigned host, const char *key, uint64_t hash, uint64_t generation,
+                     char **buffer, size_t *capacity, size_t *length) {
+    ShmSlot *s = &Segment->slots[hash % SHM_SLOTS];
+    size_t   key_length = strlen(key);
+
+    for (int tries = 0; tries < SHM_READ_TRIES; tries++) {
+        uint32_t seq = atomic_load_explicit(&s->seq, memory_order_acquire);
+        if (seq & 1) {
+            continue;
+        }
+
+        /* Copy slot; a torn copy fails the sequence check below */
+        uint32_t chunk = s->chunk;
+        uint32_t stored_key = s->key_length;
+        uint32_t stored = s->length;
+        bool     match = chunk && s->hash == hash && s->kind == kind && s->host == host &&
+                         s->generation == generation && stored_key == key_length &&
+                         chunk >= PagesOffset && chunk < SegmentSize &&
+                         sizeof(ShmChunk) + stored_key + stored <= SegmentSize - chunk;
+
+        if (match && stored > *capacity) {
+            char *grown = realloc(*buffer, stored);
+            if (!grown) {
+                return false;
+            }
+            *buffer   = grown;
+            *capacity = stored;
+        }
+
+        const char *data = (const char *)chunk_at(chunk) + sizeof(ShmChunk);
+        if (match) {
+            match = memcmp(data, key, key_length) == 0;
+        }
+        if (match) {
+            memcpy(*buffer, data + key_length, stored);
+        }
+
+        atomic_thread_fence(memory_order_acquire);
+        if (atomic_load_explicit(&s->seq, memory_order_relaxed) != seq) {
+            continue;
+        }
+        if (!match) {
+            return false;
+        }
+
+        atomic_store_explicit(&s->referenced, true, memory_order_relaxed);
+        *length = stored;
+        return true;
+    }
+    return false;
+}
+
+/**
+ * Store response in shared cache, replacing whatever occupied its slot.
+ *
+ * @param   kind        Kind of response.
+ * @param   host        Id of virtual host.
+ * @param   key         Key of response.
+ * @param   hash        Hash of kind, host, and key.
+ * @param   generation  Host generation read before the response was built.
+ * @param   data        Response.
+ * @param   length      Length of response.
+ **/
+void shmcache_store(CacheKind kind, unsigned host, const char *key, uint64_t hash, uint64_t generation,
+                    const char *data, size_t length) {
+    size_t key_length = strlen(key);
+    int    class = class_for(sizeof(ShmChunk) + key_length + length);
+    if (class < 0) {
+        return;
+    }
+
+    segment_lock();
+
+    uint32_t slot = hash % SHM_SLOTS;
+    ShmSlot *s = &Segment->slots[slot];
+    slot_clear(s);
+
+    uint32_t chunk = Segment->free[class];
+    if (chunk) {
+        Segment->free[class] = chunk_at(chunk)->next;
+    } else {
+        chunk = chunk_reclaim(class);
+    }
+
+    if (chunk) {
+        slot_write_begin(s);
+        ShmChunk *c = chunk_at(chunk);
+        c->slot = slot;
+        c->next = 0;
+        memcpy((char *)c + sizeof(ShmChunk), key, key_length);
+        memcpy((char *)c + sizeof(ShmChunk) + key_length, data, length);
+        s->kind       = kind;
+        s->host       = host;
+        s->hash       = hash;
+        s->generation = generation;
+        s->key_length = key_length;
+        s->length     = length;
+        s->chunk      = chunk;
+        atomic_store_explicit(&s->referenced, false, memory_order_relaxed);
+        atomic_fetch_add_explicit(&Segment->bytes, length, memory_order_relaxed);
+        slot_write_end(s);
+    }
+
+    pthread_mutex_unlock(&Segment->lock);
+}
+
+/**
+ * Return bytes of responses held in the shared cache.
+ **/
+unsigned long shmcache_bytes(void) {
+    return Segment ? atomic_load_explicit(&Segment->bytes, memory_order_relaxed) : 0;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
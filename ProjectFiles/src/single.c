@@ -3,6 +3,7 @@
 #include "spidey.h"
 
 #include <errno.h>
+#include <signal.h>
 #include <string.h>
 
 #include <unistd.h>
@@ -14,8 +15,21 @@
  * @return  Exit status of server (EXIT_SUCCESS).
  **/
 int single_server(int sfd) {
-    /* Accept and handle HTTP request */
+    /* A client hanging up mid-response must not kill the server */
+    signal(SIGPIPE, SIG_IGN);
+
+    /* Accept and handle HTTP requests until told to stop */
     while (true) {
+        executor_reap();
+
+        /* The request in flight (if any) is already done, so stopping drains nothing */
+        if (!restart_wait(sfd)) {
+            if (restart_stopping(sfd)) {
+                break;
+            }
+            continue;
+        }
+
     	/* Accept request */
         Request *request = accept_request(sfd);
         if(!request)
@@ -24,15 +38,21 @@ int single_server(int sfd) {
             continue;
         }
 
-        /* Handle request */
-        handle_request(request);
+        /* Handle request (once its TLS handshake, if any, is done) */
+        stats_connection(1);
+        if(!tls_enabled() || tls_accept(request) == 0)
+        {
+            handle_request(request);
+        }
 
 
 	      /* Free request */
         free_request(request);
+        stats_connection(-1);
     }
 
     /* Close server socket */
+    close(sfd);
     return EXIT_SUCCESS;
 }
 
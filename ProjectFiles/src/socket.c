@@ -35,12 +35,16 @@ int socket_listen(const char *port) {
     /* For each address entry, allocate socket, bind, and listen */
     int server_fd = -1;
     for (struct addrinfo *p = results; p && server_fd < 0; p = p->ai_next) {
-        /* Allocate socket */
-        if ((server_fd = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) < 0) {
+        /* Allocate socket (kept from CGI scripts; restarts pass it on explicitly) */
+        if ((server_fd = socket(p->ai_family, p->ai_socktype | SOCK_CLOEXEC, p->ai_protocol)) < 0) {
             fprintf(stderr, "Socket Failed: %s\n", strerror(errno));
             continue;
         }
 
+        /* Allow binding while connections of a stopped server linger in TIME_WAIT */
+        int on = 1;
+        setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
         /* Bind socket to port */
         if (bind(server_fd, p->ai_addr, p->ai_addrlen) < 0) {
             fprintf(stderr, "Bind Failed: %s\n", strerror(errno));
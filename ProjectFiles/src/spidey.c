@@ -8,11 +8,14 @@
 
 #include <unistd.h>
 
-/* Global Variables */
-char *Port	      = "9898";
-char *MimeTypesPath   = "/etc/mime.types";
-char *DefaultMimeType = "text/plain";
-char *RootPath	      = "www";
+/* Global Variables (library settings are defined in globals.c) */
+char *SlowLogPath     = "-";
+double SlowThreshold  = 100.0;          /* Milliseconds */
+bool  TraceRequests   = false;
+char *VirtualHostsPath = NULL;
+int   SharedCacheSize = 64;             /* Megabytes */
+char *CertificatePath = NULL;
+char *KeyPath         = NULL;
 
 /**
  * Display usage message and exit with specified status code.
@@ -21,14 +24,32 @@ char *RootPath	      = "www";
  * @param   status      Exit status.
  */
 void usage(const char *progname, int status) {
-    fprintf(stderr, "Usage: %s [hcmMpr]\n", progname);
+    fprintf(stderr, "Usage: %s [hcmMprlLSTVPBDCRGXAEKW]\n", progname);
     fprintf(stderr, "Options:\n");
     fprintf(stderr, "    -h            Display help message\n");
-    fprintf(stderr, "    -c mode       Single or Forking mode\n");
+    fprintf(stderr, "    -c mode       Single, Forking, Uring, or Hybrid mode\n");
     fprintf(stderr, "    -m path       Path to mimetypes file\n");
     fprintf(stderr, "    -M mimetype   Default mimetype\n");
     fprintf(stderr, "    -p port       Port to listen on\n");
     fprintf(stderr, "    -r path       Root directory\n");
+    fprintf(stderr, "    -l path       Access log (- for stderr)\n");
+    fprintf(stderr, "    -L format     Access log format: common, combined, or json\n");
+    fprintf(stderr, "    -S path       Trace requests into slow log (- for stderr)\n");
+    fprintf(stderr, "    -T msecs      Trace requests slower than msecs (default: 100)\n");
+    fprintf(stderr, "    -V path       Virtual hosts file (HOST ROOT [MIMETYPE [MIMETYPES]] per line)\n");
+    fprintf(stderr, "    -P route      Proxy /PREFIX=HOST:PORT[,HOST:PORT...] (repeatable; HTTP/1 only, HTTP/2 gets 502)\n");
+    fprintf(stderr, "    -B policy     Proxy balancing: roundrobin or leastconn\n");
+    fprintf(stderr, "    -D secs       Drain deadline when stopping (default: 30)\n");
+    fprintf(stderr, "    -C mbytes     Response cache shared by forked workers (default: 64, 0 disables)\n");
+    fprintf(stderr, "    -G route      Microcache CGI output under /PREFIX=SECONDS (0: as Cache-Control allows) (repeatable)\n");
+    fprintf(stderr, "    -X limits     CGI scripts RUNNING[:QUEUED[:SECS]] at once (default: 8:32:30)\n");
+    fprintf(stderr, "    -R kbytes     Cap each connection's body transfer rate, in KB/s (uring and HTTP/2)\n");
+    fprintf(stderr, "    -A path       Serve the default host from an archive built by pack (then from -r)\n");
+    fprintf(stderr, "    -E path       Serve HTTPS with PEM certificate chain (single and forking modes)\n");
+    fprintf(stderr, "    -K path       PEM private key (default: in the certificate file)\n");
+    fprintf(stderr, "    -W count      Handler processes in hybrid mode (default: 2 per CPU)\n");
+    fprintf(stderr, "\nSend SIGUSR1 to toggle tracing at runtime, SIGUSR2 to restart without\n");
+    fprintf(stderr, "dropping connections, and SIGTERM to stop after draining requests.\n");
     exit(status);
 }
 
@@ -38,12 +59,14 @@ void usage(const char *progname, int status) {
  * @param   argc        Number of arguments.
  * @param   argv        Array of argument strings.
  * @param   mode        Pointer to ServerMode variable.
+ * @param   format      Pointer to AccessLogFormat variable.
+ * @param   balance     Pointer to ProxyBalance variable.
  * @return  true if parsing was successful, false if there was an error.
  *
- * This should set the mode, MimeTypesPath, DefaultMimeType, Port, and RootPath
- * if specified.
+ * This should set the mode, MimeTypesPath, DefaultMimeType, Port, RootPath,
+ * and AccessLogPath if specified.
  */
-bool parse_options(int argc, char *argv[], ServerMode *mode) {
+bool parse_options(int argc, char *argv[], ServerMode *mode, AccessLogFormat *format, ProxyBalance *balance) {
     int argind = 1;
     while (argind < argc && strlen(argv[argind]) > 1 && argv[argind][0] == '-') {
         char *arg = argv[argind++];
@@ -53,6 +76,10 @@ bool parse_options(int argc, char *argv[], ServerMode *mode) {
 	    	    *mode = SINGLE;
                 } else if (streq(argv[argind], "forking")) {
 	    	    *mode = FORKING;
+                } else if (streq(argv[argind], "uring")) {
+	    	    *mode = URING;
+                } else if (streq(argv[argind], "hybrid")) {
+	    	    *mode = HYBRID;
 	    	} else {
 	    	    return false;
 	    	}
@@ -73,6 +100,78 @@ bool parse_options(int argc, char *argv[], ServerMode *mode) {
 	    case 'r':
 	    	RootPath = argv[argind++];
 	    	break;
+	    case 'l':
+	    	AccessLogPath = argv[argind++];
+	    	break;
+	    case 'L':
+	    	if (streq(argv[argind], "common")) {
+	    	    *format = ACCESS_LOG_COMMON;
+	    	} else if (streq(argv[argind], "combined")) {
+	    	    *format = ACCESS_LOG_COMBINED;
+	    	} else if (streq(argv[argind], "json")) {
+	    	    *format = ACCESS_LOG_JSON;
+	    	} else {
+	    	    return false;
+	    	}
+	    	argind++;
+	    	break;
+	    case 'S':
+	    	SlowLogPath = argv[argind++];
+	    	TraceRequests = true;
+	    	break;
+	    case 'T':
+	    	SlowThreshold = strtod(argv[argind++], NULL);
+	    	TraceRequests = true;
+	    	break;
+	    case 'V':
+	    	VirtualHostsPath = argv[argind++];
+	    	break;
+	    case 'P':
+	    	if (proxy_add(argv[argind++]) < 0) {
+	    	    return false;
+	    	}
+	    	break;
+	    case 'B':
+	    	if (streq(argv[argind], "roundrobin")) {
+	    	    *balance = PROXY_ROUND_ROBIN;
+	    	} else if (streq(argv[argind], "leastconn")) {
+	    	    *balance = PROXY_LEAST_CONNECTIONS;
+	    	} else {
+	    	    return false;
+	    	}
+	    	argind++;
+	    	break;
+	    case 'D':
+	    	DrainTimeout = atoi(argv[argind++]);
+	    	break;
+	    case 'C':
+	    	SharedCacheSize = atoi(argv[argind++]);
+	    	break;
+	    case 'G':
+	    	if (microcache_add(argv[argind++]) < 0) {
+	    	    return false;
+	    	}
+	    	break;
+	    case 'X':
+	    	if (cgi_limits(argv[argind++]) < 0) {
+	    	    return false;
+	    	}
+	    	break;
+	    case 'R':
+	    	TransferRate = atol(argv[argind++]) * 1024;
+	    	break;
+	    case 'A':
+	    	ArchivePath = argv[argind++];
+	    	break;
+	    case 'E':
+	    	CertificatePath = argv[argind++];
+	    	break;
+	    case 'K':
+	    	KeyPath = argv[argind++];
+	    	break;
+	    case 'W':
+	    	HybridHandlers = atoi(argv[argind++]);
+	    	break;
 	    default:
 	        return false;
 	    	break;
@@ -87,29 +186,70 @@ bool parse_options(int argc, char *argv[], ServerMode *mode) {
  **/
 int main(int argc, char *argv[]) {
     ServerMode mode;
+    AccessLogFormat format = ACCESS_LOG_COMMON;
+    ProxyBalance balance = PROXY_ROUND_ROBIN;
     int status = EXIT_SUCCESS;
 
     /* Parse command line options */
-    if(!(parse_options(argc, argv, &mode))){
+    if(!(parse_options(argc, argv, &mode, &format, &balance))){
       usage(argv[0], EXIT_FAILURE);
     }
 
-    /* Listen to server socket */
-    int server_fd = socket_listen(Port);
+    /* TLS is terminated by single and forking workers (uring sends from the
+     * ring, which would need the kernel to hold the whole session, and hybrid
+     * reads request heads before any handler could do a handshake) */
+    if(CertificatePath && mode != SINGLE && mode != FORKING)
+    {
+        fatal("HTTPS (-E) is only supported in single and forking modes");
+    }
+
+    /* Listen to server socket (or take over the one of the server being restarted) */
+    int server_fd = restart_listen(Port);
     if(server_fd < 0)
     {
         return EXIT_FAILURE;
     }
 
-    /* Determine real RootPath */
+    /* Determine real RootPath (with an archive, it serves what was not packed) */
     char buffer[BUFSIZ];
     RootPath = realpath(RootPath, buffer);
+    if(!RootPath)
+    {
+        fatal("Unable to resolve root directory: %s", strerror(errno));
+    }
+
+    /* Build virtual host table (the default host serves RootPath) */
+    if(vhost_init(VirtualHostsPath) < 0)
+    {
+        return EXIT_FAILURE;
+    }
 
-    log("Listening on port %s", Port);
+    /* Start access log and metrics before any workers are forked */
+    if(accesslog_open(AccessLogPath, format) < 0 || stats_init() < 0 || trace_open(SlowLogPath, SlowThreshold, TraceRequests) < 0 ||
+       proxy_init(balance) < 0 || watch_init() < 0 || response_init() < 0 || microcache_init() < 0 ||
+       cgi_init() < 0 || (ArchivePath && archive_open(ArchivePath) < 0) ||
+       (CertificatePath && tls_init(CertificatePath, KeyPath) < 0))
+    {
+        return EXIT_FAILURE;
+    }
+
+    /* Forked workers share one copy of each cached response (CGI executors,
+     * forked in the other modes, share just microcached output) */
+    if((mode == FORKING || mode == HYBRID || microcache_enabled()) && SharedCacheSize > 0 && watch_enabled() &&
+       shmcache_init((size_t)SharedCacheSize << 20, mode == FORKING || mode == HYBRID) < 0)
+    {
+        return EXIT_FAILURE;
+    }
+
+    log("Listening on port %s%s", Port, tls_enabled() ? " (HTTPS)" : "");
     debug("RootPath        = %s", RootPath);
     debug("MimeTypesPath   = %s", MimeTypesPath);
     debug("DefaultMimeType = %s", DefaultMimeType);
-    debug("ConcurrencyMode = %s", mode == SINGLE ? "Single" : "Forking");
+    debug("ConcurrencyMode = %s", mode == SINGLE ? "Single" : mode == FORKING ? "Forking" : mode == URING ? "Uring" : "Hybrid");
+
+    /* Tell the server being restarted (if any) to stop accepting */
+    restart_init(argv);
+    restart_ready();
 
     /* Start either forking or single HTTP server */
     if(mode == SINGLE)
@@ -120,11 +260,23 @@ int main(int argc, char *argv[]) {
     {
         status = forking_server(server_fd);
     }
+    else if(mode == URING)
+    {
+        status = uring_server(server_fd);
+    }
+    else if(mode == HYBRID)
+    {
+        status = hybrid_server(server_fd);
+    }
     else
     {
         return EXIT_FAILURE;
     }
 
+    /* Drained (or gave up): cancel the deadline and write out remaining access log records */
+    alarm(0);
+    accesslog_close();
+    log("Stopped");
     return status;
 }
 
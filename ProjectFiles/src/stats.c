@@ -0,0 +1,230 @@
+/* stats.c: Server Metrics */
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <stdatomic.h>
+#include <string.h>
+
+#include <sys/mman.h>
+
+/* Constants */
+
+#define STATS_WORKERS       16          /* Counter slots (one per worker) */
+#define STATS_STATUSES      16          /* Status counter slots */
+#define CACHELINE           64
+
+/* Worker Stats */
+
+typedef struct {
+    uint64_t  statuses[STATS_STATUSES]; /*< Requests by Status */
+    uint64_t  handlers[HANDLER_TYPES];  /*< Requests by HandlerType */
+    uint64_t  bytes;                    /*< Response bytes sent */
+    int64_t   connections;              /*< Connections opened minus closed */
+    uint64_t  cache_hits;               /*< Cache lookups answered from memory */
+    uint64_t  cache_misses;             /*< Cache lookups that went to the filesystem */
+    uint64_t  cold_reads;               /*< File reads handed to blocking I/O threads */
+    uint64_t  coalesced;                /*< CGI requests that waited for another's run */
+    Histogram phases[PHASES];           /*< Latency by Phase (nanoseconds) */
+} __attribute__((aligned(CACHELINE))) WorkerStats;
+
+/* Stats State */
+
+static WorkerStats *Workers = NULL;     /* Shared with forked workers */
+
+static const char *HandlerNames[HANDLER_TYPES] = {
+    "browse",
+    "file",
+    "cgi",
+    "error",
+    "stats",
+    "proxy",
+    "archive",
+};
+
+static const char *PhaseNames[PHASES] = {
+    "accept",
+    "parse",
+    "resolve",
+    "respond",
+};
+
+static inline WorkerStats *worker_stats(void) {
+    return &Workers[WorkerId % STATS_WORKERS];
+}
+
+static inline void counter_add(uint64_t *counter, uint64_t n) {
+    atomic_fetch_add_explicit((_Atomic uint64_t *)counter, n, memory_order_relaxed);
+}
+
+/**
+ * Allocate per-worker counters in shared memory.
+ *
+ * @return  -1 on error and 0 on success.
+ *
+ * This must be called before any workers are forked.  Each worker updates
+ * only its own cache-line aligned slot; readers sum every slot.
+ **/
+int stats_init(void) {
+    Workers = mmap(NULL, STATS_WORKERS * sizeof(WorkerStats), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (Workers == MAP_FAILED) {
+        Workers = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Record a completed request.
+ *
+ * @param   type        Handler that served the request.
+ * @param   status      Status of the HTTP request.
+ * @param   bytes       Response bytes sent.
+ **/
+void stats_request(HandlerType type, Status status, size_t bytes) {
+    if (!Workers) {
+        return;
+    }
+
+    WorkerStats *w = worker_stats();
+    counter_add(&w->statuses[status % STATS_STATUSES], 1);
+    counter_add(&w->handlers[type], 1);
+    counter_add(&w->bytes, bytes);
+}
+
+/**
+ * Record time spent in a request phase.
+ *
+ * @param   phase       Request phase.
+ * @param   start       Monotonic time phase started.
+ * @param   end         Monotonic time phase ended.
+ **/
+void stats_phase(Phase phase, const struct timespec *start, const struct timespec *end) {
+    if (!Workers) {
+        return;
+    }
+
+    int64_t elapsed = (end->tv_sec - start->tv_sec) * 1000000000LL + (end->tv_nsec - start->tv_nsec);
+    histogram_record(&worker_stats()->phases[phase], elapsed > 0 ? elapsed : 0);
+}
+
+/**
+ * Record connection being opened (delta = 1) or closed (delta = -1).
+ **/
+void stats_connection(int delta) {
+    if (!Workers) {
+        return;
+    }
+
+    atomic_fetch_add_explicit((_Atomic int64_t *)&worker_stats()->connections, delta, memory_order_relaxed);
+}
+
+/**
+ * Record cache lookup.
+ *
+ * @param   hit         Whether the lookup was answered from the cache.
+ **/
+void stats_cache(bool hit) {
+    if (!Workers) {
+        return;
+    }
+
+    WorkerStats *w = worker_stats();
+    counter_add(hit ? &w->cache_hits : &w->cache_misses, 1);
+}
+
+/**
+ * Record file read that had to wait on the disk.
+ **/
+void stats_cold_read(void) {
+    if (!Workers) {
+        return;
+    }
+
+    counter_add(&worker_stats()->cold_reads, 1);
+}
+
+/**
+ * Record CGI request that waited for another worker to run the same script.
+ **/
+void stats_coalesced(void) {
+    if (!Workers) {
+        return;
+    }
+
+    counter_add(&worker_stats()->coalesced, 1);
+}
+
+/**
+ * Write all counters, summed across workers, in Prometheus text format.
+ *
+ * @param   stream      Stream to write to.
+ * @return  -1 on error and 0 on success.
+ **/
+int stats_write(FILE *stream) {
+    if (!Workers) {
+        return -1;
+    }
+
+    WorkerStats *total = calloc(1, sizeof(WorkerStats));
+    if (!total) {
+        return -1;
+    }
+
+    for (int i = 0; i < STATS_WORKERS; i++) {
+        WorkerStats *w = &Workers[i];
+        for (int s = 0; s < STATS_STATUSES; s++) {
+            total->statuses[s] += atomic_load_explicit((_Atomic uint64_t *)&w->statuses[s], memory_order_relaxed);
+        }
+        for (int h = 0; h < HANDLER_TYPES; h++) {
+            total->handlers[h] += atomic_load_explicit((_Atomic uint64_t *)&w->handlers[h], memory_order_relaxed);
+        }
+        total->bytes       += atomic_load_explicit((_Atomic uint64_t *)&w->bytes, memory_order_relaxed);
+        total->connections += atomic_load_explicit((_Atomic int64_t *)&w->connections, memory_order_relaxed);
+        total->cache_hits   += atomic_load_explicit((_Atomic uint64_t *)&w->cache_hits, memory_order_relaxed);
+        total->cache_misses += atomic_load_explicit((_Atomic uint64_t *)&w->cache_misses, memory_order_relaxed);
+        total->cold_reads   += atomic_load_explicit((_Atomic uint64_t *)&w->cold_reads, memory_order_relaxed);
+        total->coalesced    += atomic_load_explicit((_Atomic uint64_t *)&w->coalesced, memory_order_relaxed);
+        for (int p = 0; p < PHASES; p++) {
+            histogram_merge(&total->phases[p], &w->phases[p]);
+        }
+    }
+
+    for (int s = 0; s < STATS_STATUSES; s++) {
+        const char *status = http_status_string(s);
+        if (status) {
+            fprintf(stream, "spidey_requests_total{status=\"%d\"} %lu\n", atoi(status), total->statuses[s]);
+        }
+    }
+
+    for (int h = 0; h < HANDLER_TYPES; h++) {
+        fprintf(stream, "spidey_handler_requests_total{handler=\"%s\"} %lu\n", HandlerNames[h], total->handlers[h]);
+    }
+
+    fprintf(stream, "spidey_bytes_sent_total %lu\n", total->bytes);
+    fprintf(stream, "spidey_active_connections %ld\n", total->connections);
+    fprintf(stream, "spidey_accesslog_dropped_total %lu\n", accesslog_dropped());
+    fprintf(stream, "spidey_cache_lookups_total{result=\"hit\"} %lu\n", total->cache_hits);
+    fprintf(stream, "spidey_cache_lookups_total{result=\"miss\"} %lu\n", total->cache_misses);
+    fprintf(stream, "spidey_cache_invalidations_total %lu\n", watch_invalidations());
+    fprintf(stream, "spidey_shared_cache_bytes %lu\n", shmcache_bytes());
+    fprintf(stream, "spidey_cold_reads_total %lu\n", total->cold_reads);
+    fprintf(stream, "spidey_cgi_coalesced_total %lu\n", total->coalesced);
+
+    static const double Quantiles[] = {50.0, 90.0, 99.0, 99.9};
+    for (int p = 0; p < PHASES; p++) {
+        Histogram *h = &total->phases[p];
+        for (size_t q = 0; q < sizeof(Quantiles)/sizeof(Quantiles[0]); q++) {
+            fprintf(stream, "spidey_phase_seconds{phase=\"%s\",quantile=\"%g\"} %.9f\n",
+                PhaseNames[p], Quantiles[q] / 100.0, histogram_percentile(h, Quantiles[q]) / 1e9);
+        }
+        fprintf(stream, "spidey_phase_seconds_max{phase=\"%s\"} %.9f\n", PhaseNames[p], h->max / 1e9);
+        fprintf(stream, "spidey_phase_seconds_sum{phase=\"%s\"} %.9f\n", PhaseNames[p], h->sum / 1e9);
+        fprintf(stream, "spidey_phase_seconds_count{phase=\"%s\"} %lu\n", PhaseNames[p], h->total);
+    }
+
+    free(total);
+    return 0;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,713 @@
+/* thor.c: HTTP Load Generator */
+
+#define _GNU_SOURCE
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+/* Constants */
+
+#define THOR_MAX_DEPTH      64          /* Largest pipelining depth */
+#define THOR_MAX_TARGETS    64          /* Largest URL mix */
+#define THOR_HEADER_MAX     8192        /* Largest response header */
+#define THOR_READ_SIZE      (64*1024)   /* Socket read size */
+#define THOR_STATUSES       600         /* Status code counters */
+
+/* Target */
+
+typedef struct {
+    char        *path;                  /*< Request path */
+    char        *request;               /*< Formatted request */
+    size_t       length;                /*< Length of formatted request */
+    unsigned     weight;                /*< Relative weight in URL mix */
+} Target;
+
+/* Connection */
+
+typedef enum {
+    CONN_CLOSED,
+    CONN_CONNECTING,
+    CONN_OPEN,
+} ConnectionState;
+
+typedef struct {
+    int             fd;
+    ConnectionState state;
+
+    char           *out;                /*< Pending request bytes */
+    size_t          out_length;         /*< Bytes pending */
+    size_t          out_capacity;       /*< Capacity of out */
+    size_t          out_sent;           /*< Bytes of out already sent */
+
+    uint64_t        starts[THOR_MAX_DEPTH]; /*< Start time of each request in flight */
+    int             inflight;           /*< Requests in flight */
+    int             head;               /*< Index of oldest request in flight */
+
+    char            header[THOR_HEADER_MAX]; /*< Response header being read */
+    size_t          header_length;      /*< Bytes of header read */
+    bool            in_body;            /*< Whether header has been read */
+    long long       remaining;          /*< Body bytes remaining (-1 if until EOF) */
+    int             status;             /*< Response status code */
+    bool            close_after;        /*< Server will close after response */
+} Connection;
+
+/* Options */
+
+static Target      Targets[THOR_MAX_TARGETS];
+static int         NTargets     = 0;
+static unsigned    TotalWeight  = 0;
+static char       *Host         = NULL;
+static char       *ServerPort   = NULL;
+static int         Connections  = 1;
+static int         Depth        = 1;
+static bool        KeepAlive    = false;
+static double      Rate         = 0;    /* Requests per second (0 for closed loop) */
+static uint64_t    Requests     = 1000;
+static double      Duration     = 0;    /* Seconds (overrides Requests) */
+static bool        Json         = false;
+static bool        Idle         = false; /* Hold connections open without requests */
+
+/* Results */
+
+static Histogram   Latency;
+static uint64_t    Completed    = 0;
+static uint64_t    Errors       = 0;
+static uint64_t    BytesRead    = 0;
+static uint64_t    Statuses[THOR_STATUSES];
+
+/* Pending requests (open loop) */
+
+static uint64_t   *Pending      = NULL;
+static size_t      PendingHead  = 0;
+static size_t      PendingTail  = 0;
+static size_t      PendingSize  = 0;
+
+static uint64_t    Issued       = 0;
+
+static Connection *Pool         = NULL;
+static int         EpollFd      = -1;
+static struct addrinfo *Address = NULL;
+
+/* Utilities */
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void usage(const char *progname, int status) {
+    fprintf(stderr, "Usage: %s [options] URL[@WEIGHT]...\n", progname);
+    fprintf(stderr, "Options:\n");
+    fprintf(stderr, "    -h            Display help message\n");
+    fprintf(stderr, "    -c count      Concurrent connections (1)\n");
+    fprintf(stderr, "    -d depth      Pipelined requests per connection (1, needs -k)\n");
+    fprintf(stderr, "    -k            Use HTTP/1.1 keep-alive\n");
+    fprintf(stderr, "    -n count      Total requests to complete (1000)\n");
+    fprintf(stderr, "    -t seconds    Run for duration instead of request count\n");
+    fprintf(stderr, "    -r rate       Open loop at constant requests per second\n");
+    fprintf(stderr, "    -u path       Read URL mix from file (WEIGHT URL per line)\n");
+    fprintf(stderr, "    -j            Print results as JSON\n");
+    fprintf(stderr, "    -i            Hold -c connections open idle for -t seconds (10)\n");
+    exit(status);
+}
+
+/**
+ * Parse http://host[:port]/path and add it to the URL mix.
+ *
+ * @return  -1 on error and 0 on success.
+ **/
+static int add_target(const char *url, unsigned weight) {
+    if (NTargets == THOR_MAX_TARGETS || weight == 0) {
+        return -1;
+    }
+
+    if (strncmp(url, "http://", 7) == 0) {
+        url += 7;
+    }
+
+    const char *slash = strchr(url, '/');
+    char *authority = strndup(url, slash ? (size_t)(slash - url) : strlen(url));
+    char *port = strrchr(authority, ':');
+    if (port) {
+        *port++ = 0;
+    } else {
+        port = "80";
+    }
+
+    if (!Host) {
+        Host = strdup(authority);
+        ServerPort = strdup(port);
+    } else if (!streq(Host, authority) || !streq(ServerPort, port)) {
+        fprintf(stderr, "All URLs must use the same host and port\n");
+        free(authority);
+        return -1;
+    }
+    free(authority);
+
+    Target *t = &Targets[NTargets++];
+    t->path   = strdup(slash ? slash : "/");
+    t->weight = weight;
+    TotalWeight += weight;
+    return 0;
+}
+
+/**
+ * Read URL mix from file of "WEIGHT URL" or "URL" lines.
+ **/
+static int load_targets(const char *path) {
+    FILE *fs = fopen(path, "r");
+    if (!fs) {
+        fprintf(stderr, "Unable to open %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    char buffer[BUFSIZ];
+    while (fgets(buffer, BUFSIZ, fs)) {
+        char *first = strtok(buffer, WHITESPACE);
+        char *second = strtok(NULL, WHITESPACE);
+        if (!first || first[0] == '#') {
+            continue;
+        }
+        if (add_target(second ? second : first, second ? (unsigned)atoi(first) : 1) < 0) {
+            fclose(fs);
+            return -1;
+        }
+    }
+
+    fclose(fs);
+    return 0;
+}
+
+static void format_requests(void) {
+    for (int i = 0; i < NTargets; i++) {
+        Target *t = &Targets[i];
+        t->length = asprintf(&t->request, "GET %s HTTP/%s\r\nHost: %s:%s\r\nUser-Agent: thor\r\n%s\r\n",
+            t->path, KeepAlive ? "1.1" : "1.0", Host, ServerPort, KeepAlive ? "Connection: keep-alive\r\n" : "");
+    }
+}
+
+static Target *choose_target(void) {
+    if (NTargets == 1) {
+        return &Targets[0];
+    }
+
+    unsigned pick = (unsigned)random() % TotalWeight;
+    for (int i = 0; i < NTargets; i++) {
+        if (pick < Targets[i].weight) {
+            return &Targets[i];
+        }
+        pick -= Targets[i].weight;
+    }
+    return &Targets[NTargets - 1];
+}
+
+/* Pending Queue */
+
+static void pending_push_front(uint64_t start) {
+    PendingHead = (PendingHead + PendingSize - 1) % PendingSize;
+    Pending[PendingHead] = start;
+}
+
+static void pending_push(uint64_t start) {
+    Pending[PendingTail] = start;
+    PendingTail = (PendingTail + 1) % PendingSize;
+}
+
+static size_t pending_count(void) {
+    return (PendingTail + PendingSize - PendingHead) % PendingSize;
+}
+
+static uint64_t pending_pop(void) {
+    uint64_t start = Pending[PendingHead];
+    PendingHead = (PendingHead + 1) % PendingSize;
+    return start;
+}
+
+/* Connection Functions */
+
+static int connection_open(Connection *c) {
+    c->fd = socket(Address->ai_family, Address->ai_socktype | SOCK_NONBLOCK, Address->ai_protocol);
+    if (c->fd < 0) {
+        return -1;
+    }
+
+    int one = 1;
+    setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    if (connect(c->fd, Address->ai_addr, Address->ai_addrlen) < 0 && errno != EINPROGRESS) {
+        close(c->fd);
+        return -1;
+    }
+
+    struct epoll_event event = {.events = EPOLLIN | EPOLLOUT | EPOLLET, .data.ptr = c};
+    epoll_ctl(EpollFd, EPOLL_CTL_ADD, c->fd, &event);
+
+    c->state         = CONN_CONNECTING;
+    c->out_length    = 0;
+    c->out_sent      = 0;
+    c->header_length = 0;
+    c->in_body       = false;
+    return 0;
+}
+
+/**
+ * Close connection, returning unanswered requests to the pending queue.
+ *
+ * @param   c           Connection.
+ * @param   failed      Whether unanswered requests should be counted as errors.
+ **/
+static void connection_close(Connection *c, bool failed) {
+    close(c->fd);
+    c->fd = -1;
+    c->state = CONN_CLOSED;
+
+    for (int i = c->inflight - 1; i >= 0; i--) {
+        uint64_t start = c->starts[(c->head + i) % THOR_MAX_DEPTH];
+        if (failed) {
+            Errors++;
+        } else if (Rate > 0) {
+            pending_push_front(start);
+        } else {
+            Issued--;
+        }
+    }
+    c->inflight = 0;
+    c->head = 0;
+}
+
+/**
+ * Queue one request on connection.
+ **/
+static void connection_issue(Connection *c, uint64_t start) {
+    Target *t = choose_target();
+
+    if (c->out_length + t->length > c->out_capacity) {
+        c->out_capacity = (c->out_length + t->length) * 2;
+        c->out = realloc(c->out, c->out_capacity);
+    }
+    memcpy(c->out + c->out_length, t->request, t->length);
+    c->out_length += t->length;
+
+    c->starts[(c->head + c->inflight) % THOR_MAX_DEPTH] = start;
+    c->inflight++;
+}
+
+static int connection_flush(Connection *c) {
+    while (c->out_sent < c->out_length) {
+        ssize_t n = send(c->fd, c->out + c->out_sent, c->out_length - c->out_sent, MSG_NOSIGNAL);
+        if (n < 0) {
+            return (errno == EAGAIN) ? 0 : -1;
+        }
+        c->out_sent += n;
+    }
+    c->out_length = c->out_sent = 0;
+    return 0;
+}
+
+static void response_complete(Connection *c) {
+    uint64_t start = c->starts[c->head];
+    uint64_t end = now_ns();
+
+    histogram_record(&Latency, end > start ? end - start : 0);
+    Statuses[c->status < THOR_STATUSES ? c->status : 0]++;
+    Completed++;
+
+    c->head = (c->head + 1) % THOR_MAX_DEPTH;
+    c->inflight--;
+    c->header_length = 0;
+    c->in_body = false;
+}
+
+/**
+ * Parse response status and framing headers.
+ **/
+static void response_parse_header(Connection *c) {
+    c->header[c->header_length] = 0;
+    c->status      = 0;
+    c->remaining   = -1;
+    c->close_after = strncmp(c->header, "HTTP/1.0", 8) == 0;
+
+    char *space = strchr(c->header, ' ');
+    if (space) {
+        c->status = atoi(space + 1);
+    }
+
+    for (char *line = strchr(c->header, '\n'); line; line = strchr(line, '\n')) {
+        line += 1;
+        if (strncasecmp(line, "Content-Length:", 15) == 0) {
+            c->remaining = atoll(line + 15);
+        } else if (strncasecmp(line, "Connection:", 11) == 0) {
+            char *value = line + 11;
+            while (*value == ' ') value++;
+            c->close_after = strncasecmp(value, "close", 5) == 0;
+        }
+    }
+
+    if (c->remaining < 0) {
+        c->close_after = true;
+    }
+    c->in_body = true;
+}
+
+/**
+ * Consume response bytes.
+ *
+ * @return  -1 if the connection should be closed and 0 otherwise.
+ **/
+static int connection_consume(Connection *c, char *data, size_t length) {
+    while (length > 0) {
+        if (c->inflight == 0) {
+            return -1;
+        }
+
+        if (!c->in_body) {
+            size_t n = 0;
+            char *end = NULL;
+            while (n < length && c->header_length < THOR_HEADER_MAX - 1) {
+                c->header[c->header_length++] = data[n++];
+                if ((c->header_length >= 4 && memcmp(c->header + c->header_length - 4, "\r\n\r\n", 4) == 0) ||
+                    (c->header_length >= 2 && memcmp(c->header + c->header_length - 2, "\n\n", 2) == 0)) {
+                    end = c->header;
+                    break;
+                }
+            }
+            data += n;
+            length -= n;
+
+            if (!end) {
+                if (c->header_length >= THOR_HEADER_MAX - 1) {
+                    return -1;
+                }
+                continue;
+            }
+            response_parse_header(c);
+        }
+
+        if (c->remaining >= 0) {
+            size_t n = (size_t)c->remaining < length ? (size_t)c->remaining : length;
+            c->remaining -= n;
+            data += n;
+            length -= n;
+            if (c->remaining == 0) {
+                bool close_after = c->close_after;
+                response_complete(c);
+                if (close_after) {
+                    return -1;
+                }
+            }
+        } else {
+            length = 0;
+        }
+    }
+    return 0;
+}
+
+static void connection_read(Connection *c) {
+    char buffer[THOR_READ_SIZE];
+
+    while (true) {
+        ssize_t n = recv(c->fd, buffer, sizeof(buffer), 0);
+        if (n < 0) {
+            if (errno == EAGAIN) {
+                return;
+            }
+            connection_close(c, true);
+            return;
+        }
+
+        if (n == 0) {
+            /* End of a close-delimited response, or of a partial one */
+            if (c->in_body && c->remaining < 0 && c->inflight > 0) {
+                response_complete(c);
+                connection_close(c, false);
+            } else {
+                connection_close(c, c->in_body || c->header_length > 0);
+            }
+            return;
+        }
+
+        BytesRead += n;
+        if (connection_consume(c, buffer, n) < 0) {
+            connection_close(c, false);
+            return;
+        }
+    }
+}
+
+/* Driver */
+
+static bool done(uint64_t started, uint64_t now) {
+    if (Duration > 0) {
+        return now - started >= (uint64_t)(Duration * 1e9);
+    }
+    return Completed + Errors >= Requests;
+}
+
+/**
+ * Give every connection as much work as it may carry.
+ **/
+static void dispatch(uint64_t now, uint64_t limit) {
+    int depth = KeepAlive ? Depth : 1;
+
+    for (int i = 0; i < Connections; i++) {
+        Connection *c = &Pool[i];
+
+        while (c->inflight < depth) {
+            uint64_t start;
+            if (Rate > 0) {
+                if (pending_count() == 0) {
+                    break;
+                }
+                start = pending_pop();
+            } else {
+                if (Issued >= limit) {
+                    break;
+                }
+                start = now;
+            }
+
+            if (c->state == CONN_CLOSED && connection_open(c) < 0) {
+                Errors++;
+                break;
+            }
+            connection_issue(c, start);
+            Issued++;
+        }
+
+        if (c->state == CONN_OPEN && c->out_length > c->out_sent && connection_flush(c) < 0) {
+            connection_close(c, true);
+        }
+    }
+}
+
+/**
+ * Open every connection, hold them idle without sending a request, and close
+ * them once the duration is over.
+ *
+ * Prints a line once the connections are established, so a caller can take
+ * measurements of the server while they are held.
+ *
+ * @return  Exit status (EXIT_FAILURE if any connection failed).
+ **/
+static int hold_idle(void) {
+    int connected = 0;
+    for (int i = 0; i < Connections; i++) {
+        if (connection_open(&Pool[i]) < 0) {
+            Errors++;
+        }
+    }
+
+    struct epoll_event events[256];
+    uint64_t deadline = now_ns() + 10 * 1000000000ULL;
+    while (connected + (int)Errors < Connections && now_ns() < deadline) {
+        int n = epoll_wait(EpollFd, events, 256, 100);
+        for (int i = 0; i < n; i++) {
+            Connection *c = events[i].data.ptr;
+            if (c->state != CONN_CONNECTING) {
+                continue;
+            }
+            if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+                connection_close(c, true);
+                Errors++;
+            } else if (events[i].events & EPOLLOUT) {
+                c->state = CONN_OPEN;
+                connected++;
+            }
+        }
+    }
+
+    printf("Holding %d idle connections (%d failed)\n", connected, Connections - connected);
+    fflush(stdout);
+
+    struct timespec hold = {(time_t)Duration, (long)((Duration - (time_t)Duration) * 1e9)};
+    while (nanosleep(&hold, &hold) < 0 && errno == EINTR);
+
+    for (int i = 0; i < Connections; i++) {
+        if (Pool[i].state != CONN_CLOSED) {
+            close(Pool[i].fd);
+        }
+    }
+    return connected == Connections ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+static void report(double elapsed) {
+    double p50  = histogram_percentile(&Latency, 50.0) / 1e6;
+    double p90  = histogram_percentile(&Latency, 90.0) / 1e6;
+    double p99  = histogram_percentile(&Latency, 99.0) / 1e6;
+    double p999 = histogram_percentile(&Latency, 99.9) / 1e6;
+    double max  = Latency.max / 1e6;
+    double mean = Latency.total ? (double)Latency.sum / Latency.total / 1e6 : 0;
+
+    if (Json) {
+        printf("{\"requests\":%lu,\"errors\":%lu,\"seconds\":%.3f,\"rps\":%.1f,\"mbps\":%.3f,"
+               "\"mean_ms\":%.3f,\"p50_ms\":%.3f,\"p90_ms\":%.3f,\"p99_ms\":%.3f,\"p999_ms\":%.3f,\"max_ms\":%.3f}\n",
+               Completed, Errors, elapsed, Completed / elapsed, BytesRead / elapsed / 1e6,
+               mean, p50, p90, p99, p999, max);
+        return;
+    }
+
+    printf("Requests:    %lu completed, %lu errors in %.3f s\n", Completed, Errors, elapsed);
+    printf("Throughput:  %.1f req/s, %.3f MB/s\n", Completed / elapsed, BytesRead / elapsed / 1e6);
+    printf("Latency:     mean %.3f ms, p50 %.3f ms, p90 %.3f ms, p99 %.3f ms, p99.9 %.3f ms, max %.3f ms\n",
+           mean, p50, p90, p99, p999, max);
+    if (Rate > 0) {
+        printf("             (measured from scheduled send time at %.0f req/s)\n", Rate);
+    }
+    for (int s = 0; s < THOR_STATUSES; s++) {
+        if (Statuses[s]) {
+            printf("Status %3d:  %lu\n", s, Statuses[s]);
+        }
+    }
+}
+
+/**
+ * Hammer server with requests and report latency distribution.
+ **/
+int main(int argc, char *argv[]) {
+    int argind = 1;
+    while (argind < argc && strlen(argv[argind]) > 1 && argv[argind][0] == '-') {
+        char *arg = argv[argind++];
+        if (arg[1] != 'h' && arg[1] != 'k' && arg[1] != 'j' && arg[1] != 'i' && argind >= argc) {
+            usage(argv[0], EXIT_FAILURE);
+        }
+        switch (arg[1]) {
+            case 'c': Connections = atoi(argv[argind++]); break;
+            case 'd': Depth       = atoi(argv[argind++]); break;
+            case 'n': Requests    = strtoull(argv[argind++], NULL, 10); break;
+            case 't': Duration    = atof(argv[argind++]); break;
+            case 'r': Rate        = atof(argv[argind++]); break;
+            case 'k': KeepAlive   = true; break;
+            case 'j': Json        = true; break;
+            case 'i': Idle        = true; break;
+            case 'u':
+                if (load_targets(argv[argind++]) < 0) {
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'h': usage(argv[0], EXIT_SUCCESS); break;
+            default:  usage(argv[0], EXIT_FAILURE); break;
+        }
+    }
+
+    for (; argind < argc; argind++) {
+        char *url = strdup(argv[argind]);
+        char *weight = strrchr(url, '@');
+        if (weight) {
+            *weight++ = 0;
+        }
+        if (add_target(url, weight ? (unsigned)atoi(weight) : 1) < 0) {
+            usage(argv[0], EXIT_FAILURE);
+        }
+        free(url);
+    }
+
+    if (NTargets == 0 || Connections < 1 || Depth < 1 || Depth > THOR_MAX_DEPTH) {
+        usage(argv[0], EXIT_FAILURE);
+    }
+
+    struct addrinfo hints = {.ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM};
+    int status = getaddrinfo(Host, ServerPort, &hints, &Address);
+    if (status != 0) {
+        fprintf(stderr, "getaddrinfo failed: %s\n", gai_strerror(status));
+        return EXIT_FAILURE;
+    }
+
+    format_requests();
+    signal(SIGPIPE, SIG_IGN);
+
+    EpollFd = epoll_create1(0);
+    Pool = calloc(Connections, sizeof(Connection));
+    PendingSize = (size_t)Connections * THOR_MAX_DEPTH + 1024 * 1024;
+    Pending = calloc(PendingSize, sizeof(uint64_t));
+    if (EpollFd < 0 || !Pool || !Pending) {
+        fprintf(stderr, "Unable to allocate connections: %s\n", strerror(errno));
+        return EXIT_FAILURE;
+    }
+    for (int i = 0; i < Connections; i++) {
+        Pool[i].fd = -1;
+    }
+
+    if (Idle) {
+        Duration = Duration > 0 ? Duration : 10;
+        status = hold_idle();
+        freeaddrinfo(Address);
+        return status;
+    }
+
+    uint64_t started = now_ns();
+    uint64_t scheduled = 0;
+    uint64_t limit = Duration > 0 ? UINT64_MAX : Requests;
+    struct epoll_event events[256];
+
+    while (!done(started, now_ns())) {
+        uint64_t now = now_ns();
+
+        /* Schedule open-loop requests whose send time has arrived */
+        uint64_t next = UINT64_MAX;
+        if (Rate > 0) {
+            while (scheduled < limit && pending_count() < PendingSize - 1) {
+                uint64_t when = started + (uint64_t)(scheduled * 1e9 / Rate);
+                if (when > now) {
+                    next = when;
+                    break;
+                }
+                pending_push(when);
+                scheduled++;
+            }
+        }
+
+        dispatch(now, limit);
+
+        struct timespec timeout = {0, 100 * 1000000};
+        if (next != UINT64_MAX) {
+            uint64_t wait = next - now;
+            timeout.tv_sec  = wait / 1000000000ULL;
+            timeout.tv_nsec = wait % 1000000000ULL;
+        }
+
+        int n = epoll_pwait2(EpollFd, events, 256, &timeout, NULL);
+        for (int i = 0; i < n; i++) {
+            Connection *c = events[i].data.ptr;
+            if (c->state == CONN_CLOSED) {
+                continue;
+            }
+
+            if (events[i].events & (EPOLLERR | EPOLLHUP) && !(events[i].events & EPOLLIN)) {
+                connection_close(c, true);
+                continue;
+            }
+
+            if (c->state == CONN_CONNECTING && events[i].events & EPOLLOUT) {
+                c->state = CONN_OPEN;
+            }
+
+            if (c->state == CONN_OPEN && c->out_length > c->out_sent && connection_flush(c) < 0) {
+                connection_close(c, true);
+                continue;
+            }
+
+            if (events[i].events & EPOLLIN) {
+                connection_read(c);
+            }
+        }
+    }
+
+    report((now_ns() - started) / 1e9);
+    freeaddrinfo(Address);
+    return Errors ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
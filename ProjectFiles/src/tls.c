@@ -0,0 +1,381 @@
+/* tls.c: TLS Termination */
+
+#define _GNU_SOURCE
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <string.h>
+
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+
+/* The handshake happens in user space; afterwards the kernel takes over the
+ * record layer (kTLS) when it can, so the client's socket carries plaintext
+ * as far as the rest of the server is concerned: requests are read, files
+ * are sent with sendfile(2), and pipes are spliced exactly as without TLS.
+ *
+ * When the kernel cannot take over both directions (no tls module, a cipher
+ * it does not offload, or an OpenSSL that only offloads sending), a relay
+ * thread keeps the same promise: the request's descriptor is swapped for one
+ * end of a socket pair, and the thread moves records between the other end
+ * and the client through OpenSSL. */
+
+/* TLS Session */
+
+struct TlsSession {
+    SSL        *ssl;                    /*< OpenSSL connection */
+    int         socket;                 /*< Client socket (OpenSSL's own descriptor) */
+    int         local;                  /*< Relay end of the request's socket pair (-1 with kTLS) */
+    pthread_t   thread;                 /*< Relay thread */
+    atomic_int  references;             /*< Request, and relay thread (if any) */
+};
+
+/* TLS State */
+
+static SSL_CTX *Context = NULL;         /* Shared by every connection (and forked worker) */
+
+/**
+ * Describe the oldest OpenSSL error of this thread (and forget the rest).
+ **/
+static const char *tls_error(void) {
+    static __thread char buffer[128];
+    unsigned long error = ERR_get_error();
+
+    if (error) {
+        ERR_error_string_n(error, buffer, sizeof(buffer));
+    } else {
+        snprintf(buffer, sizeof(buffer), "%s", errno ? strerror(errno) : "connection closed");
+    }
+    ERR_clear_error();
+    return buffer;
+}
+
+/**
+ * Load certificate and key and prepare for accepting TLS connections.
+ *
+ * @param   certificate Path to PEM certificate chain (server certificate first).
+ * @param   key         Path to PEM private key (NULL if it follows the chain in
+ * the certificate file).
+ * @return  -1 on error and 0 on success.
+ *
+ * Clients resume sessions with tickets (sealed with keys made here, before
+ * any workers are forked, so every worker can open every ticket) or, with
+ * clients that do not take tickets, from each process's session cache.
+ **/
+int tls_init(const char *certificate, const char *key) {
+    Context = SSL_CTX_new(TLS_server_method());
+    if (!Context) {
+        log("Unable to create TLS context: %s", tls_error());
+        return -1;
+    }
+
+    SSL_CTX_set_min_proto_version(Context, TLS1_2_VERSION);
+    SSL_CTX_set_options(Context, SSL_OP_NO_RENEGOTIATION | SSL_OP_CIPHER_SERVER_PREFERENCE);
+#ifdef SSL_OP_ENABLE_KTLS
+    SSL_CTX_set_options(Context, SSL_OP_ENABLE_KTLS);
+#endif
+
+    if (SSL_CTX_use_certificate_chain_file(Context, certificate) != 1 ||
+        SSL_CTX_use_PrivateKey_file(Context, key ? key : certificate, SSL_FILETYPE_PEM) != 1 ||
+        SSL_CTX_check_private_key(Context) != 1) {
+        log("Unable to load certificate %s (key %s): %s", certificate, key ? key : certificate, tls_error());
+        SSL_CTX_free(Context);
+        Context = NULL;
+        return -1;
+    }
+
+    static const unsigned char SessionContext[] = "spidey";
+    SSL_CTX_set_session_id_context(Context, SessionContext, sizeof(SessionContext) - 1);
+    SSL_CTX_set_session_cache_mode(Context, SSL_SESS_CACHE_SERVER);
+    SSL_CTX_sess_set_cache_size(Context, TLS_SESSION_CACHE);
+    SSL_CTX_set_timeout(Context, TLS_SESSION_LIFETIME);
+
+    /* The relay writes to clients that may have hung up */
+    signal(SIGPIPE, SIG_IGN);
+    return 0;
+}
+
+/**
+ * Return whether clients are served over TLS.
+ **/
+bool tls_enabled(void) {
+    return Context != NULL;
+}
+
+/**
+ * Drop reference to session, releasing it (and everything it holds) with the
+ * last one.
+ **/
+static void tls_release(TlsSession *s) {
+    if (atomic_fetch_sub(&s->references, 1) > 1) {
+        return;
+    }
+
+    SSL_free(s->ssl);
+    close(s->socket);
+    if (s->local >= 0) {
+        close(s->local);
+    }
+    free(s);
+}
+
+/**
+ * Return whether the kernel encrypts (send) or decrypts (receive) records.
+ **/
+static bool tls_offloaded(SSL *ssl, bool send) {
+#if defined(BIO_get_ktls_send) && defined(BIO_get_ktls_recv)
+    return send ? BIO_get_ktls_send(SSL_get_wbio(ssl)) > 0 : BIO_get_ktls_recv(SSL_get_rbio(ssl)) > 0;
+#else
+    return false;
+#endif
+}
+
+/**
+ * Relay between the request's socket pair and the client until the server
+ * is done responding.
+ *
+ * Both descriptors are non-blocking, so a client that is slow to send does
+ * not hold up the response (or the other way around).  The relay ends
+ * once the server has closed its end and everything it wrote has been sent.
+ **/
+static void *tls_relay(void *arg) {
+    TlsSession *s = arg;
+    char        in[TLS_RELAY_CHUNK];    /* Client to server */
+    char        out[TLS_RELAY_CHUNK];   /* Server to client */
+    size_t      in_length = 0, in_sent = 0, out_length = 0;
+    bool        reading = true;         /* Client may send more */
+    bool        writing = true;         /* Server may respond more */
+
+    fcntl(s->socket, F_SETFL, fcntl(s->socket, F_GETFL) | O_NONBLOCK);
+    fcntl(s->local, F_SETFL, fcntl(s->local, F_GETFL) | O_NONBLOCK);
+
+    while (writing || out_length > 0) {
+        short socket_events = 0, local_events = 0;
+        bool  progress = false;
+
+        if (reading && in_length == 0) {
+            int n = SSL_read(s->ssl, in, sizeof(in));
+            if (n > 0) {
+                in_length = n;
+                in_sent   = 0;
+                progress  = true;
+            } else {
+                switch (SSL_get_error(s->ssl, n)) {
+                    case SSL_ERROR_WANT_READ:
+                        socket_events |= POLLIN;
+                        break;
+                    case SSL_ERROR_WANT_WRITE:
+                        socket_events |= POLLOUT;
+                        break;
+                    default:
+                        /* Client is done sending (the server sees end of file) */
+                        ERR_clear_error();
+                        reading  = false;
+                        progress = true;
+                        shutdown(s->local, SHUT_WR);
+                        break;
+                }
+            }
+        }
+
+        if (in_length > 0) {
+            ssize_t n = write(s->local, in + in_sent, in_length - in_sent);
+            if (n > 0) {
+                in_sent += n;
+                in_length = in_sent == in_length ? 0 : in_length;
+                progress  = true;
+            } else if (n < 0 && (errno == EAGAIN || errno == EINTR)) {
+                local_events |= POLLOUT;
+            } else {
+                /* Server stopped reading: drop whatever else the client sends */
+                reading   = false;
+                in_length = 0;
+                progress  = true;
+            }
+        }
+
+        if (writing && out_length == 0) {
+            ssize_t n = read(s->local, out, sizeof(out));
+            if (n > 0) {
+                out_length = n;
+                progress   = true;
+            } else if (n < 0 && (errno == EAGAIN || errno == EINTR)) {
+                local_events |= POLLIN;
+            } else {
+                writing  = false;
+                progress = true;
+            }
+        }
+
+        if (out_length > 0) {
+            int n = SSL_write(s->ssl, out, out_length);
+            if (n > 0) {
+                out_length = 0;
+                progress   = true;
+            } else {
+                switch (SSL_get_error(s->ssl, n)) {
+                    case SSL_ERROR_WANT_READ:
+                        socket_events |= POLLIN;
+                        break;
+                    case SSL_ERROR_WANT_WRITE:
+                        socket_events |= POLLOUT;
+                        break;
+                    default:
+                        debug("Unable to relay response: %s", tls_error());
+                        goto done;
+                }
+            }
+        }
+
+        if (!progress) {
+            struct pollfd pfds[] = {
+                {.fd = socket_events ? s->socket : -1, .events = socket_events},
+                {.fd = local_events ? s->local : -1, .events = local_events},
+            };
+            if (poll(pfds, 2, -1) < 0 && errno != EINTR) {
+                goto done;
+            }
+        }
+    }
+
+    /* Best effort: clients that wait for close_notify get it */
+    fcntl(s->socket, F_SETFL, fcntl(s->socket, F_GETFL) & ~O_NONBLOCK);
+    SSL_shutdown(s->ssl);
+
+done:
+    ERR_clear_error();
+    tls_release(s);
+    return NULL;
+}
+
+/**
+ * Swap request's descriptor for one end of a socket pair and start relaying
+ * the other end to the client.
+ *
+ * @return  -1 on error and 0 on success.
+ *
+ * The descriptor keeps its number, so the request stream and response
+ * (already opened on it) need not know.
+ **/
+static int tls_relay_start(Request *r, TlsSession *s) {
+    int pair[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, pair) < 0) {
+        return -1;
+    }
+
+    if (dup3(pair[0], r->fd, O_CLOEXEC) < 0) {
+        close(pair[0]);
+        close(pair[1]);
+        return -1;
+    }
+    close(pair[0]);
+    s->local = pair[1];
+    atomic_fetch_add(&s->references, 1);
+
+    if ((errno = pthread_create(&s->thread, NULL, tls_relay, s)) != 0) {
+        /* The request's end is now the pair's, so the client is lost either way */
+        close(s->local);
+        s->local = -1;
+        atomic_fetch_sub(&s->references, 1);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Perform TLS handshake with newly accepted client.
+ *
+ * @param   r           Request structure (accepted, not yet read from).
+ * @return  -1 on error and 0 on success.
+ *
+ * Afterwards the request's descriptor carries plaintext: either the kernel
+ * does the record layer for it (kTLS, so sendfile still works and nothing is
+ * copied through user space), or it is relayed (see tls_relay).  Either way
+ * free_request finishes the session (tls_close).
+ **/
+int tls_accept(Request *r) {
+    TlsSession *s = calloc(1, sizeof(TlsSession));
+    if (!s) {
+        return -1;
+    }
+    s->local  = -1;
+    atomic_init(&s->references, 1);
+    s->socket = fcntl(r->fd, F_DUPFD_CLOEXEC, 0);
+    s->ssl    = SSL_new(Context);
+    if (s->socket < 0 || !s->ssl || SSL_set_fd(s->ssl, s->socket) != 1) {
+        log("Unable to start TLS session: %s", tls_error());
+        if (s->socket >= 0) {
+            close(s->socket);
+        }
+        SSL_free(s->ssl);
+        free(s);
+        return -1;
+    }
+    r->tls = s;
+
+    /* Clients that stall mid-handshake are dropped */
+    struct timeval timeout = {.tv_sec = TLS_HANDSHAKE_TIMEOUT};
+    setsockopt(s->socket, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(s->socket, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    if (SSL_accept(s->ssl) != 1) {
+        debug("TLS handshake with %s:%s failed: %s", request_host(r), request_port(r), tls_error());
+        return -1;
+    }
+    timeout.tv_sec = 0;
+    setsockopt(s->socket, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(s->socket, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+    bool send = tls_offloaded(s->ssl, true);
+    bool recv = tls_offloaded(s->ssl, false);
+    debug("TLS handshake with %s:%s: %s %s, %s (kTLS send %s, receive %s)", request_host(r), request_port(r),
+          SSL_get_version(s->ssl), SSL_get_cipher_name(s->ssl), SSL_session_reused(s->ssl) ? "resumed" : "full",
+          send ? "on" : "off", recv ? "on" : "off");
+
+    if (send && recv) {
+        return 0;
+    }
+    if (tls_relay_start(r, s) < 0) {
+        log("Unable to relay TLS connection: %s", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Finish TLS session of request whose descriptor was just closed.
+ *
+ * @param   r           Request structure.
+ *
+ * Waits for the relay (if any) to send what is left of the response, unless
+ * the request was detached (its CGI executor still answers it, so the relay
+ * finishes on its own).  Executors leave the session to the server.
+ **/
+void tls_close(Request *r) {
+    TlsSession *s = r->tls;
+    if (!s || r->executor) {
+        return;
+    }
+    r->tls = NULL;
+
+    if (s->local >= 0) {
+        if (r->detached) {
+            pthread_detach(s->thread);
+        } else {
+            pthread_join(s->thread, NULL);
+        }
+    } else if (!r->detached && SSL_is_init_finished(s->ssl)) {
+        SSL_shutdown(s->ssl);
+        ERR_clear_error();
+    }
+    tls_release(s);
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,151 @@
+/* trace.c: Per-request Tracing and Slow Log */
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <string.h>
+
+#include <unistd.h>
+
+/* Trace State */
+
+static volatile sig_atomic_t Tracing = 0; /* Toggled by SIGUSR1 */
+static uint64_t Threshold = 0;          /* Slow request threshold (nanoseconds) */
+static int      SlowFd    = -1;
+
+static const char *PointNames[TRACE_POINTS] = {
+    "accept",
+    "read",
+    "parsed",
+    "resolved",
+    "write",
+    "done",
+};
+
+static inline uint64_t timespec_ns(const struct timespec *ts) {
+    return (uint64_t)ts->tv_sec * 1000000000ULL + ts->tv_nsec;
+}
+
+static void trace_toggle(int signum) {
+    Tracing = !Tracing;
+}
+
+/**
+ * Open slow log.
+ *
+ * @param   path            Path to slow log ("-" for stderr).
+ * @param   threshold_ms    Requests slower than this are logged.
+ * @param   enabled         Whether tracing starts enabled.
+ * @return  -1 on error and 0 on success.
+ *
+ * Tracing can be toggled at runtime by sending the server SIGUSR1; forked
+ * workers inherit the setting in effect when they are forked.
+ **/
+int trace_open(const char *path, double threshold_ms, bool enabled) {
+    if (streq(path, "-")) {
+        SlowFd = STDERR_FILENO;
+    } else if ((SlowFd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644)) < 0) {
+        log("Unable to open slow log %s: %s", path, strerror(errno));
+        return -1;
+    }
+
+    Threshold = (uint64_t)(threshold_ms * 1000000.0);
+    Tracing   = enabled;
+    signal(SIGUSR1, trace_toggle);
+    return 0;
+}
+
+/**
+ * Begin tracing request accepted at specified monotonic time.
+ **/
+void trace_start(Trace *t, const struct timespec *accepted) {
+    memset(t, 0, sizeof(Trace));
+    t->enabled = Tracing && SlowFd >= 0;
+    if (t->enabled) {
+        t->points[TRACE_ACCEPT] = timespec_ns(accepted);
+    }
+}
+
+/**
+ * Record the first time request reaches point.
+ **/
+void trace_point(Trace *t, TracePoint point) {
+    if (!t->enabled || t->points[point]) {
+        return;
+    }
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    t->points[point] = timespec_ns(&now);
+}
+
+/**
+ * Describe request for the slow log.
+ *
+ * @param   t           Trace record.
+ * @param   r           HTTP Request structure.
+ * @param   status      Status of the HTTP request.
+ * @param   bytes       Response bytes.
+ *
+ * The label is copied so the trace can outlive the request (as it does when
+ * a server backend streams the body after the request is freed).
+ **/
+void trace_label(Trace *t, Request *r, Status status, size_t bytes) {
+    if (!t->enabled) {
+        return;
+    }
+
+    const char *status_string = http_status_string(status);
+    snprintf(t->label, sizeof(t->label), "%.46s %s \"%.12s %.80s\" %zu",
+        request_host(r), status_string ? status_string : "-",
+        r->method ? r->method : "-", r->uri ? r->uri : "-", bytes);
+}
+
+/**
+ * Complete trace, writing it to the slow log if it exceeded the threshold.
+ *
+ * Each line lists milliseconds since accept at every point reached followed
+ * by the number of client reads and writes, for example:
+ *
+ *  slow 153.204ms 127.0.0.1 200 OK "GET /big.bin" 5242880 read=0.041 ... reads=1 writes=640
+ **/
+void trace_finish(Trace *t) {
+    /* Connections closed before a request was handled have no label */
+    if (!t->enabled || !t->label[0]) {
+        return;
+    }
+
+    trace_point(t, TRACE_DONE);
+    t->enabled = false;
+    uint64_t start   = t->points[TRACE_ACCEPT];
+    uint64_t elapsed = t->points[TRACE_DONE] - start;
+    if (elapsed < Threshold) {
+        return;
+    }
+
+    char line[512];
+    int  n = snprintf(line, sizeof(line), "slow %.3fms %s", elapsed / 1e6, t->label);
+    for (int p = TRACE_FIRST_READ; p < TRACE_POINTS && n < (int)sizeof(line); p++) {
+        if (t->points[p]) {
+            n += snprintf(line + n, sizeof(line) - n, " %s=%.3f", PointNames[p], (t->points[p] - start) / 1e6);
+        } else {
+            n += snprintf(line + n, sizeof(line) - n, " %s=-", PointNames[p]);
+        }
+    }
+    if (n < (int)sizeof(line)) {
+        n += snprintf(line + n, sizeof(line) - n, " reads=%u writes=%u\n", t->reads, t->writes);
+    }
+    if (n >= (int)sizeof(line)) {
+        n = sizeof(line) - 1;
+        line[n - 1] = '\n';
+    }
+
+    /* One write per line keeps lines from forked workers intact */
+    if (write(SlowFd, line, n) < 0) {
+        debug("Unable to write slow log: %s", strerror(errno));
+    }
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,120 @@
+/* transfer.c: Transfer Scheduler */
+
+#include "spidey.h"
+
+#include <limits.h>
+
+/* Constants */
+
+#define TRANSFER_AGING_MAX  32          /* Turns lost after which bias no longer grows */
+
+/**
+ * Start transfer of a body.
+ *
+ * @param   t           Transfer.
+ * @param   length      Bytes of body to send.
+ **/
+void transfer_start(Transfer *t, off_t length) {
+    t->remaining = length;
+    t->passes    = 0;
+}
+
+/**
+ * Return bytes to send on the transfer's turn.
+ **/
+size_t transfer_quantum(const Transfer *t) {
+    return t->remaining < TRANSFER_QUANTUM ? (size_t)t->remaining : TRANSFER_QUANTUM;
+}
+
+/**
+ * Choose the transfer that gets the next turn.
+ *
+ * @param   transfers   Candidate transfers (ready to send).
+ * @param   n           Number of candidates.
+ * @return  Index of chosen transfer (-1 if there is none).
+ *
+ * Shortest remaining goes first, so small responses are not queued behind
+ * bulk ones; every turn a transfer loses halves its weight, so even the
+ * largest download gets a turn within a bounded number of them.
+ **/
+ssize_t transfer_pick(Transfer *const *transfers, size_t n) {
+    ssize_t best = -1;
+    off_t   best_weight = 0;
+
+    for (size_t i = 0; i < n; i++) {
+        const Transfer *t = transfers[i];
+        off_t weight = t->remaining >> (t->passes < TRANSFER_AGING_MAX ? t->passes : TRANSFER_AGING_MAX);
+        if (best < 0 || weight < best_weight) {
+            best        = i;
+            best_weight = weight;
+        }
+    }
+
+    for (size_t i = 0; i < n; i++) {
+        if ((ssize_t)i != best && transfers[i]->passes < UINT_MAX) {
+            transfers[i]->passes++;
+        }
+    }
+    return best;
+}
+
+/**
+ * Record bytes handed out on a transfer's turn.
+ **/
+void transfer_sent(Transfer *t, size_t sent) {
+    t->remaining -= sent;
+    t->passes     = 0;
+}
+
+/* Bandwidth Caps
+ *
+ * A connection capped by TransferRate keeps the earliest time it may send
+ * again; every send pushes that time back by as long as the bytes take at the
+ * capped rate. */
+
+/**
+ * Push back pacing time of a connection that sent bytes.
+ *
+ * @param   eligible    Earliest time of next send (updated).
+ * @param   sent        Bytes sent.
+ * @param   now         Current monotonic time.
+ **/
+void transfer_pace(struct timespec *eligible, size_t sent, const struct timespec *now) {
+    if (TransferRate <= 0) {
+        return;
+    }
+
+    if (!transfer_throttled(eligible, now)) {
+        *eligible = *now;
+    }
+
+    long long nsecs = (long long)sent * 1000000000LL / TransferRate;
+    eligible->tv_sec  += nsecs / 1000000000LL;
+    eligible->tv_nsec += nsecs % 1000000000LL;
+    if (eligible->tv_nsec >= 1000000000L) {
+        eligible->tv_sec++;
+        eligible->tv_nsec -= 1000000000L;
+    }
+}
+
+/**
+ * Return whether pacing time is still in the future.
+ **/
+bool transfer_throttled(const struct timespec *eligible, const struct timespec *now) {
+    return eligible->tv_sec > now->tv_sec || (eligible->tv_sec == now->tv_sec && eligible->tv_nsec > now->tv_nsec);
+}
+
+/**
+ * Return milliseconds until pacing time (rounded up; 0 if it has passed).
+ **/
+int transfer_wait(const struct timespec *eligible, const struct timespec *now) {
+    if (!transfer_throttled(eligible, now)) {
+        return 0;
+    }
+
+    long long nsecs = (long long)(eligible->tv_sec - now->tv_sec) * 1000000000LL + (eligible->tv_nsec - now->tv_nsec);
+    long long msecs = (nsecs + 999999) / 1000000;
+    return msecs < INT_MAX ? (int)msecs : INT_MAX;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
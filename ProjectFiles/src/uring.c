@@ -0,0 +1,1113 @@
+/* uring.c: io_uring HTTP Server */
+
+#define _GNU_SOURCE
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <signal.h>
+#include <string.h>
+
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define HAVE_IO_URING
+#endif
+#endif
+
+#ifdef HAVE_IO_URING
+
+#include <stdatomic.h>
+#include <stdint.h>
+
+#include <linux/io_uring.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+
+/* Constants */
+
+#define URING_ENTRIES       256         /* Submission queue entries */
+#define URING_CONNECTIONS   (128*1024)  /* Most connection slots (fixed files), if descriptors allow */
+#define URING_RESERVED_FDS  64          /* Descriptors left for files, pipes, and logs */
+#define URING_ACCEPTS       8           /* Accepts kept in flight */
+#define URING_BUFFERS       128         /* Registered buffers shared by all connections */
+#define URING_BUFSIZ        (64*1024)   /* Registered buffer size */
+#define URING_REPLIES       128         /* Idle reply states kept for reuse */
+#define URING_INFLIGHT      16          /* File chunks in flight at once */
+#define URING_IO_THREADS    4           /* Threads reading chunks not in the page cache */
+#define URING_HEAD_TIMEOUT  30          /* Seconds a client may take to send its request head */
+
+/**
+ * Operation tags stored in the low byte of each SQE's user_data
+ */
+typedef enum {
+    OP_ACCEPT = 1,                      /**< Accept client into slot */
+    OP_REGISTER,                        /**< Install socket into fixed file slot */
+    OP_POLL,                            /**< Wait for request bytes (before taking a buffer) */
+    OP_RECV,                            /**< Receive request headers */
+    OP_SEND_HEAD,                       /**< Send response slices */
+    OP_READ_BODY,                       /**< Read file chunk into slot buffer */
+    OP_SEND_BODY,                       /**< Send file chunk from slot buffer */
+    OP_UNREGISTER,                      /**< Remove socket from fixed file slot */
+    OP_CANCEL,                          /**< Cancel accept when draining */
+    OP_TIMEOUT,                         /**< Wake up for throttled bodies */
+    OP_WAKE,                            /**< Collect chunks read by I/O threads */
+    OP_DEADLINE,                        /**< Give up on request head (linked to poll) */
+} Operation;
+
+/* Ring */
+
+typedef struct {
+    int                  fd;            /*< Ring file descriptor */
+
+    unsigned            *sq_head;       /*< Submission queue head (kernel) */
+    unsigned            *sq_tail;       /*< Submission queue tail (us) */
+    unsigned            *sq_mask;       /*< Submission queue index mask */
+    unsigned            *sq_array;      /*< Submission queue index array */
+    struct io_uring_sqe *sqes;          /*< Submission queue entries */
+    unsigned             sq_pending;    /*< Entries queued but not submitted */
+
+    unsigned            *cq_head;       /*< Completion queue head (us) */
+    unsigned            *cq_tail;       /*< Completion queue tail (kernel) */
+    unsigned            *cq_mask;       /*< Completion queue index mask */
+    struct io_uring_cqe *cqes;          /*< Completion queue entries */
+
+    void                *sq_ring;       /*< Mapped submission ring */
+    size_t               sq_ring_size;  /*< Size of submission ring mapping */
+    void                *cq_ring;       /*< Mapped completion ring */
+    size_t               cq_ring_size;  /*< Size of completion ring mapping */
+    size_t               sqes_size;     /*< Size of entries mapping */
+} Ring;
+
+/* Reply: state of a connection being answered (pooled, so idle connections
+ * do without it) */
+
+typedef struct Reply Reply;
+struct Reply {
+    Response            *response;      /*< Response built by handlers (reused) */
+    struct msghdr        msg;           /*< Message describing unsent slices */
+    struct iovec         iov[RESPONSE_SLICES];
+
+    int                  body_fd;       /*< File body (-1 if none) */
+    off_t                body_offset;   /*< Offset of next byte to read */
+    off_t                body_end;      /*< Offset just past the body */
+    size_t               chunk_length;  /*< Bytes of current chunk */
+    size_t               chunk_sent;    /*< Bytes of current chunk sent */
+    Transfer             transfer;      /*< Scheduling state of file body */
+    struct timespec      eligible;      /*< Earliest time of next chunk (bandwidth cap) */
+    bool                 cold;          /*< Chunk was not in the page cache */
+    FileJob              job;           /*< Read of cold chunk by an I/O thread */
+
+    Reply               *next;          /*< Next idle reply in pool */
+};
+
+/* Connection: what every slot keeps, idle or not */
+
+typedef struct {
+    int                  fd;            /*< Client socket (also registered in fixed slot; -1 while accepting) */
+    bool                 busy;          /*< Whether the slot is in use */
+    bool                 waiting;       /*< Whether body waits for its next turn */
+    bool                 listed;        /*< Whether slot is on the Waiting list */
+    int                  buffer;        /*< Registered buffer held (-1 if none) */
+    uint32_t             nrecv;         /*< Bytes of request received */
+    uint32_t             nread;         /*< Bytes of request consumed by parser */
+    struct sockaddr_storage addr;       /*< Client address filled in by accept */
+    socklen_t            addrlen;       /*< Client address length */
+    struct timespec      accepted;      /*< Monotonic time client was accepted */
+    struct __kernel_timespec deadline;  /*< Monotonic time request head must arrive by */
+    char                *head;          /*< Partial request head kept between reads (NULL if none) */
+    Trace                trace;         /*< Trace kept until the response is sent */
+    Reply               *reply;         /*< Reply state (NULL until a request is dispatched) */
+} Connection;
+
+/* Server State
+ *
+ * Slots are handed out from a stack of freed ones (or, before any is freed,
+ * past the highest used), so untouched slots cost no memory.  Buffers are
+ * held only while a request is received or a file chunk is in flight;
+ * requests that arrive while none is free are parked until one is given
+ * back. */
+
+static Ring        TheRing;
+static Connection *Connections;
+static int         Slots = 0;           /* Connection slots (fixed files) */
+static int         NextSlot = 0;        /* Lowest slot never used */
+static int        *FreeSlots;           /* Slots given back (stack) */
+static int         NFreeSlots = 0;
+static char       *Buffers;
+static int         FreeBuffers[URING_BUFFERS];
+static int         NFreeBuffers = 0;
+static int         Receiving = 0;       /* Buffers held by requests being received */
+static int        *Parked;              /* Slots with a request to receive but no buffer (FIFO) */
+static int         ParkedHead = 0;
+static int         NParked = 0;
+static int        *Waiting;             /* Slots whose bodies may wait for a turn */
+static int         NWaiting = 0;
+static Transfer  **Candidates;          /* Bodies competing for turns (see schedule_bodies) */
+static int        *CandidateSlots;
+static Reply      *Replies = NULL;      /* Idle replies */
+static int         NReplies = 0;
+static int         Accepting = 0;
+static const int   NoFile = -1;
+static int         InFlight = 0;        /* File chunks queued and not yet sent */
+static bool        Waking = false;      /* Whether a timeout is queued */
+static struct __kernel_timespec WakeTime;
+static int         IoWake = -1;         /* Eventfd of blocking I/O threads (-1 if none) */
+static uint64_t    IoCount;
+
+/* Ring Functions */
+
+static int io_uring_setup(unsigned entries, struct io_uring_params *p) {
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int io_uring_register(int fd, unsigned opcode, const void *arg, unsigned nr_args) {
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+/**
+ * Create ring and map its submission and completion queues.
+ *
+ * @param   ring        Ring structure.
+ * @param   entries     Number of submission queue entries.
+ * @return  -1 on error and 0 on success.
+ **/
+static int ring_init(Ring *ring, unsigned entries) {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    memset(ring, 0, sizeof(Ring));
+
+    ring->fd = io_uring_setup(entries, &p);
+    if (ring->fd < 0) {
+        return -1;
+    }
+
+    ring->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    ring->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_ring_size > ring->sq_ring_size) {
+            ring->sq_ring_size = ring->cq_ring_size;
+        }
+        ring->cq_ring_size = ring->sq_ring_size;
+    }
+
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ring == MAP_FAILED) {
+        goto fail;
+    }
+
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->cq_ring = ring->sq_ring;
+    } else {
+        ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+        if (ring->cq_ring == MAP_FAILED) {
+            goto fail;
+        }
+    }
+
+    ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        goto fail;
+    }
+
+    ring->sq_head  = (unsigned *)((char *)ring->sq_ring + p.sq_off.head);
+    ring->sq_tail  = (unsigned *)((char *)ring->sq_ring + p.sq_off.tail);
+    ring->sq_mask  = (unsigned *)((char *)ring->sq_ring + p.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)((char *)ring->sq_ring + p.sq_off.array);
+    ring->cq_head  = (unsigned *)((char *)ring->cq_ring + p.cq_off.head);
+    ring->cq_tail  = (unsigned *)((char *)ring->cq_ring + p.cq_off.tail);
+    ring->cq_mask  = (unsigned *)((char *)ring->cq_ring + p.cq_off.ring_mask);
+    ring->cqes     = (struct io_uring_cqe *)((char *)ring->cq_ring + p.cq_off.cqes);
+    return 0;
+
+fail:
+    close(ring->fd);
+    ring->fd = -1;
+    return -1;
+}
+
+/**
+ * Submit queued entries and wait for at least one completion.
+ *
+ * @param   ring        Ring structure.
+ * @return  -1 on error and 0 on success.
+ **/
+static int ring_submit_and_wait(Ring *ring) {
+    int submitted = io_uring_enter(ring->fd, ring->sq_pending, 1, IORING_ENTER_GETEVENTS);
+    if (submitted < 0) {
+        return (errno == EINTR) ? 0 : -1;
+    }
+    ring->sq_pending -= submitted;
+    return 0;
+}
+
+/**
+ * Reserve the next submission queue entry, flushing the queue if it is full.
+ *
+ * @param   ring        Ring structure.
+ * @return  Zeroed submission queue entry.
+ **/
+static struct io_uring_sqe *ring_get_sqe(Ring *ring) {
+    unsigned head = atomic_load_explicit((_Atomic unsigned *)ring->sq_head, memory_order_acquire);
+    unsigned tail = *ring->sq_tail;
+
+    while (tail - head > *ring->sq_mask) {
+        int submitted = io_uring_enter(ring->fd, ring->sq_pending, 0, 0);
+        if (submitted > 0) {
+            ring->sq_pending -= submitted;
+        }
+        head = atomic_load_explicit((_Atomic unsigned *)ring->sq_head, memory_order_acquire);
+    }
+
+    unsigned index = tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    ring->sq_array[index] = index;
+    atomic_store_explicit((_Atomic unsigned *)ring->sq_tail, tail + 1, memory_order_release);
+    ring->sq_pending++;
+    return sqe;
+}
+
+/* Pools */
+
+static inline char *buffer_data(int buffer) {
+    return Buffers + (size_t)buffer * URING_BUFSIZ;
+}
+
+/**
+ * Take slot for a new connection (-1 if all are in use).
+ **/
+static int slot_take(void) {
+    if (NFreeSlots > 0) {
+        return FreeSlots[--NFreeSlots];
+    }
+    return NextSlot < Slots ? NextSlot++ : -1;
+}
+
+/**
+ * Give back slot of a closed connection.
+ **/
+static void slot_give(int slot) {
+    Connections[slot].busy = false;
+    FreeSlots[NFreeSlots++] = slot;
+}
+
+/**
+ * Take reply state for a dispatched request (NULL on error).
+ **/
+static Reply *reply_take(void) {
+    Reply *x = Replies;
+    if (x) {
+        Replies = x->next;
+        NReplies--;
+    } else if (!(x = calloc(1, sizeof(Reply))) || !(x->response = response_new(-1, NULL))) {
+        free(x);
+        return NULL;
+    }
+
+    x->body_fd  = -1;
+    x->eligible = (struct timespec){0, 0};
+    x->cold     = false;
+    return x;
+}
+
+/**
+ * Give back reply state of a closed connection (kept for reuse up to
+ * URING_REPLIES, so a burst does not pin its memory).
+ **/
+static void reply_give(Reply *x) {
+    if (NReplies >= URING_REPLIES) {
+        response_free(x->response);
+        free(x);
+        return;
+    }
+
+    response_reset(x->response);
+    x->next = Replies;
+    Replies = x;
+    NReplies++;
+}
+
+/* Submission Helpers */
+
+static inline uint64_t pack(int slot, Operation op) {
+    return ((uint64_t)slot << 8) | op;
+}
+
+static void queue_accept(int sfd, int slot) {
+    Connection *c = &Connections[slot];
+    struct io_uring_sqe *sqe = ring_get_sqe(&TheRing);
+
+    c->busy     = true;
+    c->fd       = -1;
+    c->addrlen  = sizeof(c->addr);
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd     = sfd;
+    sqe->addr   = (uint64_t)(uintptr_t)&c->addr;
+    sqe->addr2  = (uint64_t)(uintptr_t)&c->addrlen;
+    sqe->user_data = pack(slot, OP_ACCEPT);
+    Accepting++;
+}
+
+static void queue_cancel_accept(int slot) {
+    struct io_uring_sqe *sqe = ring_get_sqe(&TheRing);
+
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd     = -1;
+    sqe->addr   = pack(slot, OP_ACCEPT);
+    sqe->user_data = pack(slot, OP_CANCEL);
+}
+
+static void queue_files_update(int slot, const int *fd, Operation op, unsigned flags) {
+    struct io_uring_sqe *sqe = ring_get_sqe(&TheRing);
+
+    sqe->opcode = IORING_OP_FILES_UPDATE;
+    sqe->fd     = -1;
+    sqe->addr   = (uint64_t)(uintptr_t)fd;
+    sqe->len    = 1;
+    sqe->off    = slot;
+    sqe->flags  = flags;
+    sqe->user_data = pack(slot, op);
+}
+
+/**
+ * Queue poll for request bytes, linked to a timeout at the slot's deadline
+ * (the poll then fails with -ECANCELED).
+ **/
+static void queue_poll(int slot, unsigned flags) {
+    Connection *c = &Connections[slot];
+    struct io_uring_sqe *sqe = ring_get_sqe(&TheRing);
+
+    sqe->opcode        = IORING_OP_POLL_ADD;
+    sqe->fd            = slot;
+    sqe->flags         = IOSQE_FIXED_FILE | IOSQE_IO_LINK | flags;
+    sqe->poll32_events = POLLIN;
+    sqe->user_data     = pack(slot, OP_POLL);
+
+    sqe = ring_get_sqe(&TheRing);
+    sqe->opcode        = IORING_OP_LINK_TIMEOUT;
+    sqe->fd            = -1;
+    sqe->addr          = (uint64_t)(uintptr_t)&c->deadline;
+    sqe->len           = 1;
+    sqe->timeout_flags = IORING_TIMEOUT_ABS;
+    sqe->user_data     = pack(slot, OP_DEADLINE);
+}
+
+static void queue_recv(int slot) {
+    Connection *c = &Connections[slot];
+    struct io_uring_sqe *sqe = ring_get_sqe(&TheRing);
+
+    sqe->opcode    = IORING_OP_READ_FIXED;
+    sqe->fd        = slot;
+    sqe->flags     = IOSQE_FIXED_FILE;
+    sqe->addr      = (uint64_t)(uintptr_t)(buffer_data(c->buffer) + c->nrecv);
+    sqe->len       = URING_BUFSIZ - c->nrecv - 1;
+    sqe->buf_index = c->buffer;
+    sqe->user_data = pack(slot, OP_RECV);
+}
+
+static void queue_send_head(int slot) {
+    Reply *x = Connections[slot].reply;
+    struct io_uring_sqe *sqe = ring_get_sqe(&TheRing);
+
+    memset(&x->msg, 0, sizeof(x->msg));
+    x->msg.msg_iov    = x->iov;
+    x->msg.msg_iovlen = response_iovecs(x->response, x->iov, RESPONSE_SLICES);
+
+    sqe->opcode    = IORING_OP_SENDMSG;
+    sqe->fd        = slot;
+    sqe->flags     = IOSQE_FIXED_FILE;
+    sqe->addr      = (uint64_t)(uintptr_t)&x->msg;
+    sqe->len       = 1;
+    sqe->msg_flags = MSG_NOSIGNAL | (x->body_fd >= 0 ? MSG_MORE : 0);
+    sqe->user_data = pack(slot, OP_SEND_HEAD);
+}
+
+static void queue_send_body(int slot, unsigned flags) {
+    Connection *c = &Connections[slot];
+    struct io_uring_sqe *sqe = ring_get_sqe(&TheRing);
+
+    sqe->opcode    = IORING_OP_WRITE_FIXED;
+    sqe->fd        = slot;
+    sqe->flags     = IOSQE_FIXED_FILE | flags;
+    sqe->addr      = (uint64_t)(uintptr_t)(buffer_data(c->buffer) + c->reply->chunk_sent);
+    sqe->len       = c->reply->chunk_length - c->reply->chunk_sent;
+    sqe->buf_index = c->buffer;
+    sqe->user_data = pack(slot, OP_SEND_BODY);
+}
+
+static void queue_timeout(const struct timespec *when) {
+    struct io_uring_sqe *sqe = ring_get_sqe(&TheRing);
+
+    WakeTime.tv_sec  = when->tv_sec;
+    WakeTime.tv_nsec = when->tv_nsec;
+    sqe->opcode        = IORING_OP_TIMEOUT;
+    sqe->fd            = -1;
+    sqe->addr          = (uint64_t)(uintptr_t)&WakeTime;
+    sqe->len           = 1;
+    sqe->timeout_flags = IORING_TIMEOUT_ABS;
+    sqe->user_data     = pack(0, OP_TIMEOUT);
+    Waking = true;
+}
+
+static void queue_wake(void) {
+    struct io_uring_sqe *sqe = ring_get_sqe(&TheRing);
+
+    sqe->opcode    = IORING_OP_READ;
+    sqe->fd        = IoWake;
+    sqe->addr      = (uint64_t)(uintptr_t)&IoCount;
+    sqe->len       = sizeof(IoCount);
+    sqe->user_data = pack(0, OP_WAKE);
+}
+
+/**
+ * Queue the next file chunk as a linked read and send pair.
+ *
+ * A short read fails the link, which cancels the send.  Reads only use the
+ * page cache (RWF_NOWAIT) when there are I/O threads to take the ones that
+ * would wait on the disk (see read_cold_chunk); otherwise a short read ends
+ * the transfer.  The slot must hold a buffer.
+ **/
+static void queue_body_chunk(int slot, const struct timespec *now) {
+    Connection *c = &Connections[slot];
+    Reply      *x = c->reply;
+    struct io_uring_sqe *sqe = ring_get_sqe(&TheRing);
+
+    size_t quantum = transfer_quantum(&x->transfer);
+    x->chunk_length = quantum < URING_BUFSIZ ? quantum : URING_BUFSIZ;
+    x->chunk_sent   = 0;
+    c->waiting      = false;
+    transfer_sent(&x->transfer, x->chunk_length);
+    transfer_pace(&x->eligible, x->chunk_length, now);
+    InFlight++;
+
+    sqe->opcode    = IORING_OP_READ_FIXED;
+    sqe->fd        = x->body_fd;
+    sqe->flags     = IOSQE_IO_LINK;
+    sqe->addr      = (uint64_t)(uintptr_t)buffer_data(c->buffer);
+    sqe->len       = x->chunk_length;
+    sqe->off       = x->body_offset;
+    sqe->buf_index = c->buffer;
+    sqe->rw_flags  = IoWake >= 0 ? RWF_NOWAIT : 0;
+    sqe->user_data = pack(slot, OP_READ_BODY);
+
+    queue_send_body(slot, 0);
+}
+
+/**
+ * Hand chunk that is not in the page cache to an I/O thread.
+ **/
+static void read_cold_chunk(int slot) {
+    Connection *c = &Connections[slot];
+    Reply      *x = c->reply;
+
+    x->cold        = false;
+    x->job.fd      = x->body_fd;
+    x->job.buffer  = buffer_data(c->buffer);
+    x->job.length  = x->chunk_length;
+    x->job.offset  = x->body_offset;
+    x->job.data    = (void *)(intptr_t)slot;
+    stats_cold_read();
+    fileio_submit(&x->job);
+}
+
+/* Buffers and Turns */
+
+/**
+ * Receive request into a buffer, or park connection until one is free.
+ *
+ * Requests being received hold at most URING_BUFFERS - URING_INFLIGHT
+ * buffers, so slow clients cannot starve file bodies of theirs.  Buffers are
+ * only taken once bytes are waiting, so the receive completes right away.
+ **/
+static void connection_receive(int slot) {
+    Connection *c = &Connections[slot];
+
+    if (Receiving >= URING_BUFFERS - URING_INFLIGHT) {
+        Parked[(ParkedHead + NParked++) % Slots] = slot;
+        return;
+    }
+    Receiving++;
+    c->buffer = FreeBuffers[--NFreeBuffers];
+    if (c->head) {
+        memcpy(buffer_data(c->buffer), c->head, c->nrecv);
+        free(c->head);
+        c->head = NULL;
+    }
+    queue_recv(slot);
+}
+
+/**
+ * Give back slot's buffer (if any); a request buffer goes to the first
+ * parked connection.
+ **/
+static void connection_release(int slot) {
+    Connection *c = &Connections[slot];
+    if (c->buffer < 0) {
+        return;
+    }
+
+    FreeBuffers[NFreeBuffers++] = c->buffer;
+    c->buffer = -1;
+    if (c->reply) {
+        return;
+    }
+
+    Receiving--;
+    if (NParked > 0) {
+        int next = Parked[ParkedHead];
+        ParkedHead = (ParkedHead + 1) % Slots;
+        NParked--;
+        connection_receive(next);
+    }
+}
+
+/**
+ * Mark body as waiting for its next turn.
+ **/
+static void connection_wait(int slot) {
+    Connection *c = &Connections[slot];
+
+    c->waiting = true;
+    if (!c->listed) {
+        c->listed = true;
+        Waiting[NWaiting++] = slot;
+    }
+}
+
+/**
+ * Hand out turns to file bodies waiting for one.
+ *
+ * Bodies go out one chunk per turn with at most URING_INFLIGHT chunks in
+ * flight, so a large download cannot fill the ring (and the sockets) ahead of
+ * small responses; turns favor the shortest remaining body (see
+ * transfer_pick).  Each chunk holds a buffer until it is sent.  Bodies over
+ * their bandwidth cap sit out until a timeout wakes the loop.
+ **/
+static void schedule_bodies(void) {
+    struct timespec now, wake = {0, 0};
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    /* Only slots on the Waiting list are looked at; the list is rebuilt as it goes */
+    int n = 0, listed = NWaiting;
+    NWaiting = 0;
+    for (int i = 0; i < listed; i++) {
+        int         slot = Waiting[i];
+        Connection *c = &Connections[slot];
+        c->listed = false;
+        if (!c->waiting) {
+            continue;
+        }
+        if (transfer_throttled(&c->reply->eligible, &now)) {
+            if ((wake.tv_sec == 0 && wake.tv_nsec == 0) || transfer_throttled(&wake, &c->reply->eligible)) {
+                wake = c->reply->eligible;
+            }
+            connection_wait(slot);
+            continue;
+        }
+        Candidates[n]     = &c->reply->transfer;
+        CandidateSlots[n++] = slot;
+    }
+
+    while (n > 0 && InFlight < URING_INFLIGHT && NFreeBuffers > 0) {
+        ssize_t i = transfer_pick(Candidates, n);
+        int  slot = CandidateSlots[i];
+        Connections[slot].buffer = FreeBuffers[--NFreeBuffers];
+        queue_body_chunk(slot, &now);
+        Candidates[i]     = Candidates[n - 1];
+        CandidateSlots[i] = CandidateSlots[--n];
+    }
+
+    /* The rest wait for their next turn */
+    while (n > 0) {
+        connection_wait(CandidateSlots[--n]);
+    }
+
+    if (!Waking && (wake.tv_sec || wake.tv_nsec)) {
+        queue_timeout(&wake);
+    }
+}
+
+/* Connection Functions */
+
+static ssize_t connection_read(void *cookie, char *buf, size_t size) {
+    Connection *c = cookie;
+    size_t available = c->nrecv - c->nread;
+    size_t n = size < available ? size : available;
+
+    memcpy(buf, buffer_data(c->buffer) + c->nread, n);
+    c->nread += n;
+    return n;
+}
+
+static int connection_close(void *cookie) {
+    return 0;
+}
+
+/**
+ * Release connection slot, closing client socket and file body.
+ **/
+static void connection_close_slot(int slot) {
+    Connection *c = &Connections[slot];
+    Reply      *x = c->reply;
+
+    if (x && x->body_fd >= 0) {
+        fileio_release(x->body_fd, 0, x->body_end);
+        close(x->body_fd);
+        x->body_fd = -1;
+    }
+    connection_release(slot);
+    free(c->head);
+    c->head    = NULL;
+    c->waiting = false;
+    trace_finish(&c->trace);
+    queue_files_update(slot, &NoFile, OP_UNREGISTER, 0);
+}
+
+/**
+ * Set partial request head aside and give back its buffer until more bytes
+ * arrive, so clients sending slowly hold no buffer between reads.
+ **/
+static void connection_suspend(int slot) {
+    Connection *c = &Connections[slot];
+
+    if (!(c->head = malloc(c->nrecv))) {
+        connection_close_slot(slot);
+        return;
+    }
+    memcpy(c->head, buffer_data(c->buffer), c->nrecv);
+    connection_release(slot);
+    queue_poll(slot, 0);
+}
+
+/**
+ * Send chunks read by I/O threads.
+ **/
+static void send_cold_chunks(void) {
+    for (FileJob *job = fileio_completed(), *next; job; job = next) {
+        next = job->next;
+
+        int slot = (int)(intptr_t)job->data;
+        if (job->error || job->result != Connections[slot].reply->chunk_length) {
+            debug("Unable to read file body: %s", strerror(job->error ? job->error : EIO));
+            InFlight--;
+            connection_close_slot(slot);
+            continue;
+        }
+        queue_send_body(slot, 0);
+    }
+}
+
+/**
+ * Parse and handle buffered request, capturing the response for sending.
+ **/
+static void connection_dispatch(int slot) {
+    Connection *c = &Connections[slot];
+
+    Request *r = calloc(1, sizeof(Request));
+    Reply   *x = r ? reply_take() : NULL;
+    if (!x) {
+        free(r);
+        connection_close_slot(slot);
+        return;
+    }
+
+    r->fd       = c->fd;
+    r->start    = c->accepted;
+    r->trace    = c->trace;
+    r->response = x->response;
+    r->addr     = c->addr;
+    r->addrlen  = c->addrlen;
+
+    r->stream   = request_stream(r, c, connection_read, connection_close);
+    r->received = c->nrecv;
+    if (!r->stream) {
+        free(r);
+        reply_give(x);
+        connection_close_slot(slot);
+        return;
+    }
+
+    debug("Accepted Request From %s:%s", request_host(r), request_port(r));
+    handle_request(r);
+
+    /* Take ownership of file body; the slices stay in the reply's response */
+    off_t length = 0;
+    x->body_fd  = response_take_body(x->response, &x->body_offset, &length);
+    x->body_end = x->body_offset + length;
+    c->trace    = r->trace;
+    transfer_start(&x->transfer, length);
+
+    r->response = NULL;
+    free_request(r);
+
+    /* The request is parsed, so its buffer can serve someone else */
+    connection_release(slot);
+    c->reply = x;
+
+    if (response_pending(x->response) > 0) {
+        queue_send_head(slot);
+    } else if (x->body_fd >= 0 && length > 0) {
+        connection_wait(slot);
+    } else {
+        connection_close_slot(slot);
+    }
+}
+
+/**
+ * Process completion queue entry.
+ **/
+static void handle_completion(int sfd, struct io_uring_cqe *cqe) {
+    int slot = (int)(cqe->user_data >> 8);
+    Operation op = (Operation)(cqe->user_data & 0xff);
+    Connection *c = &Connections[slot];
+    Reply      *x = c->reply;
+    int res = cqe->res;
+
+    switch (op) {
+        case OP_ACCEPT:
+            Accepting--;
+            if (res < 0) {
+                debug("Unable to Accept Client: %s", strerror(-res));
+                slot_give(slot);
+                break;
+            }
+            c->fd = res;
+            clock_gettime(CLOCK_MONOTONIC, &c->accepted);
+            trace_start(&c->trace, &c->accepted);
+            stats_connection(1);
+            c->deadline.tv_sec  = c->accepted.tv_sec + URING_HEAD_TIMEOUT;
+            c->deadline.tv_nsec = c->accepted.tv_nsec;
+            c->nrecv   = c->nread = 0;
+            c->buffer  = -1;
+            c->head    = NULL;
+            c->reply   = NULL;
+            c->waiting = false;
+            queue_files_update(slot, &c->fd, OP_REGISTER, IOSQE_IO_LINK);
+            queue_poll(slot, 0);
+            break;
+
+        case OP_REGISTER:
+            if (res < 0) {
+                debug("Unable to register client: %s", strerror(-res));
+            }
+            break;
+
+        case OP_POLL:
+            if (res < 0) {
+                connection_close_slot(slot);
+                break;
+            }
+            connection_receive(slot);
+            break;
+
+        case OP_RECV:
+            if (res <= 0) {
+                connection_close_slot(slot);
+                break;
+            }
+            c->trace.reads++;
+            trace_point(&c->trace, TRACE_FIRST_READ);
+            c->nrecv += res;
+            buffer_data(c->buffer)[c->nrecv] = 0;
+            if (strstr(buffer_data(c->buffer), "\r\n\r\n") || strstr(buffer_data(c->buffer), "\n\n") || c->nrecv >= URING_BUFSIZ - 1) {
+                connection_dispatch(slot);
+            } else {
+                connection_suspend(slot);
+            }
+            break;
+
+        case OP_SEND_HEAD:
+            if (res <= 0) {
+                connection_close_slot(slot);
+                break;
+            }
+            c->trace.writes++;
+            trace_point(&c->trace, TRACE_FIRST_WRITE);
+            response_advance(x->response, res);
+            if (response_pending(x->response) > 0) {
+                queue_send_head(slot);
+            } else if (x->body_fd >= 0 && x->body_offset < x->body_end) {
+                connection_wait(slot);
+            } else {
+                connection_close_slot(slot);
+            }
+            break;
+
+        case OP_READ_BODY:
+            if (res != (int)x->chunk_length) {
+                /* Wait on the disk in an I/O thread once the send is cancelled */
+                x->cold = IoWake >= 0 && (res == -EAGAIN || res >= 0);
+                if (!x->cold) {
+                    debug("Short read of file body: %d", res);
+                }
+            }
+            break;
+
+        case OP_SEND_BODY:
+            if (res <= 0 && x->cold) {
+                read_cold_chunk(slot);
+                break;
+            }
+            if (res <= 0) {
+                InFlight--;
+                connection_close_slot(slot);
+                break;
+            }
+            c->trace.writes++;
+            trace_point(&c->trace, TRACE_FIRST_WRITE);
+            x->chunk_sent += res;
+            if (x->chunk_sent < x->chunk_length) {
+                queue_send_body(slot, 0);
+                break;
+            }
+            InFlight--;
+            connection_release(slot);
+            x->body_offset += x->chunk_length;
+            if (x->body_offset < x->body_end) {
+                connection_wait(slot);
+            } else {
+                connection_close_slot(slot);
+            }
+            break;
+
+        case OP_CANCEL:
+        case OP_DEADLINE:
+            break;
+
+        case OP_TIMEOUT:
+            Waking = false;
+            break;
+
+        case OP_WAKE:
+            if (res < 0 && res != -EINTR) {
+                fatal("Unable to wait for I/O threads: %s", strerror(-res));
+            }
+            send_cold_chunks();
+            queue_wake();
+            break;
+
+        case OP_UNREGISTER:
+            stats_connection(-1);
+            close(c->fd);
+            c->fd = -1;
+            if (x) {
+                reply_give(x);
+                c->reply = NULL;
+            }
+            slot_give(slot);
+            break;
+    }
+}
+
+/**
+ * Keep URING_ACCEPTS accepts in flight (as long as there are free slots).
+ **/
+static void replenish_accepts(int sfd) {
+    int slot;
+    while (Accepting < URING_ACCEPTS && (slot = slot_take()) >= 0) {
+        queue_accept(sfd, slot);
+    }
+}
+
+/**
+ * Stop accepting: cancel accepts in flight on idle slots.
+ **/
+static void cancel_accepts(void) {
+    for (int slot = 0; slot < NextSlot; slot++) {
+        if (Connections[slot].busy && Connections[slot].fd < 0) {
+            queue_cancel_accept(slot);
+        }
+    }
+}
+
+/**
+ * Return whether any slot is still accepting or serving a client.
+ **/
+static bool slots_busy(void) {
+    for (int slot = 0; slot < NextSlot; slot++) {
+        if (Connections[slot].busy) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Determine number of connection slots.
+ *
+ * Every connection is a descriptor, so the soft limit is raised as far as
+ * allowed and slots leave URING_RESERVED_FDS descriptors for everything else.
+ **/
+static int uring_slots(void) {
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) < 0) {
+        return URING_ACCEPTS;
+    }
+
+    if (limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+        getrlimit(RLIMIT_NOFILE, &limit);
+    }
+
+    rlim_t slots = limit.rlim_cur > URING_RESERVED_FDS + URING_ACCEPTS ? limit.rlim_cur - URING_RESERVED_FDS : URING_ACCEPTS;
+    return slots < URING_CONNECTIONS ? (int)slots : URING_CONNECTIONS;
+}
+
+/**
+ * Create ring, registered buffers, and sparse fixed file table.
+ *
+ * @return  -1 on error and 0 on success.
+ *
+ * Per-slot tables are allocated zeroed and only touched as slots come into
+ * use, so idle capacity costs address space rather than memory.
+ **/
+static int uring_init(void) {
+    if (ring_init(&TheRing, URING_ENTRIES) < 0) {
+        return -1;
+    }
+
+    Slots          = uring_slots();
+    Connections    = calloc(Slots, sizeof(Connection));
+    FreeSlots      = calloc(Slots, sizeof(int));
+    Parked         = calloc(Slots, sizeof(int));
+    Waiting        = calloc(Slots, sizeof(int));
+    Candidates     = calloc(Slots, sizeof(Transfer *));
+    CandidateSlots = calloc(Slots, sizeof(int));
+    int *files     = malloc(Slots * sizeof(int));
+    if (!Connections || !FreeSlots || !Parked || !Waiting || !Candidates || !CandidateSlots || !files) {
+        free(files);
+        return -1;
+    }
+
+    Buffers = mmap(NULL, (size_t)URING_BUFFERS * URING_BUFSIZ, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (Buffers == MAP_FAILED) {
+        free(files);
+        return -1;
+    }
+
+    /* Registered buffers are pinned, so fork would copy them for every CGI
+     * executor; executors never read from them */
+    madvise(Buffers, (size_t)URING_BUFFERS * URING_BUFSIZ, MADV_DONTFORK);
+
+    struct iovec iovecs[URING_BUFFERS];
+    for (int buffer = 0; buffer < URING_BUFFERS; buffer++) {
+        iovecs[buffer].iov_base = buffer_data(buffer);
+        iovecs[buffer].iov_len  = URING_BUFSIZ;
+        FreeBuffers[NFreeBuffers++] = URING_BUFFERS - 1 - buffer;
+    }
+    for (int slot = 0; slot < Slots; slot++) {
+        files[slot] = -1;
+    }
+
+    if (io_uring_register(TheRing.fd, IORING_REGISTER_BUFFERS, iovecs, URING_BUFFERS) < 0) {
+        debug("Unable to register buffers: %s", strerror(errno));
+        free(files);
+        return -1;
+    }
+
+    int status = io_uring_register(TheRing.fd, IORING_REGISTER_FILES, files, Slots);
+    free(files);
+    if (status < 0) {
+        debug("Unable to register files: %s", strerror(errno));
+        return -1;
+    }
+
+    /* Without I/O threads, chunks not in the page cache are read by the kernel's own workers */
+    if ((IoWake = fileio_init(URING_IO_THREADS)) >= 0) {
+        queue_wake();
+    } else {
+        log("Unable to start I/O threads: %s", strerror(errno));
+    }
+
+    debug("io_uring: %d connection slots, %d buffers", Slots, URING_BUFFERS);
+    return 0;
+}
+
+/**
+ * Handle HTTP requests from an io_uring event loop.
+ *
+ * @param   sfd         Server socket file descriptor.
+ * @return  Exit status of server (EXIT_SUCCESS).
+ *
+ * Accepts, request reads, file reads, and sends are queued as SQEs and
+ * submitted together once per loop iteration.  File bodies take turns sending
+ * chunks (see schedule_bodies); chunks that are not in the page cache are read
+ * by blocking I/O threads, so the loop never waits on the disk.  Falls back to single_server
+ * if the kernel does not support io_uring.
+ *
+ * Once told to stop, pending accepts are cancelled and the loop runs until
+ * every connection has been answered or the drain deadline passes.
+ **/
+int uring_server(int sfd) {
+    if (uring_init() < 0) {
+        log("io_uring unavailable (%s), falling back to single mode", strerror(errno));
+        return single_server(sfd);
+    }
+
+    /* Failed sends are reported in completions rather than as signals */
+    signal(SIGPIPE, SIG_IGN);
+
+    bool draining = false;
+    while (true) {
+        executor_reap();
+        if (!draining && restart_stopping(sfd)) {
+            draining = true;
+            cancel_accepts();
+        }
+        if (!draining) {
+            replenish_accepts(sfd);
+        } else if (!slots_busy() || restart_expired()) {
+            break;
+        }
+
+        schedule_bodies();
+        if (ring_submit_and_wait(&TheRing) < 0) {
+            fatal("io_uring_enter failed: %s", strerror(errno));
+        }
+
+        /* Reap all available completions */
+        unsigned head = *TheRing.cq_head;
+        unsigned tail = atomic_load_explicit((_Atomic unsigned *)TheRing.cq_tail, memory_order_acquire);
+        while (head != tail) {
+            struct io_uring_cqe cqe = TheRing.cqes[head & *TheRing.cq_mask];
+            atomic_store_explicit((_Atomic unsigned *)TheRing.cq_head, ++head, memory_order_release);
+            handle_completion(sfd, &cqe);
+            tail = atomic_load_explicit((_Atomic unsigned *)TheRing.cq_tail, memory_order_acquire);
+        }
+    }
+
+    close(sfd);
+    return EXIT_SUCCESS;
+}
+
+#else
+
+/**
+ * Handle HTTP requests from an io_uring event loop.
+ *
+ * @param   sfd         Server socket file descriptor.
+ * @return  Exit status of server (EXIT_SUCCESS).
+ *
+ * io_uring is not available on this platform, so this is single_server.
+ **/
+int uring_server(int sfd) {
+    log("io_uring not supported, falling back to single mode");
+    return single_server(sfd);
+}
+
+#endif
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
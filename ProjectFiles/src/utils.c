@@ -4,6 +4,7 @@
 
 #include <ctype.h>
 #include <errno.h>
+#include <limits.h>
 #include <string.h>
 
 #include <sys/stat.h>
@@ -12,26 +13,29 @@
 /**
  * Determine mime-type from file extension.
  *
+ * @param   host        Virtual host serving the file.
  * @param   path        Path to file.
  * @return  An allocated string containing the mime-type of the specified file.
  *
  * This function first finds the file's extension and then scans the contents
- * of the MimeTypesPath file to determine which mimetype the file has.
+ * of the host's mime.types file to determine which mimetype the file has.
  *
- * The MimeTypesPath file (typically /etc/mime.types) consists of rules in the
+ * The mime.types file (typically /etc/mime.types) consists of rules in the
  * following format:
  *
  *  <MIMETYPE>      <EXT1> <EXT2> ...
  *
  * This function simply checks the file extension version each extension for
- * each mimetype and returns the mimetype on the first match.
+ * each mimetype and returns the mimetype on the first match.  While the
+ * filesystem is being watched, the parsed file is looked up instead (see
+ * cache_mimetype).
  *
- * If no extension exists or no matching mimetype is found, then return
- * DefaultMimeType.
+ * If no extension exists or no matching mimetype is found, then return the
+ * host's default mimetype.
  *
  * This function returns an allocated string that must be free'd.
  **/
-char * determine_mimetype(const char *path) {
+char * determine_mimetype(const VirtualHost *host, const char *path) {
     char *ext;
     char *mimetype;
     char *token;
@@ -41,17 +45,23 @@ char * determine_mimetype(const char *path) {
     /* Find file extension */
     ext = strchr(path, '.');
     if(!ext){
-      return strdup(DefaultMimeType);
+      return strdup(host->default_mimetype);
     }
     ext++;
 
-    /* Open MimeTypesPath file */
-    fs = fopen(MimeTypesPath, "r");
+    /* Look up parsed mime.types, if it is being kept current */
+    const char *cached = cache_mimetype(host, ext);
+    if(cached)
+    {
+        return strdup(cached);
+    }
+
+    /* Open mime.types file */
+    fs = fopen(host->mimetypes_path, "r");
     if(!fs)
     {
-        fclose(fs);
         debug("Could not open mimestypepath: %s", strerror(errno));
-        return strdup(DefaultMimeType);
+        return strdup(host->default_mimetype);
     }
 
     /* Scan file for matching file extensions */
@@ -74,12 +84,13 @@ char * determine_mimetype(const char *path) {
 
     fclose(fs);
 
-    return strdup(DefaultMimeType);
+    return strdup(host->default_mimetype);
 }
 
 /**
- * Determine actual filesystem path based on RootPath and URI.
+ * Determine actual filesystem path based on the host's root and URI.
  *
+ * @param   host        Virtual host serving the request.
  * @param   uri         Resource path of URI.
  * @return  An allocated string containing the full path of the resource on the
  * local filesystem.
@@ -87,29 +98,33 @@ char * determine_mimetype(const char *path) {
  * This function uses realpath(3) to generate the realpath of the
  * file requested in the URI.
  *
- * As a security check, if the real path does not begin with the RootPath, then
- * return NULL.
+ * As a security check, if the real path does not begin with the host's root,
+ * then return NULL.
  *
  * Otherwise, return a newly allocated string containing the real path.  This
  * string must later be free'd.
  **/
-char * determine_request_path(const char *uri){
+char * determine_request_path(const VirtualHost *host, const char *uri){
     char realPath[BUFSIZ];
-    strcpy(realPath, RootPath);
-    strcat(realPath, uri);
-
-    //debug("Real Path: %s", realPath);
+    if(snprintf(realPath, sizeof(realPath), "%s%s", host->root, uri) >= (int)sizeof(realPath))
+    {
+        return NULL;
+    }
 
-    char absPath[BUFSIZ];
-    realpath(realPath, absPath);
-    int lenRoot = strlen(RootPath);
+    char absPath[PATH_MAX];
+    if(!realpath(realPath, absPath))
+    {
+        debug("Unable to resolve %s: %s", realPath, strerror(errno));
+        return NULL;
+    }
 
     debug("Path: %s", absPath);
 
-    if(strncmp(realPath, RootPath, lenRoot) == 0)
+    /* Resolved path must be the root itself or lie beneath it */
+    if(strncmp(absPath, host->root, host->root_length) == 0 &&
+       (absPath[host->root_length] == '/' || absPath[host->root_length] == '\0'))
     {
-        char * newAbsPath = strdup(absPath);
-        return newAbsPath;
+        return strdup(absPath);
     }
     else
     {
@@ -129,9 +144,13 @@ char * determine_request_path(const char *uri){
 const char * http_status_string(Status status) {
     static char *StatusStrings[] = {
         "200 OK",
+        "304 Not Modified",
         "400 Bad Request",
         "404 Not Found",
         "500 Internal Server Error",
+        "502 Bad Gateway",
+        "503 Service Unavailable",
+        "504 Gateway Timeout",
         "418 I'm A Teapot",
     };
 
@@ -139,18 +158,34 @@ const char * http_status_string(Status status) {
     {
         return StatusStrings[0];
     }
-    else if(status == HTTP_STATUS_BAD_REQUEST)
+    else if(status == HTTP_STATUS_NOT_MODIFIED)
     {
         return StatusStrings[1];
     }
-    else if(status == HTTP_STATUS_NOT_FOUND)
+    else if(status == HTTP_STATUS_BAD_REQUEST)
     {
         return StatusStrings[2];
     }
-    else if(status == HTTP_STATUS_INTERNAL_SERVER_ERROR)
+    else if(status == HTTP_STATUS_NOT_FOUND)
     {
         return StatusStrings[3];
     }
+    else if(status == HTTP_STATUS_INTERNAL_SERVER_ERROR)
+    {
+        return StatusStrings[4];
+    }
+    else if(status == HTTP_STATUS_BAD_GATEWAY)
+    {
+        return StatusStrings[5];
+    }
+    else if(status == HTTP_STATUS_SERVICE_UNAVAILABLE)
+    {
+        return StatusStrings[6];
+    }
+    else if(status == HTTP_STATUS_GATEWAY_TIMEOUT)
+    {
+        return StatusStrings[7];
+    }
     else
     {
         debug("Bad HTTP Status");
@@ -0,0 +1,199 @@
+/* vhost.c: Name-based Virtual Hosts */
+
+#include "spidey.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <limits.h>
+#include <string.h>
+#include <strings.h>
+
+/* Constants */
+
+#define VHOST_MAX           1024        /* Largest number of virtual hosts */
+
+/* Virtual Host State */
+
+static VirtualHost  Hosts[VHOST_MAX];   /* Hosts[0] is the default host */
+static size_t       NHosts = 0;
+static VirtualHost **Table = NULL;      /* Open addressing table of named hosts */
+static size_t       TableMask = 0;
+
+/**
+ * Hash host name (FNV-1a, case-insensitive) up to length bytes.
+ **/
+static uint64_t vhost_hash(const char *name, size_t length) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < length; i++) {
+        hash ^= (unsigned char)tolower((unsigned char)name[i]);
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+/**
+ * Add virtual host.
+ *
+ * @param   name        Host name (NULL for the default host).
+ * @param   root        Document root.
+ * @param   mimetype    Default mimetype.
+ * @param   mimetypes   Path to mime.types file.
+ * @return  -1 on error and 0 on success.
+ **/
+static int vhost_add(const char *name, const char *root, const char *mimetype, const char *mimetypes) {
+    char path[PATH_MAX];
+
+    if (NHosts >= VHOST_MAX) {
+        log("Too many virtual hosts (max %d)", VHOST_MAX);
+        return -1;
+    }
+
+    if (!realpath(root, path)) {
+        log("Unable to resolve root %s: %s", root, strerror(errno));
+        return -1;
+    }
+
+    VirtualHost *host = &Hosts[NHosts];
+    host->name             = name ? strdup(name) : NULL;
+    host->root             = strdup(path);
+    host->root_length      = strlen(path);
+    host->default_mimetype = strdup(mimetype);
+    host->mimetypes_path   = strdup(mimetypes);
+    host->id               = NHosts;
+    if ((name && !host->name) || !host->root || !host->default_mimetype || !host->mimetypes_path) {
+        return -1;
+    }
+
+    NHosts++;
+    return 0;
+}
+
+/**
+ * Load virtual hosts and build the Host header lookup table.
+ *
+ * @param   path        Path to virtual host file (NULL for none).
+ * @return  -1 on error and 0 on success.
+ *
+ * The default host (used when the Host header is missing or unknown) is built
+ * from RootPath, DefaultMimeType, and MimeTypesPath.  Each line of the
+ * virtual host file has the form:
+ *
+ *  <HOST>  <ROOT>  [DEFAULT-MIMETYPE  [MIMETYPES-PATH]]
+ *
+ * Blank lines and lines beginning with # are ignored.  Each host gets its own
+ * id, which caches use to partition their entries.
+ **/
+int vhost_init(const char *path) {
+    if (vhost_add(NULL, RootPath, DefaultMimeType, MimeTypesPath) < 0) {
+        return -1;
+    }
+
+    if (path) {
+        FILE *fs = fopen(path, "r");
+        if (!fs) {
+            log("Unable to open virtual hosts %s: %s", path, strerror(errno));
+            return -1;
+        }
+
+        char buffer[BUFSIZ];
+        int  line = 0;
+        while (fgets(buffer, BUFSIZ, fs)) {
+            line++;
+            char *name = strtok(buffer, WHITESPACE "\r");
+            if (!name || name[0] == '#') {
+                continue;
+            }
+
+            char *root      = strtok(NULL, WHITESPACE "\r");
+            char *mimetype  = strtok(NULL, WHITESPACE "\r");
+            char *mimetypes = strtok(NULL, WHITESPACE "\r");
+            if (!root) {
+                log("%s:%d: missing document root", path, line);
+                fclose(fs);
+                return -1;
+            }
+
+            if (vhost_add(name, root, mimetype ? mimetype : DefaultMimeType, mimetypes ? mimetypes : MimeTypesPath) < 0) {
+                fclose(fs);
+                return -1;
+            }
+            debug("Virtual host %s -> %s", name, root);
+        }
+        fclose(fs);
+    }
+
+    /* Size table to at most half full */
+    size_t size = 2;
+    while (size < 2 * NHosts) {
+        size *= 2;
+    }
+
+    Table = calloc(size, sizeof(VirtualHost *));
+    if (!Table) {
+        return -1;
+    }
+    TableMask = size - 1;
+
+    for (size_t i = 1; i < NHosts; i++) {
+        VirtualHost *host = &Hosts[i];
+        size_t slot = vhost_hash(host->name, strlen(host->name)) & TableMask;
+        while (Table[slot] && strcasecmp(Table[slot]->name, host->name) != 0) {
+            slot = (slot + 1) & TableMask;
+        }
+        if (Table[slot]) {
+            log("Duplicate virtual host %s", host->name);
+        }
+        Table[slot] = host;
+    }
+
+    return 0;
+}
+
+/**
+ * Find virtual host for Host header.
+ *
+ * @param   header      Value of Host header (may be NULL).
+ * @return  Matching virtual host, or the default host.
+ *
+ * Any port suffix and trailing whitespace are ignored and names are matched
+ * case-insensitively.
+ **/
+const VirtualHost *vhost_lookup(const char *header) {
+    if (!header || !Table) {
+        return &Hosts[0];
+    }
+
+    /* Measure name, stopping at port (but not inside an IPv6 literal) */
+    size_t length = 0;
+    if (header[0] == '[') {
+        length = strcspn(header, "]");
+        length += header[length] == ']';
+    } else {
+        length = strcspn(header, ": \t\r\n");
+    }
+
+    size_t slot = vhost_hash(header, length) & TableMask;
+    for (VirtualHost *host = Table[slot]; host; host = Table[slot = (slot + 1) & TableMask]) {
+        if (strncasecmp(host->name, header, length) == 0 && host->name[length] == '\0') {
+            return host;
+        }
+    }
+
+    return &Hosts[0];
+}
+
+/**
+ * Return number of virtual hosts (including the default host).
+ **/
+size_t vhost_count(void) {
+    return NHosts;
+}
+
+/**
+ * Return virtual host with specified id.
+ **/
+const VirtualHost *vhost_get(size_t id) {
+    return id < NHosts ? &Hosts[id] : NULL;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,331 @@
+/* watch.c: Filesystem Watcher */
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <string.h>
+
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* Constants */
+
+#define WATCH_ALL_HOSTS     UINT_MAX    /* Directory shared by several hosts */
+#define WATCH_MIMETYPES     (UINT_MAX - 1) /* Directory holding a mime.types file */
+#define WATCH_ROOT_EVENTS   (IN_CREATE | IN_DELETE | IN_MODIFY | IN_CLOSE_WRITE | IN_ATTRIB | \
+                             IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF)
+#define WATCH_FILE_EVENTS   (IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE | IN_DELETE | IN_ATTRIB)
+
+/* Watched directory */
+
+typedef struct {
+    int         wd;                     /*< Watch descriptor (-1 if free) */
+    unsigned    host;                   /*< Host id, WATCH_ALL_HOSTS, or WATCH_MIMETYPES */
+    char       *path;                   /*< Directory path */
+} WatchDir;
+
+/* Generations shared with forked workers */
+
+typedef struct {
+    _Atomic uint64_t mimetypes;         /*< Bumped when any mime.types file changes */
+    _Atomic uint64_t invalidations;     /*< Total bumps (for metrics) */
+    _Atomic bool     failed;            /*< Watcher stopped; nothing cached can be trusted */
+    _Atomic uint64_t hosts[];           /*< Bumped when anything under a host root changes */
+} Generations;
+
+/* Watch State */
+
+static Generations *Shared = NULL;
+static size_t       NHosts = 0;
+static int          Inotify = -1;
+static pthread_t    Watcher;
+static WatchDir    *Dirs = NULL;
+static size_t       NDirs = 0;
+
+/**
+ * Bump generation of host (or of every host).
+ **/
+static void watch_bump(unsigned host) {
+    if (host == WATCH_MIMETYPES) {
+        atomic_fetch_add_explicit(&Shared->mimetypes, 1, memory_order_release);
+    } else if (host == WATCH_ALL_HOSTS) {
+        for (size_t i = 0; i < NHosts; i++) {
+            atomic_fetch_add_explicit(&Shared->hosts[i], 1, memory_order_release);
+        }
+    } else if (host < NHosts) {
+        atomic_fetch_add_explicit(&Shared->hosts[host], 1, memory_order_release);
+    }
+    atomic_fetch_add_explicit(&Shared->invalidations, 1, memory_order_relaxed);
+}
+
+static WatchDir *watch_find(int wd) {
+    for (size_t i = 0; i < NDirs; i++) {
+        if (Dirs[i].wd == wd) {
+            return &Dirs[i];
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Watch directory on behalf of host.
+ *
+ * @return  -1 on error and 0 on success.
+ *
+ * inotify returns the same descriptor when a directory is watched twice, so
+ * directories shared by hosts (or holding a mime.types file as well) bump
+ * every host.
+ **/
+static int watch_add(const char *path, unsigned host, uint32_t events) {
+    int wd = inotify_add_watch(Inotify, path, events | IN_ONLYDIR | IN_MASK_ADD);
+    if (wd < 0) {
+        log("Unable to watch %s: %s", path, strerror(errno));
+        return -1;
+    }
+
+    WatchDir *dir = watch_find(wd);
+    if (dir) {
+        if (dir->host != host) {
+            dir->host = WATCH_ALL_HOSTS;
+        }
+        return 0;
+    }
+
+    if (!(dir = watch_find(-1))) {
+        WatchDir *dirs = realloc(Dirs, (NDirs + 1) * sizeof(WatchDir));
+        if (!dirs) {
+            return -1;
+        }
+        Dirs = dirs;
+        dir  = &Dirs[NDirs++];
+    }
+
+    dir->wd   = wd;
+    dir->host = host;
+    dir->path = strdup(path);
+    return dir->path ? 0 : -1;
+}
+
+/**
+ * Watch directory and every directory beneath it.
+ **/
+static void watch_tree(const char *path, unsigned host) {
+    if (watch_add(path, host, WATCH_ROOT_EVENTS) < 0) {
+        return;
+    }
+
+    DIR *d = opendir(path);
+    if (!d) {
+        return;
+    }
+
+    struct dirent *e;
+    while ((e = readdir(d))) {
+        char child[PATH_MAX];
+        struct stat s;
+        if (streq(e->d_name, ".") || streq(e->d_name, "..") ||
+            snprintf(child, sizeof(child), "%s/%s", path, e->d_name) >= (int)sizeof(child)) {
+            continue;
+        }
+        if (e->d_type == DT_DIR || (e->d_type == DT_UNKNOWN && lstat(child, &s) == 0 && S_ISDIR(s.st_mode))) {
+            watch_tree(child, host);
+        }
+    }
+    closedir(d);
+}
+
+/**
+ * Watch directory of mime.types file (editors replace rather than rewrite).
+ **/
+static void watch_mimetypes(const char *path) {
+    char dir[PATH_MAX];
+    const char *slash = strrchr(path, '/');
+
+    if (!slash) {
+        strcpy(dir, ".");
+    } else if (slash == path) {
+        strcpy(dir, "/");
+    } else if ((size_t)(slash - path) < sizeof(dir)) {
+        memcpy(dir, path, slash - path);
+        dir[slash - path] = '\0';
+    } else {
+        return;
+    }
+    watch_add(dir, WATCH_MIMETYPES, WATCH_FILE_EVENTS);
+}
+
+/**
+ * Return whether event names a mime.types file of some host.
+ **/
+static bool watch_is_mimetypes(const WatchDir *dir, const char *name) {
+    size_t length = strlen(dir->path);
+    for (size_t i = 0; i < NHosts; i++) {
+        const char *path = vhost_get(i)->mimetypes_path;
+        const char *slash = strrchr(path, '/');
+        const char *base = slash ? slash + 1 : path;
+        if (streq(base, name) && (!slash || (strncmp(path, dir->path, length) == 0 && (size_t)(slash - path) == length))) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Apply one inotify event.
+ **/
+static void watch_event(const struct inotify_event *event) {
+    if (event->mask & IN_Q_OVERFLOW) {
+        /* Events were lost, so anything may have changed */
+        watch_bump(WATCH_ALL_HOSTS);
+        watch_bump(WATCH_MIMETYPES);
+        return;
+    }
+
+    WatchDir *dir = watch_find(event->wd);
+    if (!dir) {
+        return;
+    }
+
+    if (event->len && watch_is_mimetypes(dir, event->name)) {
+        debug("Mimetypes changed: %s/%s", dir->path, event->name);
+        watch_bump(WATCH_MIMETYPES);
+    }
+    if (dir->host == WATCH_MIMETYPES) {
+        return;
+    }
+
+    debug("Changed: %s/%s", dir->path, event->len ? event->name : "");
+    watch_bump(dir->host);
+
+    /* New directories need watches of their own */
+    if ((event->mask & IN_ISDIR) && (event->mask & (IN_CREATE | IN_MOVED_TO)) && event->len) {
+        char child[PATH_MAX];
+        if (snprintf(child, sizeof(child), "%s/%s", dir->path, event->name) < (int)sizeof(child)) {
+            watch_tree(child, dir->host);
+        }
+    }
+
+    /* The kernel dropped the watch (directory removed) */
+    if (event->mask & IN_IGNORED) {
+        free(dir->path);
+        dir->path = NULL;
+        dir->wd   = -1;
+    }
+}
+
+/**
+ * Read inotify events and bump generations until the process exits.
+ **/
+static void *watch_thread(void *arg) {
+    char buffer[64 * 1024] __attribute__((aligned(__alignof__(struct inotify_event))));
+
+    while (true) {
+        ssize_t n = read(Inotify, buffer, sizeof(buffer));
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            log("Unable to read filesystem events: %s", strerror(errno));
+            break;
+        }
+
+        for (char *p = buffer; p < buffer + n; ) {
+            const struct inotify_event *event = (const struct inotify_event *)p;
+            watch_event(event);
+            p += sizeof(struct inotify_event) + event->len;
+        }
+    }
+
+    /* Without events, nothing cached can be trusted any longer */
+    atomic_store(&Shared->failed, true);
+    return NULL;
+}
+
+/**
+ * Watch every host root and mime.types file.
+ *
+ * @return  -1 on error and 0 on success.
+ *
+ * Each host has a generation counter (in shared memory, so forked workers
+ * see it) that is bumped whenever anything beneath its root changes; the
+ * mime.types files share one more counter.  Caches record the generation an
+ * entry was built at and drop entries whose generation has moved on, so they
+ * never need to stat(2) what they hold.
+ *
+ * This must be called after vhost_init and before any workers are forked.  If
+ * watching is not possible, caching stays off.
+ **/
+int watch_init(void) {
+    NHosts = vhost_count();
+
+    Generations *shared = mmap(NULL, sizeof(Generations) + NHosts * sizeof(uint64_t), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (shared == MAP_FAILED) {
+        return -1;
+    }
+
+    if ((Inotify = inotify_init1(IN_CLOEXEC)) < 0) {
+        log("Unable to watch filesystem (caching disabled): %s", strerror(errno));
+        munmap(shared, sizeof(Generations) + NHosts * sizeof(uint64_t));
+        return 0;
+    }
+
+    Shared = shared;
+    for (size_t i = 0; i < NHosts; i++) {
+        /* An archived default host never reads beneath its root */
+        if (i > 0 || !ArchivePath) {
+            watch_tree(vhost_get(i)->root, i);
+        }
+        watch_mimetypes(vhost_get(i)->mimetypes_path);
+    }
+
+    if ((errno = pthread_create(&Watcher, NULL, watch_thread, NULL)) != 0) {
+        log("Unable to start watcher (caching disabled): %s", strerror(errno));
+        atomic_store(&Shared->failed, true);
+        return 0;
+    }
+    pthread_detach(Watcher);
+
+    debug("Watching %zu directories", NDirs);
+    return 0;
+}
+
+/**
+ * Return whether filesystem changes are being watched (and caching is safe).
+ **/
+bool watch_enabled(void) {
+    return Shared && !atomic_load_explicit(&Shared->failed, memory_order_relaxed);
+}
+
+/**
+ * Return current generation of host's files (including mime.types).
+ *
+ * Entries built at an older generation must not be used.
+ **/
+uint64_t watch_generation(const VirtualHost *host) {
+    if (!Shared) {
+        return 0;
+    }
+    return atomic_load_explicit(&Shared->hosts[host->id], memory_order_acquire) +
+           atomic_load_explicit(&Shared->mimetypes, memory_order_acquire);
+}
+
+/**
+ * Return generation of mime.types files.
+ **/
+uint64_t watch_mimetypes_generation(void) {
+    return Shared ? atomic_load_explicit(&Shared->mimetypes, memory_order_acquire) : 0;
+}
+
+/**
+ * Return total number of invalidations.
+ **/
+unsigned long watch_invalidations(void) {
+    return Shared ? atomic_load_explicit(&Shared->invalidations, memory_order_relaxed) : 0;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,113 @@
+#!/bin/bash
+
+# Title: bench.sh
+# Description: Benchmark spidey on loopback in every mode and compare against
+# a stored baseline.
+#
+# Environment:
+#   BENCH_MODES         Server modes to run           (single forking uring hybrid)
+#   BENCH_SIZES         File sizes to serve           (1KB 1MB 64MB)
+#   BENCH_CONCURRENCY   Client connection counts      (1 8 32)
+#   BENCH_DURATION      Seconds per measurement       (2)
+#   BENCH_RESULTS       Where to write results        (bench_results.jsonl)
+#   BENCH_BASELINE      Baseline to compare against   (test_scripts/bench_baseline.jsonl)
+#   BENCH_TOLERANCE     Allowed relative regression   (0.25)
+
+SPIDEY=./bin/spidey
+THOR=./bin/thor
+MODES=${BENCH_MODES:-"single forking uring hybrid"}
+SIZES=${BENCH_SIZES:-"1KB 1MB 64MB"}
+CONCURRENCY=${BENCH_CONCURRENCY:-"1 8 32"}
+DURATION=${BENCH_DURATION:-2}
+RESULTS=${BENCH_RESULTS:-bench_results.jsonl}
+BASELINE=${BENCH_BASELINE:-test_scripts/bench_baseline.jsonl}
+TOLERANCE=${BENCH_TOLERANCE:-0.25}
+WORKSPACE=$(mktemp -d /tmp/spidey-bench.XXXXXX)
+
+. $(dirname $0)/bench_common.sh
+
+# Functions
+
+bytes() {
+    case $1 in
+	*KB) echo $((${1%KB} * 1024)) ;;
+	*MB) echo $((${1%MB} * 1024 * 1024)) ;;
+	*GB) echo $((${1%GB} * 1024 * 1024 * 1024)) ;;
+	*)   echo $1 ;;
+    esac
+}
+
+make_fixtures() {
+    mkdir -p $WORKSPACE/www/test_files $WORKSPACE/www/listing $WORKSPACE/www/scripts
+
+    for size in $SIZES; do
+	head -c $(bytes $size) /dev/zero | tr '\0' 'x' > $WORKSPACE/www/test_files/$size.txt
+    done
+
+    for i in $(seq 100); do
+	touch $WORKSPACE/www/listing/entry-$i.txt
+    done
+
+    cat > $WORKSPACE/www/scripts/hello.sh <<EOF
+#!/bin/sh
+echo "HTTP/1.0 200 OK"
+echo "Content-type: text/plain"
+echo
+echo "Hello, \$QUERY_STRING"
+EOF
+    chmod 755 $WORKSPACE/www/scripts/hello.sh
+}
+
+measure() {
+    mode=$1 route=$2 path=$3 connections=$4
+    result=$($THOR -j -c $connections -t $DURATION http://127.0.0.1:$PORT$path)
+    printf "    %-10s %-16s c=%-4s %s\n" $mode $route $connections "$result"
+    echo "{\"mode\":\"$mode\",\"route\":\"$route\",\"concurrency\":$connections,${result#\{}" >> $RESULTS
+}
+
+# Setup
+
+trap cleanup EXIT
+trap "exit 1" INT TERM
+
+if [ ! -x $SPIDEY ] || [ ! -x $THOR ]; then
+    echo "Build $SPIDEY and $THOR first (make)" >&2
+    exit 1
+fi
+
+make_fixtures
+: > $RESULTS
+
+# Benchmarks
+
+for mode in $MODES; do
+    echo "Benchmarking $mode mode ..."
+    start_server $mode || exit 1
+
+    for connections in $CONCURRENCY; do
+	for size in $SIZES; do
+	    measure $mode file-$size /test_files/$size.txt $connections
+	done
+	measure $mode browse /listing $connections
+	measure $mode cgi "/scripts/hello.sh?bench" $connections
+    done
+
+    stop_server
+done
+
+# Comparison
+
+if [ "$BENCH_UPDATE_BASELINE" = 1 ]; then
+    cp $RESULTS $BASELINE
+    echo "Updated baseline $BASELINE"
+    exit 0
+fi
+
+if [ ! -r $BASELINE ]; then
+    echo "No baseline at $BASELINE (run make bench-baseline)"
+    exit 0
+fi
+
+./test_scripts/bench_compare.py $BASELINE $RESULTS $TOLERANCE
+
+# vim: set sts=4 sw=4 ts=8 ft=sh:
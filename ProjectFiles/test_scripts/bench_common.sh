@@ -0,0 +1,46 @@
+# Title: bench_common.sh
+# Description: Server helpers shared by the benchmark scripts (sourced, not
+# run).  Scripts set SPIDEY and WORKSPACE, and serve $WORKSPACE/www.
+
+SERVER_PID=
+CLIENT_PID=
+
+# Functions
+
+cleanup() {
+    [ -n "$CLIENT_PID" ] && kill $CLIENT_PID 2> /dev/null && wait $CLIENT_PID 2> /dev/null
+    [ -n "$SERVER_PID" ] && kill $SERVER_PID 2> /dev/null && wait $SERVER_PID 2> /dev/null
+    rm -fr $WORKSPACE
+}
+
+start_server() {
+    for attempt in $(seq 10); do
+	PORT=$((20000 + RANDOM % 20000))
+	$SPIDEY -c $1 -p $PORT -r $WORKSPACE/www -l /dev/null 2> $WORKSPACE/spidey.log &
+	SERVER_PID=$!
+
+	for i in $(seq 50); do
+	    if ! kill -0 $SERVER_PID 2> /dev/null; then
+		break
+	    fi
+	    if (exec 3<> /dev/tcp/127.0.0.1/$PORT) 2> /dev/null; then
+		return 0
+	    fi
+	    sleep 0.1
+	done
+
+	kill $SERVER_PID 2> /dev/null
+	wait $SERVER_PID 2> /dev/null
+    done
+
+    echo "Unable to start spidey in $1 mode" >&2
+    return 1
+}
+
+stop_server() {
+    kill $SERVER_PID 2> /dev/null
+    wait $SERVER_PID 2> /dev/null
+    SERVER_PID=
+}
+
+# vim: set sts=4 sw=4 ts=8 ft=sh:
@@ -0,0 +1,65 @@
+#!/usr/bin/env python3
+
+# Title: bench_compare.py
+# Description: Compare benchmark results against a baseline and fail on
+# throughput or tail latency regressions.
+
+import json
+import os
+import sys
+
+# Functions
+
+def usage(status=0):
+    progname = os.path.basename(sys.argv[0])
+    print(f'Usage: {progname} BASELINE RESULTS [TOLERANCE]')
+    sys.exit(status)
+
+
+def load(path):
+    ''' Load JSON lines keyed by (mode, route, concurrency). '''
+    results = {}
+    with open(path) as stream:
+        for line in stream:
+            if line.strip():
+                record = json.loads(line)
+                key = (record['mode'], record['route'], record['concurrency'])
+                results[key] = record
+    return results
+
+
+def main():
+    arguments = sys.argv[1:]
+    if len(arguments) < 2:
+        usage(1)
+
+    baseline  = load(arguments[0])
+    results   = load(arguments[1])
+    tolerance = float(arguments[2]) if len(arguments) > 2 else 0.25
+
+    regressions = 0
+    for key, current in sorted(results.items()):
+        previous = baseline.get(key)
+        if not previous:
+            continue
+
+        name = '{} {} c={}'.format(*key)
+        if previous['rps'] > 0 and current['rps'] < previous['rps'] * (1 - tolerance):
+            print(f'REGRESSION {name}: throughput {current["rps"]:.1f} req/s < baseline {previous["rps"]:.1f} req/s')
+            regressions += 1
+        if previous['p99_ms'] > 0 and current['p99_ms'] > previous['p99_ms'] * (1 + tolerance):
+            print(f'REGRESSION {name}: p99 {current["p99_ms"]:.3f} ms > baseline {previous["p99_ms"]:.3f} ms')
+            regressions += 1
+        if current['errors'] > previous['errors']:
+            print(f'REGRESSION {name}: {current["errors"]} errors > baseline {previous["errors"]}')
+            regressions += 1
+
+    print(f'{len(results)} measurements, {regressions} regressions (tolerance {tolerance:.0%})')
+    sys.exit(1 if regressions else 0)
+
+# Main execution
+
+if __name__ == '__main__':
+    main()
+
+# vim: set sts=4 sw=4 ts=8 expandtab ft=python:
@@ -0,0 +1,93 @@
+#!/bin/bash
+
+# Title: bench_idle.sh
+# Description: Measure spidey's resident memory per idle connection (clients
+# that connected but have not sent a request yet).
+#
+# Environment:
+#   BENCH_MODES         Server modes to run           (uring hybrid)
+#   BENCH_IDLE          Idle connections to hold      (10000)
+#   BENCH_HOLD          Seconds to hold them          (3)
+
+SPIDEY=./bin/spidey
+THOR=./bin/thor
+MODES=${BENCH_MODES:-"uring hybrid"}
+IDLE=${BENCH_IDLE:-10000}
+HOLD=${BENCH_HOLD:-3}
+WORKSPACE=$(mktemp -d /tmp/spidey-bench.XXXXXX)
+
+. $(dirname $0)/bench_common.sh
+
+# Functions
+
+# Resident memory (KB) of the server and every process it forked (forked
+# processes share pages, so the sum overstates what forking and hybrid modes
+# cost)
+rss() {
+    pids="$1 $(pgrep -P $1 | tr '\n' ' ')"
+    total=0
+    for pid in $pids; do
+	kb=$(awk '/^VmRSS:/ {print $2}' /proc/$pid/status 2> /dev/null)
+	total=$((total + ${kb:-0}))
+    done
+    echo $total
+}
+
+measure() {
+    mode=$1
+
+    sleep 0.5
+    before=$(rss $SERVER_PID)
+
+    $THOR -i -c $IDLE -t $HOLD http://127.0.0.1:$PORT/ > $WORKSPACE/thor.out &
+    CLIENT_PID=$!
+    for i in $(seq 100); do
+	grep -q Holding $WORKSPACE/thor.out && break
+	sleep 0.1
+    done
+    sleep 0.5
+    during=$(rss $SERVER_PID)
+    held=$(awk '/Holding/ {print $2}' $WORKSPACE/thor.out)
+    wait $CLIENT_PID 2> /dev/null
+    CLIENT_PID=
+
+    if [ -z "$held" ] || [ "$held" -eq 0 ]; then
+	echo "    $mode: no idle connections held" >&2
+	return 1
+    fi
+
+    awk -v mode=$mode -v held=$held -v before=$before -v during=$during 'BEGIN {
+	printf "    %-10s %6d idle  RSS %8d KB -> %8d KB  %.2f KB/connection\n", mode, held, before, during, (during - before) / held
+    }'
+}
+
+# Setup
+
+trap cleanup EXIT
+trap "exit 1" INT TERM
+
+if [ ! -x $SPIDEY ] || [ ! -x $THOR ]; then
+    echo "Build $SPIDEY and $THOR first (make)" >&2
+    exit 1
+fi
+
+# Server and client each need a descriptor per connection
+ulimit -n $(ulimit -Hn) 2> /dev/null
+if [ $(ulimit -n) != unlimited ] && [ $(ulimit -n) -lt $((IDLE + 128)) ]; then
+    IDLE=$(($(ulimit -n) - 128))
+    echo "Descriptor limit allows only $IDLE idle connections" >&2
+fi
+
+mkdir -p $WORKSPACE/www
+echo "Hello" > $WORKSPACE/www/index.html
+
+# Benchmarks
+
+for mode in $MODES; do
+    echo "Measuring $mode mode ..."
+    start_server $mode || exit 1
+    measure $mode
+    stop_server
+done
+
+# vim: set sts=4 sw=4 ts=8 ft=sh: